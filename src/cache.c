@@ -0,0 +1,264 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A cache of disk blocks read by volume readers. It is split into shards,
+ * each with its own lock, so that concurrent readers rarely contend. Each
+ * shard evicts with the CLOCK algorithm, which approximates LRU without
+ * updating a list on every hit. */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldmcore.h"
+
+/* The most shards a cache is split into. A cache of fewer blocks has one
+ * shard per block. */
+#define N_SHARDS 16
+
+/* Marks the end of a hash chain */
+#define NONE UINT32_MAX
+
+typedef struct {
+    const void *disk;
+    uint64_t block;
+    uint32_t next;      /* The next entry in the same hash bucket */
+    int referenced;     /* Used since the clock hand last passed */
+    int valid;
+} _entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    uint32_t n_entries;
+    _entry_t *entries;
+    uint8_t *data;      /* LDMCORE_CACHE_BLOCK bytes for each entry */
+
+    uint32_t n_buckets; /* A power of 2 */
+    uint32_t *buckets;
+
+    uint32_t hand;
+    uint32_t n_valid;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} _shard_t;
+
+struct _ldmcore_cache {
+    uint64_t size;
+    uint32_t n_shards;
+    _shard_t shards[N_SHARDS];
+};
+
+static uint64_t
+_hash(const void * const disk, const uint64_t block)
+{
+    /* The finaliser of MurmurHash3 */
+    uint64_t h = block ^ ((uintptr_t) disk >> 4);
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return h;
+}
+
+ldmcore_cache_t *
+ldmcore_cache_new(const uint64_t size)
+{
+    ldmcore_cache_t * const cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) abort();
+
+    /* Round down to whole blocks in each shard, but hold at least one */
+    uint64_t n_blocks = size / LDMCORE_CACHE_BLOCK;
+    if (n_blocks == 0) n_blocks = 1;
+    cache->n_shards = n_blocks < N_SHARDS ? n_blocks : N_SHARDS;
+
+    uint64_t per_shard = n_blocks / cache->n_shards;
+    if (per_shard > UINT32_MAX / 2) per_shard = UINT32_MAX / 2;
+    cache->size = per_shard * cache->n_shards * LDMCORE_CACHE_BLOCK;
+
+    uint32_t n_buckets = 1;
+    while (n_buckets < per_shard) n_buckets <<= 1;
+
+    for (uint32_t i = 0; i < cache->n_shards; i++) {
+        _shard_t * const shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+
+        shard->n_entries = per_shard;
+        shard->entries = calloc(per_shard, sizeof(*shard->entries));
+        shard->data = malloc(per_shard * LDMCORE_CACHE_BLOCK);
+        shard->n_buckets = n_buckets;
+        shard->buckets = malloc(n_buckets * sizeof(*shard->buckets));
+        if (shard->entries == NULL || shard->data == NULL ||
+            shard->buckets == NULL)
+        {
+            abort();
+        }
+        memset(shard->buckets, 0xff, n_buckets * sizeof(*shard->buckets));
+    }
+
+    return cache;
+}
+
+void
+ldmcore_cache_free(ldmcore_cache_t * const cache)
+{
+    if (cache == NULL) return;
+
+    for (uint32_t i = 0; i < cache->n_shards; i++) {
+        _shard_t * const shard = &cache->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->entries);
+        free(shard->data);
+        free(shard->buckets);
+    }
+
+    free(cache);
+}
+
+static _shard_t *
+_get_shard(ldmcore_cache_t * const cache, const uint64_t hash)
+{
+    /* The high bits of the hash select the shard, as the low bits select the
+     * bucket within it */
+    return &cache->shards[(hash >> 32) % cache->n_shards];
+}
+
+/* Returns the index of the entry for a block, or NONE. Called with the shard
+ * locked. */
+static uint32_t
+_find(const _shard_t * const shard, const uint64_t hash,
+      const void * const disk, const uint64_t block)
+{
+    uint32_t i = shard->buckets[hash & (shard->n_buckets - 1)];
+    while (i != NONE) {
+        const _entry_t * const e = &shard->entries[i];
+        if (e->disk == disk && e->block == block) return i;
+        i = e->next;
+    }
+
+    return NONE;
+}
+
+int
+ldmcore_cache_lookup(ldmcore_cache_t * const cache, const void * const disk,
+                     const uint64_t block, const size_t offset,
+                     const size_t count, void * const dst)
+{
+    const uint64_t hash = _hash(disk, block);
+    _shard_t * const shard = _get_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    const uint32_t i = _find(shard, hash, disk, block);
+    if (i != NONE) {
+        shard->entries[i].referenced = 1;
+        memcpy(dst, shard->data + (size_t) i * LDMCORE_CACHE_BLOCK + offset,
+               count);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return i != NONE;
+}
+
+/* Remove an entry from its hash chain. Called with the shard locked. */
+static void
+_unlink(_shard_t * const shard, const uint32_t i)
+{
+    const _entry_t * const e = &shard->entries[i];
+    uint32_t * link = &shard->buckets[_hash(e->disk, e->block) &
+                                      (shard->n_buckets - 1)];
+    while (*link != i) link = &shard->entries[*link].next;
+    *link = e->next;
+}
+
+void
+ldmcore_cache_insert(ldmcore_cache_t * const cache, const void * const disk,
+                     const uint64_t block, const void * const data)
+{
+    const uint64_t hash = _hash(disk, block);
+    _shard_t * const shard = _get_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Another reader may have inserted it after our lookup missed */
+    if (_find(shard, hash, disk, block) != NONE) goto out;
+
+    /* Advance the hand past entries used since it last passed them */
+    uint32_t i;
+    for (;;) {
+        i = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->n_entries;
+
+        _entry_t * const e = &shard->entries[i];
+        if (!e->valid) {
+            shard->n_valid++;
+            break;
+        }
+        if (!e->referenced) {
+            _unlink(shard, i);
+            shard->evictions++;
+            break;
+        }
+        e->referenced = 0;
+    }
+
+    _entry_t * const e = &shard->entries[i];
+    e->disk = disk;
+    e->block = block;
+    e->valid = 1;
+    e->referenced = 0;
+
+    uint32_t * const bucket = &shard->buckets[hash & (shard->n_buckets - 1)];
+    e->next = *bucket;
+    *bucket = i;
+
+    memcpy(shard->data + (size_t) i * LDMCORE_CACHE_BLOCK, data,
+           LDMCORE_CACHE_BLOCK);
+
+out:
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void
+ldmcore_cache_get_stats(ldmcore_cache_t * const cache,
+                        ldmcore_cache_stats_t * const stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->size = cache->size;
+
+    for (uint32_t i = 0; i < cache->n_shards; i++) {
+        _shard_t * const shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->used += (uint64_t) shard->n_valid * LDMCORE_CACHE_BLOCK;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,252 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Persistent dm-raid metadata devices and snapshot COW stores */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/loop.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ldmcore.h"
+
+/* dm-raid's region size in sectors, which is the granularity of the
+ * write-intent bitmap */
+#define DM_RAID_REGION_SIZE 128
+
+/* dm-raid puts its superblock in the first 4k of the metadata device, and the
+ * bitmap superblock and bitmap after it */
+#define DM_RAID_META_HEADER (8 * 1024)
+
+#define MIB (1024 * 1024)
+#define DM_RAID_META_MIN_SIZE (4 * MIB)
+
+/* The number of times to retry if another process takes the free loop device
+ * before we attach to it */
+#define LOOP_RETRIES 10
+
+/* The size of a metadata device with a bitmap covering the given number of
+ * sectors, rounded up to a whole MiB */
+static uint64_t
+_meta_size(const uint64_t sectors)
+{
+    const uint64_t regions =
+        (sectors + DM_RAID_REGION_SIZE - 1) / DM_RAID_REGION_SIZE;
+    uint64_t size = DM_RAID_META_HEADER + (regions + 7) / 8;
+    size = (size + MIB - 1) / MIB * MIB;
+
+    return size < DM_RAID_META_MIN_SIZE ? DM_RAID_META_MIN_SIZE : size;
+}
+
+/* Open the backing file of a metadata device, creating it if necessary */
+static int
+_open_meta_file(const char * const dir, const ldmcore_vol_t * const vol,
+                const uint32_t leg, char ** const path,
+                ldmcore_err_t * const err)
+{
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Unable to create metadata directory %s: %m",
+                               dir);
+    }
+
+    char guid[37];
+    uuid_unparse_lower(vol->guid, guid);
+    if (asprintf(path, "%s/%s-%" PRIu32 ".meta", dir, guid, leg) == -1)
+        abort();
+
+    const int fd = open(*path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        const int r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                      "Unable to open metadata file %s: %m",
+                                      *path);
+        free(*path); *path = NULL;
+        return r;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        const int r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                      "Unable to stat metadata file %s: %m",
+                                      *path);
+        close(fd);
+        free(*path); *path = NULL;
+        return r;
+    }
+
+    /* A new file is sparse and zeroed, which dm-raid initialises on first
+     * use. Grow an existing file if the partition has grown. */
+    const uint64_t size = _meta_size(vol->parts[leg]->size);
+    if ((uint64_t) st.st_size < size && ftruncate(fd, size) == -1) {
+        const int r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                      "Unable to resize metadata file %s: %m",
+                                      *path);
+        close(fd);
+        free(*path); *path = NULL;
+        return r;
+    }
+
+    return fd;
+}
+
+/* Attach a file to a free loop device which is detached automatically when it
+ * is last closed. Returns an open descriptor for the loop device. */
+static int
+_loop_attach(const int file_fd, const char * const path, char ** const device,
+             ldmcore_err_t * const err)
+{
+    const int ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (ctl == -1) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Unable to open /dev/loop-control: %m");
+    }
+
+    int r = 0;
+    int i;
+    for (i = 0; i < LOOP_RETRIES; i++) {
+        const int n = ioctl(ctl, LOOP_CTL_GET_FREE);
+        if (n == -1) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                "Unable to find a free loop device: %m");
+            break;
+        }
+
+        if (asprintf(device, "/dev/loop%i", n) == -1) abort();
+
+        const int fd = open(*device, O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                "Unable to open %s: %m", *device);
+            free(*device); *device = NULL;
+            break;
+        }
+
+        if (ioctl(fd, LOOP_SET_FD, file_fd) == -1) {
+            const int errsv = errno;
+            close(fd);
+            free(*device); *device = NULL;
+
+            /* Somebody else took it */
+            if (errsv == EBUSY) continue;
+
+            errno = errsv;
+            r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                "Unable to attach %s to a loop device: %m",
+                                path);
+            break;
+        }
+
+        struct loop_info64 info;
+        memset(&info, 0, sizeof(info));
+        info.lo_flags = LO_FLAGS_AUTOCLEAR;
+        strncpy((char *) info.lo_file_name, path, LO_NAME_SIZE - 1);
+
+        if (ioctl(fd, LOOP_SET_STATUS64, &info) == -1) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                "Unable to configure %s: %m", *device);
+            ioctl(fd, LOOP_CLR_FD, 0);
+            close(fd);
+            free(*device); *device = NULL;
+            break;
+        }
+
+        r = fd;
+        break;
+    }
+
+    if (i == LOOP_RETRIES) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                            "Unable to attach %s to a loop device: "
+                            "no free loop device", path);
+    }
+
+    close(ctl);
+    return r;
+}
+
+int
+ldmcore_dm_meta_attach(const char * const dir, const ldmcore_vol_t * const vol,
+                       const uint32_t leg, char ** const device, int * const fd,
+                       ldmcore_err_t * const err)
+{
+    *device = NULL;
+    *fd = -1;
+
+    char *path;
+    const int file_fd = _open_meta_file(dir, vol, leg, &path, err);
+    if (file_fd < 0) return file_fd;
+
+    const int r = _loop_attach(file_fd, path, device, err);
+
+    /* The loop device holds its own reference to the file */
+    close(file_fd);
+    free(path);
+
+    if (r < 0) return r;
+
+    *fd = r;
+    return 0;
+}
+
+int
+ldmcore_dm_cow_attach(const char * const path, char ** const device,
+                      int * const fd, ldmcore_err_t * const err)
+{
+    *device = NULL;
+    *fd = -1;
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Unable to stat COW store %s: %m", path);
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        *device = strdup(path);
+        if (!*device) abort();
+        return 0;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "COW store %s is not a file or a block device",
+                               path);
+    }
+
+    const int file_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (file_fd == -1) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Unable to open COW store %s: %m", path);
+    }
+
+    const int r = _loop_attach(file_fd, path, device, err);
+    close(file_fd);
+
+    if (r < 0) return r;
+
+    *fd = r;
+    return 0;
+}
@@ -0,0 +1,658 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generation of device mapper tables for LDM volumes */
+
+#include <config.h>
+
+#include <inttypes.h>
+#include <libdevmapper.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uuid/uuid.h>
+
+#include "ldmcore.h"
+
+#define DM_UUID_PREFIX "LDM-"
+
+static char *
+_printf(const char * const fmt, ...)
+{
+    char *r;
+
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&r, fmt, ap) == -1) abort();
+    va_end(ap);
+
+    return r;
+}
+
+/* Append formatted text to a malloced string */
+static void
+_append_printf(char ** const s, const char * const fmt, ...)
+{
+    char *tail;
+
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&tail, fmt, ap) == -1) abort();
+    va_end(ap);
+
+    char * const r = _printf("%s%s", *s, tail);
+    free(*s); free(tail);
+    *s = r;
+}
+
+static ldmcore_dm_target_t *
+_init_table(ldmcore_dm_table_t * const table, const uint32_t n_targets)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->n_targets = n_targets;
+    table->targets = calloc(n_targets, sizeof(*table->targets));
+    if (table->targets == NULL) abort();
+
+    return table->targets;
+}
+
+char *
+ldmcore_dm_part_name(const ldmcore_part_t * const part)
+{
+    return _printf("ldm_part_%s_%s", part->dg->name, part->name);
+}
+
+char *
+ldmcore_dm_part_uuid(const ldmcore_part_t * const part)
+{
+    char ldm_disk_guid[37];
+    uuid_unparse_lower(part->disk->guid, ldm_disk_guid);
+
+    return _printf("%s%s-%s", DM_UUID_PREFIX, part->name, ldm_disk_guid);
+}
+
+char *
+ldmcore_dm_vol_name(const ldmcore_vol_t * const vol)
+{
+    return _printf("ldm_vol_%s_%s", vol->dg->name, vol->name);
+}
+
+char *
+ldmcore_dm_vol_uuid(const ldmcore_vol_t * const vol,
+                    const uuid_t uuid_override)
+{
+    char ldm_vol_uuid[37];
+    if (uuid_override && !uuid_is_null(uuid_override)) {
+        uuid_unparse_lower(uuid_override, ldm_vol_uuid);
+    } else {
+        uuid_unparse_lower(vol->guid, ldm_vol_uuid);
+    }
+
+    return _printf("%s%s-%s", DM_UUID_PREFIX, vol->name, ldm_vol_uuid);
+}
+
+int
+ldmcore_dm_vol_has_legs(const ldmcore_vol_t * const vol)
+{
+    return vol->type == LDMCORE_VOLUME_TYPE_MIRRORED ||
+           vol->type == LDMCORE_VOLUME_TYPE_RAID5;
+}
+
+int
+ldmcore_dm_part_table(const ldmcore_part_t * const part,
+                      ldmcore_dm_table_t * const table,
+                      ldmcore_err_t * const err)
+{
+    const ldmcore_disk_t * const disk = part->disk;
+
+    const char * const device = ldmcore_disk_get_device(disk);
+    if (!device) {
+        memset(table, 0, sizeof(*table));
+        return ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                               "Disk %s required by partition %s is missing",
+                               disk->name, part->name);
+    }
+
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = part->size;
+    target->type = "linear";
+    target->params = _printf("%s %" PRIu64,
+                             device, disk->data_start + part->start);
+
+    table->name = ldmcore_dm_part_name(part);
+    table->uuid = ldmcore_dm_part_uuid(part);
+
+    return 0;
+}
+
+/* Comparator function that allows for sorting partitions by vol_offset (as the
+ * partitions may not always be sorted in increasing vol_offset order for
+ * spanned LDM partitions). */
+static int
+_cmp_part_vol_offset(const void * const a, const void * const b)
+{
+    const ldmcore_part_t * const ap = *(ldmcore_part_t * const *)a;
+    const ldmcore_part_t * const bp = *(ldmcore_part_t * const *)b;
+
+    if (ap->vol_offset < bp->vol_offset) return -1;
+    if (ap->vol_offset > bp->vol_offset) return 1;
+    return 0;
+}
+
+static int
+_spanned_table(const ldmcore_vol_t * const vol,
+               ldmcore_dm_table_t * const table, ldmcore_err_t * const err)
+{
+    int r = 0;
+
+    /* Sort partitions by vol_offset. We sort a copy because the volume may be
+     * concurrently accessed by other readers. */
+    ldmcore_part_t ** const parts = malloc(vol->n_parts * sizeof(*parts));
+    if (parts == NULL) abort();
+    memcpy(parts, vol->parts, vol->n_parts * sizeof(*parts));
+    qsort(parts, vol->n_parts, sizeof(*parts), _cmp_part_vol_offset);
+
+    ldmcore_dm_target_t * const targets = _init_table(table, vol->n_parts);
+
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        const ldmcore_part_t * const part = parts[i];
+        const ldmcore_disk_t * const disk = part->disk;
+
+        const char * const device = ldmcore_disk_get_device(disk);
+        if (!device) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                                "Disk %s required by spanned volume %s is "
+                                "missing", disk->name, vol->name);
+            goto out;
+        }
+
+        /* Sanity check: current position from adding up sizes of partitions
+         * should equal the volume offset of the partition */
+        if (pos != part->vol_offset) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                "Partition volume offset does not match "
+                                "sizes of preceding partitions");
+            goto out;
+        }
+
+        ldmcore_dm_target_t * const target = &targets[i];
+        target->start = pos;
+        target->size = part->size;
+        target->type = "linear";
+        target->params = _printf("%s %" PRIu64,
+                                 device, disk->data_start + part->start);
+        pos += part->size;
+    }
+
+out:
+    free(parts);
+    return r;
+}
+
+static int
+_striped_table(const ldmcore_vol_t * const vol,
+               ldmcore_dm_table_t * const table, ldmcore_err_t * const err)
+{
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = vol->size;
+    target->type = "striped";
+    target->params = _printf("%" PRIu32 " %" PRIu64,
+                             vol->n_parts, vol->chunk_size);
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        const ldmcore_part_t * const part = vol->parts[i];
+        const ldmcore_disk_t * const disk = part->disk;
+
+        const char * const device = ldmcore_disk_get_device(disk);
+        if (!device) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                                   "Disk %s required by striped volume %s is "
+                                   "missing", disk->name, vol->name);
+        }
+
+        _append_printf(&target->params, " %s %" PRIu64,
+                       device, disk->data_start + part->start);
+    }
+
+    return 0;
+}
+
+/* dm-raid requires a chunk size for raid1, although it doesn't use it */
+#define DM_RAID1_CHUNK_SIZE 128
+
+static uint64_t
+_raid_chunk_size(const ldmcore_vol_t * const vol)
+{
+    return vol->type == LDMCORE_VOLUME_TYPE_MIRRORED ?
+           DM_RAID1_CHUNK_SIZE : vol->chunk_size;
+}
+
+static int
+_check_raid_opts(const ldmcore_vol_t * const vol,
+                 const ldmcore_dm_raid_opts_t * const opts,
+                 ldmcore_err_t * const err)
+{
+    if (opts->region_size & (opts->region_size - 1)) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Region size %" PRIu32 " is not a power of 2",
+                               opts->region_size);
+    }
+    if (opts->region_size && opts->region_size < _raid_chunk_size(vol)) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Region size %" PRIu32
+                               " is smaller than the chunk size %" PRIu64,
+                               opts->region_size, _raid_chunk_size(vol));
+    }
+
+    if (opts->min_recovery_rate && opts->max_recovery_rate &&
+        opts->min_recovery_rate > opts->max_recovery_rate)
+    {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Minimum recovery rate %" PRIu32 " is greater "
+                               "than maximum recovery rate %" PRIu32,
+                               opts->min_recovery_rate,
+                               opts->max_recovery_rate);
+    }
+
+    if (opts->write_mostly == 0) return 0;
+
+    if (vol->type != LDMCORE_VOLUME_TYPE_MIRRORED) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Write mostly legs can only be set for mirrored "
+                               "volumes");
+    }
+
+    const uint64_t all = vol->n_parts >= 64 ?
+                         UINT64_MAX : (UINT64_C(1) << vol->n_parts) - 1;
+    if (opts->write_mostly & ~all) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Write mostly leg is out of range for volume "
+                               "%s with %" PRIu32 " legs",
+                               vol->name, vol->n_parts);
+    }
+    if (opts->write_mostly == all) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Not all legs of volume %s can be write mostly",
+                               vol->name);
+    }
+
+    return 0;
+}
+
+/* Format the chunk size and optional parameters of a raid target, preceded by
+ * their count */
+static char *
+_raid_params(const ldmcore_vol_t * const vol,
+             const ldmcore_dm_raid_opts_t * const opts)
+{
+    char *params = _printf("%" PRIu64, _raid_chunk_size(vol));
+    unsigned int n = 1;
+
+    if (opts && opts->nosync) {
+        _append_printf(&params, " nosync");
+        n++;
+    }
+    if (opts && opts->region_size) {
+        _append_printf(&params, " region_size %" PRIu32, opts->region_size);
+        n += 2;
+    }
+    if (opts && opts->min_recovery_rate) {
+        _append_printf(&params, " min_recovery_rate %" PRIu32,
+                       opts->min_recovery_rate);
+        n += 2;
+    }
+    if (opts && opts->max_recovery_rate) {
+        _append_printf(&params, " max_recovery_rate %" PRIu32,
+                       opts->max_recovery_rate);
+        n += 2;
+    }
+    if (opts && opts->daemon_sleep) {
+        _append_printf(&params, " daemon_sleep %" PRIu32, opts->daemon_sleep);
+        n += 2;
+    }
+    for (uint32_t i = 0; opts && i < vol->n_parts && i < 64; i++) {
+        if (opts->write_mostly & (UINT64_C(1) << i)) {
+            _append_printf(&params, " write_mostly %" PRIu32, i);
+            n += 2;
+        }
+    }
+
+    char * const r = _printf("%u %s", n, params);
+    free(params);
+    return r;
+}
+
+static int
+_raid_table(const ldmcore_vol_t * const vol, const char * const * const legs,
+            const char * const * const metas,
+            const ldmcore_dm_raid_opts_t * const opts,
+            ldmcore_dm_table_t * const table, ldmcore_err_t * const err)
+{
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = vol->size;
+    target->type = "raid";
+
+    if (opts) {
+        const int r = _check_raid_opts(vol, opts, err);
+        if (r < 0) return r;
+    }
+
+    char * const params = _raid_params(vol, opts);
+    target->params = _printf("%s %s %" PRIu32,
+                             vol->type == LDMCORE_VOLUME_TYPE_MIRRORED ?
+                             "raid1" : "raid5_ls",
+                             params, vol->n_parts);
+    free(params);
+
+    uint32_t n_found = 0;
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        if (legs[i]) {
+            const char * const meta = metas && metas[i] ? metas[i] : "-";
+            _append_printf(&target->params, " %s %s", meta, legs[i]);
+            n_found++;
+        } else {
+            _append_printf(&target->params, " - -");
+        }
+    }
+
+    if (vol->type == LDMCORE_VOLUME_TYPE_MIRRORED && n_found == 0) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                               "Mirrored volume is missing all partitions");
+    }
+    if (vol->type == LDMCORE_VOLUME_TYPE_RAID5 && n_found + 1 < vol->n_parts) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                               "RAID5 volume is missing more than 1 component");
+    }
+
+    return 0;
+}
+
+int
+ldmcore_dm_vol_table(const ldmcore_vol_t * const vol,
+                     const uuid_t uuid_override,
+                     const char * const * const legs,
+                     const char * const * const metas,
+                     const ldmcore_dm_raid_opts_t * const raid_opts,
+                     ldmcore_dm_table_t * const table,
+                     ldmcore_err_t * const err)
+{
+    int r;
+
+    switch (vol->type) {
+    case LDMCORE_VOLUME_TYPE_SIMPLE:
+    case LDMCORE_VOLUME_TYPE_SPANNED:
+        r = _spanned_table(vol, table, err);
+        break;
+
+    case LDMCORE_VOLUME_TYPE_STRIPED:
+        r = _striped_table(vol, table, err);
+        break;
+
+    case LDMCORE_VOLUME_TYPE_MIRRORED:
+    case LDMCORE_VOLUME_TYPE_RAID5:
+        r = _raid_table(vol, legs, metas, raid_opts, table, err);
+        break;
+
+    default:
+        /* Should be impossible */
+        memset(table, 0, sizeof(*table));
+        return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                               "Unexpected volume type: %u", vol->type);
+    }
+
+    if (r < 0) {
+        ldmcore_dm_table_clear(table);
+        return r;
+    }
+
+    table->name = ldmcore_dm_vol_name(vol);
+    table->uuid = ldmcore_dm_vol_uuid(vol, uuid_override);
+
+    return 0;
+}
+
+int
+ldmcore_dm_vol_leg_table(const ldmcore_vol_t * const vol,
+                         const uuid_t uuid_override,
+                         ldmcore_dm_table_t * const table,
+                         ldmcore_err_t * const err)
+{
+    if (vol->type != LDMCORE_VOLUME_TYPE_MIRRORED) {
+        memset(table, 0, sizeof(*table));
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Volume %s is not mirrored", vol->name);
+    }
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        const ldmcore_part_t * const part = vol->parts[i];
+        const ldmcore_disk_t * const disk = part->disk;
+
+        const char * const device = ldmcore_disk_get_device(disk);
+        if (!device) continue;
+
+        ldmcore_dm_target_t * const target = _init_table(table, 1);
+        target->start = 0;
+        target->size = vol->size;
+        target->type = "linear";
+        target->params = _printf("%s %" PRIu64,
+                                 device, disk->data_start + part->start);
+
+        table->name = ldmcore_dm_vol_name(vol);
+        table->uuid = ldmcore_dm_vol_uuid(vol, uuid_override);
+        table->read_only = 1;
+
+        return 0;
+    }
+
+    memset(table, 0, sizeof(*table));
+    return ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                           "Mirrored volume is missing all partitions");
+}
+
+/* dm-cache block size in sectors */
+#define DM_CACHE_BLOCK_SIZE 128
+
+/* dm-writecache block size in bytes */
+#define DM_WRITECACHE_BLOCK_SIZE 4096
+
+/* The size in sectors of a dm-cache metadata device for a cache device of the
+ * given size. The kernel recommends 4MiB plus 16 bytes per cache block. We
+ * base the estimate on the whole cache device, and round up to a MiB. */
+static uint64_t
+_cache_meta_size(const uint64_t device_size)
+{
+    const uint64_t blocks = device_size / DM_CACHE_BLOCK_SIZE;
+    const uint64_t bytes = 4 * 1024 * 1024 + 16 * blocks;
+    const uint64_t mib = (bytes + 1024 * 1024 - 1) / (1024 * 1024);
+
+    return mib * 2048;
+}
+
+void
+ldmcore_dm_table_add_suffix(ldmcore_dm_table_t * const table,
+                            const char * const suffix)
+{
+    char * const name = _printf("%s%s", table->name, suffix);
+    char * const uuid = _printf("%s%s", table->uuid, suffix);
+
+    free(table->name); table->name = name;
+    free(table->uuid); table->uuid = uuid;
+}
+
+/* Initialise a table with a single linear target, named after the volume */
+static void
+_cache_linear_table(const ldmcore_vol_t * const vol,
+                    const uuid_t uuid_override, const char * const suffix,
+                    const char * const device,
+                    const uint64_t offset, const uint64_t size,
+                    ldmcore_dm_table_t * const table)
+{
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = size;
+    target->type = "linear";
+    target->params = _printf("%s %" PRIu64, device, offset);
+
+    table->name = ldmcore_dm_vol_name(vol);
+    table->uuid = ldmcore_dm_vol_uuid(vol, uuid_override);
+    ldmcore_dm_table_add_suffix(table, suffix);
+}
+
+int
+ldmcore_dm_cache_pool_tables(const ldmcore_vol_t * const vol,
+                             const uuid_t uuid_override,
+                             const ldmcore_dm_cache_t * const cache,
+                             ldmcore_dm_table_t * const meta,
+                             ldmcore_dm_table_t * const data,
+                             ldmcore_err_t * const err)
+{
+    memset(meta, 0, sizeof(*meta));
+    memset(data, 0, sizeof(*data));
+
+    if (cache->mode != LDMCORE_DM_CACHE_WRITETHROUGH &&
+        cache->mode != LDMCORE_DM_CACHE_WRITEBACK)
+    {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Cache mode %u doesn't use a metadata device",
+                               cache->mode);
+    }
+
+    const uint64_t meta_size = _cache_meta_size(cache->device_size);
+    if (cache->device_size < meta_size + DM_CACHE_BLOCK_SIZE) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Cache device %s is too small: %" PRIu64
+                               " sectors", cache->device, cache->device_size);
+    }
+
+    /* Only whole cache blocks are usable */
+    uint64_t data_size = cache->device_size - meta_size;
+    data_size -= data_size % DM_CACHE_BLOCK_SIZE;
+
+    _cache_linear_table(vol, uuid_override, LDMCORE_DM_CACHE_META,
+                        cache->device, 0, meta_size, meta);
+    _cache_linear_table(vol, uuid_override, LDMCORE_DM_CACHE_DATA,
+                        cache->device, meta_size, data_size, data);
+
+    return 0;
+}
+
+int
+ldmcore_dm_cache_table(const ldmcore_vol_t * const vol,
+                       const uuid_t uuid_override,
+                       const ldmcore_dm_cache_t * const cache,
+                       const char * const origin,
+                       const char * const meta, const char * const data,
+                       ldmcore_dm_table_t * const table,
+                       ldmcore_err_t * const err)
+{
+    memset(table, 0, sizeof(*table));
+
+    char *params;
+    const char *type;
+    switch (cache->mode) {
+    case LDMCORE_DM_CACHE_WRITECACHE:
+        /* s: the cache device is an SSD rather than persistent memory */
+        type = "writecache";
+        params = _printf("s %s %s %u 0", origin, cache->device,
+                         DM_WRITECACHE_BLOCK_SIZE);
+        break;
+
+    case LDMCORE_DM_CACHE_WRITETHROUGH:
+    case LDMCORE_DM_CACHE_WRITEBACK:
+        /* dm-cache defaults to writeback */
+        type = "cache";
+        params = _printf("%s %s %s %u %s smq 0", meta, data, origin,
+                         DM_CACHE_BLOCK_SIZE,
+                         cache->mode == LDMCORE_DM_CACHE_WRITETHROUGH ?
+                         "1 writethrough" : "0");
+        break;
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Unexpected cache mode: %u", cache->mode);
+    }
+
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = vol->size;
+    target->type = type;
+    target->params = params;
+
+    table->name = ldmcore_dm_vol_name(vol);
+    table->uuid = ldmcore_dm_vol_uuid(vol, uuid_override);
+
+    return 0;
+}
+
+/* dm-snapshot chunk size in sectors. Small chunks keep the COW store of a
+ * clone close to the amount of data actually changed. */
+#define DM_SNAPSHOT_CHUNK_SIZE 8
+
+int
+ldmcore_dm_snapshot_table(const ldmcore_vol_t * const vol,
+                          const uuid_t uuid_override, const char * const origin,
+                          const char * const cow, const int persistent,
+                          ldmcore_dm_table_t * const table,
+                          ldmcore_err_t * const err)
+{
+    memset(table, 0, sizeof(*table));
+
+    ldmcore_dm_target_t * const target = _init_table(table, 1);
+    target->start = 0;
+    target->size = vol->size;
+    target->type = "snapshot";
+    target->params = _printf("%s %s %c %u", origin, cow,
+                             persistent ? 'P' : 'N', DM_SNAPSHOT_CHUNK_SIZE);
+
+    table->name = ldmcore_dm_vol_name(vol);
+    table->uuid = ldmcore_dm_vol_uuid(vol, uuid_override);
+
+    return 0;
+}
+
+void
+ldmcore_dm_table_clear(ldmcore_dm_table_t * const table)
+{
+    for (uint32_t i = 0; i < table->n_targets; i++) {
+        free(table->targets[i].params);
+    }
+    free(table->targets);
+    free(table->name);
+    free(table->uuid);
+    memset(table, 0, sizeof(*table));
+}
+
+uint16_t
+ldmcore_dm_udev_flags(const int sync)
+{
+    dm_udev_set_sync_support(sync ? 1 : 0);
+    dm_udev_set_checking(sync ? 1 : 0);
+
+    if (sync) return 0;
+
+    return DM_UDEV_DISABLE_DM_RULES_FLAG |
+           DM_UDEV_DISABLE_SUBSYSTEM_RULES_FLAG |
+           DM_UDEV_DISABLE_DISK_RULES_FLAG |
+           DM_UDEV_DISABLE_OTHER_RULES_FLAG;
+}
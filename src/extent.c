@@ -0,0 +1,233 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Translation of volume ranges to extents on member disks */
+
+#include <config.h>
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldmcore.h"
+
+typedef struct {
+    ldmcore_extent_t *extents;
+    uint32_t n_extents;
+    uint32_t alloc;
+} _extent_list_t;
+
+static void
+_add_extent(_extent_list_t * const list, const ldmcore_vol_t * const vol,
+            const uint32_t part, const ldmcore_extent_role_t role,
+            const uint64_t vol_offset, const uint64_t part_offset,
+            const uint64_t length)
+{
+    if (list->n_extents == list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 8;
+        list->extents = realloc(list->extents,
+                                list->alloc * sizeof(*list->extents));
+        if (list->extents == NULL) abort();
+    }
+
+    const ldmcore_part_t * const p = vol->parts[part];
+
+    ldmcore_extent_t * const extent = &list->extents[list->n_extents++];
+    extent->part = part;
+    extent->role = role;
+    extent->vol_offset = vol_offset;
+    extent->offset = p->disk->data_start + p->start + part_offset;
+    extent->length = length;
+}
+
+/* Simple, spanned and mirrored volumes. Every partition covers the range of the
+ * volume given by its vol_offset and size. Mirrored volumes have one partition
+ * per leg, each of which covers the whole volume. */
+static void
+_map_linear(const ldmcore_vol_t * const vol, const ldmcore_extent_role_t role,
+            const uint64_t offset, const uint64_t length,
+            _extent_list_t * const list)
+{
+    const uint64_t end = offset + length;
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        const ldmcore_part_t * const part = vol->parts[i];
+
+        const uint64_t part_end = part->vol_offset + part->size;
+        if (part_end <= offset || part->vol_offset >= end) continue;
+
+        const uint64_t start = offset > part->vol_offset ?
+                               offset : part->vol_offset;
+        const uint64_t stop = end < part_end ? end : part_end;
+
+        _add_extent(list, vol, i, role,
+                    start, start - part->vol_offset, stop - start);
+    }
+}
+
+static int
+_cmp_extent_vol_offset(const void * const a, const void * const b)
+{
+    const ldmcore_extent_t * const ae = a;
+    const ldmcore_extent_t * const be = b;
+
+    if (ae->vol_offset < be->vol_offset) return -1;
+    if (ae->vol_offset > be->vol_offset) return 1;
+    return 0;
+}
+
+static void
+_map_striped(const ldmcore_vol_t * const vol,
+             const uint64_t offset, const uint64_t length,
+             _extent_list_t * const list)
+{
+    const uint64_t chunk = vol->chunk_size;
+    const uint32_t n = vol->n_parts;
+
+    uint64_t pos = offset;
+    const uint64_t end = offset + length;
+    while (pos < end) {
+        const uint64_t chunk_i = pos / chunk;
+        const uint64_t within = pos % chunk;
+        const uint64_t row = chunk_i / n;
+        const uint32_t col = chunk_i % n;
+
+        uint64_t len = chunk - within;
+        if (len > end - pos) len = end - pos;
+
+        _add_extent(list, vol, col, LDMCORE_EXTENT_DATA,
+                    pos, row * chunk + within, len);
+        pos += len;
+    }
+}
+
+/* RAID5 volumes use the left-symmetric layout. Each row of chunks contains n-1
+ * data chunks and a parity chunk. Parity rotates backwards from the last
+ * column, and data for a row starts in the column following its parity. */
+static void
+_map_raid5(const ldmcore_vol_t * const vol,
+           const uint64_t offset, const uint64_t length,
+           _extent_list_t * const list)
+{
+    const uint64_t chunk = vol->chunk_size;
+    const uint32_t n = vol->n_parts;
+
+    uint64_t pos = offset;
+    const uint64_t end = offset + length;
+    while (pos < end) {
+        const uint64_t row = pos / chunk / (n - 1);
+        const uint32_t parity = (n - 1) - row % n;
+
+        /* Parity covers the union of the ranges within a chunk of the data
+         * extents in this row */
+        uint64_t parity_start = chunk;
+        uint64_t parity_end = 0;
+        uint64_t parity_vol_offset = pos;
+
+        while (pos < end && pos / chunk / (n - 1) == row) {
+            const uint64_t within = pos % chunk;
+            const uint32_t d = pos / chunk % (n - 1);
+            const uint32_t col = (parity + 1 + d) % n;
+
+            uint64_t len = chunk - within;
+            if (len > end - pos) len = end - pos;
+
+            _add_extent(list, vol, col, LDMCORE_EXTENT_DATA,
+                        pos, row * chunk + within, len);
+
+            if (within < parity_start) parity_start = within;
+            if (within + len > parity_end) parity_end = within + len;
+
+            pos += len;
+        }
+
+        _add_extent(list, vol, parity, LDMCORE_EXTENT_PARITY,
+                    parity_vol_offset, row * chunk + parity_start,
+                    parity_end - parity_start);
+    }
+}
+
+int
+ldmcore_vol_map_range(const ldmcore_vol_t * const vol,
+                      const uint64_t offset, const uint64_t length,
+                      ldmcore_extent_t ** const extents,
+                      uint32_t * const n_extents,
+                      ldmcore_err_t * const err)
+{
+    *extents = NULL;
+    *n_extents = 0;
+
+    if (offset > vol->size || length > vol->size - offset) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Range %" PRIu64 "+%" PRIu64
+                               " is outside volume %s of size %" PRIu64,
+                               offset, length, vol->name, vol->size);
+    }
+
+    if ((vol->type == LDMCORE_VOLUME_TYPE_STRIPED ||
+         vol->type == LDMCORE_VOLUME_TYPE_RAID5) &&
+        (vol->chunk_size == 0 || vol->n_parts == 0))
+    {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Volume %s has invalid chunk size %" PRIu64
+                               " or partition count %" PRIu32,
+                               vol->name, vol->chunk_size, vol->n_parts);
+    }
+    if (vol->type == LDMCORE_VOLUME_TYPE_RAID5 && vol->n_parts < 2) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "RAID5 volume %s has only %" PRIu32
+                               " partitions", vol->name, vol->n_parts);
+    }
+
+    _extent_list_t list = { NULL, 0, 0 };
+
+    switch (vol->type) {
+    case LDMCORE_VOLUME_TYPE_SIMPLE:
+    case LDMCORE_VOLUME_TYPE_SPANNED:
+        _map_linear(vol, LDMCORE_EXTENT_DATA, offset, length, &list);
+
+        /* Partitions may not be in vol_offset order */
+        if (list.n_extents > 1) {
+            qsort(list.extents, list.n_extents, sizeof(*list.extents),
+                  _cmp_extent_vol_offset);
+        }
+        break;
+
+    case LDMCORE_VOLUME_TYPE_MIRRORED:
+        _map_linear(vol, LDMCORE_EXTENT_MIRROR, offset, length, &list);
+        break;
+
+    case LDMCORE_VOLUME_TYPE_STRIPED:
+        _map_striped(vol, offset, length, &list);
+        break;
+
+    case LDMCORE_VOLUME_TYPE_RAID5:
+        _map_raid5(vol, offset, length, &list);
+        break;
+
+    default:
+        /* Should be impossible */
+        return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                               "Unexpected volume type: %u", vol->type);
+    }
+
+    *extents = list.extents;
+    *n_extents = list.n_extents;
+
+    return 0;
+}
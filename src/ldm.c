@@ -17,17 +17,19 @@
 
 #include <config.h>
 
-#include <endian.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libdevmapper.h>
 #include <linux/fs.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -35,156 +37,16 @@
 #include <unistd.h>
 #include <uuid/uuid.h>
 
-#include "mbr.h"
-#include "gpt.h"
 #include "ldm.h"
+#include "ldmcore.h"
 
 #define DM_UUID_PREFIX "LDM-"
 
-#define UUID_FMT "%02x%02x%02x%02x-%02x%02x-%02x%02x-" \
-                 "%02x%02x-%02x%02x%02x%02x%02x%02x"
-#define UUID_VALS(uuid) (uuid)[0], (uuid)[1], (uuid)[2], (uuid)[3], \
-                        (uuid)[4], (uuid)[5], (uuid)[6], (uuid)[7], \
-                        (uuid)[8], (uuid)[9], (uuid)[10], (uuid)[11], \
-                        (uuid)[12], (uuid)[13], (uuid)[14], (uuid)[15]
-
 /**
  * SECTION:ldm
  * @include: ldm.h
  */
 
-/*
- * The layout here is mostly derived from:
- * http://hackipedia.org/Disk%20formats/Partition%20tables/Windows%20NT%20Logical%20Disk%20Manager/html,%20ldmdoc/index.html
- *
- * Note that the above reference describes a slightly older version of LDM, but
- * the fields it describes remain accurate.
- *
- * The principal difference from the above version is the addition of support
- * for LDM on GPT disks.
- */
-
-/* Fixed structures
- *
- * These structures don't contain any variable-length fields, and can therefore
- * be accessed directly.
- */
-
-struct _privhead
-{
-    char magic[8]; // "PRIVHEAD"
-
-    uint32_t unknown_sequence;
-    uint16_t version_major;
-    uint16_t version_minor;
-
-    uint64_t unknown_timestamp;
-    uint64_t unknown_number;
-    uint64_t unknown_size1;
-    uint64_t unknown_size2;
-
-    char disk_guid[64];
-    char host_guid[64];
-    char disk_group_guid[64];
-    char disk_group_name[32];
-
-    uint16_t unknown1;
-    char padding1[9];
-
-    uint64_t logical_disk_start;
-    uint64_t logical_disk_size;
-    uint64_t ldm_config_start;
-    uint64_t ldm_config_size;
-    uint64_t n_tocs;
-    uint64_t toc_size;
-    uint32_t n_configs;
-    uint32_t n_logs;
-    uint64_t config_size;
-    uint64_t log_size;
-
-    uint32_t disk_signature;
-    /* Values below aren't set in my data */
-    char disk_set_guid[16];
-    char disk_set_guid_dup[16];
-
-} __attribute__((__packed__));
-
-struct _tocblock_bitmap
-{
-    char name[8];
-    uint16_t flags1;
-    uint64_t start;
-    uint64_t size; // Relative to start of DB
-    uint64_t flags2;
-} __attribute__((__packed__));
-
-struct _tocblock
-{
-    char magic[8]; // "TOCBLOCK"
-
-    uint32_t seq1;
-    char padding1[4];
-    uint32_t seq2;
-    char padding2[16];
-
-    struct _tocblock_bitmap bitmap[2];
-} __attribute__((__packed__));
-
-struct _vmdb
-{
-    char magic[4]; // "VMDB"
-
-    uint32_t vblk_last;
-    uint32_t vblk_size;
-    uint32_t vblk_first_offset;
-
-    uint16_t update_status;
-
-    uint16_t version_major;
-    uint16_t version_minor;
-
-    char disk_group_name[31];
-    char disk_group_guid[64];
-
-    uint64_t committed_seq;
-    uint64_t pending_seq;
-    uint32_t n_committed_vblks_vol;
-    uint32_t n_committed_vblks_comp;
-    uint32_t n_committed_vblks_part;
-    uint32_t n_committed_vblks_disk;
-    char padding1[12];
-    uint32_t n_pending_vblks_vol;
-    uint32_t n_pending_vblks_comp;
-    uint32_t n_pending_vblks_part;
-    uint32_t n_pending_vblks_disk;
-    char padding2[12];
-
-    uint64_t last_accessed;
-} __attribute__((__packed__));
-
-/* This is the header of every VBLK entry */
-struct _vblk_head
-{
-    char magic[4]; // "VBLK"
-
-    uint32_t seq;
-
-    uint32_t record_id;
-    uint16_t entry;
-    uint16_t entries_total;
-} __attribute__((__packed__));
-
-/* This is the header of every VBLK record, which may span multiple VBLK
- * entries. I.e. if a VBLK record is split across 2 entries, only the first will
- * have this header immediately following the entry header. */
-struct _vblk_rec_head
-{
-    uint16_t status;
-    uint8_t  flags;
-    uint8_t  type;
-    uint32_t size;
-} __attribute__((__packed__));
-
 /* Array clearing functions */
 
 static void
@@ -193,12 +55,6 @@ _unref_object(gpointer const data)
     g_object_unref(*(GObject **)data);
 }
 
-static void
-_free_pointer(gpointer const data)
-{
-    g_free(*(gpointer *)data);
-}
-
 static void
 _free_gstring(gpointer const data)
 {
@@ -237,12 +93,44 @@ ldm_error_get_type(void)
 }
 
 /* We catch log messages generated by device mapper with errno != 0 and store
- * them here */
-static int _dm_err_last_level = 0;
-static const char *_dm_err_last_file = NULL;
-static int _dm_err_last_line = 0;
-static int _dm_err_last_errno = 0;
-static char *_dm_err_last_msg = NULL;
+ * them here. Volumes may be activated from several threads at once, so the
+ * last error is kept per thread. */
+typedef struct {
+    int level;
+    const char *file;
+    int line;
+    int errnum;
+    char *msg;
+} _dm_err_t;
+
+static void
+_dm_err_free(gpointer const data)
+{
+    _dm_err_t * const dm_err = data;
+
+    free(dm_err->msg);
+    g_free(dm_err);
+}
+
+static GPrivate _dm_err_key = G_PRIVATE_INIT(_dm_err_free);
+
+/* udev flags passed with every device mapper operation. Set by
+ * ldm_dm_set_udev_sync(). */
+static uint16_t _dm_udev_flags = 0;
+
+static _dm_err_t *
+_dm_err_get(void)
+{
+    _dm_err_t *dm_err = g_private_get(&_dm_err_key);
+    if (dm_err == NULL) {
+        dm_err = g_new0(_dm_err_t, 1);
+        g_private_set(&_dm_err_key, dm_err);
+    }
+    return dm_err;
+}
+
+#define _dm_err_last_errno (_dm_err_get()->errnum)
+#define _dm_err_last_msg (_dm_err_get()->msg)
 
 static void
 _dm_log_fn(const int level, const char * const file, const int line,
@@ -250,34 +138,43 @@ _dm_log_fn(const int level, const char * const file, const int line,
 {
     if (dm_errno == 0) return;
 
-    _dm_err_last_level = level;
-    _dm_err_last_file = file;
-    _dm_err_last_line = line;
-
     /* device-mapper doesn't set dm_errno usefully (it only seems to use
      * EUNCLASSIFIED), so we capture errno directly and cross our fingers */
-    _dm_err_last_errno = errno;
+    const int errnum = errno;
 
-    if (_dm_err_last_msg) {
-        free(_dm_err_last_msg);
-        _dm_err_last_msg = NULL;
+    _dm_err_t * const dm_err = _dm_err_get();
+    dm_err->level = level;
+    dm_err->file = file;
+    dm_err->line = line;
+    dm_err->errnum = errnum;
+
+    if (dm_err->msg) {
+        free(dm_err->msg);
+        dm_err->msg = NULL;
     }
 
     va_list ap;
     va_start(ap, f);
-    if (vasprintf(&_dm_err_last_msg, f, ap) == -1) {
+    if (vasprintf(&dm_err->msg, f, ap) == -1) {
         g_error("vasprintf");
     }
     va_end(ap);
 }
 
+/* Debug output from the LDM core is passed to GLib's logging */
+static void
+_core_log_fn(const char * const fmt, va_list ap)
+{
+    g_logv(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, fmt, ap);
+}
+
 /* Macros for exporting object properties */
 
 #define EXPORT_PROP_STRING(object, klass, property)                            \
 gchar *                                                                        \
 ldm_ ## object ## _get_ ## property(const klass * const o)                     \
 {                                                                              \
-    gpointer p = o->priv->property;                                            \
+    gpointer p = o->priv->core->property;                                      \
     if (p == NULL) return NULL;                                                \
                                                                                \
     const size_t len = strlen(p) + 1;                                          \
@@ -291,7 +188,7 @@ gchar *                                                                        \
 ldm_ ## object ## _get_guid(const klass * const o)                             \
 {                                                                              \
     gchar *r = g_malloc(37);                                                   \
-    uuid_unparse(o->priv->guid, r);                                            \
+    uuid_unparse(o->priv->core->guid, r);                                      \
     return r;                                                                  \
 }
 
@@ -299,69 +196,195 @@ ldm_ ## object ## _get_guid(const klass * const o)                             \
 type                                                                           \
 ldm_ ## object ## _get_ ## property(const klass * const o)                     \
 {                                                                              \
-    return o->priv->property;                                                  \
+    return o->priv->core->property;                                            \
 }
 
 /* LDM */
 
+/* Readers never take a lock. disk_groups is an immutable snapshot which is
+ * replaced wholesale by writers, who are serialised by lock. A reader counts
+ * itself in readers while it takes a reference to the snapshot. A replaced
+ * snapshot is moved to stale, which is cleared by the first writer to see no
+ * readers. A replaced device path may still be in use by a reader of an
+ * LDMDisk, which isn't counted, so it is moved to retired, which is only
+ * cleared on dispose. */
 struct _LDMPrivate
 {
     GArray *disk_groups;
+    gint readers;
+
+    GMutex lock;
+    GPtrArray *stale;
+    GArray *retired;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(LDM, ldm, G_TYPE_OBJECT)
 
+struct _retired
+{
+    gpointer data;
+    GDestroyNotify destroy;
+};
+
+static void
+_free_retired(gpointer const data)
+{
+    struct _retired * const r = data;
+    r->destroy(r->data);
+}
+
+/* Defer freeing of data which a lock-free reader may still be accessing until
+ * the LDM object is disposed. Must be called with lock held. */
+static void
+_ldm_retire(LDMPrivate * const priv, gpointer const data,
+            GDestroyNotify const destroy)
+{
+    if (data == NULL) return;
+
+    struct _retired r = { data, destroy };
+    g_array_append_val(priv->retired, r);
+}
+
+static void
+_unref_array(gpointer const data)
+{
+    g_array_unref((GArray *) data);
+}
+
+/* Replace the published disk group array. Must be called with lock held. */
+static void
+_ldm_publish_disk_groups(LDMPrivate * const priv, GArray * const disk_groups)
+{
+    GArray * const old = priv->disk_groups;
+    g_atomic_pointer_set(&priv->disk_groups, disk_groups);
+    if (old) g_ptr_array_add(priv->stale, old);
+
+    /* A reader which starts after this sees the new snapshot, so with none in
+     * progress no stale snapshot can be reached */
+    if (g_atomic_int_get(&priv->readers) == 0) {
+        g_ptr_array_set_size(priv->stale, 0);
+    }
+}
+
 static void
 ldm_dispose(GObject * const object)
 {
     LDM *ldm = LDM_CAST(object);
 
+    g_mutex_lock(&ldm->priv->lock);
     if (ldm->priv->disk_groups) {
-        g_array_unref(ldm->priv->disk_groups); ldm->priv->disk_groups = NULL;
+        GArray * const disk_groups = ldm->priv->disk_groups;
+        g_atomic_pointer_set(&ldm->priv->disk_groups, NULL);
+        g_array_unref(disk_groups);
+    }
+    if (ldm->priv->stale) {
+        g_ptr_array_unref(ldm->priv->stale); ldm->priv->stale = NULL;
     }
+    if (ldm->priv->retired) {
+        g_array_unref(ldm->priv->retired); ldm->priv->retired = NULL;
+    }
+    g_mutex_unlock(&ldm->priv->lock);
 
     /* Restore default logging function. */
     dm_log_with_errno_init(NULL);
 }
 
+static void
+ldm_finalize(GObject * const object)
+{
+    LDM *ldm = LDM_CAST(object);
+
+    g_mutex_clear(&ldm->priv->lock);
+}
+
 static void
 ldm_init(LDM * const o)
 {
     o->priv = ldm_get_instance_private(o);
     bzero(o->priv, sizeof(*o->priv));
 
-    /* Provide our logging function. */
+    g_mutex_init(&o->priv->lock);
+    o->priv->stale = g_ptr_array_new_with_free_func(_unref_array);
+    o->priv->retired = g_array_new(FALSE, FALSE, sizeof(struct _retired));
+    g_array_set_clear_func(o->priv->retired, _free_retired);
+
+    /* Provide our logging functions. */
+    ldmcore_set_log_fn(_core_log_fn);
     dm_log_with_errno_init(_dm_log_fn);
     dm_set_name_mangling_mode(DM_STRING_MANGLING_AUTO);
     dm_set_uuid_prefix(DM_UUID_PREFIX);
 }
 
+enum {
+    SIGNAL_LDM_DISK_ATTACHED,
+    SIGNAL_LDM_DISK_DETACHED,
+    SIGNAL_LDM_DISK_GROUP_COMPLETE,
+    SIGNAL_LDM_LAST
+};
+
+static guint _ldm_signals[SIGNAL_LDM_LAST] = { 0, };
+
 static void
 ldm_class_init(LDMClass * const klass)
 {
     GObjectClass *object_class = G_OBJECT_CLASS(klass);
     object_class->dispose = ldm_dispose;
+    object_class->finalize = ldm_finalize;
+
+    /**
+     * LDM::disk-attached:
+     * @o: The #LDM object
+     * @dg: The #LDMDiskGroup containing @disk
+     * @disk: The #LDMDisk whose device has been found
+     *
+     * Emitted by ldm_add() and ldm_add_fd() when a device is found for a disk
+     * which was previously missing.
+     */
+    _ldm_signals[SIGNAL_LDM_DISK_ATTACHED] =
+        g_signal_new("disk-attached", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+                     G_TYPE_NONE, 2, LDM_TYPE_DISK_GROUP, LDM_TYPE_DISK);
+
+    /**
+     * LDM::disk-detached:
+     * @o: The #LDM object
+     * @dg: The #LDMDiskGroup containing @disk
+     * @disk: The #LDMDisk whose device has been removed
+     *
+     * Emitted by ldm_remove_device() when the device of a disk is removed.
+     */
+    _ldm_signals[SIGNAL_LDM_DISK_DETACHED] =
+        g_signal_new("disk-detached", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+                     G_TYPE_NONE, 2, LDM_TYPE_DISK_GROUP, LDM_TYPE_DISK);
 
+    /**
+     * LDM::disk-group-complete:
+     * @o: The #LDM object
+     * @dg: The #LDMDiskGroup which is now complete
+     *
+     * Emitted by ldm_add() and ldm_add_fd() when devices have been found for
+     * all disks in a disk group.
+     */
+    _ldm_signals[SIGNAL_LDM_DISK_GROUP_COMPLETE] =
+        g_signal_new("disk-group-complete", G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL,
+                     G_TYPE_NONE, 1, LDM_TYPE_DISK_GROUP);
 }
 
 /* LDMDiskGroup */
 
+/* Each object is a wrapper around an object in the LDM core. Every wrapper
+ * holds a reference to the core disk group, which owns all of its objects. */
+
 struct _LDMDiskGroupPrivate
 {
-    uuid_t guid;
-    uint32_t id;
-    char *name;
+    ldmcore_dg_t *core;
 
-    uint64_t sequence;
-
-    /* GObjects */
+    /* GObjects wrapping the disk group's core objects */
     GArray *disks;
     GArray *parts;
     GArray *vols;
-
-    /* We don't expose components, so they're no GObjects */
-    uint32_t n_comps;
-    GArray *comps;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(LDMDiskGroup, ldm_disk_group, G_TYPE_OBJECT)
@@ -377,7 +400,7 @@ ldm_disk_group_get_property(GObject * const o, const guint property_id,
                             GValue * const value, GParamSpec * const pspec)
 {
     LDMDiskGroup * const dg = LDM_DISK_GROUP(o);
-    LDMDiskGroupPrivate * const priv = dg->priv;
+    const ldmcore_dg_t * const priv = dg->priv->core;
 
     switch (property_id) {
     case PROP_LDM_DISK_GROUP_GUID:
@@ -407,9 +430,6 @@ ldm_disk_group_dispose(GObject * const object)
     if (dg->priv->vols) {
         g_array_unref(dg->priv->vols); dg->priv->vols = NULL;
     }
-    if (dg->priv->comps) {
-        g_array_unref(dg->priv->comps); dg->priv->comps = NULL;
-    }
     if (dg->priv->parts) {
         g_array_unref(dg->priv->parts); dg->priv->parts = NULL;
     }
@@ -423,7 +443,9 @@ ldm_disk_group_finalize(GObject * const object)
 {
     LDMDiskGroup *dg = LDM_DISK_GROUP(object);
 
-    g_free(dg->priv->name); dg->priv->name = NULL;
+    if (dg->priv->core) {
+        ldmcore_dg_unref(dg->priv->core); dg->priv->core = NULL;
+    }
 }
 
 static void
@@ -492,41 +514,80 @@ ldm_volume_type_get_type(void)
     return etype;
 }
 
-/* LDMVolume */
+/* LDMExtentRole */
 
-typedef enum {
-    _VOLUME_TYPE_GEN = 0x3,
-    _VOLUME_TYPE_RAID5 = 0x4
-} _int_volume_type;
+GType
+ldm_extent_role_get_type(void)
+{
+    static GType etype = 0;
+    if (etype == 0) {
+        static const GEnumValue values[] = {
+            { LDM_EXTENT_ROLE_DATA, "LDM_EXTENT_ROLE_DATA", "data" },
+            { LDM_EXTENT_ROLE_PARITY, "LDM_EXTENT_ROLE_PARITY", "parity" },
+            { LDM_EXTENT_ROLE_MIRROR, "LDM_EXTENT_ROLE_MIRROR", "mirror" },
+            { 0, NULL, NULL }
+        };
+        etype = g_enum_register_static("LDMExtentRole", values);
+    }
+    return etype;
+}
 
-struct _LDMVolumePrivate
+GType
+ldm_dm_cache_mode_get_type(void)
 {
-    guint32 id;
-    gchar *name;
-    uuid_t guid;
-    gchar *dgname;
+    static GType etype = 0;
+    if (etype == 0) {
+        static const GEnumValue values[] = {
+            { LDM_DM_CACHE_NONE, "LDM_DM_CACHE_NONE", "none" },
+            { LDM_DM_CACHE_WRITECACHE, "LDM_DM_CACHE_WRITECACHE",
+              "writecache" },
+            { LDM_DM_CACHE_WRITETHROUGH, "LDM_DM_CACHE_WRITETHROUGH",
+              "writethrough" },
+            { LDM_DM_CACHE_WRITEBACK, "LDM_DM_CACHE_WRITEBACK", "writeback" },
+            { 0, NULL, NULL }
+        };
+        etype = g_enum_register_static("LDMDMCacheMode", values);
+    }
+    return etype;
+}
+
+/* LDMVolume */
 
-    guint64 size;
-    guint8 part_type;
+/* The device mapper settings of a volume */
+typedef struct {
+    /* User specified UUID for device mapper */
+    uuid_t uuid_override;
 
-    guint8 flags;       /* Not exposed: unclear what it means */
-    gchar *id1;         /* Not exposed: unclear what it means */
-    gchar *id2;         /* Not exposed: unclear what it means */
-    guint64 size2;      /* Not exposed: unclear what it means */
-    gchar *hint;
+    /* Directory containing persistent dm-raid metadata, or NULL */
+    gchar *metadata_dir;
 
-    /* Derived */
-    LDMVolumeType type;
-    GArray *parts;
-    guint64 chunk_size;
+    /* Optional dm-raid parameters for mirrored and RAID5 volumes */
+    ldmcore_dm_raid_opts_t raid_opts;
 
-    /* Only used during parsing */
-    _int_volume_type _int_type;
-    guint32 _n_comps;
-    guint32 _n_comps_i;
+    /* Create device mapper devices read-only */
+    gboolean read_only;
 
-    /* User specified UUID for device mapper */
-    uuid_t uuid_override;
+    /* A cache to stack on the volume's device */
+    ldmcore_dm_cache_mode_t cache_mode;
+    gchar *cache_device;
+
+    /* The COW store of a snapshot to stack on the volume's device */
+    gchar *snapshot_cow;
+    gboolean snapshot_persistent;
+} _dm_opts_t;
+
+struct _LDMVolumePrivate
+{
+    ldmcore_vol_t *core;
+
+    /* LDMPartition wrappers of core->parts */
+    GArray *parts;
+
+    /* Device mapper settings. They may be changed while the volume is being
+     * activated, so they are only accessed with dm_lock held. Activation works
+     * on a copy taken when it starts. */
+    GMutex dm_lock;
+    _dm_opts_t dm;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(LDMVolume, ldm_volume, G_TYPE_OBJECT)
@@ -547,7 +608,7 @@ ldm_volume_get_property(GObject * const o, const guint property_id,
                         GValue * const value, GParamSpec *pspec)
 {
     LDMVolume * const vol = LDM_VOLUME(o);
-    LDMVolumePrivate * const priv = vol->priv;
+    const ldmcore_vol_t * const priv = vol->priv->core;
 
     switch (property_id) {
     case PROP_LDM_VOLUME_NAME:
@@ -562,7 +623,7 @@ ldm_volume_get_property(GObject * const o, const guint property_id,
         break;
 
     case PROP_LDM_VOLUME_TYPE:
-        g_value_set_enum(value, priv->type); break;
+        g_value_set_enum(value, (LDMVolumeType) priv->type); break;
 
     case PROP_LDM_VOLUME_SIZE:
         g_value_set_uint64(value, priv->size); break;
@@ -592,7 +653,7 @@ EXPORT_PROP_SCALAR(volume, LDMVolume, chunk_size, guint64)
 LDMVolumeType
 ldm_volume_get_voltype(const LDMVolume * const o)
 {
-    return o->priv->type;
+    return (LDMVolumeType) o->priv->core->type;
 }
 
 static void
@@ -604,17 +665,41 @@ ldm_volume_dispose(GObject * const object)
     if (vol->parts) { g_array_unref(vol->parts); vol->parts = NULL; }
 }
 
+static void
+_dm_opts_clear(_dm_opts_t * const opts)
+{
+    g_free(opts->metadata_dir); opts->metadata_dir = NULL;
+    g_free(opts->cache_device); opts->cache_device = NULL;
+    g_free(opts->snapshot_cow); opts->snapshot_cow = NULL;
+}
+
+/* Copy a volume's device mapper settings. The copy must be freed with
+ * _dm_opts_clear(). */
+static void
+_dm_opts_get(const LDMVolumePrivate * const vol, _dm_opts_t * const opts)
+{
+    GMutex * const lock = (GMutex *) &vol->dm_lock;
+
+    g_mutex_lock(lock);
+    *opts = vol->dm;
+    opts->metadata_dir = g_strdup(vol->dm.metadata_dir);
+    opts->cache_device = g_strdup(vol->dm.cache_device);
+    opts->snapshot_cow = g_strdup(vol->dm.snapshot_cow);
+    g_mutex_unlock(lock);
+}
+
 static void
 ldm_volume_finalize(GObject * const object)
 {
     LDMVolume * const vol_o = LDM_VOLUME(object);
     LDMVolumePrivate * const vol = vol_o->priv;
 
-    g_free(vol->name); vol->name = NULL;
-    g_free(vol->dgname); vol->dgname = NULL;
-    g_free(vol->id1); vol->id1 = NULL;
-    g_free(vol->id2); vol->id2 = NULL;
-    g_free(vol->hint); vol->hint = NULL;
+    if (vol->core) {
+        ldmcore_dg_unref(vol->core->dg); vol->core = NULL;
+    }
+
+    _dm_opts_clear(&vol->dm);
+    g_mutex_clear(&vol->dm_lock);
 }
 
 static void
@@ -741,55 +826,18 @@ ldm_volume_init(LDMVolume * const o)
     o->priv = ldm_volume_get_instance_private(o);
     bzero(o->priv, sizeof(*o->priv));
 
-    /* We don't have a trivial way to initialize this array to the correct size
-     * during parsing because we cut out components. We initialize it here and
-     * allow it to grow dynamically. */
+    g_mutex_init(&o->priv->dm_lock);
     o->priv->parts = g_array_new(FALSE, FALSE, sizeof(LDMPartition *));
     g_array_set_clear_func(o->priv->parts, _unref_object);
 }
 
-/* We don't expose components externally */
-
-typedef enum {
-    _COMPONENT_TYPE_STRIPED = 0x1,
-    _COMPONENT_TYPE_SPANNED = 0x2,
-    _COMPONENT_TYPE_RAID    = 0x3
-} _LDMComponentType;
-
-struct _LDMComponent
-{
-    guint32 id;
-    guint32 parent_id;
-
-    _LDMComponentType type;
-    uint32_t n_parts;
-    GArray *parts;
-
-    guint64 chunk_size;
-    guint32 n_columns;
-};
-
-static void
-_cleanup_comp(gpointer const data)
-{
-    struct _LDMComponent * const comp = (struct _LDMComponent *) data;
-    g_array_unref(comp->parts);
-}
-
 /* LDMPartition */
 
 struct _LDMPartitionPrivate
 {
-    guint32 id;
-    guint32 parent_id;
-    gchar *name;
-
-    guint64 start;
-    guint64 vol_offset; /* Not exposed: only used for sanity checking */
-    guint64 size;
-    guint32 index;      /* Not exposed directly: container array is sorted */
+    ldmcore_part_t *core;
 
-    guint32 disk_id;
+    /* Wrapper of core->disk */
     LDMDisk *disk;
 };
 
@@ -807,7 +855,7 @@ ldm_partition_get_property(GObject * const o, const guint property_id,
                                 GValue * const value, GParamSpec * const pspec)
 {
     LDMPartition * const part = LDM_PARTITION(o);
-    LDMPartitionPrivate * const priv = part->priv;
+    const ldmcore_part_t * const priv = part->priv->core;
 
     switch (property_id) {
     case PROP_LDM_PARTITION_NAME:
@@ -843,7 +891,9 @@ ldm_partition_finalize(GObject * const object)
     LDMPartition * const part_o = LDM_PARTITION(object);
     LDMPartitionPrivate * const part = part_o->priv;
 
-    g_free(part->name); part->name = NULL;
+    if (part->core) {
+        ldmcore_dg_unref(part->core->dg); part->core = NULL;
+    }
 }
 
 static void
@@ -911,17 +961,7 @@ ldm_partition_init(LDMPartition * const o)
 
 struct _LDMDiskPrivate
 {
-    guint32 id;
-    gchar *name;
-    gchar *dgname;
-
-    guint64 data_start;
-    guint64 data_size;
-    guint64 metadata_start;
-    guint64 metadata_size;
-
-    uuid_t guid;
-    gchar *device; // NULL until device is found
+    ldmcore_disk_t *core;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(LDMDisk, ldm_disk, G_TYPE_OBJECT)
@@ -942,7 +982,7 @@ ldm_disk_get_property(GObject * const o, const guint property_id,
                            GValue * const value, GParamSpec * const pspec)
 {
     const LDMDisk * const disk = LDM_DISK(o);
-    const LDMDiskPrivate * const priv = disk->priv;
+    const ldmcore_disk_t * const priv = disk->priv->core;
 
     switch (property_id) {
     case PROP_LDM_DISK_NAME:
@@ -957,7 +997,8 @@ ldm_disk_get_property(GObject * const o, const guint property_id,
         break;
 
     case PROP_LDM_DISK_DEVICE:
-        g_value_set_string(value, priv->device); break;
+        g_value_set_string(value, ldmcore_disk_get_device(priv));
+        break;
 
     case PROP_LDM_DISK_DATA_START:
         g_value_set_uint64(value, priv->data_start); break;
@@ -978,21 +1019,27 @@ ldm_disk_get_property(GObject * const o, const guint property_id,
 
 EXPORT_PROP_STRING(disk, LDMDisk, name)
 EXPORT_PROP_GUID(disk, LDMDisk)
-EXPORT_PROP_STRING(disk, LDMDisk, device)
 EXPORT_PROP_SCALAR(disk, LDMDisk, data_start, guint64)
 EXPORT_PROP_SCALAR(disk, LDMDisk, data_size, guint64)
 EXPORT_PROP_SCALAR(disk, LDMDisk, metadata_start, guint64)
 EXPORT_PROP_SCALAR(disk, LDMDisk, metadata_size, guint64)
 
+/* device is published by ldm_add_fd() while readers may be accessing it */
+gchar *
+ldm_disk_get_device(const LDMDisk * const o)
+{
+    return g_strdup(ldmcore_disk_get_device(o->priv->core));
+}
+
 static void
 ldm_disk_finalize(GObject * const object)
 {
     LDMDisk * const disk_o = LDM_DISK(object);
     LDMDiskPrivate * const disk = disk_o->priv;
 
-    g_free(disk->name); disk->name = NULL;
-    g_free(disk->dgname); disk->dgname = NULL;
-    g_free(disk->device); disk->device = NULL;
+    if (disk->core) {
+        ldmcore_dg_unref(disk->core->dg); disk->core = NULL;
+    }
 }
 
 static void
@@ -1119,2115 +1166,3167 @@ ldm_disk_init(LDMDisk * const o)
     bzero(o->priv, sizeof(*o->priv));
 }
 
-static gboolean
-_find_vmdb(const void * const config, const gchar * const path,
-           const guint secsize, const struct _vmdb ** const vmdb,
-           GError ** const err)
+static void
+_set_core_error(GError ** const err, const ldmcore_err_t * const core_err)
 {
-    /* TOCBLOCK starts 2 sectors into config */
-    const struct _tocblock *tocblock = config + secsize * 2;
-    if (memcmp(tocblock->magic, "TOCBLOCK", 8) != 0) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Didn't find TOCBLOCK at config offset %" PRIX64,
-                    UINT64_C(0x400));
-        return FALSE;
+    LDMError code;
+    switch (core_err->code) {
+    case LDMCORE_ERROR_IO:              code = LDM_ERROR_IO; break;
+    case LDMCORE_ERROR_NOT_LDM:         code = LDM_ERROR_NOT_LDM; break;
+    case LDMCORE_ERROR_INVALID:         code = LDM_ERROR_INVALID; break;
+    case LDMCORE_ERROR_INCONSISTENT:    code = LDM_ERROR_INCONSISTENT; break;
+    case LDMCORE_ERROR_NOTSUPPORTED:    code = LDM_ERROR_NOTSUPPORTED; break;
+    case LDMCORE_ERROR_MISSING_DISK:    code = LDM_ERROR_MISSING_DISK; break;
+    default:                            code = LDM_ERROR_INTERNAL;
     }
 
-    g_debug("TOCBLOCK: %s\n"
-            "  Sequence1: %" PRIu64 "\n"
-            "  Sequence2: %" PRIu64 "\n"
-            "  Bitmap: %s\n"
-            "    Flags1: %04" PRIo8 "\n"
-            "    Start: %" PRIu64 "\n"
-            "    Size: %" PRIu64 "\n"
-            "    Flags2: %016" PRIo64 "\n"
-            "  Bitmap: %s\n"
-            "    Flags1: %04" PRIo8 "\n"
-            "    Start: %" PRIu64 "\n"
-            "    Size: %" PRIu64 "\n"
-            "    Flags2: %016" PRIo64,
-            path,
-            (uint64_t) be64toh(tocblock->seq1),
-            (uint64_t) be64toh(tocblock->seq2),
-            tocblock->bitmap[0].name,
-            be16toh(tocblock->bitmap[0].flags1),
-            (uint64_t) be64toh(tocblock->bitmap[0].start),
-            (uint64_t) be64toh(tocblock->bitmap[0].size),
-            (uint64_t) be64toh(tocblock->bitmap[0].flags2),
-            tocblock->bitmap[1].name,
-            be16toh(tocblock->bitmap[1].flags1),
-            (uint64_t) be64toh(tocblock->bitmap[1].start),
-            (uint64_t) be64toh(tocblock->bitmap[1].size),
-            (uint64_t) be64toh(tocblock->bitmap[1].flags2));
-
-    /* Find the start of the DB */
-    *vmdb = NULL;
-    for (int i = 0; i < 2; i++) {
-        const struct _tocblock_bitmap *bitmap = &tocblock->bitmap[i];
-        if (strcmp(bitmap->name, "config") == 0) {
-            *vmdb = config + be64toh(tocblock->bitmap[i].start) * secsize;
-            break;
-        }
-    }
+    g_set_error_literal(err, LDM_ERROR, code, core_err->msg);
+}
 
-    if (*vmdb == NULL) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "TOCBLOCK doesn't contain config bitmap");
-        return FALSE;
-    }
+/* Create GObjects for all objects in a parsed disk group. Takes ownership of
+ * the caller's reference to core. */
+static LDMDiskGroup *
+_wrap_disk_group(ldmcore_dg_t * const core)
+{
+    LDMDiskGroup * const dg_o =
+        LDM_DISK_GROUP(g_object_new(LDM_TYPE_DISK_GROUP, NULL));
+    LDMDiskGroupPrivate * const dg = dg_o->priv;
 
-    if (memcmp((*vmdb)->magic, "VMDB", 4) != 0) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Didn't find VMDB at config offset %lX",
-                    (unsigned long int)((void *) (*vmdb) - config));
-        return FALSE;
-    }
+    dg->core = core;
 
-    g_debug("VMDB: %s\n"
-            "  VBLK last: %" PRIu32 "\n"
-            "  VBLK size: %" PRIu32 "\n"
-            "  VBLK first offset: %" PRIu32 "\n"
-            "  Version major: %" PRIu16 "\n"
-            "  Version minor: %" PRIu16 "\n"
-            "  Disk group GUID: %s\n"
-            "  Committed sequence: %" PRIu64 "\n"
-            "  Pending sequence: %" PRIu64 "\n"
-            "  Committed volumes: %" PRIu32 "\n"
-            "  Committed components: %" PRIu32 "\n"
-            "  Committed partitions: %" PRIu32 "\n"
-            "  Committed disks: %" PRIu32 "\n"
-            "  Pending volumes: %" PRIu32 "\n"
-            "  Pending components: %" PRIu32 "\n"
-            "  Pending partitions: %" PRIu32 "\n"
-            "  Pending disks: %" PRIu32,
-            path,
-            be32toh((*vmdb)->vblk_last),
-            be32toh((*vmdb)->vblk_size),
-            be32toh((*vmdb)->vblk_first_offset),
-            be16toh((*vmdb)->version_major),
-            be16toh((*vmdb)->version_minor),
-            (*vmdb)->disk_group_guid,
-            (uint64_t) be64toh((*vmdb)->committed_seq),
-            (uint64_t) be64toh((*vmdb)->pending_seq),
-            be32toh((*vmdb)->n_committed_vblks_vol),
-            be32toh((*vmdb)->n_committed_vblks_comp),
-            be32toh((*vmdb)->n_committed_vblks_part),
-            be32toh((*vmdb)->n_committed_vblks_disk),
-            be32toh((*vmdb)->n_pending_vblks_vol),
-            be32toh((*vmdb)->n_pending_vblks_comp),
-            be32toh((*vmdb)->n_pending_vblks_part),
-            be32toh((*vmdb)->n_pending_vblks_disk));
+    dg->disks = g_array_sized_new(FALSE, FALSE,
+                                  sizeof(LDMDisk *), core->n_disks);
+    dg->parts = g_array_sized_new(FALSE, FALSE,
+                                  sizeof(LDMPartition *), core->n_parts);
+    dg->vols = g_array_sized_new(FALSE, FALSE,
+                                 sizeof(LDMVolume *), core->n_vols);
+    g_array_set_clear_func(dg->disks, _unref_object);
+    g_array_set_clear_func(dg->parts, _unref_object);
+    g_array_set_clear_func(dg->vols, _unref_object);
 
-    return TRUE;
-}
+    for (guint32 i = 0; i < core->n_disks; i++) {
+        LDMDisk * const disk_o = LDM_DISK(g_object_new(LDM_TYPE_DISK, NULL));
+        disk_o->priv->core = &core->disks[i];
+        ldmcore_dg_ref(core);
 
-static gboolean
-_read_config(const int fd, const gchar * const path,
-             const guint secsize, const struct _privhead * const privhead,
-             void ** const config, GError ** const err)
-{
-    /* Sanity check ldm_config_start and ldm_config_size */
-    struct stat stat;
-    if (fstat(fd, &stat) == -1) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                    "Unable to stat %s: %m", path);
-        return FALSE;
+        g_array_append_val(dg->disks, disk_o);
     }
 
-    uint64_t size = stat.st_size;
-    if (S_ISBLK(stat.st_mode)) {
-        if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                        "Unable to get block device size for %s: %m", path);
-            return FALSE;
-        }
-    }
+    for (guint32 i = 0; i < core->n_parts; i++) {
+        ldmcore_part_t * const part = &core->parts[i];
 
-    const uint64_t config_start =
-        be64toh(privhead->ldm_config_start) * secsize;
-    const uint64_t config_size =
-        be64toh(privhead->ldm_config_size) * secsize;
+        LDMPartition * const part_o =
+            LDM_PARTITION(g_object_new(LDM_TYPE_PARTITION, NULL));
+        part_o->priv->core = part;
+        ldmcore_dg_ref(core);
 
-    if (config_start > size) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "LDM config start (%" PRIX64") is outside file in %s",
-                    config_start, path);
-        return FALSE;
-    }
-    if (config_start + config_size > size) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "LDM config end (%" PRIX64 ") is outside file in %s",
-                    config_start + config_size, path);
-        return FALSE;
+        LDMDisk * const disk_o =
+            g_array_index(dg->disks, LDMDisk *, part->disk - core->disks);
+        part_o->priv->disk = g_object_ref(disk_o);
+
+        g_array_append_val(dg->parts, part_o);
     }
 
-    *config = g_malloc(config_size);
-    size_t read = 0;
-    while (read < config_size) {
-        ssize_t in = pread(fd, *config + read, config_size - read,
-                           config_start + read);
-        if (in == 0) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "%s contains invalid LDM metadata", path);
-            goto error;
-        }
+    for (guint32 i = 0; i < core->n_vols; i++) {
+        ldmcore_vol_t * const vol = &core->vols[i];
 
-        if (in == -1) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                        "Error reading from %s: %m", path);
-            goto error;
+        LDMVolume * const vol_o =
+            LDM_VOLUME(g_object_new(LDM_TYPE_VOLUME, NULL));
+        vol_o->priv->core = vol;
+        ldmcore_dg_ref(core);
+
+        for (guint32 j = 0; j < vol->n_parts; j++) {
+            LDMPartition * const part_o =
+                g_array_index(dg->parts, LDMPartition *,
+                              vol->parts[j] - core->parts);
+            g_object_ref(part_o);
+            g_array_append_val(vol_o->priv->parts, part_o);
         }
 
-        read += in;
+        g_array_append_val(dg->vols, vol_o);
     }
 
-    return TRUE;
-
-error:
-    g_free(*config); *config = NULL;
-    return FALSE;
+    return dg_o;
 }
 
-static gboolean
-_read_privhead_off(const int fd, const gchar * const path,
-                   const uint64_t ph_start,
-                   struct _privhead * const privhead, GError **err)
-{
-    size_t read = 0;
-    while (read < sizeof(*privhead)) {
-        ssize_t in = pread(fd, (char *) privhead + read,
-                           sizeof(*privhead) - read,
-                           ph_start + read);
-        if (in == 0) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "%s contains invalid LDM metadata", path);
-            return FALSE;
-        }
-
-        if (in == -1) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                        "Error reading from %s: %m", path);
-            return FALSE;
-        }
-
-        read += in;
-    }
-
-    if (memcmp(privhead->magic, "PRIVHEAD", 8) != 0) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "PRIVHEAD not found at offset %" PRIX64, ph_start);
+gboolean
+ldm_add(LDM * const o, const gchar * const path, GError ** const err)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
+                    "Error opening %s for reading: %m", path);
         return FALSE;
     }
 
-    g_debug("PRIVHEAD: %s\n"
-            "  Version Major: %" PRIu16 "\n"
-            "  Version Minor: %" PRIu16 "\n"
-            "  Disk GUID: %s\n"
-            "  Disk Group GUID: %s\n"
-            "  Logical Disk Start: %" PRIu64 "\n"
-            "  Logical Disk Size: %" PRIu64 "\n"
-            "  LDM Config Start: %" PRIu64 "\n"
-            "  LDM Config Size: %" PRIu64,
-            path,
-            be16toh(privhead->version_major),
-            be16toh(privhead->version_minor),
-            privhead->disk_guid,
-            privhead->disk_group_guid,
-            (uint64_t) be64toh(privhead->logical_disk_start),
-            (uint64_t) be64toh(privhead->logical_disk_size),
-            (uint64_t) be64toh(privhead->ldm_config_start),
-            (uint64_t) be64toh(privhead->ldm_config_size));
+    int secsize;
+    if (ioctl(fd, BLKSSZGET, &secsize) == -1) {
+        g_warning("Unable to determine sector size of %s. Assuming 512 byte "
+                  "sectors", path);
+        secsize = 512;
+    }
 
-    return TRUE;
+    return ldm_add_fd(o, fd, secsize, path, err);
 }
 
-static gboolean
-_read_privhead_mbr(const int fd, const gchar * const path, const guint secsize,
-                   struct _privhead * const privhead, GError ** const err)
+/* Copy the published disk group array, adding dg_o if it is not NULL, and
+ * omitting omit if it is not NULL */
+static GArray *
+_copy_disk_groups(const GArray * const disk_groups, LDMDiskGroup * const dg_o,
+                  const LDMDiskGroup * const omit)
 {
-    g_debug("Device %s uses MBR", path);
+    GArray * const r = g_array_sized_new(FALSE, FALSE, sizeof(LDMDiskGroup *),
+                                         disk_groups->len + 1);
+    g_array_set_clear_func(r, _unref_object);
 
-    /* On an MBR disk, the first PRIVHEAD is in sector 6 */
-    return _read_privhead_off(fd, path, secsize * 6, privhead, err);
-}
+    for (guint i = 0; i < disk_groups->len; i++) {
+        LDMDiskGroup * const c = g_array_index(disk_groups, LDMDiskGroup *, i);
+        if (c == omit) continue;
 
-void _map_gpt_error(const int e, const gchar * const path, GError ** const err)
-{
-    switch (-e) {
-    case GPT_ERROR_INVALID:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "%s contains an invalid GPT header", path);
-        break;
+        g_object_ref(c);
+        g_array_append_val(r, c);
+    }
+    if (dg_o) g_array_append_val(r, dg_o);
 
-    case GPT_ERROR_READ:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                    "Error reading from %s: %m", path);
-        break;
+    return r;
+}
 
-    case GPT_ERROR_INVALID_PART:
-        g_error("Request for invalid GPT partition");
+/* Find the disk VBLK for the scanned disk and attach the device to it.
+ *
+ * Returns the disk if it was previously missing, or NULL otherwise. */
+static LDMDisk *
+_attach_disk(LDMPrivate * const priv, LDMDiskGroupPrivate * const dg,
+             const ldmcore_scan_t * const scan, const gchar * const path)
+{
+    ldmcore_disk_t * const disk = ldmcore_dg_find_disk(dg->core,
+                                                       scan->disk_guid);
+    if (disk == NULL) return NULL;
 
-    default:
-        g_error("Unhandled GPT return value: %i\n", e);
-    }
+    char * const old = ldmcore_disk_attach(disk, scan, path);
+    _ldm_retire(priv, old, free);
+    if (old) return NULL;
 
+    return g_array_index(dg->disks, LDMDisk *, disk - dg->core->disks);
 }
 
 static gboolean
-_read_privhead_gpt(const int fd, const gchar * const path, const guint secsize,
-                   struct _privhead * const privhead, GError ** const err)
+_disk_group_is_complete(const LDMDiskGroupPrivate * const dg)
 {
-    g_debug("Device %s uses GPT", path);
-
-    int r;
-
-    gpt_handle_t *h;
-    r = gpt_open_secsize(fd, secsize, &h);
-    if (r < 0) {
-        _map_gpt_error(r, path, err);
-        return FALSE;
+    for (guint32 i = 0; i < dg->core->n_disks; i++) {
+        if (!ldmcore_disk_get_device(&dg->core->disks[i])) return FALSE;
     }
+    return TRUE;
+}
 
-    gpt_t gpt;
-    gpt_get_header(h, &gpt);
+gboolean
+ldm_add_fd(LDM * const o, const int fd, const guint secsize,
+           const gchar * const path, GError ** const err)
+{
+    LDMPrivate * const priv = o->priv;
 
-    static const uuid_t LDM_METADATA = { 0xAA,0xC8,0x08,0x58,
-                                         0x8F,0x7E,
-                                         0xE0,0x42,
-                                         0x85,0xD2,
-                                         0xE1,0xE9,0x04,0x34,0xCF,0xB3 };
+    /* The GObject documentation states quite clearly that method calls on an
+     * object which has been disposed should *not* result in an error. Seems
+     * weird, but...
+     */
+    if (!g_atomic_pointer_get(&priv->disk_groups)) return TRUE;
 
-    for (uint32_t i = 0; i < gpt.pte_array_len; i++) {
-        gpt_pte_t pte;
-        r = gpt_get_pte(h, i, &pte);
-        if (r < 0) {
-            _map_gpt_error(r, path, err);
-            gpt_close(h);
-            return FALSE;
-        }
+    gboolean locked = FALSE;
 
-        if (uuid_compare(pte.type, LDM_METADATA) == 0) {
-            /* PRIVHEAD is in the last LBA of the LDM metadata partition */
-            gpt_close(h);
-            return _read_privhead_off(fd, path, pte.last_lba * secsize,
-                                       privhead, err);
-        }
+    ldmcore_scan_t scan;
+    ldmcore_err_t core_err;
+    if (ldmcore_scan(fd, path, secsize, &scan, &core_err) < 0) {
+        _set_core_error(err, &core_err);
+        goto error;
     }
 
-    g_set_error(err, LDM_ERROR, LDM_ERROR_NOT_LDM,
-                "%s does not contain LDM metadata", path);
-    return FALSE;
-}
+    /* Everything above only touches the device. Everything below modifies the
+     * model, and must be serialised against other writers. */
+    g_mutex_lock(&priv->lock); locked = TRUE;
 
-static gboolean
-_read_privhead(const int fd, const gchar * const path, const guint secsize,
-               struct _privhead * const privhead, GError ** const err)
-{
-    // Whether the disk is MBR or GPT, we expect to find an MBR at the beginning
-    mbr_t mbr;
-    int r = mbr_read(fd, &mbr);
-    if (r < 0) {
-        switch (-r) {
-        case MBR_ERROR_INVALID:
-            g_set_error(err, LDM_ERROR, LDM_ERROR_NOT_LDM,
-                        "Didn't detect a partition table");
-            return FALSE;
+    GArray * const disk_groups = priv->disk_groups;
+    if (!disk_groups) goto out;
 
-        case MBR_ERROR_READ:
-            g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                        "Error reading from %s: %m", path);
-            return FALSE;
+    LDMDiskGroup *dg_o = NULL;
+    LDMDiskGroupPrivate *dg = NULL;
+    LDMDisk *attached = NULL;
+    for (guint i = 0; i < disk_groups->len; i++) {
+        LDMDiskGroup *c = g_array_index(disk_groups,
+                                            LDMDiskGroup *, i);
 
-        default:
-            g_error("Unhandled return value from mbr_read: %i", r);
+        if (uuid_compare(scan.disk_group_guid, c->priv->core->guid) == 0) {
+            dg_o = c;
         }
     }
 
-    switch (mbr.part[0].type) {
-    case MBR_PART_WINDOWS_LDM:
-        return _read_privhead_mbr(fd, path, secsize, privhead, err);
+    if (dg_o == NULL) {
+        ldmcore_dg_t *core;
+        if (ldmcore_dg_parse(&scan, path, &core, &core_err) < 0) {
+            _set_core_error(err, &core_err);
+            goto error;
+        }
 
-    case MBR_PART_EFI_PROTECTIVE:
-        return _read_privhead_gpt(fd, path, secsize, privhead, err);
+        dg_o = _wrap_disk_group(core);
+        dg = dg_o->priv;
 
-    default:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOT_LDM,
-                    "%s does not contain LDM metadata", path);
-        return FALSE;
-    }
-}
+        /* The new disk group is not visible to readers until it is published,
+         * so it must be complete before then */
+        attached = _attach_disk(priv, dg, &scan, path);
+        _ldm_publish_disk_groups(priv,
+                                 _copy_disk_groups(disk_groups, dg_o, NULL));
+    } else {
+        dg = dg_o->priv;
 
-#define PARSE_VAR_INT(func_name, out_type)                                     \
-static gboolean                                                                \
-func_name(const guint8 ** const var, out_type * const out,                     \
-          const gchar * const field, const gchar * const type,                 \
-          GError ** const err)                                                 \
-{                                                                              \
-    guint8 i = **var; (*var)++;                                                \
-    if (i > sizeof(*out)) {                                                    \
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INTERNAL,                   \
-                    "Found %hhu byte integer for %s:%s", i, field, type);      \
-        return FALSE;                                                          \
-    }                                                                          \
-                                                                               \
-    *out = 0;                                                                  \
-    for(;i > 0; i--) {                                                         \
-        *out <<= 8;                                                            \
-        *out += **var; (*var)++;                                               \
-    }                                                                          \
-                                                                               \
-    return TRUE;                                                               \
-}
+        if (ldmcore_dg_check_scan(dg->core, &scan, path, &core_err) < 0) {
+            _set_core_error(err, &core_err);
+            goto error;
+        }
 
-PARSE_VAR_INT(_parse_var_int32, uint32_t)
-PARSE_VAR_INT(_parse_var_int64, uint64_t)
+        attached = _attach_disk(priv, dg, &scan, path);
+    }
 
-static gchar *
-_parse_var_string(const guint8 ** const var)
-{
-    guint8 len = **var; (*var)++;
-    gchar *ret = g_malloc(len + 1);
-    memcpy(ret, *var, len); (*var) += len;
-    ret[len] = '\0';
+    /* Signal handlers are run without the lock held, so they may call back
+     * into this object */
+    gboolean complete = FALSE;
+    if (attached) {
+        g_object_ref(dg_o);
+        g_object_ref(attached);
+        complete = _disk_group_is_complete(dg);
+    }
 
-    return ret;
-}
+    g_mutex_unlock(&priv->lock); locked = FALSE;
 
-static void
-_parse_var_skip(const guint8 ** const var)
-{
-    guint8 len = **var; (*var)++;
-    (*var) += len;
-}
+    if (attached) {
+        g_signal_emit(o, _ldm_signals[SIGNAL_LDM_DISK_ATTACHED], 0,
+                      dg_o, attached);
+        if (complete) {
+            g_signal_emit(o, _ldm_signals[SIGNAL_LDM_DISK_GROUP_COMPLETE], 0,
+                          dg_o);
+        }
 
-static gboolean
-_parse_vblk_vol(const guint8 revision, const guint16 flags,
-                const guint8 * vblk, LDMVolumePrivate * const vol,
-                GError ** const err)
-{
-    if (revision != 5) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported volume VBLK revision %hhu", revision);
-        return FALSE;
+        g_object_unref(attached);
+        g_object_unref(dg_o);
     }
 
-    if (!_parse_var_int32(&vblk, &vol->id, "id", "volume", err))
-        return FALSE;
-    vol->name = _parse_var_string(&vblk);
-
-    /* Volume type: 'gen' or 'raid5'. We parse this elsewhere */
-    _parse_var_skip(&vblk);
+out:
+    if (locked) g_mutex_unlock(&priv->lock);
+    ldmcore_scan_clear(&scan);
+    close(fd);
+    return TRUE;
 
-    /* Unknown. N.B. Documentation lists this as a single zero, but I have
-     * observed it to have the variable length string value: '8000000000000000'
-     */
-    _parse_var_skip(&vblk);
+error:
+    if (locked) g_mutex_unlock(&priv->lock);
+    ldmcore_scan_clear(&scan);
+    close(fd);
+    return FALSE;
+}
 
-    /* Volume state */
-    vblk += 14;
+gboolean
+ldm_remove_device(LDM * const o, const gchar * const path,
+                  GError ** const err)
+{
+    LDMPrivate * const priv = o->priv;
 
-    vol->_int_type = *(uint8_t *)vblk; vblk += 1;
-    switch(vol->_int_type) {
-    case _VOLUME_TYPE_GEN:
-    case _VOLUME_TYPE_RAID5:
-        break;
+    g_mutex_lock(&priv->lock);
 
-    default:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported volume VBLK type %u", vol->_int_type);
-        return FALSE;
+    GArray * const disk_groups = priv->disk_groups;
+    if (!disk_groups) {
+        g_mutex_unlock(&priv->lock);
+        return TRUE;
     }
 
-    /* Unknown */
-    vblk += 1;
+    LDMDiskGroup *dg_o = NULL;
+    LDMDisk *detached = NULL;
+    for (guint i = 0; i < disk_groups->len && !detached; i++) {
+        LDMDiskGroup * const c = g_array_index(disk_groups, LDMDiskGroup *, i);
+        GArray * const disks = c->priv->disks;
 
-    /* Volume number */
-    vblk += 1;
+        for (guint j = 0; j < disks->len; j++) {
+            LDMDisk * const disk_o = g_array_index(disks, LDMDisk *, j);
+            ldmcore_disk_t * const disk = disk_o->priv->core;
 
-    /* Zeroes */
-    vblk += 3;
+            if (g_strcmp0(ldmcore_disk_get_device(disk), path) == 0) {
+                _ldm_retire(priv, ldmcore_disk_detach(disk), free);
 
-    /* Flags */
-    vol->flags = *(uint8_t *)vblk; vblk += 1;
+                dg_o = g_object_ref(c);
+                detached = g_object_ref(disk_o);
+                break;
+            }
+        }
+    }
 
-    if (!_parse_var_int32(&vblk, &vol->_n_comps, "n_children", "volume", err))
+    if (!detached) {
+        g_mutex_unlock(&priv->lock);
+        g_set_error(err, LDM_ERROR, LDM_ERROR_NOT_LDM,
+                    "%s is not a member of a known disk group", path);
         return FALSE;
+    }
 
-    /* Commit id */
-    vblk += 8;
-
-    /* Id? */
-    vblk += 8;
+    /* Forget a disk group entirely when its last device is removed. If a
+     * member is added again its metadata will be re-read, as it may have
+     * changed in the meantime. */
+    const ldmcore_dg_t * const core = dg_o->priv->core;
+    gboolean empty = TRUE;
+    for (guint32 i = 0; i < core->n_disks; i++) {
+        if (ldmcore_disk_get_device(&core->disks[i])) {
+            empty = FALSE;
+            break;
+        }
+    }
+    if (empty) {
+        _ldm_publish_disk_groups(priv,
+                                 _copy_disk_groups(disk_groups, NULL, dg_o));
+    }
 
-    if (!_parse_var_int64(&vblk, &vol->size, "size", "volume", err))
-        return FALSE;
+    g_mutex_unlock(&priv->lock);
 
-    /* Zeroes */
-    vblk += 4;
+    g_signal_emit(o, _ldm_signals[SIGNAL_LDM_DISK_DETACHED], 0,
+                  dg_o, detached);
 
-    vol->part_type = *((uint8_t *)vblk); vblk++;
+    g_object_unref(detached);
+    g_object_unref(dg_o);
 
-    /* Volume GUID */
-    memcpy(&vol->guid, vblk, 16); vblk += 16;
+    return TRUE;
+}
 
-    if (flags & 0x08) vol->id1 = _parse_var_string(&vblk);
-    if (flags & 0x20) vol->id2 = _parse_var_string(&vblk);
-    if (flags & 0x80 && !_parse_var_int64(&vblk, &vol->size2,
-                                          "size2", "volume", err))
-        return FALSE;
-    if (flags & 0x02) vol->hint = _parse_var_string(&vblk);
-
-    g_debug("Volume: %s\n"
-            "  ID: %" PRIu32 "\n"
-            "  Type: %" PRIi32 "\n"
-            "  Flags: %" PRIu8 "\n"
-            "  Children: %" PRIu32 "\n"
-            "  Size: %" PRIu64 "\n"
-            "  Partition Type: %" PRIu8 "\n"
-            "  ID1: %s\n"
-            "  ID2: %s\n"
-            "  Size2: %" PRIu64 "\n"
-            "  Hint: %s",
-            vol->name,
-            vol->id,
-            vol->_int_type,
-            vol->flags,
-            vol->_n_comps,
-            vol->size,
-            vol->part_type,
-            vol->id1,
-            vol->id2,
-            vol->size2,
-            vol->hint);
+LDM *
+ldm_new(void)
+{
+    LDM *ldm = LDM_CAST(g_object_new(LDM_TYPE, NULL));
+    ldm->priv->disk_groups = g_array_sized_new(FALSE, FALSE,
+                                               sizeof (LDMDiskGroup *), 1);
+    g_array_set_clear_func(ldm->priv->disk_groups, _unref_object);
 
-    return TRUE;
+    return ldm;
 }
 
-static gboolean
-_parse_vblk_comp(const guint8 revision, const guint16 flags,
-                 const guint8 *vblk, struct _LDMComponent * const comp,
-                 GError ** const err)
+GArray *
+ldm_get_disk_groups(LDM * const o)
 {
-    if (revision != 3) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported component VBLK revision %hhu", revision);
-        return FALSE;
-    }
+    /* A published array is never modified, and is not freed while a reader is
+     * counted, so this is safe without taking the lock */
+    g_atomic_int_inc(&o->priv->readers);
+    GArray * const disk_groups = g_atomic_pointer_get(&o->priv->disk_groups);
+    if (disk_groups) g_array_ref(disk_groups);
+    g_atomic_int_add(&o->priv->readers, -1);
+    return disk_groups;
+}
 
-    if (!_parse_var_int32(&vblk, &comp->id, "id", "volume", err)) return FALSE;
+static guint64
+_array_size(const GArray * const array)
+{
+    return array ? sizeof(*array) + array->len * sizeof(gpointer) : 0;
+}
 
-    /* Name */
-    _parse_var_skip(&vblk);
+static void
+_disk_group_memory_usage(const LDMDiskGroup * const dg_o,
+                         LDMMemoryUsage * const usage)
+{
+    const LDMDiskGroupPrivate * const dg = dg_o->priv;
+
+    ldmcore_mem_t mem;
+    ldmcore_dg_memory_usage(dg->core, &mem);
+
+    uuid_copy(usage->disk_group, dg->core->guid);
+    usage->config = mem.config;
+    usage->structs = mem.structs;
+    usage->names = mem.names;
+    usage->arrays = mem.arrays;
+
+    /* Add the GObject wrappers */
+    usage->structs += sizeof(LDMDiskGroup) + sizeof(LDMDiskGroupPrivate) +
+        dg->core->n_disks * (sizeof(LDMDisk) + sizeof(LDMDiskPrivate)) +
+        dg->core->n_parts * (sizeof(LDMPartition) +
+                             sizeof(LDMPartitionPrivate)) +
+        dg->core->n_vols * (sizeof(LDMVolume) + sizeof(LDMVolumePrivate));
+    usage->arrays += _array_size(dg->disks) + _array_size(dg->parts) +
+                     _array_size(dg->vols);
+
+    if (dg->vols) {
+        for (guint i = 0; i < dg->vols->len; i++) {
+            const LDMVolume * const vol =
+                g_array_index(dg->vols, LDMVolume *, i);
+            usage->arrays += _array_size(vol->priv->parts);
+        }
+    }
+}
 
-    /* Volume state */
-    _parse_var_skip(&vblk);
+GArray *
+ldm_get_memory_usage(LDM * const o)
+{
+    GArray * const disk_groups = ldm_get_disk_groups(o);
+    if (!disk_groups) return g_array_new(FALSE, FALSE, sizeof(LDMMemoryUsage));
 
-    comp->type = *((uint8_t *) vblk); vblk++;
-    switch (comp->type) {
-    case _COMPONENT_TYPE_STRIPED:
-    case _COMPONENT_TYPE_SPANNED:
-    case _COMPONENT_TYPE_RAID:
-        break;
+    GArray * const r = g_array_sized_new(FALSE, FALSE, sizeof(LDMMemoryUsage),
+                                         disk_groups->len);
+    g_array_set_size(r, disk_groups->len);
 
-    default:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Component VBLK OID=%u has unsupported type %u",
-                    comp->id, comp->type);
-        return FALSE;
+    for (guint i = 0; i < disk_groups->len; i++) {
+        _disk_group_memory_usage(g_array_index(disk_groups, LDMDiskGroup *, i),
+                                 &g_array_index(r, LDMMemoryUsage, i));
     }
 
-    /* Zeroes */
-    vblk += 4;
+    g_array_unref(disk_groups);
+    return r;
+}
 
-    if (!_parse_var_int32(&vblk, &comp->n_parts, "n_parts", "component", err))
-        return FALSE;
-    comp->parts = g_array_sized_new(FALSE, FALSE,
-                                    sizeof(LDMPartition *), comp->n_parts);
-    /* All members of the component's partition array will be passed to the
-     * parent volume's partition array after initial parsing. We don't unref its
-     * objects on cleanup, which makes it cleaner to bulk-transfer them. */
+GArray *
+ldm_disk_group_get_volumes(LDMDiskGroup * const o)
+{
+    if (o->priv->vols) g_array_ref(o->priv->vols);
+    return o->priv->vols;
+}
 
-    /* Log Commit ID */
-    vblk += 8;
+GArray *
+ldm_disk_group_get_partitions(LDMDiskGroup * const o)
+{
+    if (o->priv->parts) g_array_ref(o->priv->parts);
+    return o->priv->parts;
+}
 
-    /* Zeroes */
-    vblk += 8;
+GArray *
+ldm_disk_group_get_disks(LDMDiskGroup * const o)
+{
+    if (o->priv->disks) g_array_ref(o->priv->disks);
+    return o->priv->disks;
+}
 
-    if (!_parse_var_int32(&vblk, &comp->parent_id,
-                          "parent_id", "component", err))
-        return FALSE;
+GArray *
+ldm_volume_get_partitions(LDMVolume * const o)
+{
+    if (o->priv->parts) g_array_ref(o->priv->parts);
+    return o->priv->parts;
+}
 
-    /* Zeroes */
-    vblk += 1;
+LDMDisk *
+ldm_partition_get_disk(LDMPartition * const o)
+{
+    if (o->priv->disk) g_object_ref(o->priv->disk);
+    return o->priv->disk;
+}
 
-    if (flags & 0x10) {
-        if (!_parse_var_int64(&vblk, &comp->chunk_size,
-                              "chunk_size", "component", err))
-            return FALSE;
+static GString *
+_dm_part_uuid(const LDMPartitionPrivate * const part)
+{
+    char * const s = ldmcore_dm_part_uuid(part->core);
+    GString * const dm_uuid = g_string_new(s);
+    free(s);
 
-        if (!_parse_var_int32(&vblk, &comp->n_columns,
-                              "n_columns", "component", err))
-            return FALSE;
-    }
+    return dm_uuid;
+}
 
-    g_debug("Component:\n"
-            "  ID: %" PRIu32 "\n"
-            "  Parent ID: %" PRIu32 "\n"
-            "  Type: %" PRIu32 "\n"
-            "  Parts: %" PRIu32 "\n"
-            "  Chunk Size: %" PRIu64 "\n"
-            "  Columns: %" PRIu32,
-            comp->id,
-            comp->parent_id,
-            comp->type,
-            comp->n_parts,
-            comp->chunk_size,
-            comp->n_columns);
+static GString *
+_dm_vol_name(const LDMVolumePrivate * const vol)
+{
+    char * const s = ldmcore_dm_vol_name(vol->core);
+    GString * const r = g_string_new(s);
+    free(s);
 
-    return TRUE;
+    return r;
 }
 
-static gboolean
-_parse_vblk_part(const guint8 revision, const guint16 flags,
-                 const guint8 *vblk, LDMPartitionPrivate * const part,
-                 GError ** const err)
+static GString *
+_dm_uuid(const ldmcore_vol_t * const vol, const uuid_t uuid_override)
 {
-    if (revision != 3) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported partition VBLK revision %hhu", revision);
-        return FALSE;
-    }
+    char * const s = ldmcore_dm_vol_uuid(vol, uuid_override);
+    GString * const dm_uuid = g_string_new(s);
+    free(s);
 
-    if (!_parse_var_int32(&vblk, &part->id, "id", "volume", err)) return FALSE;
-    part->name = _parse_var_string(&vblk);
+    return dm_uuid;
+}
 
-    /* Zeroes */
-    vblk += 4;
+static GString *
+_dm_vol_uuid(const LDMVolumePrivate * const vol)
+{
+    GMutex * const lock = (GMutex *) &vol->dm_lock;
+    uuid_t uuid_override;
 
-    /* Log Commit ID */
-    vblk += 8;
+    g_mutex_lock(lock);
+    uuid_copy(uuid_override, vol->dm.uuid_override);
+    g_mutex_unlock(lock);
 
-    part->start = be64toh(*(uint64_t *)vblk); vblk += 8;
-    part->vol_offset = be64toh(*(uint64_t *)vblk); vblk += 8;
+    return _dm_uuid(vol->core, uuid_override);
+}
 
-    if (!_parse_var_int64(&vblk, &part->size, "size", "partition", err))
-        return FALSE;
+/* Look up a device by UUID with a single DM_DEVICE_INFO. Returns FALSE on
+ * error. Otherwise, info->exists is set if the device exists. If it does, and
+ * mangled_name is not NULL, it receives the device's name. */
+static gboolean
+_dm_info_by_uuid(const gchar * const uuid, struct dm_info * const info,
+                 gchar ** const mangled_name, GError ** const err)
+{
+    gboolean r = FALSE;
 
-    if (!_parse_var_int32(&vblk, &part->parent_id,
-                          "parent_id", "partition", err))
-        return FALSE;
+    if (mangled_name) *mangled_name = NULL;
 
-    if (!_parse_var_int32(&vblk, &part->disk_id, "disk_id", "partition", err))
+    struct dm_task * const task = dm_task_create(DM_DEVICE_INFO);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_INFO) failed: %s",
+                    _dm_err_last_msg);
         return FALSE;
-
-    if (flags & 0x08) {
-        if (!_parse_var_int32(&vblk, &part->index, "index", "partition", err))
-            return FALSE;
     }
 
-    g_debug("Partition: %s\n"
-            "  ID: %" PRIu32 "\n"
-            "  Parent ID: %" PRIu32 "\n"
-            "  Disk ID: %" PRIu32 "\n"
-            "  Index: %" PRIu32 "\n"
-            "  Start: %" PRIu64 "\n"
-            "  Vol Offset: %" PRIu64 "\n"
-            "  Size: %" PRIu64,
-            part->name,
-            part->id,
-            part->parent_id,
-            part->disk_id,
-            part->index,
-            part->start,
-            part->vol_offset,
-            part->size);
-
-    return TRUE;
-}
+    if (!dm_task_set_uuid(task, uuid)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_INFO: dm_task_set_uuid(%s) failed: %s",
+                    uuid, _dm_err_last_msg);
+        goto out;
+    }
 
-static gboolean
-_parse_vblk_disk(const guint8 revision, const guint16 flags,
-                 const guint8 *vblk, LDMDiskPrivate * const disk,
-                 GError ** const err)
-{
-    if (!_parse_var_int32(&vblk, &disk->id, "id", "volume", err)) return FALSE;
-    disk->name = _parse_var_string(&vblk);
-
-    if (revision == 3) {
-        char *guid = _parse_var_string(&vblk);
-        if (uuid_parse(guid, disk->guid) == -1) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Disk %u has invalid guid: %s", disk->id, guid);
-            g_free(guid);
-            return FALSE;
-        }
+    if (!dm_task_run(task)) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        goto out;
+    }
 
-        g_free(guid);
+    if (!dm_task_get_info(task, info)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_INFO: dm_task_get_info failed: %s",
+                    _dm_err_last_msg);
+        goto out;
+    }
 
-        /* No need to parse rest of structure */
+    if (info->exists && mangled_name) {
+        char * const tmp = dm_task_get_name_mangled(task);
+        *mangled_name = g_strdup(tmp);
+        dm_free(tmp);
     }
 
-    else if (revision == 4) {
-        memcpy(&disk->guid, vblk, 16);
+    r = TRUE;
 
-        /* No need to parse rest of structure */
-    }
+out:
+    dm_task_destroy(task);
+    return r;
+}
 
-    else {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported disk VBLK revision %hhu", revision);
-        return FALSE;
-    }
+gchar *
+_dm_get_device(const gchar * const uuid, GError ** const err)
+{
+    struct dm_info info;
+    gchar *mangled_name;
+    if (!_dm_info_by_uuid(uuid, &info, &mangled_name, err)) return NULL;
+    if (!info.exists) return NULL;
 
-    g_debug("Disk: %s\n"
-            "  ID: %u\n"
-            "  GUID: " UUID_FMT,
-            disk->name,
-            disk->id,
-            UUID_VALS(disk->guid));
+    gchar * const r = g_strdup_printf("%s/%s", dm_dir(), mangled_name);
+    g_free(mangled_name);
 
-    return TRUE;
+    return r;
 }
 
+/* Add the targets of a table to a DM_DEVICE_CREATE or DM_DEVICE_RELOAD task,
+ * and make it read-only if required */
 static gboolean
-_parse_vblk_disk_group(const guint8 revision, const guint16 flags,
-                       const guint8 *vblk, LDMDiskGroupPrivate * const dg,
-                       GError ** const err)
+_dm_task_add_table(struct dm_task * const task, const gchar * const op,
+                   const ldmcore_dm_table_t * const table, GError ** const err)
 {
-    if (revision != 3 && revision != 4) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unsupported disk VBLK revision %hhu", revision);
+    if (table->read_only && !dm_task_set_ro(task)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "%s: dm_task_set_ro(%s) failed: %s",
+                    op, table->name, _dm_err_last_msg);
         return FALSE;
     }
 
-    if (!_parse_var_int32(&vblk, &dg->id, "id", "disk group", err))
-        return FALSE;
-    dg->name = _parse_var_string(&vblk);
-
-    /* No need to parse rest of structure */
+    for (guint i = 0; i < table->n_targets; i++) {
+        const ldmcore_dm_target_t * const target = &table->targets[i];
 
-    g_debug("Disk Group: %s\n"
-            "  ID: %u",
-            dg->name,
-            dg->id);
+        if (!dm_task_add_target(task, target->start, target->size,
+                                      target->type, target->params))
+        {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "%s: "
+                        "dm_task_add_target(%s, %" PRIu64 ", %" PRIu64 ", "
+                                           "%s, %s) failed: %s",
+                        op, table->name, target->start, target->size,
+                        target->type, target->params, _dm_err_last_msg);
+            return FALSE;
+        }
+    }
 
     return TRUE;
 }
 
-struct _spanned_rec {
-    uint32_t record_id;
-    uint16_t entries_total;
-    uint16_t entries_found;
-    int offset;
-    char data[];
-};
-
-static gboolean
-_parse_vblk(const void * data, LDMDiskGroup * const dg_o, GArray *comps,
-            const gchar * const path, const int offset,
-            GError ** const err)
+gboolean
+_dm_create(const ldmcore_dm_table_t * const table,
+           uint32_t udev_cookie, GString **mangled_name, dev_t * const devt,
+           GError ** const err)
 {
-    LDMDiskGroupPrivate * const dg = dg_o->priv;
+    gboolean r = TRUE;
 
-    const struct _vblk_rec_head * const rec_head = data;
+    if (mangled_name) *mangled_name = NULL;
 
-    const guint8 type = rec_head->type & 0x0F;
-    const guint8 revision = (rec_head->type & 0xF0) >> 4;
+    struct dm_task * const task = dm_task_create(DM_DEVICE_CREATE);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_CREATE) failed: %s",
+                    _dm_err_last_msg);
+        return FALSE;
+    }
 
-    data += sizeof(struct _vblk_rec_head);
+    if (!dm_task_set_name(task, table->name)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_CREATE: dm_task_set_name(%s) failed: %s",
+                    table->name, _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
 
-    switch (type) {
-    case 0x00:
-        /* Blank VBLK */
-        break;
+    if (!dm_task_set_uuid(task, table->uuid)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_CREATE: dm_task_set_uuid(%s) failed: %s",
+                    table->uuid, _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
 
-    case 0x01:
-    {
-        LDMVolume * const vol =
-            LDM_VOLUME(g_object_new(LDM_TYPE_VOLUME, NULL));
-        g_array_append_val(dg->vols, vol);
-        if (!_parse_vblk_vol(revision, rec_head->flags, data, vol->priv, err))
-            return FALSE;
-        break;
+    if (!_dm_task_add_table(task, "DM_DEVICE_CREATE", table, err)) {
+        r = FALSE; goto out;
     }
 
-    case 0x02:
-    {
-        g_array_set_size(comps, comps->len + 1);
-        struct _LDMComponent *comp =
-            (struct _LDMComponent *) comps->data + comps->len - 1;
-        if (!_parse_vblk_comp(revision, rec_head->flags, data, comp, err))
-            return FALSE;
-        break;
+    if (!dm_task_set_cookie(task, &udev_cookie, _dm_udev_flags)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_CREATE: dm_task_set_cookie(%08X) failed: %s",
+                    udev_cookie, _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
+
+    if (!dm_task_run(task)) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
+
+    if (devt) {
+        struct dm_info info;
+        if (!dm_task_get_info(task, &info)) {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "DM_DEVICE_CREATE: dm_task_get_info(%s) failed: %s",
+                        table->name, _dm_err_last_msg);
+            r = FALSE; goto out;
+        }
+        *devt = makedev(info.major, info.minor);
+    }
+
+    if (mangled_name) {
+        char *tmp = dm_task_get_name_mangled(task);
+        *mangled_name = g_string_new(tmp);
+        dm_free(tmp);
+    }
+
+out:
+    dm_task_destroy(task);
+    return r;
+}
+
+gboolean
+_dm_remove(const gchar * const name, uint32_t udev_cookie, GError ** const err)
+{
+    gboolean r = TRUE;
+
+    struct dm_task * const task = dm_task_create(DM_DEVICE_REMOVE);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_REMOVE) failed: %s",
+                    _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
+
+    if (!dm_task_set_name(task, name)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_REMOVE: dm_task_set_name(%s) failed: %s",
+                    name, _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
+
+    if (udev_cookie && !dm_task_set_cookie(task, &udev_cookie, _dm_udev_flags)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_REMOVE: dm_task_set_cookie(%08X) failed: %s",
+                    udev_cookie, _dm_err_last_msg);
+        r = FALSE; goto out;
+    }
+
+    /* If a remove operation fails, try again in case it was only opened
+     * transiently. */
+    dm_task_retry_remove(task);
+
+    if (!dm_task_run(task)) {
+        if (_dm_err_last_errno == EBUSY) {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "Device is still mounted");
+        } else {
+            g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                                _dm_err_last_msg);
+        }
+        r = FALSE; goto out;
+    }
+
+out:
+    dm_task_destroy(task);
+    return r;
+}
+
+static GString *
+_dm_create_part(const LDMPartitionPrivate * const part, uint32_t cookie,
+                const gboolean read_only, GError ** const err)
+{
+    ldmcore_dm_table_t table;
+    ldmcore_err_t core_err;
+    if (ldmcore_dm_part_table(part->core, &table, &core_err) < 0) {
+        _set_core_error(err, &core_err);
+        return NULL;
+    }
+    table.read_only = read_only;
+
+    GString *mangled_name = NULL;
+    if (!_dm_create(&table, cookie, &mangled_name, NULL, err)) {
+        mangled_name = NULL;
+    }
+
+    ldmcore_dm_table_clear(&table);
+
+    return mangled_name;
+}
+
+/* The state of a single volume during batch activation */
+typedef struct {
+    const LDMVolumePrivate *vol;
+
+    /* The volume's device mapper settings, copied when activation starts */
+    _dm_opts_t opts;
+
+    /* TRUE if the volume's device already exists, or activation has failed */
+    gboolean done;
+    GError *err;
+
+    /* Partition devices created for the volume, and paths to them */
+    GArray *devices;
+    gchar **legs;
+
+    /* dm-raid metadata devices for each leg, and open descriptors which keep
+     * them attached until the volume has been created */
+    gchar **metas;
+    int *meta_fds;
+
+    GString *created;
+} _activation_t;
+
+/* Returns TRUE if a volume's own device and its partition devices are created
+ * read-only. The origin of a snapshot is never written to. */
+static gboolean
+_dm_vol_read_only(const _dm_opts_t * const opts)
+{
+    return opts->read_only || opts->snapshot_cow != NULL;
+}
+
+/* A mirrored volume activated read-only is mapped directly to one of its legs,
+ * rather than through a raid target on partition devices */
+static gboolean
+_dm_vol_single_leg(const LDMVolumePrivate * const vol,
+                   const _dm_opts_t * const opts)
+{
+    return _dm_vol_read_only(opts) &&
+           vol->core->type == LDMCORE_VOLUME_TYPE_MIRRORED;
+}
+
+/* Returns TRUE if a volume's device is built on partition devices */
+static gboolean
+_dm_vol_uses_legs(const LDMVolumePrivate * const vol,
+                  const _dm_opts_t * const opts)
+{
+    return !_dm_vol_single_leg(vol, opts) &&
+           ldmcore_dm_vol_has_legs(vol->core);
+}
+
+/* Describe the cache to stack on a volume, including the size of the cache
+ * device */
+static gboolean
+_dm_vol_cache(const _dm_opts_t * const opts,
+              ldmcore_dm_cache_t * const cache, GError ** const err)
+{
+    if (opts->read_only) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
+                    "A cache can't be stacked on a read-only volume");
+        return FALSE;
+    }
+    if (opts->snapshot_cow) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
+                    "A cache can't be combined with a snapshot");
+        return FALSE;
     }
 
-    case 0x03:
+    const int fd = open(opts->cache_device, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
+                    "Unable to open cache device %s: %s",
+                    opts->cache_device, g_strerror(errno));
+        return FALSE;
+    }
+
+    uint64_t size;
+    if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
+                    "Unable to get size of cache device %s: %s",
+                    opts->cache_device, g_strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
+
+    cache->mode = opts->cache_mode;
+    cache->device = opts->cache_device;
+    cache->device_size = size / 512;
+
+    return TRUE;
+}
+
+/* Create a device from a table, recording it so it will be removed again if
+ * activation fails, and return its device number as major:minor */
+static gchar *
+_dm_create_recorded(_activation_t * const act,
+                    const ldmcore_dm_table_t * const table,
+                    const uint32_t cookie)
+{
+    GString *name;
+    dev_t devt;
+    if (!_dm_create(table, cookie, &name, &devt, &act->err)) return NULL;
+
+    if (!act->devices) {
+        act->devices = g_array_new(FALSE, FALSE, sizeof(GString *));
+        g_array_set_clear_func(act->devices, _free_gstring);
+    }
+    g_array_append_val(act->devices, name);
+
+    return g_strdup_printf("%u:%u", major(devt), minor(devt));
+}
+
+/* Create a volume's device with a writable snapshot stacked on it. The
+ * volume's read-only table is created as the snapshot's origin device, and the
+ * snapshot device takes the volume's name and UUID. */
+static void
+_dm_create_snapshot(_activation_t * const act,
+                    ldmcore_dm_table_t * const table, const uint32_t cookie)
+{
+    const LDMVolumePrivate * const vol = act->vol;
+    const _dm_opts_t * const opts = &act->opts;
+
+    char *cow;
+    int cow_fd;
+    ldmcore_err_t core_err;
+    if (ldmcore_dm_cow_attach(opts->snapshot_cow, &cow, &cow_fd,
+                              &core_err) < 0)
     {
-        LDMPartition * const part =
-            LDM_PARTITION(g_object_new(LDM_TYPE_PARTITION, NULL));
-        g_array_append_val(dg->parts, part);
-        if (!_parse_vblk_part(revision, rec_head->flags, data, part->priv, err))
-            return FALSE;
-        break;
+        _set_core_error(&act->err, &core_err);
+        return;
     }
 
-    case 0x04:
+    ldmcore_dm_table_t snapshot_table;
+    memset(&snapshot_table, 0, sizeof(snapshot_table));
+
+    ldmcore_dm_table_add_suffix(table, LDMCORE_DM_SNAPSHOT_ORIGIN);
+    gchar * const origin = _dm_create_recorded(act, table, cookie);
+    if (!origin) goto out;
+
+    if (ldmcore_dm_snapshot_table(vol->core, opts->uuid_override, origin, cow,
+                                  opts->snapshot_persistent,
+                                  &snapshot_table, &core_err) < 0)
     {
-        LDMDisk * const disk =
-            LDM_DISK(g_object_new(LDM_TYPE_DISK, NULL));
-        g_array_append_val(dg->disks, disk);
-        if (!_parse_vblk_disk(revision, rec_head->flags, data, disk->priv, err))
-            return FALSE;
-        break;
+        _set_core_error(&act->err, &core_err);
+        goto out;
+    }
+    snapshot_table.read_only = opts->read_only;
+
+    if (_dm_create(&snapshot_table, cookie, NULL, NULL, &act->err)) {
+        act->created = g_string_new(snapshot_table.name);
+    }
+
+out:
+    ldmcore_dm_table_clear(&snapshot_table);
+    g_free(origin);
+
+    /* The snapshot device holds a loop device COW store open */
+    if (cow_fd != -1) close(cow_fd);
+    free(cow);
+}
+
+/* Create a volume's device with a cache stacked on it. The volume's table is
+ * created as the cache's origin device. The cache device takes the volume's
+ * name and UUID. Devices are referred to by device number, so the cache can be
+ * created under the same udev cookie as the devices it uses. */
+static void
+_dm_create_cached(_activation_t * const act, ldmcore_dm_table_t * const table,
+                  const uint32_t cookie)
+{
+    const LDMVolumePrivate * const vol = act->vol;
+    const _dm_opts_t * const opts = &act->opts;
+
+    ldmcore_dm_cache_t cache;
+    if (!_dm_vol_cache(opts, &cache, &act->err)) return;
+
+    gchar *origin = NULL;
+    gchar *meta = NULL;
+    gchar *data = NULL;
+    ldmcore_dm_table_t meta_table, data_table, cache_table;
+    ldmcore_err_t core_err;
+
+    memset(&meta_table, 0, sizeof(meta_table));
+    memset(&data_table, 0, sizeof(data_table));
+    memset(&cache_table, 0, sizeof(cache_table));
+
+    ldmcore_dm_table_add_suffix(table, LDMCORE_DM_CACHE_ORIGIN);
+    origin = _dm_create_recorded(act, table, cookie);
+    if (!origin) goto out;
+
+    if (cache.mode != LDMCORE_DM_CACHE_WRITECACHE) {
+        if (ldmcore_dm_cache_pool_tables(vol->core, opts->uuid_override,
+                                         &cache, &meta_table, &data_table,
+                                         &core_err) < 0)
+        {
+            _set_core_error(&act->err, &core_err);
+            goto out;
+        }
+
+        meta = _dm_create_recorded(act, &meta_table, cookie);
+        if (!meta) goto out;
+        data = _dm_create_recorded(act, &data_table, cookie);
+        if (!data) goto out;
     }
 
-    case 0x05:
+    if (ldmcore_dm_cache_table(vol->core, opts->uuid_override, &cache,
+                               origin, meta, data,
+                               &cache_table, &core_err) < 0)
     {
-        if (!_parse_vblk_disk_group(revision, rec_head->flags, data, dg, err))
-            return FALSE;
-        break;
+        _set_core_error(&act->err, &core_err);
+        goto out;
+    }
+
+    if (_dm_create(&cache_table, cookie, NULL, NULL, &act->err)) {
+        act->created = g_string_new(cache_table.name);
+    }
+
+out:
+    ldmcore_dm_table_clear(&meta_table);
+    ldmcore_dm_table_clear(&data_table);
+    ldmcore_dm_table_clear(&cache_table);
+    g_free(origin);
+    g_free(meta);
+    g_free(data);
+}
+
+static void
+_activation_fail_all(_activation_t * const acts, const guint n_acts,
+                     const gboolean legs_only, const gchar * const msg)
+{
+    for (guint i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        if (act->done) continue;
+        if (legs_only && !_dm_vol_uses_legs(act->vol, &act->opts)) continue;
+
+        g_set_error_literal(&act->err, LDM_ERROR, LDM_ERROR_EXTERNAL, msg);
+        act->done = TRUE;
+    }
+}
+
+/* Create partition devices for all volumes which are built on them. All
+ * partitions are created under a single udev cookie, and we wait for udev once
+ * for all of them. */
+static void
+_dm_create_legs(_activation_t * const acts, const guint n_acts)
+{
+    gboolean any = FALSE;
+    for (guint i = 0; i < n_acts; i++) {
+        if (!acts[i].done && _dm_vol_uses_legs(acts[i].vol, &acts[i].opts)) {
+            any = TRUE;
+            break;
+        }
+    }
+    if (!any) return;
+
+    uint32_t cookie;
+    if (!dm_udev_create_cookie(&cookie)) {
+        gchar * const msg = g_strdup_printf("dm_udev_create_cookie: %s",
+                                            _dm_err_last_msg);
+        _activation_fail_all(acts, n_acts, TRUE, msg);
+        g_free(msg);
+        return;
+    }
+
+    const char *dir = dm_dir();
+
+    for (guint i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        const LDMVolumePrivate * const vol = act->vol;
+        const _dm_opts_t * const opts = &act->opts;
+
+        if (act->done || !_dm_vol_uses_legs(vol, opts)) continue;
+
+        act->legs = g_new0(gchar *, vol->parts->len);
+        act->devices = g_array_new(FALSE, FALSE, sizeof(GString *));
+        g_array_set_clear_func(act->devices, _free_gstring);
+
+        for (guint j = 0; j < vol->parts->len; j++) {
+            const LDMPartition * const part_o =
+                g_array_index(vol->parts, const LDMPartition *, j);
+
+            GString *chunk = _dm_create_part(part_o->priv, cookie,
+                                             _dm_vol_read_only(opts),
+                                             &act->err);
+            if (chunk == NULL) {
+                if (act->err->code == LDM_ERROR_MISSING_DISK) {
+                    g_warning("%s", act->err->message);
+                    g_error_free(act->err); act->err = NULL;
+                    continue;
+                }
+
+                act->done = TRUE;
+                break;
+            }
+
+            g_array_append_val(act->devices, chunk);
+            act->legs[j] = g_strdup_printf("%s/%s", dir, chunk->str);
+
+            if (opts->metadata_dir) {
+                if (!act->metas) {
+                    act->metas = g_new0(gchar *, vol->parts->len);
+                    act->meta_fds = g_new(int, vol->parts->len);
+                    for (guint k = 0; k < vol->parts->len; k++) {
+                        act->meta_fds[k] = -1;
+                    }
+                }
+
+                char *meta;
+                ldmcore_err_t core_err;
+                if (ldmcore_dm_meta_attach(opts->metadata_dir, vol->core, j,
+                                           &meta, &act->meta_fds[j],
+                                           &core_err) < 0)
+                {
+                    _set_core_error(&act->err, &core_err);
+                    act->done = TRUE;
+                    break;
+                }
+
+                act->metas[j] = g_strdup(meta);
+                free(meta);
+            }
+        }
+    }
+
+    /* Wait until all partitions have been created */
+    dm_udev_wait(cookie);
+}
+
+/* Create devices for all volumes under a single udev cookie */
+static void
+_dm_create_vols(_activation_t * const acts, const guint n_acts)
+{
+    gboolean any = FALSE;
+    for (guint i = 0; i < n_acts; i++) {
+        if (!acts[i].done) {
+            any = TRUE;
+            break;
+        }
+    }
+    if (!any) return;
+
+    uint32_t cookie;
+    if (!dm_udev_create_cookie(&cookie)) {
+        gchar * const msg = g_strdup_printf("dm_udev_create_cookie: %s",
+                                            _dm_err_last_msg);
+        _activation_fail_all(acts, n_acts, FALSE, msg);
+        g_free(msg);
+        return;
+    }
+
+    for (guint i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        const LDMVolumePrivate * const vol = act->vol;
+        const _dm_opts_t * const opts = &act->opts;
+
+        if (act->done) continue;
+        act->done = TRUE;
+
+        ldmcore_dm_table_t table;
+        ldmcore_err_t core_err;
+        int r;
+        if (_dm_vol_single_leg(vol, opts)) {
+            r = ldmcore_dm_vol_leg_table(vol->core, opts->uuid_override,
+                                         &table, &core_err);
+        } else {
+            r = ldmcore_dm_vol_table(vol->core, opts->uuid_override,
+                                     (const char * const *) act->legs,
+                                     (const char * const *) act->metas,
+                                     &opts->raid_opts, &table, &core_err);
+            table.read_only = _dm_vol_read_only(opts);
+        }
+        if (r < 0) {
+            _set_core_error(&act->err, &core_err);
+            continue;
+        }
+
+        if (opts->snapshot_cow) {
+            _dm_create_snapshot(act, &table, cookie);
+        } else if (opts->cache_mode != LDMCORE_DM_CACHE_NONE) {
+            _dm_create_cached(act, &table, cookie);
+        } else if (_dm_create(&table, cookie, NULL, NULL, &act->err)) {
+            act->created = g_string_new(table.name);
+        }
+
+        ldmcore_dm_table_clear(&table);
+    }
+
+    dm_udev_wait(cookie);
+}
+
+/* Activate a batch of volumes. Partition devices for all volumes are created
+ * before any volume devices, so udev is waited for twice in total rather than
+ * once or twice per volume. If a volume fails, any partition devices created
+ * for it are removed. */
+static void
+_dm_create_batch(_activation_t * const acts, const guint n_acts)
+{
+    /* Skip volumes whose device already exists */
+    for (guint i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        _dm_opts_get(act->vol, &act->opts);
+
+        GString * const uuid = _dm_uuid(act->vol->core,
+                                        act->opts.uuid_override);
+        struct dm_info info;
+        if (!_dm_info_by_uuid(uuid->str, &info, NULL, &act->err) ||
+            info.exists)
+        {
+            act->done = TRUE;
+        }
+        g_string_free(uuid, TRUE);
+    }
+
+    _dm_create_legs(acts, n_acts);
+    _dm_create_vols(acts, n_acts);
+
+    for (guint i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+
+        if (act->devices && act->err) {
+            GError *cleanup_err = NULL;
+            for (guint j = act->devices->len; j > 0; j--) {
+                GString *device = g_array_index(act->devices, GString *, j - 1);
+                if (!_dm_remove(device->str, 0, &cleanup_err)) {
+                    g_warning("%s", cleanup_err->message);
+                    g_error_free(cleanup_err); cleanup_err = NULL;
+                }
+            }
+        }
+
+        if (act->devices) {
+            g_array_unref(act->devices); act->devices = NULL;
+        }
+        if (act->legs) {
+            for (guint j = 0; j < act->vol->parts->len; j++) {
+                g_free(act->legs[j]);
+            }
+            g_free(act->legs); act->legs = NULL;
+        }
+
+        /* A created volume holds its metadata devices open. Otherwise, they
+         * are detached automatically when closed here. */
+        if (act->metas) {
+            for (guint j = 0; j < act->vol->parts->len; j++) {
+                if (act->meta_fds[j] != -1) close(act->meta_fds[j]);
+                g_free(act->metas[j]);
+            }
+            g_free(act->metas); act->metas = NULL;
+            g_free(act->meta_fds); act->meta_fds = NULL;
+        }
+
+        _dm_opts_clear(&act->opts);
+    }
+}
+
+static void
+_free_dm_status(gpointer const data)
+{
+    LDMDMStatus * const status = data;
+
+    g_free(status->name);
+    g_free(status->uuid);
+    g_free(status->device);
+    g_free(status->status);
+    if (status->object) g_object_unref(status->object);
+    g_free(status);
+}
+
+/* Query the status of a single device. Returns NULL if the device isn't an LDM
+ * device, or has gone away since it was listed. */
+static LDMDMStatus *
+_dm_get_status(const char * const name, GError ** const err)
+{
+    LDMDMStatus *status = NULL;
+
+    struct dm_task * const task = dm_task_create(DM_DEVICE_STATUS);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_STATUS) failed: %s",
+                    _dm_err_last_msg);
+        return NULL;
+    }
+
+    if (!dm_task_set_name(task, name)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_STATUS: dm_task_set_name(%s) failed: %s",
+                    name, _dm_err_last_msg);
+        goto out;
+    }
+
+    if (!dm_task_run(task)) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        goto out;
+    }
+
+    struct dm_info info;
+    if (!dm_task_get_info(task, &info)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_STATUS: dm_task_get_info failed: %s",
+                    _dm_err_last_msg);
+        goto out;
+    }
+
+    const char * const uuid = dm_task_get_uuid(task);
+    if (!info.exists || !uuid || !g_str_has_prefix(uuid, DM_UUID_PREFIX))
+        goto out;
+
+    status = g_new0(LDMDMStatus, 1);
+    status->name = g_strdup(name);
+    status->uuid = g_strdup(uuid);
+    status->device = g_strdup_printf("%s/%s", dm_dir(), name);
+    status->devt = makedev(info.major, info.minor);
+    status->open_count = info.open_count;
+    status->suspended = info.suspended ? TRUE : FALSE;
+
+    GString * const table = g_string_new("");
+    void *next = NULL;
+    do {
+        uint64_t start, length;
+        char *type, *params;
+        next = dm_get_next_target(task, next, &start, &length, &type, &params);
+        if (type == NULL) continue;
+
+        if (table->len > 0) g_string_append_c(table, '\n');
+        g_string_append_printf(table, "%" PRIu64 " %" PRIu64 " %s %s",
+                               start, length, type, params ? params : "");
+    } while (next);
+    status->status = g_string_free(table, FALSE);
+
+out:
+    dm_task_destroy(task);
+    return status;
+}
+
+GHashTable *
+ldm_dm_get_status_map(LDM * const o, GError ** const err)
+{
+    GHashTable * const map = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   NULL, _free_dm_status);
+
+    /* Index the model's volumes and partitions by device mapper UUID */
+    GHashTable * const objects = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                       g_free, NULL);
+    GArray * const disk_groups = ldm_get_disk_groups(o);
+    for (guint i = 0; disk_groups && i < disk_groups->len; i++) {
+        const LDMDiskGroup * const dg =
+            g_array_index(disk_groups, LDMDiskGroup *, i);
+
+        for (guint j = 0; j < dg->priv->vols->len; j++) {
+            LDMVolume * const vol = g_array_index(dg->priv->vols,
+                                                  LDMVolume *, j);
+            GString * const uuid = _dm_vol_uuid(vol->priv);
+            g_hash_table_insert(objects, g_string_free(uuid, FALSE), vol);
+        }
+
+        for (guint j = 0; j < dg->priv->parts->len; j++) {
+            LDMPartition * const part = g_array_index(dg->priv->parts,
+                                                      LDMPartition *, j);
+            GString * const uuid = _dm_part_uuid(part->priv);
+            g_hash_table_insert(objects, g_string_free(uuid, FALSE), part);
+        }
+    }
+
+    struct dm_task * const task = dm_task_create(DM_DEVICE_LIST);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_LIST) failed: %s",
+                    _dm_err_last_msg);
+        goto error;
+    }
+
+    if (!dm_task_run(task)) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        goto error;
+    }
+
+    struct dm_names *names = dm_task_get_names(task);
+    if (!names) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_get_names: %s", _dm_err_last_msg);
+        goto error;
+    }
+
+    if (names->dev != 0) {
+        for (;;) {
+            /* All devices we create have names starting with ldm_. Don't query
+             * other devices. */
+            if (g_str_has_prefix(names->name, "ldm_")) {
+                GError *status_err = NULL;
+                LDMDMStatus * const status =
+                    _dm_get_status(names->name, &status_err);
+
+                if (status) {
+                    GObject * const object =
+                        g_hash_table_lookup(objects, status->uuid);
+                    if (object) status->object = g_object_ref(object);
+
+                    g_hash_table_replace(map, status->uuid, status);
+                } else if (status_err) {
+                    /* The device may have been removed since it was listed */
+                    g_debug("%s", status_err->message);
+                    g_error_free(status_err);
+                }
+            }
+
+            if (names->next == 0) break;
+
+            names = (struct dm_names *)((char *)names + names->next);
+        }
+    }
+
+    dm_task_destroy(task);
+    g_hash_table_destroy(objects);
+    if (disk_groups) g_array_unref(disk_groups);
+    return map;
+
+error:
+    if (task) dm_task_destroy(task);
+    g_hash_table_destroy(objects);
+    if (disk_groups) g_array_unref(disk_groups);
+    g_hash_table_destroy(map);
+    return NULL;
+}
+
+const LDMDMStatus *
+ldm_volume_dm_get_status(const LDMVolume * const o, GHashTable * const map)
+{
+    GString * const uuid = _dm_vol_uuid(o->priv);
+    const LDMDMStatus * const r = g_hash_table_lookup(map, uuid->str);
+    g_string_free(uuid, TRUE);
+
+    return r;
+}
+
+const LDMDMStatus *
+ldm_partition_dm_get_status(const LDMPartition * const o,
+                            GHashTable * const map)
+{
+    GString * const uuid = _dm_part_uuid(o->priv);
+    const LDMDMStatus * const r = g_hash_table_lookup(map, uuid->str);
+    g_string_free(uuid, TRUE);
+
+    return r;
+}
+
+void
+ldm_dm_set_udev_sync(const gboolean sync)
+{
+    _dm_udev_flags = ldmcore_dm_udev_flags(sync);
+}
+
+static gint
+_cmp_dm_status_devt(gconstpointer const a, gconstpointer const b)
+{
+    const LDMDMStatus * const sa = *(const LDMDMStatus * const *) a;
+    const LDMDMStatus * const sb = *(const LDMDMStatus * const *) b;
+
+    return sa->devt < sb->devt ? -1 : sa->devt > sb->devt;
+}
+
+GArray *
+ldm_dm_trigger(LDM * const o, GError ** const err)
+{
+    GHashTable * const map = ldm_dm_get_status_map(o, err);
+    if (!map) return NULL;
+
+    /* Devices are numbered in the order they were created, so devices are
+     * triggered before the devices stacked on them */
+    GPtrArray * const devices = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, map);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(devices, value);
+    }
+    g_ptr_array_sort(devices, _cmp_dm_status_devt);
+
+    GArray *triggered = g_array_new(FALSE, FALSE, sizeof(GString *));
+    g_array_set_clear_func(triggered, _free_gstring);
+
+    for (guint i = 0; i < devices->len; i++) {
+        const LDMDMStatus * const status = g_ptr_array_index(devices, i);
+
+        gchar * const path = g_strdup_printf("/sys/dev/block/%u:%u/uevent",
+                                             major(status->devt),
+                                             minor(status->devt));
+        const int fd = open(path, O_WRONLY | O_CLOEXEC);
+        const gboolean written = fd != -1 && write(fd, "change", 6) == 6;
+        if (!written) {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
+                        "Unable to trigger %s: %s: %s",
+                        status->name, path, g_strerror(errno));
+        }
+        if (fd != -1) close(fd);
+        g_free(path);
+
+        if (!written) {
+            g_array_unref(triggered); triggered = NULL;
+            break;
+        }
+
+        GString * const name = g_string_new(status->name);
+        g_array_append_val(triggered, name);
+    }
+
+    g_ptr_array_unref(devices);
+    g_hash_table_destroy(map);
+
+    return triggered;
+}
+
+GString *
+ldm_volume_dm_get_name(const LDMVolume * const o)
+{
+    return _dm_vol_name(o->priv);
+}
+
+gchar *
+ldm_partition_dm_get_device(const LDMPartition * const o, GError ** const err)
+{
+    GString *uuid = _dm_part_uuid(o->priv);
+    gchar* r = _dm_get_device(uuid->str, err);
+    g_string_free(uuid, TRUE);
+
+    return r;
+}
+
+gchar *
+ldm_volume_dm_get_device(const LDMVolume * const o, GError ** const err)
+{
+    GString *uuid = _dm_vol_uuid(o->priv);
+    gchar* r = _dm_get_device(uuid->str, err);
+    g_string_free(uuid, TRUE);
+
+    return r;
+}
+
+gboolean
+ldm_volume_dm_create(const LDMVolume * const o, GString **created,
+                     GError ** const err)
+{
+    if (created) *created = NULL;
+
+    _activation_t act = { 0, };
+    act.vol = o->priv;
+
+    _dm_create_batch(&act, 1);
+
+    if (act.err) {
+        g_propagate_error(err, act.err);
+        return FALSE;
     }
 
-    default:
-        g_set_error(err, LDM_ERROR, LDM_ERROR_NOTSUPPORTED,
-                    "Unknown VBLK type %hhi in %s at config offset %X",
-                    type, path, offset);
-        return FALSE;
+    if (created)
+        *created = act.created;
+    else if (act.created)
+        g_string_free(act.created, TRUE);
+
+    return TRUE;
+}
+
+static void
+_clear_dm_result(gpointer const data)
+{
+    LDMVolumeDMResult * const result = data;
+
+    g_object_unref(result->volume);
+    if (result->created) g_string_free(result->created, TRUE);
+    if (result->error) g_error_free(result->error);
+}
+
+GArray *
+ldm_volumes_dm_create(GArray * const volumes)
+{
+    _activation_t * const acts = g_new0(_activation_t, volumes->len);
+    for (guint i = 0; i < volumes->len; i++) {
+        acts[i].vol = g_array_index(volumes, LDMVolume *, i)->priv;
+    }
+
+    _dm_create_batch(acts, volumes->len);
+
+    GArray * const results = g_array_sized_new(FALSE, FALSE,
+                                               sizeof(LDMVolumeDMResult),
+                                               volumes->len);
+    g_array_set_clear_func(results, _clear_dm_result);
+
+    for (guint i = 0; i < volumes->len; i++) {
+        LDMVolumeDMResult result;
+        result.volume = g_object_ref(g_array_index(volumes, LDMVolume *, i));
+        result.created = acts[i].created;
+        result.error = acts[i].err;
+        g_array_append_val(results, result);
+    }
+
+    g_free(acts);
+    return results;
+}
+
+/* Volumes which share a disk are activated together in a single batch.
+ * Batches have no dependencies on each other, and are run concurrently. */
+typedef struct {
+    _activation_t *acts;
+    guint n_acts;
+} _activation_batch_t;
+
+static void
+_dm_create_batch_thread(gpointer const data, gpointer const user_data)
+{
+    _activation_batch_t * const batch = data;
+    _dm_create_batch(batch->acts, batch->n_acts);
+}
+
+static guint
+_find_root(guint * const parent, guint i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+GArray *
+ldm_volumes_dm_create_parallel(GArray * const volumes, guint jobs)
+{
+    const guint n_vols = volumes->len;
+    if (jobs == 0) jobs = g_get_num_processors();
+
+    /* Group volumes which share a disk */
+    guint * const parent = g_new(guint, n_vols);
+    for (guint i = 0; i < n_vols; i++) parent[i] = i;
+
+    GHashTable * const disk_owner = g_hash_table_new(NULL, NULL);
+    for (guint i = 0; i < n_vols; i++) {
+        const ldmcore_vol_t * const vol =
+            g_array_index(volumes, LDMVolume *, i)->priv->core;
+
+        for (uint32_t j = 0; j < vol->n_parts; j++) {
+            gpointer owner;
+            if (g_hash_table_lookup_extended(disk_owner, vol->parts[j]->disk,
+                                             NULL, &owner))
+            {
+                parent[_find_root(parent, i)] =
+                    _find_root(parent, GPOINTER_TO_UINT(owner));
+            } else {
+                g_hash_table_insert(disk_owner, vol->parts[j]->disk,
+                                    GUINT_TO_POINTER(i));
+            }
+        }
+    }
+    g_hash_table_destroy(disk_owner);
+
+    /* Lay out the activations of each group contiguously, remembering where
+     * each volume went */
+    guint * const group_size = g_new0(guint, n_vols);
+    for (guint i = 0; i < n_vols; i++) group_size[_find_root(parent, i)]++;
+
+    guint * const group_start = g_new0(guint, n_vols);
+    guint n_batches = 0;
+    for (guint i = 0, pos = 0; i < n_vols; i++) {
+        if (group_size[i] == 0) continue;
+        group_start[i] = pos;
+        pos += group_size[i];
+        n_batches++;
+    }
+
+    _activation_t * const acts = g_new0(_activation_t, n_vols);
+    guint * const slot = g_new(guint, n_vols);
+    guint * const group_fill = g_new0(guint, n_vols);
+    for (guint i = 0; i < n_vols; i++) {
+        const guint root = _find_root(parent, i);
+        slot[i] = group_start[root] + group_fill[root]++;
+        acts[slot[i]].vol = g_array_index(volumes, LDMVolume *, i)->priv;
+    }
+
+    _activation_batch_t * const batches = g_new0(_activation_batch_t,
+                                                 n_batches);
+    for (guint i = 0, b = 0; i < n_vols; i++) {
+        if (group_size[i] == 0) continue;
+        batches[b].acts = &acts[group_start[i]];
+        batches[b].n_acts = group_size[i];
+        b++;
+    }
+
+    GError *pool_err = NULL;
+    GThreadPool *pool = NULL;
+    if (jobs > 1 && n_batches > 1) {
+        /* libdevmapper initialises its process-wide state lazily and without
+         * locking: the control fd and ioctl buffer size on the first ioctl,
+         * and whether udev is running on the first cookie. Do both here,
+         * before any worker can race to do them. */
+        char version[64];
+        if (!dm_driver_version(version, sizeof(version))) {
+            g_debug("Unable to get device mapper driver version: %s",
+                    _dm_err_last_msg);
+        }
+        dm_udev_get_sync_support();
+
+        pool = g_thread_pool_new(_dm_create_batch_thread, NULL,
+                                 MIN(jobs, n_batches), FALSE, &pool_err);
+        if (pool == NULL) {
+            g_warning("Unable to create thread pool, activating volumes "
+                      "serially: %s", pool_err->message);
+            g_error_free(pool_err); pool_err = NULL;
+        }
+    }
+
+    for (guint b = 0; b < n_batches; b++) {
+        if (pool) {
+            g_thread_pool_push(pool, &batches[b], NULL);
+        } else {
+            _dm_create_batch_thread(&batches[b], NULL);
+        }
+    }
+
+    /* Wait for all batches to complete */
+    if (pool) g_thread_pool_free(pool, FALSE, TRUE);
+
+    GArray * const results = g_array_sized_new(FALSE, FALSE,
+                                               sizeof(LDMVolumeDMResult),
+                                               n_vols);
+    g_array_set_clear_func(results, _clear_dm_result);
+
+    for (guint i = 0; i < n_vols; i++) {
+        LDMVolumeDMResult result;
+        result.volume = g_object_ref(g_array_index(volumes, LDMVolume *, i));
+        result.created = acts[slot[i]].created;
+        result.error = acts[slot[i]].err;
+        g_array_append_val(results, result);
+    }
+
+    g_free(batches);
+    g_free(group_fill);
+    g_free(slot);
+    g_free(acts);
+    g_free(group_start);
+    g_free(group_size);
+    g_free(parent);
+
+    return results;
+}
+
+/* Returns TRUE if the devices of all disks a volume is built on are known */
+static gboolean
+_volume_is_complete(const LDMVolumePrivate * const vol)
+{
+    for (guint i = 0; i < vol->parts->len; i++) {
+        const LDMPartition * const part =
+            g_array_index(vol->parts, const LDMPartition *, i);
+
+        if (!ldmcore_disk_get_device(part->priv->disk->priv->core))
+            return FALSE;
     }
-
     return TRUE;
 }
 
-gint
-_cmp_component_parts(gconstpointer a, gconstpointer b)
+/* Add a whole disk which has appeared in /dev. Other device nodes, including
+ * partitions, are ignored. Devices without LDM metadata are expected. */
+static void
+_add_new_disk(LDM * const o, const gchar * const name)
 {
-    const LDMPartition * const ao = LDM_PARTITION(*(LDMPartition **)a);
-    const LDMPartition * const bo = LDM_PARTITION(*(LDMPartition **)b);
-
-    if (ao->priv->index < bo->priv->index) return -1;
-    if (ao->priv->index > bo->priv->index) return 1;
-    return 0;
+    gchar * const sys = g_strdup_printf("/sys/block/%s", name);
+    const gboolean disk = access(sys, F_OK) == 0;
+    g_free(sys);
+    if (!disk) return;
+
+    gchar * const path = g_strdup_printf("/dev/%s", name);
+    GError *err = NULL;
+    if (!ldm_add(o, path, &err)) {
+        g_debug("%s", err->message);
+        g_error_free(err);
+    }
+    g_free(path);
 }
 
-static gboolean
-_parse_vblks(const void * const config, const gchar * const path,
-             const struct _vmdb * const vmdb,
-             LDMDiskGroup * const dg_o, GError ** const err)
+/* Add any disk in /sys/block. This finds disks which appeared before we
+ * started watching /dev. */
+static void
+_add_all_disks(LDM * const o)
 {
-    LDMDiskGroupPrivate * const dg = dg_o->priv;
-    GArray *spanned = g_array_new(FALSE, FALSE, sizeof(gpointer));
-    g_array_set_clear_func(spanned, _free_pointer);
+    DIR * const dir = opendir("/sys/block");
+    if (!dir) return;
 
-    dg->sequence = be64toh(vmdb->committed_seq);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        _add_new_disk(o, entry->d_name);
+    }
 
-    guint32 n_disks = be32toh(vmdb->n_committed_vblks_disk);
-    guint32 n_parts = be32toh(vmdb->n_committed_vblks_part);
-    guint32 n_vols = be32toh(vmdb->n_committed_vblks_vol);
-    guint32 n_comps = be32toh(vmdb->n_committed_vblks_comp);
+    closedir(dir);
+}
 
-    dg->disks = g_array_sized_new(FALSE, FALSE,
-                                  sizeof(LDMDisk *), n_disks);
-    dg->parts = g_array_sized_new(FALSE, FALSE,
-                                  sizeof(LDMPartition *), n_parts);
-    dg->vols = g_array_sized_new(FALSE, FALSE,
-                                 sizeof(LDMVolume *), n_vols);
-    g_array_set_clear_func(dg->disks, _unref_object);
-    g_array_set_clear_func(dg->parts, _unref_object);
-    g_array_set_clear_func(dg->vols, _unref_object);
+/* Activate the pending volumes which are complete, or all pending volumes if
+ * all is TRUE, storing their results in the slots of results */
+static void
+_dm_create_pending(GArray * const results, gboolean * const pending,
+                   const guint jobs, const gboolean all)
+{
+    GArray * const volumes = g_array_new(FALSE, FALSE, sizeof(LDMVolume *));
+    GArray * const slots = g_array_new(FALSE, FALSE, sizeof(guint));
 
-    GArray *comps = g_array_sized_new(FALSE, TRUE,
-                                      sizeof(struct _LDMComponent), n_comps);
-    g_array_set_clear_func(comps, _cleanup_comp);
+    for (guint i = 0; i < results->len; i++) {
+        LDMVolume * const vol =
+            g_array_index(results, LDMVolumeDMResult, i).volume;
 
-    const guint16 vblk_size = be32toh(vmdb->vblk_size);
-    const guint16 vblk_data_size = vblk_size - sizeof(struct _vblk_head);
-    const void *vblk = (void *)vmdb + be32toh(vmdb->vblk_first_offset);
-    for(;;) {
-        const int offset = vblk - config;
+        if (!pending[i] || !(all || _volume_is_complete(vol->priv))) continue;
 
-        const struct _vblk_head * const head = vblk;
-        if (memcmp(head->magic, "VBLK", 4) != 0) break;
+        pending[i] = FALSE;
+        g_array_append_val(volumes, vol);
+        g_array_append_val(slots, i);
+    }
 
-        /* Sanity check the header */
-        if (be16toh(head->entries_total) > 0 &&
-            be16toh(head->entry) >= be16toh(head->entries_total))
-        {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "VBLK entry %u has entry (%hu) > total entries (%hu)",
-                        be32toh(head->seq), be16toh(head->entry),
-                        be16toh(head->entries_total));
-            goto error;
-        }
+    if (volumes->len > 0) {
+        GArray * const batch = jobs == 1 ?
+            ldm_volumes_dm_create(volumes) :
+            ldm_volumes_dm_create_parallel(volumes, jobs);
 
-        vblk += sizeof(struct _vblk_head);
-
-        /* Check for a spanned record */
-        if (be16toh(head->entries_total) > 1) {
-            /* Look for an existing record */
-            gboolean found = FALSE;
-            for (guint i = 0; i < spanned->len; i++) {
-                struct _spanned_rec * const r =
-                    g_array_index(spanned, struct _spanned_rec *, i);
-
-                if (r->record_id == head->record_id) {
-                    r->entries_found++;
-                    memcpy(&r->data[be16toh(head->entry) * vblk_data_size],
-                           vblk, vblk_data_size);
-                    found = TRUE;
-                    break;
-                }
-            }
-            if (!found) {
-                struct _spanned_rec * const r =
-                    g_malloc0(offsetof(struct _spanned_rec, data) +
-                              head->entries_total * vblk_data_size);
-                g_array_append_val(spanned, r);
-                r->record_id = head->record_id;
-                r->entries_total = be16toh(head->entries_total);
-                r->entries_found = 1;
-                r->offset = offset;
-
-                memcpy(&r->data[be16toh(head->entry) * vblk_data_size],
-                       vblk, vblk_data_size);
-            }
-        }
+        for (guint i = 0; i < batch->len; i++) {
+            LDMVolumeDMResult * const from =
+                &g_array_index(batch, LDMVolumeDMResult, i);
+            LDMVolumeDMResult * const to =
+                &g_array_index(results, LDMVolumeDMResult,
+                               g_array_index(slots, guint, i));
 
-        else {
-            if (!_parse_vblk(vblk, dg_o, comps, path, offset, err)) goto error;
+            to->created = from->created; from->created = NULL;
+            to->error = from->error; from->error = NULL;
         }
 
-        vblk += vblk_data_size;
+        g_array_unref(batch);
     }
 
-    for (guint i = 0; i < spanned->len; i++) {
-        struct _spanned_rec * const rec =
-            g_array_index(spanned, struct _spanned_rec *, i);
-
-        if (rec->entries_found != rec->entries_total) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Expected to find %hu entries for record %u, but "
-                        "found %hu", rec->entries_total, rec->record_id,
-                        rec->entries_found);
-            goto error;
-        }
+    g_array_unref(slots);
+    g_array_unref(volumes);
+}
 
-        if (!_parse_vblk(rec->data, dg_o, comps, path, rec->offset, err))
-            goto error;
+GArray *
+ldm_volumes_dm_create_deferred(LDM * const o, GArray * const volumes,
+                               const guint jobs, const guint timeout)
+{
+    GArray * const results = g_array_sized_new(FALSE, TRUE,
+                                               sizeof(LDMVolumeDMResult),
+                                               volumes->len);
+    g_array_set_size(results, volumes->len);
+    g_array_set_clear_func(results, _clear_dm_result);
+
+    gboolean * const pending = g_new(gboolean, volumes->len);
+    for (guint i = 0; i < volumes->len; i++) {
+        LDMVolume * const vol = g_array_index(volumes, LDMVolume *, i);
+        g_array_index(results, LDMVolumeDMResult, i).volume =
+            g_object_ref(vol);
+        pending[i] = TRUE;
     }
 
-    g_array_unref(spanned); spanned = NULL;
+    const gint64 deadline = g_get_monotonic_time() +
+                            (gint64) timeout * G_TIME_SPAN_MILLISECOND;
 
-    if (dg->disks->len != n_disks) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Expected %u disk VBLKs, but found %u",
-                    n_disks, dg->disks->len);
-        goto error;
-    }
-    if (comps->len != n_comps) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Expected %u component VBLKs, but found %u",
-                    n_comps, comps->len);
-        goto error;
-    }
-    if (dg->parts->len != n_parts) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Expected %u partition VBLKs, but found %u",
-                    n_parts, dg->parts->len);
-        goto error;
-    }
-    if (dg->vols->len != n_vols) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "Expected %u volume VBLKs, but found %u",
-                    n_vols, dg->vols->len);
-        goto error;
+    /* Watch for new device nodes before looking for disks, so none are
+     * missed */
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        g_warning("Unable to watch for new disks: inotify_init1: %s",
+                  g_strerror(errno));
+    } else if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_ATTRIB) == -1) {
+        g_warning("Unable to watch for new disks: inotify_add_watch(/dev): "
+                  "%s", g_strerror(errno));
+        close(fd); fd = -1;
     }
 
-    for (guint32 i = 0; i < n_parts; i++) {
-        LDMPartition * const part_o =
-                g_array_index(dg->parts, LDMPartition *, i);
-        LDMPartitionPrivate * const part = part_o->priv;
-
-        /* Look for the underlying disk for this partition */
-        for (guint32 j = 0; j < n_disks; j++) {
-            LDMDisk * const disk_o =
-                g_array_index(dg->disks, LDMDisk *, j);
-            LDMDiskPrivate * const disk = disk_o->priv;
-
-            if (disk->id == part->disk_id) {
-                part->disk = disk_o;
-                g_object_ref(disk_o);
-                break;
-            }
-        }
-        if (part->disk == NULL) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Partition %u references unknown disk %u",
-                        part->id, part->disk_id);
-            goto error;
-        }
+    /* Complete volumes are created straight away */
+    _dm_create_pending(results, pending, jobs, FALSE);
 
-        /* Look for the parent component */
-        gboolean parent_found = FALSE;
-        for (guint j = 0; j < comps->len; j++) {
-            struct _LDMComponent * const comp =
-                (struct _LDMComponent *)comps->data + j;
+    gboolean waiting = FALSE;
+    for (guint i = 0; i < volumes->len; i++) waiting |= pending[i];
 
-            if (comp->id == part->parent_id) {
-                g_array_append_val(comp->parts, part_o);
-                g_object_ref(part_o);
-                parent_found = TRUE;
-                break;
-            }
-        }
-        if (!parent_found) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Didn't find parent component %u for partition %u",
-                        part->parent_id, part->id);
-            goto error;
-        }
+    if (waiting && fd != -1) {
+        _add_all_disks(o);
+        _dm_create_pending(results, pending, jobs, FALSE);
     }
 
-    for (guint32 i = 0; i < n_comps; i++) {
-        struct _LDMComponent * const comp =
-            (struct _LDMComponent *)comps->data + i;
-
-        if (comp->parts->len != comp->n_parts) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Component %u expected %u partitions, but found %u",
-                        comp->id, comp->n_parts, comp->parts->len);
-            goto error;
+    for (;;) {
+        waiting = FALSE;
+        for (guint i = 0; i < volumes->len; i++) waiting |= pending[i];
+        if (!waiting || fd == -1) break;
+
+        const gint64 now = g_get_monotonic_time();
+        if (now >= deadline) break;
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        const int n = poll(&pfd, 1,
+                           (deadline - now + G_TIME_SPAN_MILLISECOND - 1) /
+                           G_TIME_SPAN_MILLISECOND);
+        if (n == -1 && errno != EINTR) {
+            g_warning("Unable to watch for new disks: poll: %s",
+                      g_strerror(errno));
+            break;
         }
-
-        if (comp->n_columns > 0 && comp->n_columns != comp->parts->len) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Component %u n_columns %u doesn't match number of "
-                        "partitions %u",
-                        comp->id, comp->n_columns, comp->parts->len);
-            goto error;
+        if (n <= 0) continue;
+
+        /* Add each new disk, then create any volumes it completes */
+        char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len;
+                 p += sizeof(struct inotify_event) +
+                      ((struct inotify_event *) p)->len)
+            {
+                const struct inotify_event * const event =
+                    (const struct inotify_event *) p;
+
+                if (event->len == 0 || event->mask & IN_ISDIR) continue;
+                _add_new_disk(o, event->name);
+            }
         }
 
-        /* Sort partitions into index order */
-        g_array_sort(comp->parts, _cmp_component_parts);
-
-        gboolean parent_found = FALSE;
-        for (guint32 j = 0; j < n_vols; j++) {
-            LDMVolume * const vol_o = g_array_index(dg->vols, LDMVolume *, j);
-            LDMVolumePrivate * const vol = vol_o->priv;
-
-            if (vol->id == comp->parent_id) {
-                parent_found = TRUE;
-
-                g_array_append_vals(vol->parts,
-                                    comp->parts->data, comp->parts->len);
-                vol->chunk_size = comp->chunk_size;
-                vol->_n_comps_i++;
-
-                switch (comp->type) {
-                case _COMPONENT_TYPE_SPANNED:
-                    if (vol->_int_type != _VOLUME_TYPE_GEN) {
-                        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                                    "Unsupported configuration: SPANNED "
-                                    "component has parent volume with type %u",
-                                    vol->_int_type);
-                        goto error;
-                    }
-
-                    if (vol->_n_comps > 1) {
-                        vol->type = LDM_VOLUME_TYPE_MIRRORED;
-                    } else if (comp->n_parts > 1) {
-                        vol->type = LDM_VOLUME_TYPE_SPANNED;
-                    } else {
-                        vol->type = LDM_VOLUME_TYPE_SIMPLE;
-                    }
-                    break;
-
-                case _COMPONENT_TYPE_STRIPED:
-                    if (vol->_int_type != _VOLUME_TYPE_GEN) {
-                        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                                    "Unsupported configuration: STRIPED "
-                                    "component has parent volume with type %u",
-                                    vol->_int_type);
-                        goto error;
-                    }
-
-                    if (vol->_n_comps != 1) {
-                        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                                    "Unsupported configuration: STRIPED "
-                                    "component has parent volume with %u "
-                                    "child components", vol->_n_comps);
-                        goto error;
-                    }
-
-                    vol->type = LDM_VOLUME_TYPE_STRIPED;
+        _dm_create_pending(results, pending, jobs, FALSE);
+    }
 
-                    break;
+    if (fd != -1) close(fd);
 
-                case _COMPONENT_TYPE_RAID:
-                    if (vol->_int_type != _VOLUME_TYPE_RAID5) {
-                        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                                    "Unsupported configuration: RAID "
-                                    "component has parent volume with type %u",
-                                    vol->_int_type);
-                        goto error;
-                    }
+    /* Mirrored and RAID5 volumes are created degraded. Others fail with
+     * LDM_ERROR_MISSING_DISK. */
+    _dm_create_pending(results, pending, jobs, TRUE);
 
-                    if (vol->_n_comps != 1) {
-                        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                                    "Unsupported configuration: RAID "
-                                    "component has parent volume with %u "
-                                    "child components", vol->_n_comps);
-                        goto error;
-                    }
+    g_free(pending);
 
-                    vol->type = LDM_VOLUME_TYPE_RAID5;
-                    break;
+    return results;
+}
 
-                default:
-                    /* Should be impossible */
-                    g_error("Unexpected component type %u", comp->type);
-                }
+static void
+_clear_dm_target(gpointer const data)
+{
+    LDMDMTarget * const target = data;
 
-                break;
-            }
-        }
-        if (!parent_found) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Didn't find parent volume %u for component %u",
-                        comp->parent_id, comp->id);
-            goto error;
-        }
-    }
+    g_free(target->type);
+    g_free(target->params);
+}
 
-    for (guint32 i = 0; i < n_vols; i++) {
-        LDMVolume * const vol_o = g_array_index(dg->vols, LDMVolume *, i);
-        LDMVolumePrivate * const vol = vol_o->priv;
+static void
+_clear_dm_table(gpointer const data)
+{
+    LDMDMTable * const table = data;
 
-        if (vol->_n_comps_i != vol->_n_comps) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Volume %u expected %u components, but only found %u",
-                        vol->id, vol->_n_comps, vol->_n_comps_i);
-            goto error;
-        }
+    g_free(table->name);
+    g_free(table->uuid);
+    g_array_unref(table->targets);
+}
 
-        vol->dgname = g_strdup(dg->name);
+static void
+_append_dm_table(GArray * const tables, const ldmcore_dm_table_t * const core)
+{
+    LDMDMTable table;
+    table.name = g_strdup(core->name);
+    table.uuid = g_strdup(core->uuid);
+    table.read_only = core->read_only;
+    table.targets = g_array_sized_new(FALSE, FALSE, sizeof(LDMDMTarget),
+                                      core->n_targets);
+    g_array_set_clear_func(table.targets, _clear_dm_target);
+
+    for (uint32_t i = 0; i < core->n_targets; i++) {
+        LDMDMTarget target;
+        target.start = core->targets[i].start;
+        target.size = core->targets[i].size;
+        target.type = g_strdup(core->targets[i].type);
+        target.params = g_strdup(core->targets[i].params);
+        g_array_append_val(table.targets, target);
     }
 
-    for (guint32 i = 0; i < n_disks; i++) {
-        LDMDisk * const disk_o = g_array_index(dg->disks, LDMDisk *, i);
-        LDMDiskPrivate * const disk = disk_o->priv;
+    g_array_append_val(tables, table);
+}
 
-        disk->dgname = g_strdup(dg->name);
+/* Append the tables of a snapshot stacked on a volume, given the volume's own
+ * table. The COW store is referenced by the path it was given as, which must be
+ * attached to a loop device first if it is a file. */
+static gboolean
+_dm_get_snapshot_tables(const LDMVolumePrivate * const vol,
+                        const _dm_opts_t * const opts, GArray * const tables,
+                        ldmcore_dm_table_t * const vol_table,
+                        GError ** const err)
+{
+    ldmcore_dm_table_add_suffix(vol_table, LDMCORE_DM_SNAPSHOT_ORIGIN);
+    _append_dm_table(tables, vol_table);
+    gchar * const origin = g_strdup_printf("%s/%s", dm_dir(), vol_table->name);
+
+    ldmcore_dm_table_t snapshot_table;
+    ldmcore_err_t core_err;
+    const int r = ldmcore_dm_snapshot_table(vol->core, opts->uuid_override,
+                                            origin, opts->snapshot_cow,
+                                            opts->snapshot_persistent,
+                                            &snapshot_table, &core_err);
+    g_free(origin);
+    if (r < 0) {
+        _set_core_error(err, &core_err);
+        return FALSE;
     }
+    snapshot_table.read_only = opts->read_only;
 
-    g_array_unref(comps);
+    _append_dm_table(tables, &snapshot_table);
+    ldmcore_dm_table_clear(&snapshot_table);
 
     return TRUE;
-
-error:
-    if (spanned) g_array_unref(spanned);
-    if (comps) g_array_unref(comps);
-    return FALSE;
 }
 
-gboolean
-ldm_add(LDM * const o, const gchar * const path, GError ** const err)
+/* Append the tables of a cache stacked on a volume, given the volume's own
+ * table */
+static gboolean
+_dm_get_cache_tables(const LDMVolumePrivate * const vol,
+                     const _dm_opts_t * const opts, GArray * const tables,
+                     ldmcore_dm_table_t * const vol_table, GError ** const err)
 {
-    const int fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_IO,
-                    "Error opening %s for reading: %m", path);
-        return FALSE;
-    }
+    ldmcore_dm_cache_t cache;
+    if (!_dm_vol_cache(opts, &cache, err)) return FALSE;
 
-    int secsize;
-    if (ioctl(fd, BLKSSZGET, &secsize) == -1) {
-        g_warning("Unable to determine sector size of %s. Assuming 512 byte "
-                  "sectors", path);
-        secsize = 512;
+    gboolean r = FALSE;
+    gchar *origin = NULL;
+    gchar *meta = NULL;
+    gchar *data = NULL;
+    ldmcore_dm_table_t meta_table, data_table, cache_table;
+    ldmcore_err_t core_err;
+
+    memset(&meta_table, 0, sizeof(meta_table));
+    memset(&data_table, 0, sizeof(data_table));
+    memset(&cache_table, 0, sizeof(cache_table));
+
+    ldmcore_dm_table_add_suffix(vol_table, LDMCORE_DM_CACHE_ORIGIN);
+    _append_dm_table(tables, vol_table);
+    origin = g_strdup_printf("%s/%s", dm_dir(), vol_table->name);
+
+    if (cache.mode != LDMCORE_DM_CACHE_WRITECACHE) {
+        if (ldmcore_dm_cache_pool_tables(vol->core, opts->uuid_override,
+                                         &cache, &meta_table, &data_table,
+                                         &core_err) < 0)
+        {
+            _set_core_error(err, &core_err);
+            goto out;
+        }
+
+        _append_dm_table(tables, &meta_table);
+        _append_dm_table(tables, &data_table);
+        meta = g_strdup_printf("%s/%s", dm_dir(), meta_table.name);
+        data = g_strdup_printf("%s/%s", dm_dir(), data_table.name);
     }
 
-    return ldm_add_fd(o, fd, secsize, path, err);
-}
+    if (ldmcore_dm_cache_table(vol->core, opts->uuid_override, &cache,
+                               origin, meta, data,
+                               &cache_table, &core_err) < 0)
+    {
+        _set_core_error(err, &core_err);
+        goto out;
+    }
 
-gboolean
-ldm_add_fd(LDM * const o, const int fd, const guint secsize,
-           const gchar * const path, GError ** const err)
-{
-    GArray *disk_groups = o->priv->disk_groups;
+    _append_dm_table(tables, &cache_table);
+    r = TRUE;
 
-    /* The GObject documentation states quite clearly that method calls on an
-     * object which has been disposed should *not* result in an error. Seems
-     * weird, but...
-     */
-    if (!disk_groups) return TRUE;
+out:
+    ldmcore_dm_table_clear(&meta_table);
+    ldmcore_dm_table_clear(&data_table);
+    ldmcore_dm_table_clear(&cache_table);
+    g_free(origin);
+    g_free(meta);
+    g_free(data);
 
-    void *config = NULL;
+    return r;
+}
 
-    struct _privhead privhead;
-    if (!_read_privhead(fd, path, secsize, &privhead, err)) goto error;
-    if (!_read_config(fd, path, secsize, &privhead, &config, err)) goto error;
+GArray *
+ldm_volume_dm_get_tables(const LDMVolume * const o, GError ** const err)
+{
+    const LDMVolumePrivate * const vol = o->priv;
 
-    const struct _vmdb *vmdb;
-    if (!_find_vmdb(config, path, secsize, &vmdb, err)) goto error;
+    _dm_opts_t opts;
+    _dm_opts_get(vol, &opts);
 
-    uuid_t disk_guid;
-    uuid_t disk_group_guid;
+    GArray *tables = g_array_new(FALSE, FALSE, sizeof(LDMDMTable));
+    g_array_set_clear_func(tables, _clear_dm_table);
 
-    if (uuid_parse(privhead.disk_guid, disk_guid) == -1) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "PRIVHEAD contains invalid GUID for disk: %s",
-                    privhead.disk_guid);
-        goto error;
-    }
-    if (uuid_parse(privhead.disk_group_guid, disk_group_guid) == -1) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                    "PRIVHEAD contains invalid GUID for disk group: %s",
-                    privhead.disk_group_guid);
-        goto error;
-    }
+    const guint n_parts = vol->parts->len;
+    gchar **legs = NULL;
 
-    LDMDiskGroup *dg_o = NULL;
-    LDMDiskGroupPrivate *dg = NULL;
-    for (guint i = 0; i < disk_groups->len; i++) {
-        LDMDiskGroup *c = g_array_index(disk_groups,
-                                            LDMDiskGroup *, i);
+    ldmcore_dm_table_t table;
+    ldmcore_err_t core_err;
 
-        if (uuid_compare(disk_group_guid, c->priv->guid) == 0) {
-            dg_o = c;
-        }
-    }
+    if (_dm_vol_uses_legs(vol, &opts)) {
+        legs = g_new0(gchar *, n_parts);
 
-    if (dg_o == NULL) {
-        dg_o = LDM_DISK_GROUP(g_object_new(LDM_TYPE_DISK_GROUP, NULL));
-        dg = dg_o->priv;
+        for (guint i = 0; i < n_parts; i++) {
+            const LDMPartition * const part =
+                g_array_index(vol->parts, const LDMPartition *, i);
 
-        uuid_copy(dg_o->priv->guid, disk_group_guid);
+            if (ldmcore_dm_part_table(part->priv->core,
+                                      &table, &core_err) < 0)
+            {
+                if (core_err.code != LDMCORE_ERROR_MISSING_DISK) {
+                    _set_core_error(err, &core_err);
+                    goto error;
+                }
 
-        g_debug("Found new disk group: " UUID_FMT, UUID_VALS(disk_group_guid));
+                /* The volume may still work without this leg */
+                g_warning("%s", core_err.msg);
+                continue;
+            }
+            table.read_only = _dm_vol_read_only(&opts);
 
-        if (!_parse_vblks(config, path, vmdb, dg_o, err)) {
-            g_object_unref(dg_o); dg_o = NULL;
-            goto error;
+            _append_dm_table(tables, &table);
+            legs[i] = g_strdup_printf("%s/%s", dm_dir(), table.name);
+            ldmcore_dm_table_clear(&table);
         }
+    }
 
-        g_array_append_val(disk_groups, dg_o);
+    int r;
+    if (_dm_vol_single_leg(vol, &opts)) {
+        r = ldmcore_dm_vol_leg_table(vol->core, opts.uuid_override,
+                                     &table, &core_err);
     } else {
-        dg = dg_o->priv;
-
-        /* Check this disk is consistent with other disks */
-        uint64_t committed = be64toh(vmdb->committed_seq);
-        if (committed != dg->sequence) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INCONSISTENT,
-                        "Members of disk group " UUID_FMT " are inconsistent: "
-                        "disk %s has committed sequence %" PRIu64 ", "
-                        "group has committed sequence %" PRIu64,
-                        UUID_VALS(disk_group_guid),
-                        path, committed, dg->sequence);
-            goto error;
-        }
+        r = ldmcore_dm_vol_table(vol->core, opts.uuid_override,
+                                 (const char * const *) legs, NULL,
+                                 &opts.raid_opts, &table, &core_err);
+        table.read_only = _dm_vol_read_only(&opts);
+    }
+    if (r < 0) {
+        _set_core_error(err, &core_err);
+        goto error;
     }
 
-    /* Find the disk VBLK for the current disk and add additional information
-     * from PRIVHEAD */
-    for (guint i = 0; i < dg->disks->len; i++) {
-        LDMDisk * const disk_o = g_array_index(dg->disks, LDMDisk *, i);
-        LDMDiskPrivate * const disk = disk_o->priv;
+    if (opts.snapshot_cow) {
+        const gboolean snapshot = _dm_get_snapshot_tables(vol, &opts, tables,
+                                                          &table, err);
+        ldmcore_dm_table_clear(&table);
+        if (!snapshot) goto error;
+        goto out;
+    }
 
-        if (uuid_compare(disk_guid, disk->guid) == 0) {
-            disk->device = g_strdup(path);
-            disk->data_start = be64toh(privhead.logical_disk_start);
-            disk->data_size = be64toh(privhead.logical_disk_size);
-            disk->metadata_start = be64toh(privhead.ldm_config_start);
-            disk->metadata_size = be64toh(privhead.ldm_config_size);
-            break;
-        }
+    if (opts.cache_mode != LDMCORE_DM_CACHE_NONE) {
+        const gboolean cached = _dm_get_cache_tables(vol, &opts, tables,
+                                                     &table, err);
+        ldmcore_dm_table_clear(&table);
+        if (!cached) goto error;
+        goto out;
     }
 
-    g_free(config);
-    close(fd);
-    return TRUE;
+    _append_dm_table(tables, &table);
+    ldmcore_dm_table_clear(&table);
+    goto out;
 
 error:
-    g_free(config);
-    close(fd);
-    return FALSE;
-}
-
-LDM *
-ldm_new(void)
-{
-    LDM *ldm = LDM_CAST(g_object_new(LDM_TYPE, NULL));
-    ldm->priv->disk_groups = g_array_sized_new(FALSE, FALSE,
-                                               sizeof (LDMDiskGroup *), 1);
-    g_array_set_clear_func(ldm->priv->disk_groups, _unref_object);
-
-    return ldm;
-}
+    g_array_unref(tables); tables = NULL;
 
-GArray *
-ldm_get_disk_groups(LDM * const o)
-{
-    if (o->priv->disk_groups) g_array_ref(o->priv->disk_groups);
-    return o->priv->disk_groups;
-}
+out:
+    if (legs) {
+        for (guint i = 0; i < n_parts; i++) g_free(legs[i]);
+        g_free(legs);
+    }
+    _dm_opts_clear(&opts);
 
-GArray *
-ldm_disk_group_get_volumes(LDMDiskGroup * const o)
-{
-    if (o->priv->vols) g_array_ref(o->priv->vols);
-    return o->priv->vols;
+    return tables;
 }
 
-GArray *
-ldm_disk_group_get_partitions(LDMDiskGroup * const o)
+/* Run a task which takes only a device name, such as DM_DEVICE_SUSPEND,
+ * DM_DEVICE_RESUME or DM_DEVICE_CLEAR */
+static gboolean
+_dm_name_task(const int type, const gchar * const op, const gchar * const name,
+              uint32_t udev_cookie, GError ** const err)
 {
-    if (o->priv->parts) g_array_ref(o->priv->parts);
-    return o->priv->parts;
-}
+    gboolean r = FALSE;
 
-GArray *
-ldm_disk_group_get_disks(LDMDiskGroup * const o)
-{
-    if (o->priv->disks) g_array_ref(o->priv->disks);
-    return o->priv->disks;
-}
+    struct dm_task * const task = dm_task_create(type);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(%s) failed: %s", op, _dm_err_last_msg);
+        return FALSE;
+    }
 
-GArray *
-ldm_volume_get_partitions(LDMVolume * const o)
-{
-    if (o->priv->parts) g_array_ref(o->priv->parts);
-    return o->priv->parts;
-}
+    if (!dm_task_set_name(task, name)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "%s: dm_task_set_name(%s) failed: %s",
+                    op, name, _dm_err_last_msg);
+        goto out;
+    }
 
-LDMDisk *
-ldm_partition_get_disk(LDMPartition * const o)
-{
-    if (o->priv->disk) g_object_ref(o->priv->disk);
-    return o->priv->disk;
-}
+    if (udev_cookie && !dm_task_set_cookie(task, &udev_cookie, _dm_udev_flags)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "%s: dm_task_set_cookie(%08X) failed: %s",
+                    op, udev_cookie, _dm_err_last_msg);
+        goto out;
+    }
 
-static GString *
-_dm_part_name(const LDMPartitionPrivate * const part)
-{
-    const LDMDiskPrivate * const disk = part->disk->priv;
+    if (!dm_task_run(task)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "%s(%s) failed: %s", op, name, _dm_err_last_msg);
+        goto out;
+    }
 
-    GString * name = g_string_new("");
-    g_string_printf(name, "ldm_part_%s_%s", disk->dgname, part->name);
+    r = TRUE;
 
-    return name;
+out:
+    dm_task_destroy(task);
+    return r;
 }
 
-static GString *
-_dm_part_uuid(const LDMPartitionPrivate * const part)
+/* Load a table into the inactive slot of an existing device */
+static gboolean
+_dm_reload(const ldmcore_dm_table_t * const table, const gchar * const name,
+           GError ** const err)
 {
-    const LDMDiskPrivate * const disk = part->disk->priv;
-
-    char ldm_disk_guid[37];
-    uuid_unparse_lower(disk->guid, ldm_disk_guid);
+    gboolean r = FALSE;
 
-    GString * dm_uuid = g_string_new("");
-    g_string_printf(dm_uuid, "%s%s-%s",
-                    DM_UUID_PREFIX, part->name, ldm_disk_guid);
+    struct dm_task * const task = dm_task_create(DM_DEVICE_RELOAD);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_RELOAD) failed: %s",
+                    _dm_err_last_msg);
+        return FALSE;
+    }
 
-    return dm_uuid;
-}
+    if (!dm_task_set_name(task, name)) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "DM_DEVICE_RELOAD: dm_task_set_name(%s) failed: %s",
+                    name, _dm_err_last_msg);
+        goto out;
+    }
 
-static GString *
-_dm_vol_name(const LDMVolumePrivate * const vol)
-{
-    GString * r = g_string_new("");
-    g_string_printf(r, "ldm_vol_%s_%s", vol->dgname, vol->name);
-    return r;
-}
+    if (!_dm_task_add_table(task, "DM_DEVICE_RELOAD", table, err)) goto out;
 
-static GString *
-_dm_vol_uuid(const LDMVolumePrivate * const vol)
-{
-    char ldm_vol_uuid[37];
-    if (!uuid_is_null(vol->uuid_override)) {
-        uuid_unparse_lower(vol->uuid_override, ldm_vol_uuid);
-    } else {
-        uuid_unparse_lower(vol->guid, ldm_vol_uuid);
+    if (!dm_task_run(task)) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        goto out;
     }
 
-    GString * dm_uuid = g_string_new("");
-    g_string_printf(dm_uuid, "%s%s-%s",
-                    DM_UUID_PREFIX, vol->name, ldm_vol_uuid);
+    r = TRUE;
 
-    return dm_uuid;
+out:
+    dm_task_destroy(task);
+    return r;
 }
 
-struct dm_target {
-    guint64 start;
-    guint64 size;
-    const gchar * type;
-    GString *params;
-};
-
-static struct dm_tree *
-_dm_get_device_tree(GError **err)
+/* Get the first target of a device's table or status */
+static gboolean
+_dm_get_target(const int type, const gchar * const op, const gchar * const name,
+               uint64_t * const start, uint64_t * const size,
+               gchar ** const target_type, gchar ** const params,
+               GError ** const err)
 {
-    struct dm_tree *tree;
-    tree = dm_tree_create();
-    if (!tree) {
+    gboolean r = FALSE;
+
+    struct dm_task * const task = dm_task_create(type);
+    if (!task) {
         g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_tree_create: %s", _dm_err_last_msg);
-        return NULL;
+                    "dm_task_create(%s) failed: %s", op, _dm_err_last_msg);
+        return FALSE;
     }
 
-    struct dm_task *task;
-    task = dm_task_create(DM_DEVICE_LIST);
-    if (!task) {
+    if (!dm_task_set_name(task, name)) {
         g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_task_create: %s", _dm_err_last_msg);
-        goto error;
+                    "%s: dm_task_set_name(%s) failed: %s",
+                    op, name, _dm_err_last_msg);
+        goto out;
     }
 
     if (!dm_task_run(task)) {
-        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                            _dm_err_last_msg);
-        goto error;
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "%s(%s) failed: %s", op, name, _dm_err_last_msg);
+        goto out;
     }
 
-    struct dm_names *names;
-    names = dm_task_get_names(task);
-    if (!task) {
+    char *t_type, *t_params;
+    dm_get_next_target(task, NULL, start, size, &t_type, &t_params);
+    if (!t_type) {
         g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_task_get_names: %s", _dm_err_last_msg);
-        goto error;
+                    "%s(%s): device has no table", op, name);
+        goto out;
     }
 
-    if (names->dev != 0) {
-        for (;;) {
-            if (!dm_tree_add_dev(tree, major(names->dev), minor(names->dev))) {
-                g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                            "dm_tree_add_dev: %s", _dm_err_last_msg);
-                goto error;
-            }
+    *target_type = g_strdup(t_type);
+    *params = g_strdup(t_params ? t_params : "");
+    r = TRUE;
 
-            if (names->next == 0) break;
+out:
+    dm_task_destroy(task);
+    return r;
+}
 
-            names = (struct dm_names *)((char *)names + names->next);
-        }
+/* Write back a dm-writecache cache before its device is removed. Setting
+ * flush_on_suspend makes the next suspend write back every dirty block. */
+static gboolean
+_dm_writecache_flush(const gchar * const name, GError ** const err)
+{
+    struct dm_task * const task = dm_task_create(DM_DEVICE_TARGET_MSG);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_TARGET_MSG) failed: %s",
+                    _dm_err_last_msg);
+        return FALSE;
     }
 
+    const gboolean sent = dm_task_set_name(task, name) &&
+                          dm_task_set_sector(task, 0) &&
+                          dm_task_set_message(task, "flush_on_suspend") &&
+                          dm_task_run(task);
     dm_task_destroy(task);
-    return tree;
+    if (!sent) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Unable to flush cache of %s: %s", name, _dm_err_last_msg);
+        return FALSE;
+    }
 
-error:
-    if (tree) dm_tree_free(tree);
-    if (task) dm_task_destroy(task);
-    return NULL;
+    if (!_dm_name_task(DM_DEVICE_SUSPEND, "DM_DEVICE_SUSPEND", name, 0, err))
+        return FALSE;
+
+    /* The first field of the status is non-zero if the cache has failed */
+    uint64_t start, size;
+    gchar *type = NULL, *status = NULL;
+    gboolean r = _dm_get_target(DM_DEVICE_STATUS, "DM_DEVICE_STATUS", name,
+                                &start, &size, &type, &status, err);
+    if (r && (status[0] != '0' || (status[1] != ' ' && status[1] != '\0'))) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Cache of %s has failed: %s", name, status);
+        r = FALSE;
+    }
+    g_free(type);
+    g_free(status);
+
+    if (!_dm_name_task(DM_DEVICE_RESUME, "DM_DEVICE_RESUME", name, 0,
+                       r ? err : NULL))
+    {
+        r = FALSE;
+    }
+
+    return r;
 }
 
-/* Returns TRUE if device with specified UUID is found or FALSE otherwise.
+/* Cleaning a dm-cache cache fails if its number of dirty blocks doesn't fall
+ * for this long */
+#define CACHE_CLEAN_STALL (30 * G_TIME_SPAN_SECOND)
+
+/* Get the number of dirty blocks from the status of a dm-cache target. Fails
+ * if the cache has failed, or if its metadata is read-only or needs checking,
+ * as dirty blocks will then never be written back. The status is:
  *
- * Found device node is returned if dm_node is not NULL. In this case dm_tree
- * MUST not be NULL as well. And the caller is responsible to free device tree
- * by calling dm_tree_free function.
- */
-gboolean
-_dm_find_tree_node_by_uuid(const gchar * const uuid,
-                                struct dm_tree_node ** dm_node,
-                                struct dm_tree ** dm_tree,
-                                GError ** const err)
+ * <metadata block size> <used>/<total metadata blocks> <cache block size>
+ * <used>/<total cache blocks> <read hits> <read misses> <write hits>
+ * <write misses> <demotions> <promotions> <dirty> <#features> <features>*
+ * <#core args> <core args>* <policy> <#policy args> <policy args>*
+ * <metadata mode> <needs_check>
+ *
+ * Older kernels omit the last two fields. */
+static gboolean
+_dm_cache_dirty(const gchar * const name, const gchar * const status,
+                guint64 * const dirty, GError ** const err)
 {
+    gchar ** const fields = g_strsplit(status, " ", -1);
+    const guint n_fields = g_strv_length(fields);
     gboolean r = FALSE;
 
-    if (dm_node) {
-        g_assert(dm_tree != NULL);
-        *dm_node = NULL;
+    if (n_fields > 0 && g_str_equal(fields[0], "Fail")) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Cache of %s has failed", name);
+        goto out;
     }
-    if (dm_tree) *dm_tree = NULL;
 
-    struct dm_tree *tree = _dm_get_device_tree(err);
-    if (tree) {
-        struct dm_tree_node *node = dm_tree_find_node_by_uuid(tree, uuid);
-        if (node) r = TRUE;
+    gchar *end = NULL;
+    if (n_fields > 10) *dirty = g_ascii_strtoull(fields[10], &end, 10);
+    if (end == NULL || end == fields[10] || *end != '\0') goto invalid;
 
-        if (dm_tree)
-            *dm_tree = tree;
-        else
-            dm_tree_free(tree);
+    /* Skip the features, core args and policy to the metadata mode */
+    guint i = 11;
+    for (int list = 0; list < 3; list++) {
+        if (list == 2) i++; /* The policy name */
+        if (i >= n_fields) goto done;
+
+        const guint64 n = g_ascii_strtoull(fields[i], &end, 10);
+        if (end == fields[i] || *end != '\0' || n >= n_fields - i)
+            goto invalid;
+        i += n + 1;
+    }
 
-        if (dm_node) *dm_node = node;
+    if (i < n_fields && g_str_equal(fields[i], "ro")) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Cache of %s has read-only metadata", name);
+        goto out;
+    }
+    if (i + 1 < n_fields && g_str_equal(fields[i + 1], "needs_check")) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Cache metadata of %s needs checking", name);
+        goto out;
     }
 
+done:
+    r = TRUE;
+    goto out;
+
+invalid:
+    g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                "Unexpected cache status for %s: %s", name, status);
+
+out:
+    g_strfreev(fields);
     return r;
 }
 
-gchar *
-_dm_get_device(const gchar * const uuid, GError ** const err)
+/* Write back a writeback dm-cache cache before its device is removed, by
+ * switching it to the cleaner policy and waiting until no blocks are dirty.
+ * Gives up if the cache fails or writeback stalls. */
+static gboolean
+_dm_cache_clean(const gchar * const name, const uint64_t start,
+                const uint64_t size, const gchar * const params,
+                GError ** const err)
 {
-    GString *r = NULL;
+    gboolean r = FALSE;
 
-    struct dm_tree_node *node = NULL;
-    struct dm_tree *tree = NULL;
-    struct dm_task *task = NULL;
+    /* <meta> <data> <origin> <block size> <#features> <features>* <policy>
+     * <#policy args> <policy args>* */
+    gchar ** const args = g_strsplit(params, " ", -1);
+    const guint n_args = g_strv_length(args);
 
-    if (_dm_find_tree_node_by_uuid(uuid, &node, &tree, err)) {
-        const struct dm_info *info = dm_tree_node_get_info(node);
+    gchar *end = NULL;
+    const guint64 n_features = n_args < 5 ? 0 :
+                               g_ascii_strtoull(args[4], &end, 10);
+    if (n_args < 5 || *end != '\0' || n_features > n_args - 5) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "Unexpected cache table for %s: %s", name, params);
+        goto out;
+    }
 
-        task = dm_task_create(DM_DEVICE_INFO);
-        if (!task) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "dm_task_create: %s", _dm_err_last_msg);
-            goto error;
+    for (guint i = 5; i < 5 + n_features; i++) {
+        /* Nothing is dirty */
+        if (g_str_equal(args[i], "writethrough") ||
+            g_str_equal(args[i], "passthrough"))
+        {
+            r = TRUE;
+            goto out;
         }
+    }
 
-        if (!dm_task_set_major(task, info->major)) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "DM_DEVICE_INFO: dm_task_set_major(%d) failed: %s",
-                        info->major, _dm_err_last_msg);
-            goto error;
-        }
+    GString * const cleaner = g_string_new("");
+    for (guint i = 0; i < 5 + n_features; i++) {
+        g_string_append_printf(cleaner, "%s ", args[i]);
+    }
+    g_string_append(cleaner, "cleaner 0");
+
+    ldmcore_dm_target_t target;
+    target.start = start;
+    target.size = size;
+    target.type = "cache";
+    target.params = cleaner->str;
+
+    ldmcore_dm_table_t table;
+    memset(&table, 0, sizeof(table));
+    table.name = (char *) name;
+    table.n_targets = 1;
+    table.targets = &target;
+
+    const gboolean reloaded = _dm_reload(&table, name, err);
+    g_string_free(cleaner, TRUE);
+    if (!reloaded) goto out;
+
+    if (!_dm_name_task(DM_DEVICE_SUSPEND, "DM_DEVICE_SUSPEND", name, 0, err) ||
+        !_dm_name_task(DM_DEVICE_RESUME, "DM_DEVICE_RESUME", name, 0, err))
+    {
+        goto out;
+    }
 
-        if (!dm_task_set_minor(task, info->minor)) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "DM_DEVICE_INFO: dm_task_set_major(%d) failed: %s",
-                        info->minor, _dm_err_last_msg);
-            goto error;
+    /* Poll until nothing is dirty, giving up if writeback stops making
+     * progress */
+    guint64 lowest = G_MAXUINT64;
+    gint64 progress = g_get_monotonic_time();
+    for (;;) {
+        uint64_t s_start, s_size;
+        gchar *type, *status;
+        if (!_dm_get_target(DM_DEVICE_STATUS, "DM_DEVICE_STATUS", name,
+                            &s_start, &s_size, &type, &status, err))
+        {
+            goto out;
         }
 
-        if (!dm_task_run(task)) {
-            g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                                _dm_err_last_msg);
-            goto error;
+        guint64 dirty;
+        const gboolean ok = _dm_cache_dirty(name, status, &dirty, err);
+        g_free(type);
+        g_free(status);
+
+        if (!ok) goto out;
+        if (dirty == 0) break;
+
+        const gint64 now = g_get_monotonic_time();
+        if (dirty < lowest) {
+            lowest = dirty;
+            progress = now;
+        } else if (now - progress > CACHE_CLEAN_STALL) {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "Writeback of cache of %s made no progress in %d "
+                        "seconds with %" G_GUINT64_FORMAT " blocks dirty",
+                        name, (int) (CACHE_CLEAN_STALL / G_TIME_SPAN_SECOND),
+                        dirty);
+            goto out;
         }
 
-        const char *dir = dm_dir();
-        char *mangled_name = dm_task_get_name_mangled(task);
-        r = g_string_new("");
-        g_string_printf(r, "%s/%s", dir, mangled_name);
-        dm_free(mangled_name);
+        g_usleep(100 * 1000);
     }
 
-error:
-    if (tree) dm_tree_free(tree);
-    if (task) dm_task_destroy(task);
+    r = TRUE;
 
-    /* Really FALSE here - don't free but return the character data. */
-    return r ? g_string_free(r, FALSE) : NULL;
+out:
+    g_strfreev(args);
+    return r;
 }
 
-gboolean
-_dm_create(const gchar * const name, const gchar * const uuid,
-           uint32_t udev_cookie, const guint n_targets,
-           const struct dm_target * const targets,
-           GString **mangled_name, GError ** const err)
+/* Write back any dirty blocks in the cache stacked on a volume before its
+ * device is removed. Does nothing if the device isn't a cache. */
+static gboolean
+_dm_cache_flush(const gchar * const name, GError ** const err)
 {
-    gboolean r = TRUE;
-
-    if (mangled_name) *mangled_name = NULL;
-
-    struct dm_task * const task = dm_task_create(DM_DEVICE_CREATE);
-    if (!task) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_task_create(DM_DEVICE_CREATE) failed: %s",
-                    _dm_err_last_msg);
+    uint64_t start, size;
+    gchar *type, *params;
+    if (!_dm_get_target(DM_DEVICE_TABLE, "DM_DEVICE_TABLE", name,
+                        &start, &size, &type, &params, err))
+    {
         return FALSE;
     }
 
-    if (!dm_task_set_name(task, name)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "DM_DEVICE_CREATE: dm_task_set_name(%s) failed: %s",
-                    name, _dm_err_last_msg);
-        r = FALSE; goto out;
+    gboolean r = TRUE;
+    if (g_str_equal(type, "writecache")) {
+        r = _dm_writecache_flush(name, err);
+    } else if (g_str_equal(type, "cache")) {
+        r = _dm_cache_clean(name, start, size, params, err);
     }
 
-    if (!dm_task_set_uuid(task, uuid)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "DM_DEVICE_CREATE: dm_task_set_uuid(%s) failed: %s",
-                    uuid, _dm_err_last_msg);
-        r = FALSE; goto out;
-    }
+    g_free(type);
+    g_free(params);
+
+    return r;
+}
 
-    for (guint i = 0; i < n_targets; i++) {
-        const struct dm_target * const target = &targets[i];
+static void
+_clear_dm_remove_result(gpointer const data)
+{
+    LDMVolumeDMRemoveResult * const result = data;
 
-        if (!dm_task_add_target(task, target->start, target->size,
-                                      target->type, target->params->str))
+    g_object_unref(result->volume);
+    if (result->removed) g_string_free(result->removed, TRUE);
+    if (result->error) g_error_free(result->error);
+}
+
+GArray *
+ldm_volumes_dm_remove(GArray * const volumes)
+{
+    GArray * const results =
+        g_array_sized_new(FALSE, TRUE, sizeof(LDMVolumeDMRemoveResult),
+                          volumes->len);
+    g_array_set_size(results, volumes->len);
+    g_array_set_clear_func(results, _clear_dm_remove_result);
+
+    /* The name of each volume's device, if it exists */
+    gchar ** const names = g_new0(gchar *, volumes->len);
+
+    struct dm_tree * const tree = dm_tree_create();
+    gboolean any = FALSE;
+
+    for (guint i = 0; i < volumes->len; i++) {
+        LDMVolume * const o = g_array_index(volumes, LDMVolume *, i);
+        LDMVolumeDMRemoveResult * const result =
+            &g_array_index(results, LDMVolumeDMRemoveResult, i);
+        result->volume = g_object_ref(o);
+
+        if (!tree) {
+            g_set_error(&result->error, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "dm_tree_create: %s", _dm_err_last_msg);
+            continue;
+        }
+
+        GString * const uuid = _dm_vol_uuid(o->priv);
+        struct dm_info info;
+        const gboolean found =
+            _dm_info_by_uuid(uuid->str, &info, &names[i], &result->error);
+        g_string_free(uuid, TRUE);
+        if (!found || !info.exists) continue;
+
+        /* Removing a cache discards anything it hasn't written back. A device
+         * which is open won't be removed, so is left alone. */
+        if (info.open_count == 0 &&
+            !_dm_cache_flush(names[i], &result->error))
         {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "DM_DEVICE_CREATE: "
-                        "dm_task_add_target(%s, %" PRIu64 ", %" PRIu64 ", "
-                                           "%s, %s) failed: %s",
-                        name, target->start, target->size,
-                        target->type, target->params->str, _dm_err_last_msg);
-            r = FALSE; goto out;
+            g_free(names[i]); names[i] = NULL;
+            continue;
         }
-    }
 
-    if (!dm_task_set_cookie(task, &udev_cookie, 0)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "DM_DEVICE_CREATE: dm_task_set_cookie(%08X) failed: %s",
-                    udev_cookie, _dm_err_last_msg);
-        r = FALSE; goto out;
-    }
+        /* Adds the volume and everything it depends on */
+        if (!dm_tree_add_dev(tree, info.major, info.minor)) {
+            g_set_error(&result->error, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "dm_tree_add_dev: %s", _dm_err_last_msg);
+            g_free(names[i]); names[i] = NULL;
+            continue;
+        }
 
-    if (!dm_task_run(task)) {
-        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                            _dm_err_last_msg);
-        r = FALSE; goto out;
+        any = TRUE;
     }
 
-    if (mangled_name) {
-        char *tmp = dm_task_get_name_mangled(task);
-        *mangled_name = g_string_new(tmp);
-        dm_free(tmp);
-    }
+    if (!any) goto out;
 
-out:
-    dm_task_destroy(task);
-    return r;
-}
+    /* Remove every LDM device in the tree in a single walk. Volumes are
+     * removed before the partition devices they are built on. Devices which
+     * are still open are skipped, along with their children. */
+    gchar *msg = NULL;
+    uint32_t cookie;
+    if (dm_udev_create_cookie(&cookie)) {
+        struct dm_tree_node * const root = dm_tree_find_node(tree, 0, 0);
+        dm_tree_set_cookie(root, cookie);
 
-gboolean
-_dm_remove(const gchar * const name, uint32_t udev_cookie, GError ** const err)
-{
-    gboolean r = TRUE;
+        /* Retry in case a device is only open transiently, for example by
+         * udev's blkid */
+        dm_tree_retry_remove(root);
 
-    struct dm_task * const task = dm_task_create(DM_DEVICE_REMOVE);
-    if (!task) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_task_create(DM_DEVICE_REMOVE) failed: %s",
-                    _dm_err_last_msg);
-        r = FALSE; goto out;
+        if (!dm_tree_deactivate_children(root, DM_UUID_PREFIX,
+                                         strlen(DM_UUID_PREFIX)))
+        {
+            msg = g_strdup(_dm_err_last_msg);
+        }
+        dm_udev_wait(cookie);
+    } else {
+        msg = g_strdup_printf("dm_udev_create_cookie: %s", _dm_err_last_msg);
     }
 
-    if (!dm_task_set_name(task, name)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "DM_DEVICE_REMOVE: dm_task_set_name(%s) failed: %s",
-                    name, _dm_err_last_msg);
-        r = FALSE; goto out;
-    }
+    for (guint i = 0; i < volumes->len; i++) {
+        if (!names[i]) continue;
 
-    if (udev_cookie && !dm_task_set_cookie(task, &udev_cookie, 0)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "DM_DEVICE_REMOVE: dm_task_set_cookie(%08X) failed: %s",
-                    udev_cookie, _dm_err_last_msg);
-        r = FALSE; goto out;
-    }
+        LDMVolumeDMRemoveResult * const result =
+            &g_array_index(results, LDMVolumeDMRemoveResult, i);
 
-    /* If a remove operation fails, try again in case it was only opened
-     * transiently. */
-    dm_task_retry_remove(task);
+        GString * const uuid = _dm_vol_uuid(result->volume->priv);
+        struct dm_info info;
+        const gboolean found =
+            _dm_info_by_uuid(uuid->str, &info, NULL, &result->error);
+        g_string_free(uuid, TRUE);
+        if (!found) continue;
 
-    if (!dm_task_run(task)) {
-        if (_dm_err_last_errno == EBUSY) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+        if (!info.exists) {
+            result->removed = g_string_new(names[i]);
+        } else if (info.open_count > 0) {
+            g_set_error(&result->error, LDM_ERROR, LDM_ERROR_EXTERNAL,
                         "Device is still mounted");
         } else {
-            g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                                _dm_err_last_msg);
+            g_set_error(&result->error, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "Unable to remove device %s: %s", names[i],
+                        msg ? msg : "unknown error");
         }
-        r = FALSE; goto out;
     }
 
+    g_free(msg);
+
 out:
-    dm_task_destroy(task);
-    return r;
+    if (tree) dm_tree_free(tree);
+
+    for (guint i = 0; i < volumes->len; i++) g_free(names[i]);
+    g_free(names);
+
+    return results;
 }
 
-static GString *
-_dm_create_part(const LDMPartitionPrivate * const part, uint32_t cookie,
-                GError ** const err)
+gboolean
+ldm_volume_dm_remove(const LDMVolume * const o, GString **removed,
+                     GError ** const err)
 {
-    const LDMDiskPrivate * const disk = part->disk->priv;
-
-    if (!disk->device) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_MISSING_DISK,
-                    "Disk %s required by partition %s is missing",
-                    disk->name, part->name);
-        return NULL;
-    }
+    if (removed) *removed = NULL;
 
-    struct dm_target target;
-    target.start = 0;
-    target.size = part->size;
-    target.type = "linear";
-    target.params = g_string_new("");
-    g_string_printf(target.params, "%s %" PRIu64,
-                    disk->device, disk->data_start + part->start);
+    GArray * const volumes = g_array_sized_new(FALSE, FALSE,
+                                               sizeof(LDMVolume *), 1);
+    g_array_append_val(volumes, o);
 
-    GString *name = _dm_part_name(part);
-    GString *uuid = _dm_part_uuid(part);
-    GString *mangled_name = NULL;
+    GArray * const results = ldm_volumes_dm_remove(volumes);
+    LDMVolumeDMRemoveResult * const result =
+        &g_array_index(results, LDMVolumeDMRemoveResult, 0);
 
-    if (!_dm_create(name->str, uuid->str, cookie, 1, &target,
-                    &mangled_name, err)) {
-        mangled_name = NULL;
+    const gboolean r = result->error == NULL;
+    if (result->error) {
+        g_propagate_error(err, result->error);
+        result->error = NULL;
+    }
+    if (removed) {
+        *removed = result->removed;
+        result->removed = NULL;
     }
 
-    g_string_free(name, TRUE);
-    g_string_free(uuid, TRUE);
-    g_string_free(target.params, TRUE);
+    g_array_unref(results);
+    g_array_unref(volumes);
 
-    return mangled_name;
+    return r;
 }
 
-/* Comparator function that allows for sorting LDMPartition objects by
- * vol_offset (as the partitions may not always be sorted in increasing
- * vol_offset order for spanned LDM partitions). */
-static gint
-_cmp_component_vol_offset(gconstpointer a, gconstpointer b)
+static void
+_clear_extent(gpointer const data)
 {
-    const LDMPartition * const ao = LDM_PARTITION(*(LDMPartition **)a);
-    const LDMPartition * const bo = LDM_PARTITION(*(LDMPartition **)b);
-    if (ao->priv->vol_offset < bo->priv->vol_offset) return -1;
-    if (ao->priv->vol_offset > bo->priv->vol_offset) return 1;
-    return 0;
+    LDMExtent * const extent = data;
+
+    if (extent->disk) g_object_unref(extent->disk);
+    g_free(extent->device);
 }
 
-static GString *
-_dm_create_spanned(const LDMVolumePrivate * const vol, GError ** const err)
+GArray *
+ldm_volume_map_range(const LDMVolume * const o,
+                     const guint64 offset, const guint64 length,
+                     GError ** const err)
 {
-    GString *name = NULL;
-    guint i = 0;
-    struct dm_target *targets = g_malloc(sizeof(*targets) * vol->parts->len);
+    const LDMVolumePrivate * const vol = o->priv;
 
-    /* Sort LDM partitions by vol_offset */
-    g_array_sort(vol->parts, _cmp_component_vol_offset);
+    ldmcore_extent_t *extents;
+    uint32_t n_extents;
+    ldmcore_err_t core_err;
+    if (ldmcore_vol_map_range(vol->core, offset, length,
+                              &extents, &n_extents, &core_err) < 0)
+    {
+        _set_core_error(err, &core_err);
+        return NULL;
+    }
 
-    uint64_t pos = 0;
-    for (; i < vol->parts->len; i++) {
-        const LDMPartition * const part_o =
-            g_array_index(vol->parts, const LDMPartition *, i);
-        const LDMPartitionPrivate * const part = part_o->priv;
+    GArray * const r = g_array_sized_new(FALSE, FALSE, sizeof(LDMExtent),
+                                         n_extents);
+    g_array_set_clear_func(r, _clear_extent);
+
+    for (uint32_t i = 0; i < n_extents; i++) {
+        const ldmcore_extent_t * const e = &extents[i];
+        const LDMPartition * const part =
+            g_array_index(vol->parts, LDMPartition *, e->part);
+        LDMDisk * const disk = part->priv->disk;
+
+        LDMExtent extent;
+        extent.disk = g_object_ref(disk);
+        extent.device = ldm_disk_get_device(disk);
+        extent.volume_offset = e->vol_offset;
+        extent.offset = e->offset;
+        extent.length = e->length;
+        extent.role = (LDMExtentRole) e->role;
+
+        g_array_append_val(r, extent);
+    }
 
-        const LDMDiskPrivate * const disk = part->disk->priv;
-        if (!disk->device) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_MISSING_DISK,
-                        "Disk %s required by spanned volume %s is missing",
-                        disk->name, vol->name);
-            goto out;
-        }
+    free(extents);
+    return r;
+}
 
-        /* Sanity check: current position from adding up sizes of partitions
-         * should equal the volume offset of the partition */
-        if (pos != part->vol_offset) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_INVALID,
-                        "Partition volume offset does not match sizes of "
-                        "preceding partitions");
-            goto out;
-        }
+struct _LDMVolumeReader {
+    LDMVolume *vol;
+    ldmcore_reader_t *core;
+};
 
-        struct dm_target *target = &targets[i];
-        target->start = pos;
-        target->size = part->size;
-        target->type = "linear";
-        target->params = g_string_new("");
-        g_string_append_printf(target->params, "%s %" PRIu64,
-                                               disk->device,
-                                               disk->data_start + part->start);
-        pos += part->size;
+LDMVolumeReader *
+ldm_volume_open(LDMVolume * const o, GError ** const err)
+{
+    ldmcore_reader_t *core;
+    ldmcore_err_t core_err;
+    if (ldmcore_reader_open(o->priv->core, &core, &core_err) < 0) {
+        _set_core_error(err, &core_err);
+        return NULL;
     }
 
-    uint32_t cookie;
-    if (!dm_udev_create_cookie(&cookie)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
-        goto out;
-    }
+    LDMVolumeReader * const reader = g_new(LDMVolumeReader, 1);
+    reader->vol = g_object_ref(o);
+    reader->core = core;
 
-    name = _dm_vol_name(vol);
-    GString *uuid = _dm_vol_uuid(vol);
+    return reader;
+}
 
-    if (!_dm_create(name->str, uuid->str, cookie, vol->parts->len, targets,
-                    NULL, err)) {
-        g_string_free(name, TRUE);
-        name = NULL;
+gssize
+ldm_volume_pread(LDMVolumeReader * const reader, void * const buf,
+                 const gsize count, const guint64 offset, GError ** const err)
+{
+    ldmcore_err_t core_err;
+    const ssize_t r = ldmcore_reader_pread(reader->core, buf, count, offset,
+                                           &core_err);
+    if (r < 0) {
+        _set_core_error(err, &core_err);
+        return -1;
     }
 
-    g_string_free(uuid, TRUE);
-    dm_udev_wait(cookie);
+    return r;
+}
 
-out:
-    for (; i > 0; i--) {
-        struct dm_target *target = &targets[i-1];
-        g_string_free(target->params, TRUE);
-    }
-    g_free(targets);
+void
+ldm_volume_close(LDMVolumeReader * const reader)
+{
+    if (reader == NULL) return;
 
-    return name;
+    ldmcore_reader_close(reader->core);
+    g_object_unref(reader->vol);
+    g_free(reader);
 }
 
-static GString *
-_dm_create_striped(const LDMVolumePrivate * const vol, GError ** const err)
+void
+ldm_volume_reader_set_cache(LDMVolumeReader * const reader,
+                            const guint64 size)
 {
-    GString *name = NULL;
-    struct dm_target target;
-
-    target.start = 0;
-    target.size = vol->size;
-    target.type = "striped";
-    target.params = g_string_new("");
-    g_string_printf(target.params, "%" PRIu32 " %" PRIu64,
-                    vol->parts->len, vol->chunk_size);
+    ldmcore_reader_set_cache(reader->core, size);
+}
 
-    for (guint i = 0; i < vol->parts->len; i++) {
-        const LDMPartition * const part_o =
-            g_array_index(vol->parts, const LDMPartition *, i);
-        const LDMPartitionPrivate * const part = part_o->priv;
+void
+ldm_volume_reader_get_stats(LDMVolumeReader * const reader,
+                            LDMVolumeReaderStats * const stats)
+{
+    ldmcore_reader_stats_t core_stats;
+    ldmcore_reader_get_stats(reader->core, &core_stats);
+
+    stats->cache_size = core_stats.cache.size;
+    stats->cache_used = core_stats.cache.used;
+    stats->cache_hits = core_stats.cache.hits;
+    stats->cache_misses = core_stats.cache.misses;
+    stats->cache_evictions = core_stats.cache.evictions;
+    stats->failovers = core_stats.failovers;
+    stats->readahead_hits = core_stats.readahead_hits;
+}
 
-        const LDMDiskPrivate * const disk = part->disk->priv;
-        if (!disk->device) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_MISSING_DISK,
-                        "Disk %s required by striped volume %s is missing",
-                        disk->name, vol->name);
-            goto out;
-        }
+/* Returns the devices a device depends on, as an array of dev_t */
+static GArray *
+_dm_get_deps(const gchar * const name, GError ** const err)
+{
+    GArray *r = NULL;
 
-        g_string_append_printf(target.params, " %s %" PRIu64,
-                                               disk->device,
-                                               disk->data_start + part->start);
+    struct dm_task * const task = dm_task_create(DM_DEVICE_DEPS);
+    if (!task) {
+        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                    "dm_task_create(DM_DEVICE_DEPS) failed: %s",
+                    _dm_err_last_msg);
+        return NULL;
     }
 
-    uint32_t cookie;
-    if (!dm_udev_create_cookie(&cookie)) {
+    if (!dm_task_set_name(task, name)) {
         g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
+                    "DM_DEVICE_DEPS: dm_task_set_name(%s) failed: %s",
+                    name, _dm_err_last_msg);
         goto out;
     }
 
-    name = _dm_vol_name(vol);
-    GString *uuid = _dm_vol_uuid(vol);
-
-    if (!_dm_create(name->str, uuid->str, cookie, 1, &target, NULL, err)) {
-        g_string_free(name, TRUE);
-        name = NULL;
+    struct dm_deps *deps;
+    if (!dm_task_run(task) || !(deps = dm_task_get_deps(task))) {
+        g_set_error_literal(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                            _dm_err_last_msg);
+        goto out;
     }
 
-    g_string_free(uuid, TRUE);
-    dm_udev_wait(cookie);
+    r = g_array_sized_new(FALSE, FALSE, sizeof(dev_t), deps->count);
+    for (uint32_t i = 0; i < deps->count; i++) {
+        const dev_t devt = deps->device[i];
+        g_array_append_val(r, devt);
+    }
 
 out:
-    g_string_free(target.params, TRUE);
-
-    return name;
+    dm_task_destroy(task);
+    return r;
 }
 
-static GString *
-_dm_create_mirrored(const LDMVolumePrivate * const vol, GError ** const err)
+/* Remove LDM partition devices which a volume used before a reload, but no
+ * longer uses and which nothing else has open. Failures are only warned about,
+ * as the volume itself has already been reloaded successfully. */
+static void
+_dm_remove_stale_deps(const GArray * const old_deps,
+                      const GArray * const new_deps)
 {
-    GString *name = NULL;
-    struct dm_target target;
+    uint32_t cookie = 0;
 
-    target.start = 0;
-    target.size = vol->size;
-    target.type = "raid";
-    target.params = g_string_new("");
-    g_string_printf(target.params, "raid1 1 128 %u", vol->parts->len);
+    for (guint i = 0; i < old_deps->len; i++) {
+        const dev_t devt = g_array_index(old_deps, dev_t, i);
 
-    GArray * devices = g_array_new(FALSE, FALSE, sizeof(GString *));
-    g_array_set_clear_func(devices, _free_gstring);
-
-    uint32_t cookie;
-    if (!dm_udev_create_cookie(&cookie)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
-        goto out;
-    }
-
-    const char *dir = dm_dir();
+        gboolean in_use = FALSE;
+        for (guint j = 0; j < new_deps->len; j++) {
+            if (g_array_index(new_deps, dev_t, j) == devt) {
+                in_use = TRUE;
+                break;
+            }
+        }
+        if (in_use || !dm_is_dm_major(major(devt))) continue;
+
+        struct dm_task * const task = dm_task_create(DM_DEVICE_INFO);
+        if (!task) continue;
+
+        struct dm_info info;
+        const char *uuid;
+        if (dm_task_set_major(task, major(devt)) &&
+            dm_task_set_minor(task, minor(devt)) &&
+            dm_task_run(task) && dm_task_get_info(task, &info) &&
+            info.exists && info.open_count == 0 &&
+            (uuid = dm_task_get_uuid(task)) != NULL &&
+            g_str_has_prefix(uuid, DM_UUID_PREFIX))
+        {
+            if (!cookie && !dm_udev_create_cookie(&cookie)) {
+                g_warning("dm_udev_create_cookie: %s", _dm_err_last_msg);
+                cookie = 0;
+            }
 
-    int found = 0;
-    for (guint i = 0; i < vol->parts->len; i++) {
-        const LDMPartition * const part_o =
-            g_array_index(vol->parts, const LDMPartition *, i);
-        const LDMPartitionPrivate * const part = part_o->priv;
-
-        GString * chunk = _dm_create_part(part, cookie, err);
-        if (chunk == NULL) {
-            if (err && (*err)->code == LDM_ERROR_MISSING_DISK) {
-                g_warning("%s", (*err)->message);
-                g_error_free(*err); *err = NULL;
-                g_string_append(target.params, " - -");
-                continue;
-            } else {
-                goto out;
+            char * const name = dm_task_get_name_mangled(task);
+            GError *err = NULL;
+            if (!_dm_remove(name, cookie, &err)) {
+                g_warning("Unable to remove unused device %s: %s",
+                          name, err->message);
+                g_error_free(err);
             }
+            dm_free(name);
         }
 
-        found++;
-        g_array_append_val(devices, chunk);
-        g_string_append_printf(target.params, " - %s/%s", dir, chunk->str);
+        dm_task_destroy(task);
     }
 
-    if (found == 0) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_MISSING_DISK,
-                    "Mirrored volume is missing all partitions");
-        return FALSE;
-    }
+    if (cookie) dm_udev_wait(cookie);
+}
 
-    /* Wait until all partitions have been created */
-    dm_udev_wait(cookie);
-    if (!dm_udev_create_cookie(&cookie)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
-        goto out;
-    }
+gboolean
+ldm_volume_dm_reload(const LDMVolume * const o, GString **reloaded,
+                     GError ** const err)
+{
+    if (reloaded) *reloaded = NULL;
 
-    name = _dm_vol_name(vol);
-    GString *uuid = _dm_vol_uuid(vol);
+    const LDMVolumePrivate * const vol = o->priv;
 
-    if (!_dm_create(name->str, uuid->str, cookie, 1, &target, NULL, err)) {
-        g_string_free(name, TRUE);
-        name = NULL;
-    }
+    _dm_opts_t opts;
+    _dm_opts_get(vol, &opts);
 
-    g_string_free(uuid, TRUE);
-    dm_udev_wait(cookie);
+    GString * const uuid = _dm_uuid(vol->core, opts.uuid_override);
+    struct dm_info info;
+    gchar *name = NULL;
+    gboolean found = _dm_info_by_uuid(uuid->str, &info, &name, err);
+    if (!found || !info.exists) {
+        g_string_free(uuid, TRUE);
+        _dm_opts_clear(&opts);
+        return found ? ldm_volume_dm_create(o, reloaded, err) : FALSE;
+    }
 
-    g_array_unref(devices); devices = NULL;
+    /* If a cache or snapshot is stacked on the volume, the volume's own table
+     * is in its origin device, which is reloaded underneath it */
+    static const gchar * const origin_suffixes[] = {
+        LDMCORE_DM_CACHE_ORIGIN, LDMCORE_DM_SNAPSHOT_ORIGIN
+    };
+    const gchar *origin_suffix = NULL;
+    const gsize uuid_len = uuid->len;
+    for (guint i = 0; i < G_N_ELEMENTS(origin_suffixes); i++) {
+        struct dm_info origin_info;
+        gchar *origin_name = NULL;
+        g_string_truncate(uuid, uuid_len);
+        g_string_append(uuid, origin_suffixes[i]);
+        found = _dm_info_by_uuid(uuid->str, &origin_info, &origin_name, err);
+        if (!found) {
+            g_string_free(uuid, TRUE);
+            g_free(name);
+            _dm_opts_clear(&opts);
+            return FALSE;
+        }
 
-out:
-    if (devices) {
-        GError *cleanup_err = NULL;
-        for (int i = devices->len; i > 0; i--) {
-            GString *device = g_array_index(devices, GString *, i - 1);
-            if (!_dm_remove(device->str, 0, &cleanup_err)) {
-                g_warning("%s", cleanup_err->message);
-                g_error_free(cleanup_err); cleanup_err = NULL;
-            }
+        if (origin_info.exists) {
+            g_free(name);
+            name = origin_name;
+            origin_suffix = origin_suffixes[i];
+            break;
         }
-        g_array_unref(devices); devices = NULL;
     }
+    g_string_free(uuid, TRUE);
 
-    g_string_free(target.params, TRUE);
-
-    return name;
-}
+    gboolean r = FALSE;
 
-static GString *
-_dm_create_raid5(const LDMVolumePrivate * const vol, GError ** const err)
-{
-    GString *name = NULL;
-    GString *uuid = NULL;
-    struct dm_target target;
+    const guint n_parts = vol->parts->len;
+    gchar **legs = NULL;
+    gchar **metas = NULL;
+    int *meta_fds = NULL;
+    /* Partition devices created by the reload, removed again on failure */
+    GArray *created = NULL;
 
-    target.start = 0;
-    target.size = vol->size;
-    target.type = "raid";
-    target.params = g_string_new("");
-    g_string_append_printf(target.params, "raid5_ls 1 %" PRIu64 " %" PRIu32,
-                           vol->chunk_size, vol->parts->len);
+    ldmcore_dm_table_t table;
+    memset(&table, 0, sizeof(table));
 
-    GArray * devices = g_array_new(FALSE, FALSE, sizeof(GString *));
-    g_array_set_clear_func(devices, _free_gstring);
+    GArray * const old_deps = _dm_get_deps(name, err);
+    if (!old_deps) goto out;
 
-    uint32_t cookie;
-    if (!dm_udev_create_cookie(&cookie)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
-        goto out;
-    }
+    /* Use existing partition devices, and create any which are missing, such
+     * as a replaced mirror leg or a newly arrived RAID5 member */
+    if (_dm_vol_uses_legs(vol, &opts)) {
+        legs = g_new0(gchar *, n_parts);
+        created = g_array_new(FALSE, FALSE, sizeof(GString *));
+        g_array_set_clear_func(created, _free_gstring);
 
-    const char *dir = dm_dir();
+        uint32_t cookie;
+        if (!dm_udev_create_cookie(&cookie)) {
+            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
+                        "dm_udev_create_cookie: %s", _dm_err_last_msg);
+            goto out;
+        }
 
-    guint n_found = 0;
-    for (guint i = 0; i < vol->parts->len; i++) {
-        const LDMPartition * const part_o =
-            g_array_index(vol->parts, const LDMPartition *, i);
-        const LDMPartitionPrivate * const part = part_o->priv;
-
-        GString * chunk = _dm_create_part(part, cookie, err);
-        if (chunk == NULL) {
-            if (err && (*err)->code == LDM_ERROR_MISSING_DISK) {
-                g_warning("%s", (*err)->message);
-                g_error_free(*err); *err = NULL;
-                g_string_append(target.params, " - -");
+        gboolean ok = TRUE;
+        for (guint i = 0; i < n_parts && ok; i++) {
+            const LDMPartitionPrivate * const part =
+                g_array_index(vol->parts, const LDMPartition *, i)->priv;
+
+            GString * const part_uuid = _dm_part_uuid(part);
+            struct dm_info part_info;
+            gchar *part_name;
+            ok = _dm_info_by_uuid(part_uuid->str, &part_info, &part_name, err);
+            g_string_free(part_uuid, TRUE);
+            if (!ok) break;
+
+            if (part_info.exists) {
+                legs[i] = g_strdup_printf("%s/%s", dm_dir(), part_name);
+                g_free(part_name);
                 continue;
-            } else {
-                goto out;
             }
+
+            GError *part_err = NULL;
+            GString * const chunk = _dm_create_part(part, cookie,
+                                                    _dm_vol_read_only(&opts),
+                                                    &part_err);
+            if (chunk == NULL) {
+                if (part_err->code == LDM_ERROR_MISSING_DISK) {
+                    g_warning("%s", part_err->message);
+                    g_error_free(part_err);
+                    continue;
+                }
+
+                g_propagate_error(err, part_err);
+                ok = FALSE;
+                break;
+            }
+
+            g_array_append_val(created, chunk);
+            legs[i] = g_strdup_printf("%s/%s", dm_dir(), chunk->str);
         }
 
-        n_found++;
-        g_array_append_val(devices, chunk);
-        g_string_append_printf(target.params, " - %s/%s", dir, chunk->str);
-    }
+        dm_udev_wait(cookie);
+        if (!ok) goto out;
+
+        if (opts.metadata_dir) {
+            metas = g_new0(gchar *, n_parts);
+            meta_fds = g_new(int, n_parts);
+            for (guint i = 0; i < n_parts; i++) meta_fds[i] = -1;
+
+            for (guint i = 0; i < n_parts; i++) {
+                if (!legs[i]) continue;
+
+                char *meta;
+                ldmcore_err_t core_err;
+                if (ldmcore_dm_meta_attach(opts.metadata_dir, vol->core, i,
+                                           &meta, &meta_fds[i],
+                                           &core_err) < 0)
+                {
+                    _set_core_error(err, &core_err);
+                    goto out;
+                }
 
-    if (n_found < vol->parts->len - 1) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_MISSING_DISK,
-                    "RAID5 volume is missing more than 1 component");
-        goto out;
+                metas[i] = g_strdup(meta);
+                free(meta);
+            }
+        }
     }
 
-    /* Wait until all partitions have been created */
-    dm_udev_wait(cookie);
-    if (!dm_udev_create_cookie(&cookie)) {
-        g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                    "dm_udev_create_cookie: %s", _dm_err_last_msg);
+    ldmcore_err_t core_err;
+    int core_r;
+    if (_dm_vol_single_leg(vol, &opts)) {
+        core_r = ldmcore_dm_vol_leg_table(vol->core, opts.uuid_override,
+                                          &table, &core_err);
+    } else {
+        core_r = ldmcore_dm_vol_table(vol->core, opts.uuid_override,
+                                      (const char * const *) legs,
+                                      (const char * const *) metas,
+                                      &opts.raid_opts, &table, &core_err);
+        table.read_only = _dm_vol_read_only(&opts);
+    }
+    if (core_r < 0) {
+        _set_core_error(err, &core_err);
         goto out;
     }
+    if (origin_suffix) ldmcore_dm_table_add_suffix(&table, origin_suffix);
 
-    name = _dm_vol_name(vol);
-    uuid = _dm_vol_uuid(vol);
+    if (!_dm_reload(&table, name, err)) goto out;
 
-    if (!_dm_create(name->str, uuid->str, cookie, 1, &target, NULL, err)) {
-        g_string_free(name, TRUE); name = NULL;
-        g_string_free(uuid, TRUE);
+    /* Suspend explicitly, so that if it fails the new table can be discarded
+     * and the device left as it was */
+    if (!_dm_name_task(DM_DEVICE_SUSPEND, "DM_DEVICE_SUSPEND", name, 0, err)) {
+        GError *clear_err = NULL;
+        if (!_dm_name_task(DM_DEVICE_CLEAR, "DM_DEVICE_CLEAR", name, 0,
+                           &clear_err))
+        {
+            g_warning("%s", clear_err->message);
+            g_error_free(clear_err);
+        }
         goto out;
     }
 
-    g_string_free(uuid, TRUE);
-    dm_udev_wait(cookie);
+    /* The new table may be live from here on, so its partition devices must
+     * be kept even if resuming fails */
+    if (created) g_array_set_size(created, 0);
+
+    /* Resuming swaps in the new table. The device must be resumed even if we
+     * can't synchronise with udev. */
+    uint32_t cookie;
+    if (!dm_udev_create_cookie(&cookie)) {
+        g_warning("dm_udev_create_cookie: %s", _dm_err_last_msg);
+        cookie = 0;
+    }
+    const gboolean resumed = _dm_name_task(DM_DEVICE_RESUME, "DM_DEVICE_RESUME",
+                                           name, cookie, err);
+    if (cookie) dm_udev_wait(cookie);
+    if (!resumed) goto out;
+
+    GError *deps_err = NULL;
+    GArray * const new_deps = _dm_get_deps(name, &deps_err);
+    if (new_deps) {
+        _dm_remove_stale_deps(old_deps, new_deps);
+        g_array_unref(new_deps);
+    } else {
+        g_warning("%s", deps_err->message);
+        g_error_free(deps_err);
+    }
 
-    g_array_unref(devices); devices = NULL;
+    if (reloaded) *reloaded = g_string_new(name);
+    r = TRUE;
 
 out:
-    if (devices) {
-        GError *cleanup_err = NULL;
-        for (int i = devices->len; i > 0; i--) {
-            GString *device = g_array_index(devices, GString *, i - 1);
+    ldmcore_dm_table_clear(&table);
+
+    if (created) {
+        for (guint i = created->len; i > 0; i--) {
+            const GString * const device =
+                g_array_index(created, GString *, i - 1);
+
+            GError *cleanup_err = NULL;
             if (!_dm_remove(device->str, 0, &cleanup_err)) {
                 g_warning("%s", cleanup_err->message);
-                g_error_free(cleanup_err); cleanup_err = NULL;
+                g_error_free(cleanup_err);
             }
         }
-        g_array_unref(devices); devices = NULL;
+        g_array_unref(created);
     }
 
-    g_string_free(target.params, TRUE);
-
-    return name;
-}
+    if (legs) {
+        for (guint i = 0; i < n_parts; i++) g_free(legs[i]);
+        g_free(legs);
+    }
 
-GString *
-ldm_volume_dm_get_name(const LDMVolume * const o)
-{
-    return _dm_vol_name(o->priv);
-}
+    /* The reloaded device holds its metadata devices open */
+    if (metas) {
+        for (guint i = 0; i < n_parts; i++) {
+            if (meta_fds[i] != -1) close(meta_fds[i]);
+            g_free(metas[i]);
+        }
+        g_free(metas);
+        g_free(meta_fds);
+    }
 
-gchar *
-ldm_partition_dm_get_device(const LDMPartition * const o, GError ** const err)
-{
-    GString *uuid = _dm_part_uuid(o->priv);
-    gchar* r = _dm_get_device(uuid->str, err);
-    g_string_free(uuid, TRUE);
+    if (old_deps) g_array_unref(old_deps);
+    g_free(name);
+    _dm_opts_clear(&opts);
 
     return r;
 }
 
-gchar *
-ldm_volume_dm_get_device(const LDMVolume * const o, GError ** const err)
-{
-    GString *uuid = _dm_vol_uuid(o->priv);
-    gchar* r = _dm_get_device(uuid->str, err);
-    g_string_free(uuid, TRUE);
+void ldm_volume_override_uuid(LDMVolume * const o,
+                              const uuid_t uuid_override) {
+    LDMVolumePrivate * const vol = o->priv;
 
-    return r;
+    g_mutex_lock(&vol->dm_lock);
+    uuid_copy(vol->dm.uuid_override, uuid_override);
+    g_mutex_unlock(&vol->dm_lock);
 }
 
-gboolean
-ldm_volume_dm_create(const LDMVolume * const o, GString **created,
-                     GError ** const err)
+void
+ldm_volume_dm_set_metadata_dir(LDMVolume * const o, const gchar * const dir)
 {
-    if (created) *created = NULL;
+    LDMVolumePrivate * const vol = o->priv;
+    gchar * const new_dir = g_strdup(dir);
 
-    const LDMVolumePrivate * const vol = o->priv;
+    g_mutex_lock(&vol->dm_lock);
+    gchar * const old_dir = vol->dm.metadata_dir;
+    vol->dm.metadata_dir = new_dir;
+    g_mutex_unlock(&vol->dm_lock);
 
-    /* Check if the device already exists */
-    GString *uuid = _dm_vol_uuid(vol);
-    if (_dm_find_tree_node_by_uuid(uuid->str, NULL, NULL, err)) {
-        g_string_free(uuid, TRUE);
-        return TRUE;
-    }
-    g_string_free(uuid, TRUE);
+    g_free(old_dir);
+}
 
-    GString *name = NULL;
-    switch (vol->type) {
-    case LDM_VOLUME_TYPE_SIMPLE:
-    case LDM_VOLUME_TYPE_SPANNED:
-        name = _dm_create_spanned(vol, err);
-        break;
+void
+ldm_volume_dm_set_snapshot(LDMVolume * const o, const gchar * const cow,
+                           const gboolean persistent)
+{
+    LDMVolumePrivate * const vol = o->priv;
+    gchar * const new_cow = g_strdup(cow);
 
-    case LDM_VOLUME_TYPE_STRIPED:
-        name = _dm_create_striped(vol, err);
-        break;
+    g_mutex_lock(&vol->dm_lock);
+    gchar * const old_cow = vol->dm.snapshot_cow;
+    vol->dm.snapshot_cow = new_cow;
+    vol->dm.snapshot_persistent = persistent;
+    g_mutex_unlock(&vol->dm_lock);
 
-    case LDM_VOLUME_TYPE_MIRRORED:
-        name = _dm_create_mirrored(vol, err);
-        break;
+    g_free(old_cow);
+}
 
-    case LDM_VOLUME_TYPE_RAID5:
-        name = _dm_create_raid5(vol, err);
-        break;
+void
+ldm_volume_dm_set_cache(LDMVolume * const o, const LDMDMCacheMode mode,
+                        const gchar * const device)
+{
+    LDMVolumePrivate * const vol = o->priv;
 
+    ldmcore_dm_cache_mode_t cache_mode;
+    switch (mode) {
+    case LDM_DM_CACHE_WRITECACHE:
+        cache_mode = LDMCORE_DM_CACHE_WRITECACHE; break;
+    case LDM_DM_CACHE_WRITETHROUGH:
+        cache_mode = LDMCORE_DM_CACHE_WRITETHROUGH; break;
+    case LDM_DM_CACHE_WRITEBACK:
+        cache_mode = LDMCORE_DM_CACHE_WRITEBACK; break;
     default:
-        /* Should be impossible */
-        g_error("Unexpected volume type: %u", vol->type);
+        cache_mode = LDMCORE_DM_CACHE_NONE;
     }
+    gchar * const new_device = cache_mode == LDMCORE_DM_CACHE_NONE ?
+                               NULL : g_strdup(device);
 
-    gboolean r = name != NULL;
-
-    if (created)
-        *created = name;
-    else if (name)
-        g_string_free(name, TRUE);
+    g_mutex_lock(&vol->dm_lock);
+    gchar * const old_device = vol->dm.cache_device;
+    vol->dm.cache_mode = cache_mode;
+    vol->dm.cache_device = new_device;
+    g_mutex_unlock(&vol->dm_lock);
 
-    return r;
+    g_free(old_device);
 }
 
-gboolean
-ldm_volume_dm_remove(const LDMVolume * const o, GString **removed,
-                     GError ** const err)
+void
+ldm_volume_dm_set_read_only(LDMVolume * const o, const gboolean read_only)
 {
-    if (removed) *removed = NULL;
-
-    const LDMVolumePrivate * const vol = o->priv;
-
-    gboolean r = FALSE;
-
-    struct dm_tree *tree = NULL;
-    struct dm_tree_node *node = NULL;
-
-    GString *uuid = _dm_vol_uuid(vol);
-    gboolean found = _dm_find_tree_node_by_uuid(uuid->str, &node, &tree, err);
-    g_string_free(uuid, TRUE);
-
-    GString *name = NULL;
-    if (found) {
-        uint32_t cookie;
-        if (!dm_udev_create_cookie(&cookie)) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "dm_udev_create_cookie: %s", _dm_err_last_msg);
-            goto out;
-        }
+    LDMVolumePrivate * const vol = o->priv;
 
-        name = _dm_vol_name(vol);
-        if (!_dm_remove(name->str, cookie, err)) {
-            g_string_free(name, TRUE); name = NULL;
-            goto out;
-        }
+    g_mutex_lock(&vol->dm_lock);
+    vol->dm.read_only = read_only;
+    g_mutex_unlock(&vol->dm_lock);
+}
 
-        dm_tree_set_cookie(node, cookie);
-        if (!dm_tree_deactivate_children(node, NULL, 0)) {
-            g_set_error(err, LDM_ERROR, LDM_ERROR_EXTERNAL,
-                        "removing children: %s", _dm_err_last_msg);
-            g_string_free(name, TRUE); name = NULL;
-            goto out;
-        }
+void
+ldm_volume_dm_set_raid_options(LDMVolume * const o,
+                               const LDMDMRaidOptions * const options)
+{
+    LDMVolumePrivate * const vol = o->priv;
 
-        dm_udev_wait(cookie);
+    ldmcore_dm_raid_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    if (options) {
+        opts.region_size = options->region_size;
+        opts.nosync = options->nosync;
+        opts.min_recovery_rate = options->min_recovery_rate;
+        opts.max_recovery_rate = options->max_recovery_rate;
+        opts.daemon_sleep = options->daemon_sleep;
+        opts.write_mostly = options->write_mostly;
     }
 
-    r = TRUE;
-
-out:
-    if (tree) dm_tree_free(tree);
-
-    if (removed)
-        *removed = name;
-    else if (name)
-        g_string_free(name, TRUE);
-
-    return r;
-}
-
-void ldm_volume_override_uuid(LDMVolume * const o,
-                              const uuid_t uuid_override) {
-    LDMVolumePrivate * const vol = o->priv;
-    uuid_copy(vol->uuid_override, uuid_override);
+    g_mutex_lock(&vol->dm_lock);
+    vol->dm.raid_opts = opts;
+    g_mutex_unlock(&vol->dm_lock);
 }
@@ -18,6 +18,7 @@
 #ifndef LIBLDM_LDM_H__
 #define LIBLDM_LDM_H__
 
+#include <sys/types.h>
 #include <uuid/uuid.h>
 
 #include <glib-object.h>
@@ -72,7 +73,28 @@ typedef struct _LDMPrivate LDMPrivate;
 /**
  * LDM:
  *
- * An LDM metadata scanner
+ * An LDM metadata scanner.
+ *
+ * An #LDM object may be shared between threads. Any number of threads may query
+ * the model concurrently with each other, and with threads adding devices.
+ * Queries never take a lock: ldm_get_disk_groups() returns an immutable
+ * snapshot of the disk groups which have been discovered so far, which will not
+ * be modified by subsequent calls to ldm_add() or ldm_add_fd(). Adding a
+ * device which belongs to a new disk group publishes a new snapshot. Adding a
+ * device which belongs to a known disk group updates the matching #LDMDisk in
+ * place. A replaced snapshot is freed once no caller holds it. Calls which add
+ * or remove devices are serialised internally. Signals are emitted in the
+ * thread which added or removed the device, without any internal lock held.
+ *
+ * The previous device path of a disk which is removed or found again is kept
+ * until the #LDM object is disposed, as a query may still be reading it. Each
+ * such event grows a long-running process by the length of a path.
+ *
+ * ldm_volume_override_uuid() and the ldm_volume_dm_set_*() functions may be
+ * called while other threads use the same volume. A call which creates or
+ * reloads a volume's device, or generates its tables, copies the volume's
+ * settings when it starts work on that volume, and is not affected by later
+ * changes to them.
  */
 typedef struct _LDM LDM;
 struct _LDM
@@ -248,6 +270,9 @@ typedef struct
 
 GType ldm_get_type(void);
 GType ldm_disk_group_get_type(void);
+GType ldm_volume_get_type(void);
+GType ldm_partition_get_type(void);
+GType ldm_disk_get_type(void);
 
 /**
  * ldm_new:
@@ -279,24 +304,74 @@ gboolean ldm_add(LDM *o, const gchar *path, GError **err);
  * @err: A #GError to receive any generated errors
  *
  * Scan a device which has been previously opened for reading and add its
- * metadata to LDM object @o.
+ * metadata to LDM object @o. This may be called concurrently with other calls
+ * on @o.
  *
  * Returns: true on success, false on error
  */
 gboolean ldm_add_fd(LDM *o, int fd, guint secsize, const gchar *path,
                     GError **err);
 
+/**
+ * ldm_remove_device:
+ * @o: An #LDM object
+ * @path: The path of a device previously added with ldm_add() or ldm_add_fd()
+ * @err: A #GError to receive any generated errors
+ *
+ * Notify LDM object @o that the device at @path has gone away. The disk
+ * backed by the device is marked missing, and #LDM::disk-detached is emitted.
+ * If this was the last device in its disk group, the disk group is removed
+ * from @o. The metadata of a removed disk group will be read again if one of
+ * its devices is subsequently added.
+ *
+ * Returns: true on success, false on error. If @path is not a member of a
+ *          known disk group, @err is set to %LDM_ERROR_NOT_LDM.
+ */
+gboolean ldm_remove_device(LDM *o, const gchar *path, GError **err);
+
 /**
  * ldm_get_disk_groups:
  * @o: An #LDM object
  *
- * Get an array of discovered disk groups.
+ * Get an array of discovered disk groups. The returned array is a snapshot,
+ * and will not be modified if further disk groups are discovered.
  *
  * Returns: (element-type LDMDiskGroup)(transfer container):
  *      An array of disk groups
  */
 GArray *ldm_get_disk_groups(LDM *o);
 
+/**
+ * LDMMemoryUsage:
+ * @disk_group: The GUID of the disk group
+ * @config: Bytes of LDM metadata read while scanning each device of the disk
+ *          group. This buffer is only held until the scan completes.
+ * @structs: Bytes of object structures, including GObject wrappers
+ * @names: Bytes of strings
+ * @arrays: Bytes of arrays of object references
+ *
+ * Memory held by a disk group. Sizes exclude allocator overhead.
+ */
+typedef struct {
+    uuid_t disk_group;
+    guint64 config;
+    guint64 structs;
+    guint64 names;
+    guint64 arrays;
+} LDMMemoryUsage;
+
+/**
+ * ldm_get_memory_usage:
+ * @o: An #LDM object
+ *
+ * Get the memory held by each discovered disk group. This can be used to size
+ * memory limits for processes which scan large numbers of devices.
+ *
+ * Returns: (element-type LDMMemoryUsage)(transfer full):
+ *      An array of memory usage
+ */
+GArray *ldm_get_memory_usage(LDM *o);
+
 /**
  * ldm_disk_group_get_volumes:
  * @o: An #LDMDiskGroup
@@ -466,6 +541,95 @@ GString *ldm_volume_dm_get_name(const LDMVolume *o);
  */
 gchar *ldm_volume_dm_get_device(const LDMVolume * const o, GError **err);
 
+/**
+ * LDMDMStatus:
+ * @name: The name of the device
+ * @uuid: The device mapper UUID of the device
+ * @device: The path of the device node
+ * @devt: The device number
+ * @open_count: The number of times the device is open
+ * @suspended: True if the device is suspended
+ * @status: The table status of the device, as reported by dmsetup status. Each
+ *          target is on a separate line.
+ * @object: The #LDMVolume or #LDMPartition the device belongs to, or NULL if
+ *          it doesn't belong to a known volume or partition
+ *
+ * The state of a device mapper device created by libldm.
+ */
+typedef struct {
+    gchar *name;
+    gchar *uuid;
+    gchar *device;
+    dev_t devt;
+    gint open_count;
+    gboolean suspended;
+    gchar *status;
+    GObject *object;
+} LDMDMStatus;
+
+/**
+ * ldm_dm_get_status_map:
+ * @o: An #LDM object
+ * @err: A #GError to receive any generated errors
+ *
+ * Get the state of all device mapper devices created by libldm, with a single
+ * scan of the device mapper device list. Each device is matched to a volume
+ * or partition of @o. Use ldm_volume_dm_get_status() and
+ * ldm_partition_dm_get_status() to look up the device of an object in the
+ * returned map.
+ *
+ * Returns: (element-type utf8 LDMDMStatus)(transfer container):
+ *      A hash table of device states indexed by device mapper UUID, or NULL
+ *      on error
+ */
+GHashTable *ldm_dm_get_status_map(LDM *o, GError **err);
+
+/**
+ * ldm_dm_set_udev_sync:
+ * @sync: Whether to synchronise with udev
+ *
+ * Choose whether device mapper operations wait for udev, which is the default.
+ * Without udev synchronisation, libldm creates and removes device nodes in the
+ * device mapper directory itself, and doesn't wait for udev to process each
+ * device. udev rules, including those which create /dev/disk symlinks, are
+ * told to ignore the devices. This is intended for early boot, where udev may
+ * not be running yet. Use ldm_dm_trigger() to hand the devices over to udev
+ * later.
+ *
+ * This setting is process-wide, and affects all #LDM objects. It should be set
+ * before any devices are created.
+ */
+void ldm_dm_set_udev_sync(gboolean sync);
+
+/**
+ * ldm_dm_trigger:
+ * @o: An #LDM object
+ * @err: A #GError to receive any generated errors
+ *
+ * Synthesise a change uevent for every device mapper device created by libldm,
+ * so that udev processes devices which were created by
+ * ldm_dm_set_udev_sync() without it. Devices are triggered in the order they
+ * were created.
+ *
+ * Returns: (element-type GString)(transfer full):
+ *      The names of the devices which were triggered, or NULL on error
+ */
+GArray *ldm_dm_trigger(LDM *o, GError **err);
+
+/**
+ * ldm_volume_dm_get_status:
+ * @o: An #LDMVolume
+ * @map: A map returned by ldm_dm_get_status_map()
+ *
+ * Look up the device mapper device of a volume in @map. This does not query
+ * device mapper.
+ *
+ * Returns: (transfer none): The state of the volume's device, or NULL if it
+ *          doesn't exist
+ */
+const LDMDMStatus *ldm_volume_dm_get_status(const LDMVolume *o,
+                                            GHashTable *map);
+
 /**
  * ldm_volume_dm_create:
  * @o: An #LDMVolume
@@ -482,6 +646,86 @@ gchar *ldm_volume_dm_get_device(const LDMVolume * const o, GError **err);
 gboolean ldm_volume_dm_create(const LDMVolume *o, GString **created,
                               GError **err);
 
+/**
+ * LDMVolumeDMResult:
+ * @volume: The volume
+ * @created: The name of the created device, if any
+ * @error: The error which prevented the device from being created, if any
+ *
+ * The result of creating a device mapper device for a single volume with
+ * ldm_volumes_dm_create().
+ */
+typedef struct {
+    LDMVolume *volume;
+    GString *created;
+    GError *error;
+} LDMVolumeDMResult;
+
+/**
+ * ldm_volumes_dm_create:
+ * @volumes: (element-type LDMVolume): The volumes to create devices for
+ *
+ * Create device mapper devices for several volumes. This is equivalent to
+ * calling ldm_volume_dm_create() for each volume, but faster. Partition devices
+ * of all mirrored and RAID5 volumes are created first, followed by all volume
+ * devices, and udev is only waited for once for each. A failure to create one
+ * volume does not affect the others, and any partition devices created for a
+ * failed volume are removed again.
+ *
+ * Returns: (element-type LDMVolumeDMResult)(transfer full):
+ *      A result for each volume, in the same order as @volumes
+ */
+GArray *ldm_volumes_dm_create(GArray *volumes);
+
+/**
+ * ldm_volumes_dm_create_parallel:
+ * @volumes: (element-type LDMVolume): The volumes to create devices for
+ * @jobs: The maximum number of volumes to activate concurrently, or 0 to use
+ *        the number of processors
+ *
+ * Create device mapper devices for several volumes, as
+ * ldm_volumes_dm_create(), using up to @jobs threads. Volumes which share a
+ * disk are activated together in a single batch, in the same order as
+ * ldm_volumes_dm_create(). Batches of volumes on disjoint sets of disks are
+ * activated concurrently. Failure of one volume does not affect the others.
+ *
+ * Concurrent batches call libdevmapper from several threads at once. This
+ * relies on each thread using its own dm_task and udev cookie, and on
+ * libdevmapper's process-wide state, which it initialises lazily, being set up
+ * before any worker starts. This function does so on the calling thread. Other
+ * threads of the process must not change libdevmapper's global settings, such
+ * as with ldm_dm_set_udev_sync(), while it runs.
+ *
+ * Returns: (element-type LDMVolumeDMResult)(transfer full):
+ *      A result for each volume, in the same order as @volumes
+ */
+GArray *ldm_volumes_dm_create_parallel(GArray *volumes, guint jobs);
+
+/**
+ * ldm_volumes_dm_create_deferred:
+ * @o: The #LDM object which @volumes belong to
+ * @volumes: (element-type LDMVolume): The volumes to create devices for
+ * @jobs: The maximum number of volumes to activate concurrently, as
+ *        ldm_volumes_dm_create_parallel()
+ * @timeout: The maximum time to wait for missing disks, in milliseconds
+ *
+ * Create device mapper devices for several volumes, waiting for the disks of
+ * incomplete volumes to appear. Volumes whose disks are all present are
+ * created immediately. While any volume is incomplete, new whole disks in /dev
+ * are added to @o with ldm_add(), and each volume is created as soon as its
+ * last disk is found. This avoids creating mirrored and RAID5 volumes degraded
+ * because a disk was slow to appear, which would then need a full resync.
+ *
+ * When @timeout expires, the remaining volumes are created as they are. As
+ * with ldm_volumes_dm_create(), mirrored and RAID5 volumes are created
+ * degraded, and other volume types fail with %LDM_ERROR_MISSING_DISK.
+ *
+ * Returns: (element-type LDMVolumeDMResult)(transfer full):
+ *      A result for each volume, in the same order as @volumes
+ */
+GArray *ldm_volumes_dm_create_deferred(LDM *o, GArray *volumes, guint jobs,
+                                       guint timeout);
+
 /**
  * ldm_volume_dm_remove:
  * @o: An #LDMVolume
@@ -499,6 +743,117 @@ gboolean ldm_volume_dm_create(const LDMVolume *o, GString **created,
 gboolean ldm_volume_dm_remove(const LDMVolume *o, GString **removed,
                               GError **err);
 
+/**
+ * LDMDMTarget:
+ * @start: The first sector of the device covered by the target
+ * @size: The number of sectors covered by the target
+ * @type: The target type, for example "linear"
+ * @params: The target's parameters
+ *
+ * A single target of a device mapper table.
+ */
+typedef struct {
+    guint64 start;
+    guint64 size;
+    gchar *type;
+    gchar *params;
+} LDMDMTarget;
+
+/**
+ * LDMDMTable:
+ * @name: The name of the device
+ * @uuid: The UUID of the device
+ * @read_only: Whether the device should be created read-only
+ * @targets: (element-type LDMDMTarget): The device's targets, in order
+ *
+ * The table of a device mapper device, as it would be created.
+ */
+typedef struct {
+    gchar *name;
+    gchar *uuid;
+    gboolean read_only;
+    GArray *targets;
+} LDMDMTable;
+
+/**
+ * ldm_volume_dm_get_tables:
+ * @o: An #LDMVolume
+ * @err: A #GError to receive any generated errors
+ *
+ * Generate the device mapper tables which ldm_volume_dm_create() would use to
+ * create a volume's device, without touching device mapper. The tables are
+ * returned in the order in which the devices must be created: the partition
+ * devices of a mirrored or RAID5 volume first, followed by the volume's device.
+ * Partitions on missing disks are skipped with a warning. Partition devices
+ * are referenced by their path in the device mapper directory.
+ *
+ * The volume's UUID override, read-only setting and dm-raid options are
+ * applied. If a cache is set with ldm_volume_dm_set_cache(), the volume's
+ * device is followed by the cache's metadata and data devices, if any, and the
+ * cache device itself. If a snapshot is set with ldm_volume_dm_set_snapshot(),
+ * the volume's device is followed by the snapshot device, which refers to its
+ * COW store by the path it was set with. dm-raid metadata devices are not
+ * included, as they are only attached on creation.
+ *
+ * Returns: (element-type LDMDMTable)(transfer full):
+ *      The volume's tables, or NULL on error
+ */
+GArray *ldm_volume_dm_get_tables(const LDMVolume *o, GError **err);
+
+/**
+ * LDMVolumeDMRemoveResult:
+ * @volume: The volume
+ * @removed: The name of the removed device, if any
+ * @error: The error which prevented the device from being removed, if any
+ *
+ * The result of removing the device mapper device of a single volume with
+ * ldm_volumes_dm_remove().
+ */
+typedef struct {
+    LDMVolume *volume;
+    GString *removed;
+    GError *error;
+} LDMVolumeDMRemoveResult;
+
+/**
+ * ldm_volumes_dm_remove:
+ * @volumes: (element-type LDMVolume): The volumes to remove devices for
+ *
+ * Remove the device mapper devices of several volumes. This is equivalent to
+ * calling ldm_volume_dm_remove() for each volume, but faster. The devices of
+ * all the volumes and of the partitions they are built on are gathered into a
+ * single dependency tree, which is removed in one walk, volumes before their
+ * partitions, and udev is only waited for once. A volume whose device is still
+ * open is not removed, and neither are its partition devices, but this does
+ * not affect the others.
+ *
+ * Returns: (element-type LDMVolumeDMRemoveResult)(transfer full):
+ *      A result for each volume, in the same order as @volumes
+ */
+GArray *ldm_volumes_dm_remove(GArray *volumes);
+
+/**
+ * ldm_volume_dm_reload:
+ * @o: An #LDMVolume
+ * @reloaded: (out): The name of the reloaded device, if any
+ * @err: A #GError to receive any generated errors
+ *
+ * Replace the table of a volume's existing device mapper device with one
+ * generated from the volume's current layout, without removing the device.
+ * This picks up a spanned volume which has been extended, a replaced mirror
+ * leg, or a RAID5 member which has become available. Missing partition devices
+ * are created. The new table is loaded, and the device is suspended and
+ * resumed to switch to it, so I/O is paused only briefly. Partition devices
+ * which the volume no longer uses are removed if nothing else has them open.
+ *
+ * If the volume has no device, this is equivalent to ldm_volume_dm_create().
+ *
+ * Returns: True if, following the call, the device exists with the new table.
+ *          @reloaded will be set if the device was reloaded or created.
+ */
+gboolean ldm_volume_dm_reload(const LDMVolume *o, GString **reloaded,
+                              GError **err);
+
 /**
  * ldm_volume_override_uuid:
  * @o: An #LDMVolume
@@ -509,6 +864,314 @@ gboolean ldm_volume_dm_remove(const LDMVolume *o, GString **removed,
  */
 void ldm_volume_override_uuid(LDMVolume * const o, const uuid_t uuid_override);
 
+/**
+ * ldm_volume_dm_set_metadata_dir:
+ * @o: An #LDMVolume
+ * @dir: (allow-none): A directory for persistent dm-raid metadata, or NULL
+ *
+ * Give each leg of a mirrored or RAID5 volume a dm-raid metadata device when
+ * its device mapper device is created. This holds a write-intent bitmap, so
+ * that after an unclean shutdown only regions which were being written are
+ * resynchronised, rather than the whole volume. The metadata of each leg is
+ * kept in a sparse file in @dir, named after the volume's GUID, which is
+ * attached to a loop device. @dir is created if it doesn't exist. The loop
+ * devices are detached automatically when the volume's device is removed.
+ *
+ * The first activation with a new metadata directory resynchronises the whole
+ * volume. By default, or if @dir is NULL, volumes have no metadata devices.
+ * This has no effect on other volume types.
+ */
+void ldm_volume_dm_set_metadata_dir(LDMVolume *o, const gchar *dir);
+
+/**
+ * ldm_volume_dm_set_read_only:
+ * @o: An #LDMVolume
+ * @read_only: Whether to create the volume's device read-only
+ *
+ * Create the device mapper devices of a volume, and of any partitions it is
+ * built on, read-only. This is suitable for backup, forensics and migration.
+ *
+ * A read-only mirrored volume with at least one leg present is mapped directly
+ * to the first such leg with a single linear target. This avoids the raid
+ * target, resynchronisation, and the partition devices of the other legs. A
+ * read-only RAID5 volume still uses a raid target, which does not resynchronise
+ * while it is read-only. Read-only is off by default.
+ */
+void ldm_volume_dm_set_read_only(LDMVolume *o, gboolean read_only);
+
+/**
+ * LDMDMRaidOptions:
+ * @region_size: The size of a write-intent bitmap region in sectors. This must
+ *               be a power of 2, and no smaller than the chunk size. 0 for the
+ *               kernel's default.
+ * @nosync: Don't synchronise legs when the device is created. This is only
+ *          safe if the legs are known to be in sync, or the device will only
+ *          be read.
+ * @min_recovery_rate: The minimum recovery rate in KiB/s per leg, or 0 for the
+ *                     kernel's default
+ * @max_recovery_rate: The maximum recovery rate in KiB/s per leg, or 0 for the
+ *                     kernel's default
+ * @daemon_sleep: The interval between write-intent bitmap flushes in
+ *                milliseconds, or 0 for the kernel's default
+ * @write_mostly: A bitmask of legs which should only be read from if no other
+ *                leg is available. Bit n refers to partition n of the volume.
+ *                This may only be set for mirrored volumes, and not for every
+ *                leg.
+ *
+ * Optional parameters of the dm-raid target used for the device mapper devices
+ * of mirrored and RAID5 volumes.
+ */
+typedef struct {
+    guint32 region_size;
+    gboolean nosync;
+    guint32 min_recovery_rate;
+    guint32 max_recovery_rate;
+    guint32 daemon_sleep;
+    guint64 write_mostly;
+} LDMDMRaidOptions;
+
+/**
+ * ldm_volume_dm_set_raid_options:
+ * @o: An #LDMVolume
+ * @options: (allow-none): dm-raid options, or NULL for the defaults
+ *
+ * Set the dm-raid options used when the device mapper device of a mirrored or
+ * RAID5 volume is created. The options are copied. They are validated when
+ * the device is created. This has no effect on other volume types.
+ */
+void ldm_volume_dm_set_raid_options(LDMVolume *o,
+                                    const LDMDMRaidOptions *options);
+
+/**
+ * ldm_volume_dm_set_snapshot:
+ * @o: An #LDMVolume
+ * @cow: (allow-none): The path of a block device or file to hold the
+ *       snapshot's changes, or NULL for no snapshot
+ * @persistent: Whether changes in @cow are kept across activations
+ *
+ * Stack a writable dm-snapshot on the device mapper device of a volume when it
+ * is created, giving a clone of the volume which never modifies its disks. The
+ * volume's own device and any partition devices are created read-only, and the
+ * volume's device is renamed with a "-sorig" suffix. The snapshot device takes
+ * the volume's name and UUID. Writes to it only go to @cow, which needs only be
+ * large enough for the blocks which are changed.
+ *
+ * A file @cow is attached to a loop device, which is detached when the
+ * snapshot device is removed. A persistent @cow must be zeroed before its first
+ * use, and then keeps the clone's changes when it is removed and created again.
+ * A non-persistent @cow is discarded when the snapshot device is removed. A
+ * snapshot can't be combined with ldm_volume_dm_set_cache(). Volumes have no
+ * snapshot by default.
+ */
+void ldm_volume_dm_set_snapshot(LDMVolume *o, const gchar *cow,
+                                gboolean persistent);
+
+/**
+ * LDMDMCacheMode:
+ * @LDM_DM_CACHE_NONE: No cache
+ * @LDM_DM_CACHE_WRITECACHE: A dm-writecache write-back cache, which only caches
+ *                           writes
+ * @LDM_DM_CACHE_WRITETHROUGH: A dm-cache cache of reads and writes, which are
+ *                             also written to the volume immediately
+ * @LDM_DM_CACHE_WRITEBACK: A dm-cache cache of reads and writes, which are
+ *                          written to the volume later
+ */
+typedef enum {
+    LDM_DM_CACHE_NONE,
+    LDM_DM_CACHE_WRITECACHE,
+    LDM_DM_CACHE_WRITETHROUGH,
+    LDM_DM_CACHE_WRITEBACK
+} LDMDMCacheMode;
+
+#define LDM_TYPE_DM_CACHE_MODE (ldm_dm_cache_mode_get_type())
+
+GType ldm_dm_cache_mode_get_type(void);
+
+/**
+ * ldm_volume_dm_set_cache:
+ * @o: An #LDMVolume
+ * @mode: The type of cache
+ * @device: (allow-none): The path of a fast block device to cache the volume
+ *          on, or NULL if @mode is %LDM_DM_CACHE_NONE
+ *
+ * Stack a cache on the device mapper device of a volume when it is created.
+ * The volume's own table is created as a device named after the volume with a
+ * "-corig" suffix, and the cache device takes the volume's name and UUID. A
+ * dm-cache cache device is split into metadata and data devices with "-cmeta"
+ * and "-cdata" suffixes.
+ *
+ * @device must be zeroed before it is first used as a cache, and must not be
+ * used as a cache for any other volume. A write-back cache is flushed to the
+ * volume before its device is removed. A cache can't be combined with
+ * ldm_volume_dm_set_read_only(). Volumes have no cache by default.
+ */
+void ldm_volume_dm_set_cache(LDMVolume *o, LDMDMCacheMode mode,
+                             const gchar *device);
+
+/**
+ * LDMExtentRole:
+ * @LDM_EXTENT_ROLE_DATA: The extent contains volume data
+ * @LDM_EXTENT_ROLE_PARITY: The extent contains RAID5 parity
+ * @LDM_EXTENT_ROLE_MIRROR: The extent is a copy of volume data on one leg of a
+ *                          mirrored volume
+ */
+typedef enum {
+    LDM_EXTENT_ROLE_DATA,
+    LDM_EXTENT_ROLE_PARITY,
+    LDM_EXTENT_ROLE_MIRROR
+} LDMExtentRole;
+
+#define LDM_TYPE_EXTENT_ROLE (ldm_extent_role_get_type())
+
+GType ldm_extent_role_get_type(void);
+
+/**
+ * LDMExtent:
+ * @disk: The disk containing the extent
+ * @device: The device of @disk, or NULL if the disk is missing
+ * @volume_offset: The offset in the volume of the first sector of the extent.
+ *                 For a parity extent, this is the offset of the first data
+ *                 extent whose parity it contains.
+ * @offset: The offset of the extent from the start of @device
+ * @length: The length of the extent
+ * @role: The contents of the extent
+ *
+ * A contiguous range of sectors on a single disk. All values are in sectors.
+ */
+typedef struct {
+    LDMDisk *disk;
+    gchar *device;
+    guint64 volume_offset;
+    guint64 offset;
+    guint64 length;
+    LDMExtentRole role;
+} LDMExtent;
+
+/**
+ * ldm_volume_map_range:
+ * @o: An #LDMVolume
+ * @offset: The offset in the volume of the start of the range, in sectors
+ * @length: The length of the range, in sectors
+ * @err: A #GError to receive any generated errors
+ *
+ * Find the extents on member disks which hold the given range of a volume. The
+ * extents are returned in volume order. A RAID5 volume returns, after the data
+ * extents of each row of chunks, a parity extent covering them. A mirrored
+ * volume returns an extent for each leg. This allows volume data to be read
+ * directly from member devices without device mapper.
+ *
+ * Returns: (element-type LDMExtent)(transfer full):
+ *      An array of extents, or NULL on error
+ */
+GArray *ldm_volume_map_range(const LDMVolume *o, guint64 offset,
+                             guint64 length, GError **err);
+
+/**
+ * LDMVolumeReader:
+ *
+ * An opaque handle for reading a volume directly from its member disks, opened
+ * with ldm_volume_open().
+ */
+typedef struct _LDMVolumeReader LDMVolumeReader;
+
+/**
+ * ldm_volume_open:
+ * @o: An #LDMVolume
+ * @err: A #GError to receive any generated errors
+ *
+ * Open a volume for reading in userspace, without creating device mapper
+ * devices or requiring root. Reads are translated to the volume's member disks
+ * with ldm_volume_map_range(). Reads of a mirrored volume are spread across
+ * its legs, and a read which fails on one leg is retried on the others. A
+ * single missing disk of a RAID5 volume is reconstructed from parity. The
+ * reader holds a reference to @o.
+ *
+ * Returns: (transfer full): A reader to be closed with ldm_volume_close(), or
+ *          NULL if the volume can't be read. The error is
+ *          %LDM_ERROR_MISSING_DISK if too many of its disks are missing.
+ */
+LDMVolumeReader *ldm_volume_open(LDMVolume *o, GError **err);
+
+/**
+ * ldm_volume_pread:
+ * @reader: An #LDMVolumeReader
+ * @buf: A buffer to receive the data
+ * @count: The number of bytes to read
+ * @offset: The offset in the volume to read from, in bytes
+ * @err: A #GError to receive any generated errors
+ *
+ * Read from a volume, with the semantics of pread(2). Unlike other volume
+ * functions, offsets and lengths are in bytes. Large reads which span several
+ * disks are read from each disk in parallel. When small reads follow each other
+ * sequentially, the reader reads ahead in whole stripes, doubling the amount
+ * with each read ahead up to 8 MiB. Readahead follows a single stream. A
+ * reader may be used by several threads at once.
+ *
+ * Returns: The number of bytes read, which is less than @count only at the end
+ *          of the volume, or -1 on error
+ */
+gssize ldm_volume_pread(LDMVolumeReader *reader, void *buf, gsize count,
+                        guint64 offset, GError **err);
+
+/**
+ * ldm_volume_close:
+ * @reader: An #LDMVolumeReader
+ *
+ * Close a reader opened with ldm_volume_open().
+ */
+void ldm_volume_close(LDMVolumeReader *reader);
+
+/**
+ * ldm_volume_reader_set_cache:
+ * @reader: An #LDMVolumeReader
+ * @size: The size of the cache in bytes, or 0 for no cache
+ *
+ * Cache the disk blocks of small reads, for callers which read the same data
+ * repeatedly, such as filesystem metadata. Large reads bypass the cache. The
+ * cache may be used by several threads at once, but this function must not be
+ * called while another thread is using @reader. Readers have no cache by
+ * default.
+ *
+ * The cache holds whole 64 KiB blocks, so @size is rounded down to a multiple
+ * of 64 KiB. A non-zero @size smaller than that gives a cache of one block.
+ */
+void ldm_volume_reader_set_cache(LDMVolumeReader *reader, guint64 size);
+
+/**
+ * LDMVolumeReaderStats:
+ * @cache_size: The size of the cache in bytes
+ * @cache_used: The bytes of the cache holding data
+ * @cache_hits: Blocks read from the cache
+ * @cache_misses: Blocks read from disk because they weren't in the cache
+ * @cache_evictions: Blocks removed from the cache to make room for others
+ * @failovers: Reads of a mirrored volume which failed on one leg and were read
+ *             from another
+ * @readahead_hits: Reads copied entirely from data read ahead of a sequential
+ *                  stream
+ *
+ * Counters of an #LDMVolumeReader. The cache counters are 0 if it has no
+ * cache.
+ */
+typedef struct {
+    guint64 cache_size;
+    guint64 cache_used;
+    guint64 cache_hits;
+    guint64 cache_misses;
+    guint64 cache_evictions;
+    guint64 failovers;
+    guint64 readahead_hits;
+} LDMVolumeReaderStats;
+
+/**
+ * ldm_volume_reader_get_stats:
+ * @reader: An #LDMVolumeReader
+ * @stats: (out): The counters of @reader
+ *
+ * Get the counters of a reader.
+ */
+void ldm_volume_reader_get_stats(LDMVolumeReader *reader,
+                                 LDMVolumeReaderStats *stats);
+
 /**
  * ldm_partition_get_disk:
  * @o: An #LDMPartition
@@ -564,6 +1227,20 @@ guint64 ldm_partition_get_size(const LDMPartition *o);
  */
 gchar *ldm_partition_dm_get_device(const LDMPartition * const o, GError **err);
 
+/**
+ * ldm_partition_dm_get_status:
+ * @o: An #LDMPartition
+ * @map: A map returned by ldm_dm_get_status_map()
+ *
+ * Look up the device mapper device of a partition in @map. This does not
+ * query device mapper.
+ *
+ * Returns: (transfer none): The state of the partition's device, or NULL if it
+ *          doesn't exist
+ */
+const LDMDMStatus *ldm_partition_dm_get_status(const LDMPartition *o,
+                                               GHashTable *map);
+
 /**
  * ldm_disk_get_name
  * @o: An #LDMDisk
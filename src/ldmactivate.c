@@ -0,0 +1,487 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ldm-activate scans devices for LDM disk groups and creates device mapper
+ * devices for all of their volumes. Unlike ldmtool it depends only on the LDM
+ * core and libdevmapper, and can be linked statically for use in an initramfs.
+ */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <libdevmapper.h>
+#include <linux/fs.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ldmcore.h"
+
+#define DM_UUID_PREFIX "LDM-"
+
+static const char *_progname = "ldm-activate";
+static int _verbose = 0;
+
+/* udev flags passed with every device creation */
+static uint16_t _udev_flags = 0;
+
+static void
+_warn(const char * const fmt, ...)
+{
+    fprintf(stderr, "%s: ", _progname);
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    fputc('\n', stderr);
+}
+
+static void
+_log_fn(const char * const fmt, va_list ap)
+{
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+}
+
+/* Milliseconds on the given clock */
+static double
+_now_ms(const clockid_t clock)
+{
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) == -1) return 0;
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Disk groups found so far */
+static ldmcore_dg_t **_dgs = NULL;
+static uint32_t _n_dgs = 0;
+
+static int
+_add_device(const char * const path)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        _warn("Error opening %s for reading: %m", path);
+        return -1;
+    }
+
+    int secsize;
+    if (ioctl(fd, BLKSSZGET, &secsize) == -1) secsize = 512;
+
+    int r = 0;
+
+    ldmcore_scan_t scan;
+    ldmcore_err_t err;
+    if (ldmcore_scan(fd, path, secsize, &scan, &err) < 0) {
+        /* Most devices aren't LDM disks */
+        if (err.code != LDMCORE_ERROR_NOT_LDM) {
+            _warn("%s", err.msg);
+            r = -1;
+        }
+        goto out;
+    }
+
+    ldmcore_dg_t *dg = NULL;
+    for (uint32_t i = 0; i < _n_dgs; i++) {
+        if (uuid_compare(scan.disk_group_guid, _dgs[i]->guid) == 0) {
+            dg = _dgs[i];
+            break;
+        }
+    }
+
+    if (dg == NULL) {
+        if (ldmcore_dg_parse(&scan, path, &dg, &err) < 0) {
+            _warn("%s", err.msg);
+            r = -1;
+            goto out;
+        }
+
+        ldmcore_dg_t ** const dgs = realloc(_dgs, (_n_dgs + 1) * sizeof(*dgs));
+        if (dgs == NULL) abort();
+        _dgs = dgs;
+        _dgs[_n_dgs++] = dg;
+    } else if (ldmcore_dg_check_scan(dg, &scan, path, &err) < 0) {
+        _warn("%s", err.msg);
+        r = -1;
+        goto out;
+    }
+
+    ldmcore_disk_t * const disk = ldmcore_dg_find_disk(dg, scan.disk_guid);
+    if (disk) free(ldmcore_disk_attach(disk, &scan, path));
+
+out:
+    ldmcore_scan_clear(&scan);
+    close(fd);
+    return r;
+}
+
+static int
+_scan_sys_block(void)
+{
+    DIR * const dir = opendir("/sys/block");
+    if (dir == NULL) {
+        _warn("Unable to open /sys/block: %m");
+        return -1;
+    }
+
+    int r = 0;
+    for (;;) {
+        const struct dirent * const entry = readdir(dir);
+        if (entry == NULL) break;
+
+        if (entry->d_name[0] == '.') continue;
+
+        char *device;
+        if (asprintf(&device, "/dev/%s", entry->d_name) == -1) abort();
+        if (_add_device(device) < 0) r = -1;
+        free(device);
+    }
+
+    closedir(dir);
+    return r;
+}
+
+/* Returns 1 if a device with the given uuid exists, 0 if it doesn't, and -1 on
+ * error */
+static int
+_dm_exists(const char * const uuid)
+{
+    int r = -1;
+
+    struct dm_task * const task = dm_task_create(DM_DEVICE_INFO);
+    if (!task) return -1;
+
+    if (!dm_task_set_uuid(task, uuid)) goto out;
+    if (!dm_task_run(task)) goto out;
+
+    struct dm_info info;
+    if (!dm_task_get_info(task, &info)) goto out;
+
+    r = info.exists ? 1 : 0;
+
+out:
+    dm_task_destroy(task);
+    return r;
+}
+
+/* Returns the mangled name of the created device, or NULL on error */
+static char *
+_dm_create(const ldmcore_dm_table_t * const table, uint32_t cookie)
+{
+    char *r = NULL;
+
+    struct dm_task * const task = dm_task_create(DM_DEVICE_CREATE);
+    if (!task) return NULL;
+
+    if (!dm_task_set_name(task, table->name)) goto out;
+    if (!dm_task_set_uuid(task, table->uuid)) goto out;
+
+    for (uint32_t i = 0; i < table->n_targets; i++) {
+        const ldmcore_dm_target_t * const target = &table->targets[i];
+
+        if (_verbose) {
+            fprintf(stderr, "%s: %" PRIu64 " %" PRIu64 " %s %s\n",
+                    table->name, target->start, target->size,
+                    target->type, target->params);
+        }
+
+        if (!dm_task_add_target(task, target->start, target->size,
+                                target->type, target->params))
+            goto out;
+    }
+
+    if (!dm_task_set_cookie(task, &cookie, _udev_flags)) goto out;
+    if (!dm_task_run(task)) goto out;
+
+    r = dm_task_get_name_mangled(task);
+
+out:
+    dm_task_destroy(task);
+    return r;
+}
+
+static void
+_dm_remove(const char * const name)
+{
+    struct dm_task * const task = dm_task_create(DM_DEVICE_REMOVE);
+    if (!task) return;
+
+    if (dm_task_set_name(task, name)) {
+        dm_task_retry_remove(task);
+        dm_task_run(task);
+    }
+
+    dm_task_destroy(task);
+}
+
+/* The state of a single volume during activation */
+typedef struct {
+    const ldmcore_vol_t *vol;
+    int done;
+    int failed;
+
+    /* Names of partition devices created for the volume, and paths to them */
+    char **parts;
+    char **legs;
+} _activation_t;
+
+/* Create partition devices for all volumes which are built on them, under a
+ * single udev cookie */
+static void
+_activate_legs(_activation_t * const acts, const uint32_t n_acts)
+{
+    uint32_t cookie;
+    if (!dm_udev_create_cookie(&cookie)) {
+        for (uint32_t i = 0; i < n_acts; i++) {
+            if (!ldmcore_dm_vol_has_legs(acts[i].vol)) continue;
+            acts[i].done = acts[i].failed = 1;
+        }
+        return;
+    }
+
+    const char * const dir = dm_dir();
+
+    for (uint32_t i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        const ldmcore_vol_t * const vol = act->vol;
+
+        if (act->done || !ldmcore_dm_vol_has_legs(vol)) continue;
+
+        /* A leg whose disk is missing is left out, and the volume is
+         * activated degraded. Any other failure fails the volume. */
+        for (uint32_t j = 0; j < vol->n_parts; j++) {
+            ldmcore_dm_table_t part_table;
+            ldmcore_err_t err;
+            if (ldmcore_dm_part_table(vol->parts[j], &part_table, &err) < 0) {
+                _warn("%s", err.msg);
+                if (err.code == LDMCORE_ERROR_MISSING_DISK) continue;
+
+                act->done = act->failed = 1;
+                break;
+            }
+
+            act->parts[j] = _dm_create(&part_table, cookie);
+            ldmcore_dm_table_clear(&part_table);
+            if (act->parts[j] == NULL) {
+                act->done = act->failed = 1;
+                break;
+            }
+
+            if (asprintf(&act->legs[j], "%s/%s", dir, act->parts[j]) == -1)
+                abort();
+        }
+    }
+
+    /* Wait until all partitions have been created */
+    dm_udev_wait(cookie);
+}
+
+/* Create devices for all volumes under a single udev cookie */
+static void
+_activate_vols(_activation_t * const acts, const uint32_t n_acts)
+{
+    uint32_t cookie;
+    if (!dm_udev_create_cookie(&cookie)) {
+        for (uint32_t i = 0; i < n_acts; i++) {
+            if (!acts[i].done) acts[i].done = acts[i].failed = 1;
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+        const ldmcore_vol_t * const vol = act->vol;
+
+        if (act->done) continue;
+        act->done = 1;
+
+        ldmcore_dm_table_t table;
+        ldmcore_err_t err;
+        if (ldmcore_dm_vol_table(vol, NULL, (const char * const *) act->legs,
+                                 NULL, NULL, &table, &err) < 0)
+        {
+            _warn("%s", err.msg);
+            act->failed = 1;
+            continue;
+        }
+
+        char * const name = _dm_create(&table, cookie);
+        ldmcore_dm_table_clear(&table);
+        if (name == NULL) {
+            act->failed = 1;
+            continue;
+        }
+
+        printf("%s\n", name);
+        dm_free(name);
+    }
+
+    dm_udev_wait(cookie);
+}
+
+/* Activate all volumes of all disk groups. Partition devices for all volumes
+ * are created before any volume devices, so we only wait for udev twice.
+ * Returns 0 on success, or -1 if any volume failed. */
+static int
+_activate_all(void)
+{
+    uint32_t n_acts = 0;
+    for (uint32_t i = 0; i < _n_dgs; i++) n_acts += _dgs[i]->n_vols;
+
+    _activation_t * const acts = calloc(n_acts, sizeof(*acts));
+    if (n_acts > 0 && acts == NULL) abort();
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < _n_dgs; i++) {
+        for (uint32_t j = 0; j < _dgs[i]->n_vols; j++) {
+            _activation_t * const act = &acts[n++];
+            const ldmcore_vol_t * const vol = &_dgs[i]->vols[j];
+
+            act->vol = vol;
+            act->parts = calloc(vol->n_parts, sizeof(*act->parts));
+            act->legs = calloc(vol->n_parts, sizeof(*act->legs));
+            if (vol->n_parts > 0 && (act->parts == NULL || act->legs == NULL))
+                abort();
+
+            char * const uuid = ldmcore_dm_vol_uuid(vol, NULL);
+            const int exists = _dm_exists(uuid);
+            free(uuid);
+            if (exists < 0) {
+                _warn("Unable to query device mapper for volume %s",
+                      vol->name);
+                act->done = act->failed = 1;
+            } else if (exists) {
+                act->done = 1;
+            }
+        }
+    }
+
+    _activate_legs(acts, n_acts);
+    _activate_vols(acts, n_acts);
+
+    int r = 0;
+    for (uint32_t i = 0; i < n_acts; i++) {
+        _activation_t * const act = &acts[i];
+
+        if (act->failed) {
+            _warn("Unable to activate volume %s", act->vol->name);
+            for (uint32_t j = act->vol->n_parts; j > 0; j--) {
+                if (act->parts[j - 1]) _dm_remove(act->parts[j - 1]);
+            }
+            r = -1;
+        }
+
+        for (uint32_t j = 0; j < act->vol->n_parts; j++) {
+            if (act->parts[j]) dm_free(act->parts[j]);
+            free(act->legs[j]);
+        }
+        free(act->parts);
+        free(act->legs);
+    }
+    free(acts);
+
+    return r;
+}
+
+static void
+_usage(FILE * const out)
+{
+    fprintf(out,
+            "Usage: %s [-n] [-t] [-v] [device...]\n"
+            "Create device mapper devices for all volumes of LDM disk groups\n"
+            "found on the given devices, or all block devices.\n"
+            "\n"
+            "  -n  Create device nodes without udev. Run 'ldmtool trigger'\n"
+            "      once udev is running.\n"
+            "  -t  Report activation timing on stderr\n"
+            "  -v  Show debugging output on stderr\n"
+            "  -h  Show this help\n", _progname);
+}
+
+int
+main(const int argc, char * const argv[])
+{
+    int timing = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ntvh")) != -1) {
+        switch (opt) {
+        case 'n':
+            /* Create nodes ourselves, and have udev ignore the devices until
+             * they are triggered */
+            _udev_flags = ldmcore_dm_udev_flags(0);
+            break;
+        case 't': timing = 1; break;
+        case 'v': _verbose = 1; break;
+        case 'h': _usage(stdout); return EXIT_SUCCESS;
+        default:  _usage(stderr); return EXIT_FAILURE;
+        }
+    }
+
+    const double start = _now_ms(CLOCK_MONOTONIC);
+
+    if (_verbose) ldmcore_set_log_fn(_log_fn);
+
+    int r = EXIT_SUCCESS;
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            if (_add_device(argv[i]) < 0) r = EXIT_FAILURE;
+        }
+    } else if (_scan_sys_block() < 0) {
+        r = EXIT_FAILURE;
+    }
+
+    const double scanned = _now_ms(CLOCK_MONOTONIC);
+
+    dm_set_name_mangling_mode(DM_STRING_MANGLING_AUTO);
+    dm_set_uuid_prefix(DM_UUID_PREFIX);
+
+    if (_activate_all() < 0) r = EXIT_FAILURE;
+
+    const double activated = _now_ms(CLOCK_MONOTONIC);
+
+    if (timing) {
+        uint32_t n_vols = 0;
+        for (uint32_t i = 0; i < _n_dgs; i++) n_vols += _dgs[i]->n_vols;
+
+        fprintf(stderr, "%s: scanned %" PRIu32 " disk groups in %.3f ms\n",
+                _progname, _n_dgs, scanned - start);
+        fprintf(stderr, "%s: activated %" PRIu32 " volumes in %.3f ms\n",
+                _progname, n_vols, activated - scanned);
+        fprintf(stderr, "%s: finished %.3f ms after boot\n",
+                _progname, _now_ms(CLOCK_BOOTTIME));
+    }
+
+    for (uint32_t i = 0; i < _n_dgs; i++) ldmcore_dg_unref(_dgs[i]);
+    free(_dgs);
+
+    dm_lib_release();
+
+    return r;
+}
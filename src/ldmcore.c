@@ -0,0 +1,1546 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <endian.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "mbr.h"
+#include "gpt.h"
+#include "ldmcore.h"
+
+#define UUID_FMT "%02x%02x%02x%02x-%02x%02x-%02x%02x-" \
+                 "%02x%02x-%02x%02x%02x%02x%02x%02x"
+#define UUID_VALS(uuid) (uuid)[0], (uuid)[1], (uuid)[2], (uuid)[3], \
+                        (uuid)[4], (uuid)[5], (uuid)[6], (uuid)[7], \
+                        (uuid)[8], (uuid)[9], (uuid)[10], (uuid)[11], \
+                        (uuid)[12], (uuid)[13], (uuid)[14], (uuid)[15]
+
+/*
+ * The layout here is mostly derived from:
+ * http://hackipedia.org/Disk%20formats/Partition%20tables/Windows%20NT%20Logical%20Disk%20Manager/html,%20ldmdoc/index.html
+ *
+ * Note that the above reference describes a slightly older version of LDM, but
+ * the fields it describes remain accurate.
+ *
+ * The principal difference from the above version is the addition of support
+ * for LDM on GPT disks.
+ */
+
+/* Fixed structures
+ *
+ * These structures don't contain any variable-length fields, and can therefore
+ * be accessed directly.
+ */
+
+struct _privhead
+{
+    char magic[8]; // "PRIVHEAD"
+
+    uint32_t unknown_sequence;
+    uint16_t version_major;
+    uint16_t version_minor;
+
+    uint64_t unknown_timestamp;
+    uint64_t unknown_number;
+    uint64_t unknown_size1;
+    uint64_t unknown_size2;
+
+    char disk_guid[64];
+    char host_guid[64];
+    char disk_group_guid[64];
+    char disk_group_name[32];
+
+    uint16_t unknown1;
+    char padding1[9];
+
+    uint64_t logical_disk_start;
+    uint64_t logical_disk_size;
+    uint64_t ldm_config_start;
+    uint64_t ldm_config_size;
+    uint64_t n_tocs;
+    uint64_t toc_size;
+    uint32_t n_configs;
+    uint32_t n_logs;
+    uint64_t config_size;
+    uint64_t log_size;
+
+    uint32_t disk_signature;
+    /* Values below aren't set in my data */
+    char disk_set_guid[16];
+    char disk_set_guid_dup[16];
+
+} __attribute__((__packed__));
+
+struct _tocblock_bitmap
+{
+    char name[8];
+    uint16_t flags1;
+    uint64_t start;
+    uint64_t size; // Relative to start of DB
+    uint64_t flags2;
+} __attribute__((__packed__));
+
+struct _tocblock
+{
+    char magic[8]; // "TOCBLOCK"
+
+    uint32_t seq1;
+    char padding1[4];
+    uint32_t seq2;
+    char padding2[16];
+
+    struct _tocblock_bitmap bitmap[2];
+} __attribute__((__packed__));
+
+struct _vmdb
+{
+    char magic[4]; // "VMDB"
+
+    uint32_t vblk_last;
+    uint32_t vblk_size;
+    uint32_t vblk_first_offset;
+
+    uint16_t update_status;
+
+    uint16_t version_major;
+    uint16_t version_minor;
+
+    char disk_group_name[31];
+    char disk_group_guid[64];
+
+    uint64_t committed_seq;
+    uint64_t pending_seq;
+    uint32_t n_committed_vblks_vol;
+    uint32_t n_committed_vblks_comp;
+    uint32_t n_committed_vblks_part;
+    uint32_t n_committed_vblks_disk;
+    char padding1[12];
+    uint32_t n_pending_vblks_vol;
+    uint32_t n_pending_vblks_comp;
+    uint32_t n_pending_vblks_part;
+    uint32_t n_pending_vblks_disk;
+    char padding2[12];
+
+    uint64_t last_accessed;
+} __attribute__((__packed__));
+
+/* This is the header of every VBLK entry */
+struct _vblk_head
+{
+    char magic[4]; // "VBLK"
+
+    uint32_t seq;
+
+    uint32_t record_id;
+    uint16_t entry;
+    uint16_t entries_total;
+} __attribute__((__packed__));
+
+/* This is the header of every VBLK record, which may span multiple VBLK
+ * entries. I.e. if a VBLK record is split across 2 entries, only the first will
+ * have this header immediately following the entry header. */
+struct _vblk_rec_head
+{
+    uint16_t status;
+    uint8_t  flags;
+    uint8_t  type;
+    uint32_t size;
+} __attribute__((__packed__));
+
+/* Logging and error handling */
+
+static ldmcore_log_fn_t _log_fn = NULL;
+
+void
+ldmcore_set_log_fn(const ldmcore_log_fn_t fn)
+{
+    _log_fn = fn;
+}
+
+static void
+_debug(const char * const fmt, ...)
+{
+    if (!_log_fn) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    _log_fn(fmt, ap);
+    va_end(ap);
+}
+
+int
+ldmcore_set_err(ldmcore_err_t * const err, const ldmcore_error_t code,
+                const char * const fmt, ...)
+{
+    if (err) {
+        err->code = code;
+
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(err->msg, sizeof(err->msg), fmt, ap);
+        va_end(ap);
+    }
+
+    return -code;
+}
+
+/* Allocation failure is fatal, as in the rest of the library */
+
+static void *
+_malloc0(const size_t size)
+{
+    void * const r = calloc(1, size);
+    if (r == NULL) abort();
+    return r;
+}
+
+static char *
+_strdup(const char * const s)
+{
+    char * const r = strdup(s);
+    if (r == NULL) abort();
+    return r;
+}
+
+/* Append a zeroed element to a dynamically sized array, returning it */
+static void *
+_append(void ** const array, uint32_t * const len, const size_t size)
+{
+    void * const r = realloc(*array, (*len + 1) * size);
+    if (r == NULL) abort();
+    *array = r;
+
+    void * const elem = (char *) r + *len * size;
+    memset(elem, 0, size);
+    (*len)++;
+
+    return elem;
+}
+
+/* Reading metadata from a device */
+
+static int
+_find_vmdb(const void * const config, const char * const path,
+           const unsigned int secsize, const struct _vmdb ** const vmdb,
+           ldmcore_err_t * const err)
+{
+    /* TOCBLOCK starts 2 sectors into config */
+    const struct _tocblock *tocblock = config + secsize * 2;
+    if (memcmp(tocblock->magic, "TOCBLOCK", 8) != 0) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Didn't find TOCBLOCK at config offset %" PRIX64,
+                               UINT64_C(0x400));
+    }
+
+    _debug("TOCBLOCK: %s\n"
+           "  Sequence1: %" PRIu64 "\n"
+           "  Sequence2: %" PRIu64 "\n"
+           "  Bitmap: %s\n"
+           "    Flags1: %04" PRIo8 "\n"
+           "    Start: %" PRIu64 "\n"
+           "    Size: %" PRIu64 "\n"
+           "    Flags2: %016" PRIo64 "\n"
+           "  Bitmap: %s\n"
+           "    Flags1: %04" PRIo8 "\n"
+           "    Start: %" PRIu64 "\n"
+           "    Size: %" PRIu64 "\n"
+           "    Flags2: %016" PRIo64,
+           path,
+           (uint64_t) be64toh(tocblock->seq1),
+           (uint64_t) be64toh(tocblock->seq2),
+           tocblock->bitmap[0].name,
+           be16toh(tocblock->bitmap[0].flags1),
+           (uint64_t) be64toh(tocblock->bitmap[0].start),
+           (uint64_t) be64toh(tocblock->bitmap[0].size),
+           (uint64_t) be64toh(tocblock->bitmap[0].flags2),
+           tocblock->bitmap[1].name,
+           be16toh(tocblock->bitmap[1].flags1),
+           (uint64_t) be64toh(tocblock->bitmap[1].start),
+           (uint64_t) be64toh(tocblock->bitmap[1].size),
+           (uint64_t) be64toh(tocblock->bitmap[1].flags2));
+
+    /* Find the start of the DB */
+    *vmdb = NULL;
+    for (int i = 0; i < 2; i++) {
+        const struct _tocblock_bitmap *bitmap = &tocblock->bitmap[i];
+        if (strcmp(bitmap->name, "config") == 0) {
+            *vmdb = config + be64toh(tocblock->bitmap[i].start) * secsize;
+            break;
+        }
+    }
+
+    if (*vmdb == NULL) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "TOCBLOCK doesn't contain config bitmap");
+    }
+
+    if (memcmp((*vmdb)->magic, "VMDB", 4) != 0) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "Didn't find VMDB at config offset %lX",
+                               (unsigned long int)((void *) (*vmdb) - config));
+    }
+
+    _debug("VMDB: %s\n"
+           "  VBLK last: %" PRIu32 "\n"
+           "  VBLK size: %" PRIu32 "\n"
+           "  VBLK first offset: %" PRIu32 "\n"
+           "  Version major: %" PRIu16 "\n"
+           "  Version minor: %" PRIu16 "\n"
+           "  Disk group GUID: %s\n"
+           "  Committed sequence: %" PRIu64 "\n"
+           "  Pending sequence: %" PRIu64 "\n"
+           "  Committed volumes: %" PRIu32 "\n"
+           "  Committed components: %" PRIu32 "\n"
+           "  Committed partitions: %" PRIu32 "\n"
+           "  Committed disks: %" PRIu32 "\n"
+           "  Pending volumes: %" PRIu32 "\n"
+           "  Pending components: %" PRIu32 "\n"
+           "  Pending partitions: %" PRIu32 "\n"
+           "  Pending disks: %" PRIu32,
+           path,
+           be32toh((*vmdb)->vblk_last),
+           be32toh((*vmdb)->vblk_size),
+           be32toh((*vmdb)->vblk_first_offset),
+           be16toh((*vmdb)->version_major),
+           be16toh((*vmdb)->version_minor),
+           (*vmdb)->disk_group_guid,
+           (uint64_t) be64toh((*vmdb)->committed_seq),
+           (uint64_t) be64toh((*vmdb)->pending_seq),
+           be32toh((*vmdb)->n_committed_vblks_vol),
+           be32toh((*vmdb)->n_committed_vblks_comp),
+           be32toh((*vmdb)->n_committed_vblks_part),
+           be32toh((*vmdb)->n_committed_vblks_disk),
+           be32toh((*vmdb)->n_pending_vblks_vol),
+           be32toh((*vmdb)->n_pending_vblks_comp),
+           be32toh((*vmdb)->n_pending_vblks_part),
+           be32toh((*vmdb)->n_pending_vblks_disk));
+
+    return 0;
+}
+
+static int
+_read_config(const int fd, const char * const path,
+             const unsigned int secsize,
+             const struct _privhead * const privhead,
+             void ** const config, ldmcore_err_t * const err)
+{
+    /* Sanity check ldm_config_start and ldm_config_size */
+    struct stat stat;
+    if (fstat(fd, &stat) == -1) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Unable to stat %s: %m", path);
+    }
+
+    uint64_t size = stat.st_size;
+    if (S_ISBLK(stat.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                   "Unable to get block device size for %s: %m",
+                                   path);
+        }
+    }
+
+    const uint64_t config_start =
+        be64toh(privhead->ldm_config_start) * secsize;
+    const uint64_t config_size =
+        be64toh(privhead->ldm_config_size) * secsize;
+
+    if (config_start > size) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "LDM config start (%" PRIX64
+                               ") is outside file in %s", config_start, path);
+    }
+    if (config_start + config_size > size) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "LDM config end (%" PRIX64
+                               ") is outside file in %s",
+                               config_start + config_size, path);
+    }
+
+    int r = 0;
+
+    *config = malloc(config_size);
+    if (*config == NULL) abort();
+
+    size_t read = 0;
+    while (read < config_size) {
+        ssize_t in = pread(fd, *config + read, config_size - read,
+                           config_start + read);
+        if (in == 0) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                "%s contains invalid LDM metadata", path);
+            goto error;
+        }
+
+        if (in == -1) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                "Error reading from %s: %m", path);
+            goto error;
+        }
+
+        read += in;
+    }
+
+    return 0;
+
+error:
+    free(*config); *config = NULL;
+    return r;
+}
+
+static int
+_read_privhead_off(const int fd, const char * const path,
+                   const uint64_t ph_start,
+                   struct _privhead * const privhead, ldmcore_err_t * const err)
+{
+    size_t read = 0;
+    while (read < sizeof(*privhead)) {
+        ssize_t in = pread(fd, (char *) privhead + read,
+                           sizeof(*privhead) - read,
+                           ph_start + read);
+        if (in == 0) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "%s contains invalid LDM metadata", path);
+        }
+
+        if (in == -1) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                   "Error reading from %s: %m", path);
+        }
+
+        read += in;
+    }
+
+    if (memcmp(privhead->magic, "PRIVHEAD", 8) != 0) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "PRIVHEAD not found at offset %" PRIX64,
+                               ph_start);
+    }
+
+    _debug("PRIVHEAD: %s\n"
+           "  Version Major: %" PRIu16 "\n"
+           "  Version Minor: %" PRIu16 "\n"
+           "  Disk GUID: %s\n"
+           "  Disk Group GUID: %s\n"
+           "  Logical Disk Start: %" PRIu64 "\n"
+           "  Logical Disk Size: %" PRIu64 "\n"
+           "  LDM Config Start: %" PRIu64 "\n"
+           "  LDM Config Size: %" PRIu64,
+           path,
+           be16toh(privhead->version_major),
+           be16toh(privhead->version_minor),
+           privhead->disk_guid,
+           privhead->disk_group_guid,
+           (uint64_t) be64toh(privhead->logical_disk_start),
+           (uint64_t) be64toh(privhead->logical_disk_size),
+           (uint64_t) be64toh(privhead->ldm_config_start),
+           (uint64_t) be64toh(privhead->ldm_config_size));
+
+    return 0;
+}
+
+static int
+_read_privhead_mbr(const int fd, const char * const path,
+                   const unsigned int secsize,
+                   struct _privhead * const privhead, ldmcore_err_t * const err)
+{
+    _debug("Device %s uses MBR", path);
+
+    /* On an MBR disk, the first PRIVHEAD is in sector 6 */
+    return _read_privhead_off(fd, path, secsize * 6, privhead, err);
+}
+
+static int
+_map_gpt_error(const int e, const char * const path, ldmcore_err_t * const err)
+{
+    switch (-e) {
+    case GPT_ERROR_INVALID:
+        return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                               "%s contains an invalid GPT header", path);
+
+    case GPT_ERROR_READ:
+        return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                               "Error reading from %s: %m", path);
+
+    case GPT_ERROR_INVALID_PART:
+        return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                               "Request for invalid GPT partition");
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                               "Unhandled GPT return value: %i", e);
+    }
+}
+
+static int
+_read_privhead_gpt(const int fd, const char * const path,
+                   const unsigned int secsize,
+                   struct _privhead * const privhead, ldmcore_err_t * const err)
+{
+    _debug("Device %s uses GPT", path);
+
+    int r;
+
+    gpt_handle_t *h;
+    r = gpt_open_secsize(fd, secsize, &h);
+    if (r < 0) return _map_gpt_error(r, path, err);
+
+    gpt_t gpt;
+    gpt_get_header(h, &gpt);
+
+    static const uuid_t LDM_METADATA = { 0xAA,0xC8,0x08,0x58,
+                                         0x8F,0x7E,
+                                         0xE0,0x42,
+                                         0x85,0xD2,
+                                         0xE1,0xE9,0x04,0x34,0xCF,0xB3 };
+
+    for (uint32_t i = 0; i < gpt.pte_array_len; i++) {
+        gpt_pte_t pte;
+        r = gpt_get_pte(h, i, &pte);
+        if (r < 0) {
+            gpt_close(h);
+            return _map_gpt_error(r, path, err);
+        }
+
+        if (uuid_compare(pte.type, LDM_METADATA) == 0) {
+            /* PRIVHEAD is in the last LBA of the LDM metadata partition */
+            gpt_close(h);
+            return _read_privhead_off(fd, path, pte.last_lba * secsize,
+                                      privhead, err);
+        }
+    }
+
+    gpt_close(h);
+    return ldmcore_set_err(err, LDMCORE_ERROR_NOT_LDM,
+                           "%s does not contain LDM metadata", path);
+}
+
+static int
+_read_privhead(const int fd, const char * const path,
+               const unsigned int secsize,
+               struct _privhead * const privhead, ldmcore_err_t * const err)
+{
+    // Whether the disk is MBR or GPT, we expect to find an MBR at the beginning
+    mbr_t mbr;
+    int r = mbr_read(fd, &mbr);
+    if (r < 0) {
+        switch (-r) {
+        case MBR_ERROR_INVALID:
+            return ldmcore_set_err(err, LDMCORE_ERROR_NOT_LDM,
+                                   "Didn't detect a partition table");
+
+        case MBR_ERROR_READ:
+            return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                   "Error reading from %s: %m", path);
+
+        default:
+            return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                                   "Unhandled return value from mbr_read: %i",
+                                   r);
+        }
+    }
+
+    switch (mbr.part[0].type) {
+    case MBR_PART_WINDOWS_LDM:
+        return _read_privhead_mbr(fd, path, secsize, privhead, err);
+
+    case MBR_PART_EFI_PROTECTIVE:
+        return _read_privhead_gpt(fd, path, secsize, privhead, err);
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOT_LDM,
+                               "%s does not contain LDM metadata", path);
+    }
+}
+
+int
+ldmcore_scan(const int fd, const char * const path,
+             const unsigned int secsize, ldmcore_scan_t * const scan,
+             ldmcore_err_t * const err)
+{
+    int r;
+
+    memset(scan, 0, sizeof(*scan));
+
+    struct _privhead privhead;
+    r = _read_privhead(fd, path, secsize, &privhead, err);
+    if (r < 0) return r;
+
+    r = _read_config(fd, path, secsize, &privhead, &scan->config, err);
+    if (r < 0) return r;
+
+    const struct _vmdb *vmdb = NULL;
+    r = _find_vmdb(scan->config, path, secsize, &vmdb, err);
+    if (r < 0) goto error;
+
+    if (uuid_parse(privhead.disk_guid, scan->disk_guid) == -1) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "PRIVHEAD contains invalid GUID for disk: %s",
+                            privhead.disk_guid);
+        goto error;
+    }
+    if (uuid_parse(privhead.disk_group_guid, scan->disk_group_guid) == -1) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "PRIVHEAD contains invalid GUID for disk group: %s",
+                            privhead.disk_group_guid);
+        goto error;
+    }
+
+    scan->logical_disk_start = be64toh(privhead.logical_disk_start);
+    scan->logical_disk_size = be64toh(privhead.logical_disk_size);
+    scan->ldm_config_start = be64toh(privhead.ldm_config_start);
+    scan->ldm_config_size = be64toh(privhead.ldm_config_size);
+    scan->committed_seq = be64toh(vmdb->committed_seq);
+    scan->config_size = scan->ldm_config_size * secsize;
+    scan->vmdb = vmdb;
+
+    return 0;
+
+error:
+    ldmcore_scan_clear(scan);
+    return r;
+}
+
+void
+ldmcore_scan_clear(ldmcore_scan_t * const scan)
+{
+    free(scan->config);
+    memset(scan, 0, sizeof(*scan));
+}
+
+/* VBLK parsing */
+
+typedef enum {
+    _VOLUME_TYPE_GEN = 0x3,
+    _VOLUME_TYPE_RAID5 = 0x4
+} _int_volume_type;
+
+/* Components are only used to derive the structure of volumes */
+
+typedef enum {
+    _COMPONENT_TYPE_STRIPED = 0x1,
+    _COMPONENT_TYPE_SPANNED = 0x2,
+    _COMPONENT_TYPE_RAID    = 0x3
+} _component_type;
+
+struct _comp
+{
+    uint32_t id;
+    uint32_t parent_id;
+
+    _component_type type;
+    uint32_t n_parts;
+    uint32_t n_parts_i;
+    ldmcore_part_t **parts;
+
+    uint64_t chunk_size;
+    uint32_t n_columns;
+};
+
+#define PARSE_VAR_INT(func_name, out_type)                                     \
+static int                                                                     \
+func_name(const uint8_t ** const var, out_type * const out,                    \
+          const char * const field, const char * const type,                   \
+          ldmcore_err_t * const err)                                           \
+{                                                                              \
+    uint8_t i = **var; (*var)++;                                               \
+    if (i > sizeof(*out)) {                                                    \
+        return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,                    \
+                               "Found %hhu byte integer for %s:%s",            \
+                               i, field, type);                                \
+    }                                                                          \
+                                                                               \
+    *out = 0;                                                                  \
+    for(;i > 0; i--) {                                                         \
+        *out <<= 8;                                                            \
+        *out += **var; (*var)++;                                               \
+    }                                                                          \
+                                                                               \
+    return 0;                                                                  \
+}
+
+PARSE_VAR_INT(_parse_var_int32, uint32_t)
+PARSE_VAR_INT(_parse_var_int64, uint64_t)
+
+static char *
+_parse_var_string(const uint8_t ** const var)
+{
+    uint8_t len = **var; (*var)++;
+    char *ret = malloc(len + 1);
+    if (ret == NULL) abort();
+    memcpy(ret, *var, len); (*var) += len;
+    ret[len] = '\0';
+
+    return ret;
+}
+
+static void
+_parse_var_skip(const uint8_t ** const var)
+{
+    uint8_t len = **var; (*var)++;
+    (*var) += len;
+}
+
+static int
+_parse_vblk_vol(const uint8_t revision, const uint16_t flags,
+                const uint8_t * vblk, ldmcore_vol_t * const vol,
+                ldmcore_err_t * const err)
+{
+    int r;
+
+    if (revision != 5) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported volume VBLK revision %hhu",
+                               revision);
+    }
+
+    if ((r = _parse_var_int32(&vblk, &vol->id, "id", "volume", err)) < 0)
+        return r;
+    vol->name = _parse_var_string(&vblk);
+
+    /* Volume type: 'gen' or 'raid5'. We parse this elsewhere */
+    _parse_var_skip(&vblk);
+
+    /* Unknown. N.B. Documentation lists this as a single zero, but I have
+     * observed it to have the variable length string value: '8000000000000000'
+     */
+    _parse_var_skip(&vblk);
+
+    /* Volume state */
+    vblk += 14;
+
+    vol->_int_type = *(uint8_t *)vblk; vblk += 1;
+    switch(vol->_int_type) {
+    case _VOLUME_TYPE_GEN:
+    case _VOLUME_TYPE_RAID5:
+        break;
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported volume VBLK type %u",
+                               vol->_int_type);
+    }
+
+    /* Unknown */
+    vblk += 1;
+
+    /* Volume number */
+    vblk += 1;
+
+    /* Zeroes */
+    vblk += 3;
+
+    /* Flags */
+    vol->flags = *(uint8_t *)vblk; vblk += 1;
+
+    if ((r = _parse_var_int32(&vblk, &vol->_n_comps,
+                         "n_children", "volume", err)) < 0)
+        return r;
+
+    /* Commit id */
+    vblk += 8;
+
+    /* Id? */
+    vblk += 8;
+
+    if ((r = _parse_var_int64(&vblk, &vol->size, "size", "volume", err)) < 0)
+        return r;
+
+    /* Zeroes */
+    vblk += 4;
+
+    vol->part_type = *((uint8_t *)vblk); vblk++;
+
+    /* Volume GUID */
+    memcpy(&vol->guid, vblk, 16); vblk += 16;
+
+    if (flags & 0x08) vol->id1 = _parse_var_string(&vblk);
+    if (flags & 0x20) vol->id2 = _parse_var_string(&vblk);
+    if (flags & 0x80 && (r = _parse_var_int64(&vblk, &vol->size2,
+                                         "size2", "volume", err)) < 0)
+        return r;
+    if (flags & 0x02) vol->hint = _parse_var_string(&vblk);
+
+    _debug("Volume: %s\n"
+           "  ID: %" PRIu32 "\n"
+           "  Type: %" PRIi32 "\n"
+           "  Flags: %" PRIu8 "\n"
+           "  Children: %" PRIu32 "\n"
+           "  Size: %" PRIu64 "\n"
+           "  Partition Type: %" PRIu8 "\n"
+           "  ID1: %s\n"
+           "  ID2: %s\n"
+           "  Size2: %" PRIu64 "\n"
+           "  Hint: %s",
+           vol->name,
+           vol->id,
+           vol->_int_type,
+           vol->flags,
+           vol->_n_comps,
+           vol->size,
+           vol->part_type,
+           vol->id1,
+           vol->id2,
+           vol->size2,
+           vol->hint);
+
+    return 0;
+}
+
+static int
+_parse_vblk_comp(const uint8_t revision, const uint16_t flags,
+                 const uint8_t *vblk, struct _comp * const comp,
+                 ldmcore_err_t * const err)
+{
+    int r;
+
+    if (revision != 3) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported component VBLK revision %hhu",
+                               revision);
+    }
+
+    if ((r = _parse_var_int32(&vblk, &comp->id, "id", "volume", err)) < 0)
+        return r;
+
+    /* Name */
+    _parse_var_skip(&vblk);
+
+    /* Volume state */
+    _parse_var_skip(&vblk);
+
+    comp->type = *((uint8_t *) vblk); vblk++;
+    switch (comp->type) {
+    case _COMPONENT_TYPE_STRIPED:
+    case _COMPONENT_TYPE_SPANNED:
+    case _COMPONENT_TYPE_RAID:
+        break;
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Component VBLK OID=%u has unsupported type %u",
+                               comp->id, comp->type);
+    }
+
+    /* Zeroes */
+    vblk += 4;
+
+    if ((r = _parse_var_int32(&vblk, &comp->n_parts,
+                         "n_parts", "component", err)) < 0)
+        return r;
+
+    /* Log Commit ID */
+    vblk += 8;
+
+    /* Zeroes */
+    vblk += 8;
+
+    if ((r = _parse_var_int32(&vblk, &comp->parent_id,
+                         "parent_id", "component", err)) < 0)
+        return r;
+
+    /* Zeroes */
+    vblk += 1;
+
+    if (flags & 0x10) {
+        if ((r = _parse_var_int64(&vblk, &comp->chunk_size,
+                             "chunk_size", "component", err)) < 0)
+            return r;
+
+        if ((r = _parse_var_int32(&vblk, &comp->n_columns,
+                             "n_columns", "component", err)) < 0)
+            return r;
+    }
+
+    _debug("Component:\n"
+           "  ID: %" PRIu32 "\n"
+           "  Parent ID: %" PRIu32 "\n"
+           "  Type: %" PRIu32 "\n"
+           "  Parts: %" PRIu32 "\n"
+           "  Chunk Size: %" PRIu64 "\n"
+           "  Columns: %" PRIu32,
+           comp->id,
+           comp->parent_id,
+           comp->type,
+           comp->n_parts,
+           comp->chunk_size,
+           comp->n_columns);
+
+    return 0;
+}
+
+static int
+_parse_vblk_part(const uint8_t revision, const uint16_t flags,
+                 const uint8_t *vblk, ldmcore_part_t * const part,
+                 ldmcore_err_t * const err)
+{
+    int r;
+
+    if (revision != 3) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported partition VBLK revision %hhu",
+                               revision);
+    }
+
+    if ((r = _parse_var_int32(&vblk, &part->id, "id", "volume", err)) < 0)
+        return r;
+    part->name = _parse_var_string(&vblk);
+
+    /* Zeroes */
+    vblk += 4;
+
+    /* Log Commit ID */
+    vblk += 8;
+
+    part->start = be64toh(*(uint64_t *)vblk); vblk += 8;
+    part->vol_offset = be64toh(*(uint64_t *)vblk); vblk += 8;
+
+    if ((r = _parse_var_int64(&vblk, &part->size,
+                              "size", "partition", err)) < 0)
+        return r;
+
+    if ((r = _parse_var_int32(&vblk, &part->parent_id,
+                         "parent_id", "partition", err)) < 0)
+        return r;
+
+    if ((r = _parse_var_int32(&vblk, &part->disk_id,
+                         "disk_id", "partition", err)) < 0)
+        return r;
+
+    if (flags & 0x08) {
+        if ((r = _parse_var_int32(&vblk, &part->index,
+                             "index", "partition", err)) < 0)
+            return r;
+    }
+
+    _debug("Partition: %s\n"
+           "  ID: %" PRIu32 "\n"
+           "  Parent ID: %" PRIu32 "\n"
+           "  Disk ID: %" PRIu32 "\n"
+           "  Index: %" PRIu32 "\n"
+           "  Start: %" PRIu64 "\n"
+           "  Vol Offset: %" PRIu64 "\n"
+           "  Size: %" PRIu64,
+           part->name,
+           part->id,
+           part->parent_id,
+           part->disk_id,
+           part->index,
+           part->start,
+           part->vol_offset,
+           part->size);
+
+    return 0;
+}
+
+static int
+_parse_vblk_disk(const uint8_t revision, const uint16_t flags,
+                 const uint8_t *vblk, ldmcore_disk_t * const disk,
+                 ldmcore_err_t * const err)
+{
+    int r;
+
+    if ((r = _parse_var_int32(&vblk, &disk->id, "id", "volume", err)) < 0)
+        return r;
+    disk->name = _parse_var_string(&vblk);
+
+    if (revision == 3) {
+        char *guid = _parse_var_string(&vblk);
+        if (uuid_parse(guid, disk->guid) == -1) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                "Disk %u has invalid guid: %s", disk->id, guid);
+            free(guid);
+            return r;
+        }
+
+        free(guid);
+
+        /* No need to parse rest of structure */
+    }
+
+    else if (revision == 4) {
+        memcpy(&disk->guid, vblk, 16);
+
+        /* No need to parse rest of structure */
+    }
+
+    else {
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported disk VBLK revision %hhu", revision);
+    }
+
+    _debug("Disk: %s\n"
+           "  ID: %u\n"
+           "  GUID: " UUID_FMT,
+           disk->name,
+           disk->id,
+           UUID_VALS(disk->guid));
+
+    return 0;
+}
+
+static int
+_parse_vblk_disk_group(const uint8_t revision, const uint16_t flags,
+                       const uint8_t *vblk, ldmcore_dg_t * const dg,
+                       ldmcore_err_t * const err)
+{
+    int r;
+
+    if (revision != 3 && revision != 4) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unsupported disk VBLK revision %hhu", revision);
+    }
+
+    if ((r = _parse_var_int32(&vblk, &dg->id, "id", "disk group", err)) < 0)
+        return r;
+    dg->name = _parse_var_string(&vblk);
+
+    /* No need to parse rest of structure */
+
+    _debug("Disk Group: %s\n"
+           "  ID: %u",
+           dg->name,
+           dg->id);
+
+    return 0;
+}
+
+struct _spanned_rec {
+    uint32_t record_id;
+    uint16_t entries_total;
+    uint16_t entries_found;
+    int offset;
+    char data[];
+};
+
+static int
+_parse_vblk(const void * data, ldmcore_dg_t * const dg,
+            struct _comp ** const comps, uint32_t * const n_comps,
+            const char * const path, const int offset,
+            ldmcore_err_t * const err)
+{
+    const struct _vblk_rec_head * const rec_head = data;
+
+    const uint8_t type = rec_head->type & 0x0F;
+    const uint8_t revision = (rec_head->type & 0xF0) >> 4;
+
+    data += sizeof(struct _vblk_rec_head);
+
+    switch (type) {
+    case 0x00:
+        /* Blank VBLK */
+        return 0;
+
+    case 0x01:
+    {
+        ldmcore_vol_t * const vol =
+            _append((void **) &dg->vols, &dg->n_vols, sizeof(*vol));
+        vol->dg = dg;
+        return _parse_vblk_vol(revision, rec_head->flags, data, vol, err);
+    }
+
+    case 0x02:
+    {
+        struct _comp * const comp =
+            _append((void **) comps, n_comps, sizeof(*comp));
+        return _parse_vblk_comp(revision, rec_head->flags, data, comp, err);
+    }
+
+    case 0x03:
+    {
+        ldmcore_part_t * const part =
+            _append((void **) &dg->parts, &dg->n_parts, sizeof(*part));
+        part->dg = dg;
+        return _parse_vblk_part(revision, rec_head->flags, data, part, err);
+    }
+
+    case 0x04:
+    {
+        ldmcore_disk_t * const disk =
+            _append((void **) &dg->disks, &dg->n_disks, sizeof(*disk));
+        disk->dg = dg;
+        return _parse_vblk_disk(revision, rec_head->flags, data, disk, err);
+    }
+
+    case 0x05:
+        return _parse_vblk_disk_group(revision, rec_head->flags, data, dg, err);
+
+    default:
+        return ldmcore_set_err(err, LDMCORE_ERROR_NOTSUPPORTED,
+                               "Unknown VBLK type %hhi in %s at config "
+                               "offset %X", type, path, offset);
+    }
+}
+
+static int
+_cmp_component_parts(const void * const a, const void * const b)
+{
+    const ldmcore_part_t * const ap = *(ldmcore_part_t * const *)a;
+    const ldmcore_part_t * const bp = *(ldmcore_part_t * const *)b;
+
+    if (ap->index < bp->index) return -1;
+    if (ap->index > bp->index) return 1;
+    return 0;
+}
+
+/* Resolve the references between objects once all VBLKs have been parsed */
+static int
+_link_vblks(ldmcore_dg_t * const dg, struct _comp * const comps,
+            const uint32_t n_comps, ldmcore_err_t * const err)
+{
+    for (uint32_t i = 0; i < dg->n_parts; i++) {
+        ldmcore_part_t * const part = &dg->parts[i];
+
+        /* Look for the underlying disk for this partition */
+        for (uint32_t j = 0; j < dg->n_disks; j++) {
+            ldmcore_disk_t * const disk = &dg->disks[j];
+
+            if (disk->id == part->disk_id) {
+                part->disk = disk;
+                break;
+            }
+        }
+        if (part->disk == NULL) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Partition %u references unknown disk %u",
+                                   part->id, part->disk_id);
+        }
+
+        /* Look for the parent component */
+        struct _comp *parent = NULL;
+        for (uint32_t j = 0; j < n_comps; j++) {
+            if (comps[j].id == part->parent_id) {
+                parent = &comps[j];
+                break;
+            }
+        }
+        if (parent == NULL) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Didn't find parent component %u for "
+                                   "partition %u", part->parent_id, part->id);
+        }
+
+        ldmcore_part_t ** const slot =
+            _append((void **) &parent->parts, &parent->n_parts_i,
+                    sizeof(*slot));
+        *slot = part;
+    }
+
+    for (uint32_t i = 0; i < n_comps; i++) {
+        struct _comp * const comp = &comps[i];
+
+        if (comp->n_parts_i != comp->n_parts) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Component %u expected %u partitions, but "
+                                   "found %u",
+                                   comp->id, comp->n_parts, comp->n_parts_i);
+        }
+
+        if (comp->n_columns > 0 && comp->n_columns != comp->n_parts_i) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Component %u n_columns %u doesn't match "
+                                   "number of partitions %u",
+                                   comp->id, comp->n_columns, comp->n_parts_i);
+        }
+
+        /* Sort partitions into index order */
+        if (comp->n_parts_i > 0) {
+            qsort(comp->parts, comp->n_parts_i, sizeof(*comp->parts),
+                  _cmp_component_parts);
+        }
+
+        ldmcore_vol_t *vol = NULL;
+        for (uint32_t j = 0; j < dg->n_vols; j++) {
+            if (dg->vols[j].id == comp->parent_id) {
+                vol = &dg->vols[j];
+                break;
+            }
+        }
+        if (vol == NULL) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Didn't find parent volume %u for "
+                                   "component %u", comp->parent_id, comp->id);
+        }
+
+        for (uint32_t j = 0; j < comp->n_parts_i; j++) {
+            ldmcore_part_t ** const slot =
+                _append((void **) &vol->parts, &vol->n_parts, sizeof(*slot));
+            *slot = comp->parts[j];
+        }
+        vol->chunk_size = comp->chunk_size;
+        vol->_n_comps_i++;
+
+        switch (comp->type) {
+        case _COMPONENT_TYPE_SPANNED:
+            if (vol->_int_type != _VOLUME_TYPE_GEN) {
+                return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                       "Unsupported configuration: SPANNED "
+                                       "component has parent volume with "
+                                       "type %u", vol->_int_type);
+            }
+
+            if (vol->_n_comps > 1) {
+                vol->type = LDMCORE_VOLUME_TYPE_MIRRORED;
+            } else if (comp->n_parts > 1) {
+                vol->type = LDMCORE_VOLUME_TYPE_SPANNED;
+            } else {
+                vol->type = LDMCORE_VOLUME_TYPE_SIMPLE;
+            }
+            break;
+
+        case _COMPONENT_TYPE_STRIPED:
+            if (vol->_int_type != _VOLUME_TYPE_GEN) {
+                return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                       "Unsupported configuration: STRIPED "
+                                       "component has parent volume with "
+                                       "type %u", vol->_int_type);
+            }
+
+            if (vol->_n_comps != 1) {
+                return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                       "Unsupported configuration: STRIPED "
+                                       "component has parent volume with %u "
+                                       "child components", vol->_n_comps);
+            }
+
+            vol->type = LDMCORE_VOLUME_TYPE_STRIPED;
+            break;
+
+        case _COMPONENT_TYPE_RAID:
+            if (vol->_int_type != _VOLUME_TYPE_RAID5) {
+                return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                       "Unsupported configuration: RAID "
+                                       "component has parent volume with "
+                                       "type %u", vol->_int_type);
+            }
+
+            if (vol->_n_comps != 1) {
+                return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                       "Unsupported configuration: RAID "
+                                       "component has parent volume with %u "
+                                       "child components", vol->_n_comps);
+            }
+
+            vol->type = LDMCORE_VOLUME_TYPE_RAID5;
+            break;
+
+        default:
+            /* Should be impossible */
+            return ldmcore_set_err(err, LDMCORE_ERROR_INTERNAL,
+                                   "Unexpected component type %u", comp->type);
+        }
+    }
+
+    for (uint32_t i = 0; i < dg->n_vols; i++) {
+        ldmcore_vol_t * const vol = &dg->vols[i];
+
+        if (vol->_n_comps_i != vol->_n_comps) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                   "Volume %u expected %u components, but "
+                                   "only found %u",
+                                   vol->id, vol->_n_comps, vol->_n_comps_i);
+        }
+    }
+
+    return 0;
+}
+
+int
+ldmcore_dg_parse(const ldmcore_scan_t * const scan, const char * const path,
+                 ldmcore_dg_t ** const dg_out, ldmcore_err_t * const err)
+{
+    int r = 0;
+
+    const void * const config = scan->config;
+    const struct _vmdb * const vmdb = scan->vmdb;
+
+    ldmcore_dg_t * const dg = _malloc0(sizeof(*dg));
+    dg->ref = 1;
+    uuid_copy(dg->guid, scan->disk_group_guid);
+    dg->sequence = be64toh(vmdb->committed_seq);
+    dg->config_size = scan->config_size;
+
+    _debug("Found new disk group: " UUID_FMT, UUID_VALS(dg->guid));
+
+    struct _spanned_rec **spanned = NULL;
+    uint32_t n_spanned = 0;
+
+    struct _comp *comps = NULL;
+    uint32_t n_comps = 0;
+
+    const uint32_t n_disks = be32toh(vmdb->n_committed_vblks_disk);
+    const uint32_t n_parts = be32toh(vmdb->n_committed_vblks_part);
+    const uint32_t n_vols = be32toh(vmdb->n_committed_vblks_vol);
+    const uint32_t n_comps_exp = be32toh(vmdb->n_committed_vblks_comp);
+
+    const uint16_t vblk_size = be32toh(vmdb->vblk_size);
+    const uint16_t vblk_data_size = vblk_size - sizeof(struct _vblk_head);
+    const void *vblk = (void *)vmdb + be32toh(vmdb->vblk_first_offset);
+    for(;;) {
+        const int offset = vblk - config;
+
+        const struct _vblk_head * const head = vblk;
+        if (memcmp(head->magic, "VBLK", 4) != 0) break;
+
+        /* Sanity check the header */
+        if (be16toh(head->entries_total) > 0 &&
+            be16toh(head->entry) >= be16toh(head->entries_total))
+        {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                "VBLK entry %u has entry (%hu) > total "
+                                "entries (%hu)",
+                                be32toh(head->seq), be16toh(head->entry),
+                                be16toh(head->entries_total));
+            goto out;
+        }
+
+        vblk += sizeof(struct _vblk_head);
+
+        /* Check for a spanned record */
+        if (be16toh(head->entries_total) > 1) {
+            /* Look for an existing record */
+            struct _spanned_rec *rec = NULL;
+            for (uint32_t i = 0; i < n_spanned; i++) {
+                if (spanned[i]->record_id == head->record_id) {
+                    rec = spanned[i];
+                    rec->entries_found++;
+                    break;
+                }
+            }
+            if (rec == NULL) {
+                rec = _malloc0(offsetof(struct _spanned_rec, data) +
+                               head->entries_total * vblk_data_size);
+                struct _spanned_rec ** const slot =
+                    _append((void **) &spanned, &n_spanned, sizeof(*slot));
+                *slot = rec;
+
+                rec->record_id = head->record_id;
+                rec->entries_total = be16toh(head->entries_total);
+                rec->entries_found = 1;
+                rec->offset = offset;
+            }
+
+            memcpy(&rec->data[be16toh(head->entry) * vblk_data_size],
+                   vblk, vblk_data_size);
+        }
+
+        else {
+            r = _parse_vblk(vblk, dg, &comps, &n_comps, path, offset, err);
+            if (r < 0) goto out;
+        }
+
+        vblk += vblk_data_size;
+    }
+
+    for (uint32_t i = 0; i < n_spanned; i++) {
+        const struct _spanned_rec * const rec = spanned[i];
+
+        if (rec->entries_found != rec->entries_total) {
+            r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                                "Expected to find %hu entries for record %u, "
+                                "but found %hu",
+                                rec->entries_total, rec->record_id,
+                                rec->entries_found);
+            goto out;
+        }
+
+        r = _parse_vblk(rec->data, dg, &comps, &n_comps,
+                        path, rec->offset, err);
+        if (r < 0) goto out;
+    }
+
+    if (dg->n_disks != n_disks) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "Expected %u disk VBLKs, but found %u",
+                            n_disks, dg->n_disks);
+        goto out;
+    }
+    if (n_comps != n_comps_exp) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "Expected %u component VBLKs, but found %u",
+                            n_comps_exp, n_comps);
+        goto out;
+    }
+    if (dg->n_parts != n_parts) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "Expected %u partition VBLKs, but found %u",
+                            n_parts, dg->n_parts);
+        goto out;
+    }
+    if (dg->n_vols != n_vols) {
+        r = ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "Expected %u volume VBLKs, but found %u",
+                            n_vols, dg->n_vols);
+        goto out;
+    }
+
+    r = _link_vblks(dg, comps, n_comps, err);
+
+out:
+    for (uint32_t i = 0; i < n_spanned; i++) free(spanned[i]);
+    free(spanned);
+    for (uint32_t i = 0; i < n_comps; i++) free(comps[i].parts);
+    free(comps);
+
+    if (r < 0) {
+        ldmcore_dg_unref(dg);
+        *dg_out = NULL;
+    } else {
+        *dg_out = dg;
+    }
+
+    return r;
+}
+
+int
+ldmcore_dg_check_scan(const ldmcore_dg_t * const dg,
+                      const ldmcore_scan_t * const scan,
+                      const char * const path, ldmcore_err_t * const err)
+{
+    /* Check this disk is consistent with other disks */
+    if (scan->committed_seq != dg->sequence) {
+        return ldmcore_set_err(err, LDMCORE_ERROR_INCONSISTENT,
+                               "Members of disk group " UUID_FMT
+                               " are inconsistent: disk %s has committed "
+                               "sequence %" PRIu64
+                               ", group has committed sequence %" PRIu64,
+                               UUID_VALS(dg->guid), path, scan->committed_seq,
+                               dg->sequence);
+    }
+
+    return 0;
+}
+
+ldmcore_dg_t *
+ldmcore_dg_ref(ldmcore_dg_t * const dg)
+{
+    __atomic_add_fetch(&dg->ref, 1, __ATOMIC_RELAXED);
+    return dg;
+}
+
+void
+ldmcore_dg_unref(ldmcore_dg_t * const dg)
+{
+    if (__atomic_sub_fetch(&dg->ref, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    for (uint32_t i = 0; i < dg->n_vols; i++) {
+        ldmcore_vol_t * const vol = &dg->vols[i];
+        free(vol->name);
+        free(vol->id1);
+        free(vol->id2);
+        free(vol->hint);
+        free(vol->parts);
+    }
+    for (uint32_t i = 0; i < dg->n_parts; i++) {
+        free(dg->parts[i].name);
+    }
+    for (uint32_t i = 0; i < dg->n_disks; i++) {
+        free(dg->disks[i].name);
+        free(dg->disks[i].device);
+    }
+
+    free(dg->vols);
+    free(dg->parts);
+    free(dg->disks);
+    free(dg->name);
+    free(dg);
+}
+
+static uint64_t
+_strsize(const char * const s)
+{
+    return s ? strlen(s) + 1 : 0;
+}
+
+void
+ldmcore_dg_memory_usage(const ldmcore_dg_t * const dg,
+                        ldmcore_mem_t * const mem)
+{
+    memset(mem, 0, sizeof(*mem));
+
+    mem->config = dg->config_size;
+    mem->structs = sizeof(*dg) +
+                   dg->n_disks * sizeof(*dg->disks) +
+                   dg->n_parts * sizeof(*dg->parts) +
+                   dg->n_vols * sizeof(*dg->vols);
+    mem->names = _strsize(dg->name);
+
+    for (uint32_t i = 0; i < dg->n_vols; i++) {
+        const ldmcore_vol_t * const vol = &dg->vols[i];
+        mem->names += _strsize(vol->name) + _strsize(vol->id1) +
+                      _strsize(vol->id2) + _strsize(vol->hint);
+        mem->arrays += vol->n_parts * sizeof(*vol->parts);
+    }
+    for (uint32_t i = 0; i < dg->n_parts; i++) {
+        mem->names += _strsize(dg->parts[i].name);
+    }
+    for (uint32_t i = 0; i < dg->n_disks; i++) {
+        mem->names += _strsize(dg->disks[i].name) +
+                      _strsize(ldmcore_disk_get_device(&dg->disks[i]));
+    }
+}
+
+ldmcore_disk_t *
+ldmcore_dg_find_disk(ldmcore_dg_t * const dg, const uuid_t guid)
+{
+    for (uint32_t i = 0; i < dg->n_disks; i++) {
+        if (uuid_compare(guid, dg->disks[i].guid) == 0) return &dg->disks[i];
+    }
+
+    return NULL;
+}
+
+/* device is set last, as readers use it to determine whether the disk is
+ * present */
+char *
+ldmcore_disk_attach(ldmcore_disk_t * const disk,
+                    const ldmcore_scan_t * const scan,
+                    const char * const device)
+{
+    disk->data_start = scan->logical_disk_start;
+    disk->data_size = scan->logical_disk_size;
+    disk->metadata_start = scan->ldm_config_start;
+    disk->metadata_size = scan->ldm_config_size;
+
+    return __atomic_exchange_n(&disk->device, _strdup(device),
+                               __ATOMIC_ACQ_REL);
+}
+
+char *
+ldmcore_disk_detach(ldmcore_disk_t * const disk)
+{
+    return __atomic_exchange_n(&disk->device, NULL, __ATOMIC_ACQ_REL);
+}
+
+const char *
+ldmcore_disk_get_device(const ldmcore_disk_t * const disk)
+{
+    return __atomic_load_n(&disk->device, __ATOMIC_ACQUIRE);
+}
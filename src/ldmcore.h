@@ -0,0 +1,450 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The LDM core parses LDM metadata into a plain C model, and generates device
+ * mapper tables for it. It has no dependency on GLib, so that it can be used by
+ * the activator in an initramfs. The GObject API in ldm.h is a thin layer over
+ * it. */
+
+#ifndef LIBLDM_LDMCORE_H__
+#define LIBLDM_LDMCORE_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <uuid/uuid.h>
+
+/* Error codes correspond to LDMError. Functions which can fail return 0 on
+ * success, or a negated error code on failure, in which case err contains the
+ * error code and a message. */
+typedef enum {
+    LDMCORE_ERROR_OK,
+    LDMCORE_ERROR_INTERNAL,
+    LDMCORE_ERROR_IO,
+    LDMCORE_ERROR_NOT_LDM,
+    LDMCORE_ERROR_INVALID,
+    LDMCORE_ERROR_INCONSISTENT,
+    LDMCORE_ERROR_NOTSUPPORTED,
+    LDMCORE_ERROR_MISSING_DISK
+} ldmcore_error_t;
+
+typedef struct {
+    ldmcore_error_t code;
+    char msg[256];
+} ldmcore_err_t;
+
+/* Fill in err, if it isn't NULL, and return the negated code. For use within
+ * libldmcore. */
+int ldmcore_set_err(ldmcore_err_t *err, ldmcore_error_t code,
+                    const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* Set a function to receive debug messages. By default they are discarded. */
+typedef void (*ldmcore_log_fn_t)(const char *fmt, va_list ap);
+void ldmcore_set_log_fn(ldmcore_log_fn_t fn);
+
+/* Volume types correspond to LDMVolumeType */
+typedef enum {
+    LDMCORE_VOLUME_TYPE_SIMPLE,
+    LDMCORE_VOLUME_TYPE_SPANNED,
+    LDMCORE_VOLUME_TYPE_STRIPED,
+    LDMCORE_VOLUME_TYPE_MIRRORED,
+    LDMCORE_VOLUME_TYPE_RAID5
+} ldmcore_volume_type_t;
+
+typedef struct _ldmcore_dg ldmcore_dg_t;
+
+typedef struct {
+    ldmcore_dg_t *dg;
+
+    uint32_t id;
+    char *name;
+    uuid_t guid;
+
+    /* Only set once the disk's device has been found */
+    uint64_t data_start;
+    uint64_t data_size;
+    uint64_t metadata_start;
+    uint64_t metadata_size;
+
+    /* NULL until the device is found. Use ldmcore_disk_get_device(), as it
+     * may be updated concurrently. */
+    char *device;
+} ldmcore_disk_t;
+
+typedef struct {
+    ldmcore_dg_t *dg;
+
+    uint32_t id;
+    uint32_t parent_id;
+    char *name;
+
+    uint64_t start;
+    uint64_t vol_offset;
+    uint64_t size;
+    uint32_t index;
+
+    uint32_t disk_id;
+    ldmcore_disk_t *disk;
+} ldmcore_part_t;
+
+typedef struct {
+    ldmcore_dg_t *dg;
+
+    uint32_t id;
+    char *name;
+    uuid_t guid;
+
+    uint64_t size;
+    uint8_t part_type;
+
+    uint8_t flags;      /* Unclear what it means */
+    char *id1;          /* Unclear what it means */
+    char *id2;          /* Unclear what it means */
+    uint64_t size2;     /* Unclear what it means */
+    char *hint;
+
+    /* Derived */
+    ldmcore_volume_type_t type;
+    uint32_t n_parts;
+    ldmcore_part_t **parts;
+    uint64_t chunk_size;
+
+    /* Only used during parsing */
+    uint8_t _int_type;
+    uint32_t _n_comps;
+    uint32_t _n_comps_i;
+} ldmcore_vol_t;
+
+struct _ldmcore_dg {
+    int ref;
+
+    uuid_t guid;
+    uint32_t id;
+    char *name;
+
+    uint64_t sequence;
+    uint64_t config_size;
+
+    uint32_t n_disks;
+    ldmcore_disk_t *disks;
+    uint32_t n_parts;
+    ldmcore_part_t *parts;
+    uint32_t n_vols;
+    ldmcore_vol_t *vols;
+};
+
+/* The result of reading LDM metadata from a single device */
+typedef struct {
+    uuid_t disk_guid;
+    uuid_t disk_group_guid;
+
+    uint64_t logical_disk_start;
+    uint64_t logical_disk_size;
+    uint64_t ldm_config_start;
+    uint64_t ldm_config_size;
+
+    uint64_t committed_seq;
+
+    void *config;
+    uint64_t config_size;
+    const void *vmdb;
+} ldmcore_scan_t;
+
+int ldmcore_scan(int fd, const char *path, unsigned int secsize,
+                 ldmcore_scan_t *scan, ldmcore_err_t *err);
+void ldmcore_scan_clear(ldmcore_scan_t *scan);
+
+int ldmcore_dg_parse(const ldmcore_scan_t *scan, const char *path,
+                     ldmcore_dg_t **dg, ldmcore_err_t *err);
+int ldmcore_dg_check_scan(const ldmcore_dg_t *dg, const ldmcore_scan_t *scan,
+                          const char *path, ldmcore_err_t *err);
+ldmcore_dg_t *ldmcore_dg_ref(ldmcore_dg_t *dg);
+void ldmcore_dg_unref(ldmcore_dg_t *dg);
+
+/* Bytes allocated for a disk group, excluding allocator overhead. config is the
+ * size of the metadata buffer read while scanning each of its devices, which is
+ * freed once the scan completes. */
+typedef struct {
+    uint64_t config;
+    uint64_t structs;
+    uint64_t names;
+    uint64_t arrays;
+} ldmcore_mem_t;
+
+void ldmcore_dg_memory_usage(const ldmcore_dg_t *dg, ldmcore_mem_t *mem);
+
+ldmcore_disk_t *ldmcore_dg_find_disk(ldmcore_dg_t *dg, const uuid_t guid);
+
+/* Attach and detach return the previous device, which the caller must free.
+ * If the disk may be accessed concurrently, the caller must not free it until
+ * no other thread can be accessing it. */
+char *ldmcore_disk_attach(ldmcore_disk_t *disk, const ldmcore_scan_t *scan,
+                          const char *device);
+char *ldmcore_disk_detach(ldmcore_disk_t *disk);
+const char *ldmcore_disk_get_device(const ldmcore_disk_t *disk);
+
+/* Extent maps */
+
+typedef enum {
+    LDMCORE_EXTENT_DATA,
+    LDMCORE_EXTENT_PARITY,
+    LDMCORE_EXTENT_MIRROR
+} ldmcore_extent_role_t;
+
+/* A range of a partition of a volume. offset is absolute on the partition's
+ * disk, and is only valid while the disk is present. A parity extent covers the
+ * parity of the data extents in the same row which precede it, and has the
+ * vol_offset of the first of them. All values are in sectors. */
+typedef struct {
+    uint32_t part;      /* Index in vol->parts */
+    ldmcore_extent_role_t role;
+    uint64_t vol_offset;
+    uint64_t offset;
+    uint64_t length;
+} ldmcore_extent_t;
+
+/* Returns, in extents, a malloced array of every extent which holds data or
+ * redundancy for the given range of the volume, in volume order. Mirrored
+ * volumes return an extent for each leg. */
+int ldmcore_vol_map_range(const ldmcore_vol_t *vol,
+                          uint64_t offset, uint64_t length,
+                          ldmcore_extent_t **extents, uint32_t *n_extents,
+                          ldmcore_err_t *err);
+
+/* Volume readers translate reads of a volume to its member disks in userspace.
+ * Reads of a mirrored volume are balanced between its legs, and fail over to
+ * another leg on error. A missing column of a RAID5 volume is reconstructed
+ * from parity. Small sequential reads are served from a buffer read ahead in
+ * whole stripes, which grows with each refill. Opening fails with
+ * LDMCORE_ERROR_MISSING_DISK if the volume cannot be read. A reader holds a
+ * reference to the volume's disk group. */
+
+typedef struct _ldmcore_reader ldmcore_reader_t;
+
+int ldmcore_reader_open(const ldmcore_vol_t *vol, ldmcore_reader_t **reader,
+                        ldmcore_err_t *err);
+
+/* offset and the return value are in bytes. Returns the number of bytes read,
+ * which is less than count only at the end of the volume, or a negated error
+ * code. */
+ssize_t ldmcore_reader_pread(ldmcore_reader_t *reader, void *buf, size_t count,
+                             uint64_t offset, ldmcore_err_t *err);
+
+void ldmcore_reader_close(ldmcore_reader_t *reader);
+
+/* Block caches hold blocks of LDMCORE_CACHE_BLOCK bytes read from disks, keyed
+ * by the disk and the index of the block on it. They may be used by several
+ * threads at once. */
+
+#define LDMCORE_CACHE_BLOCK (64 * 1024)
+
+typedef struct _ldmcore_cache ldmcore_cache_t;
+
+typedef struct {
+    uint64_t size;      /* Bytes */
+    uint64_t used;      /* Bytes */
+    uint64_t hits;      /* Blocks */
+    uint64_t misses;    /* Blocks */
+    uint64_t evictions; /* Blocks */
+} ldmcore_cache_stats_t;
+
+/* size is in bytes, and is rounded down to a whole number of blocks. A cache
+ * holds at least one block. */
+ldmcore_cache_t *ldmcore_cache_new(uint64_t size);
+void ldmcore_cache_free(ldmcore_cache_t *cache);
+
+/* Copy count bytes at offset within a block to dst if the block is cached.
+ * Returns non-zero if it was. */
+int ldmcore_cache_lookup(ldmcore_cache_t *cache, const void *disk,
+                         uint64_t block, size_t offset, size_t count,
+                         void *dst);
+
+/* Add a block, whose contents are in data */
+void ldmcore_cache_insert(ldmcore_cache_t *cache, const void *disk,
+                          uint64_t block, const void *data);
+
+void ldmcore_cache_get_stats(ldmcore_cache_t *cache,
+                             ldmcore_cache_stats_t *stats);
+
+/* Give a reader a cache of size bytes for small reads, rounded as
+ * ldmcore_cache_new(). A size of 0 removes its cache. Must not be called while
+ * another thread is using the reader. */
+void ldmcore_reader_set_cache(ldmcore_reader_t *reader, uint64_t size);
+
+typedef struct {
+    ldmcore_cache_stats_t cache;    /* Zero if the reader has no cache */
+    uint64_t failovers;             /* Reads of a mirrored volume which failed
+                                       on one leg and were read from another */
+    uint64_t readahead_hits;        /* Reads copied entirely from data read
+                                       ahead */
+} ldmcore_reader_stats_t;
+
+void ldmcore_reader_get_stats(ldmcore_reader_t *reader,
+                              ldmcore_reader_stats_t *stats);
+
+/* XOR count bytes of src into dst, with the widest vector instructions the CPU
+ * supports */
+void ldmcore_xor(void *dst, const void *src, size_t count);
+
+/* Device mapper tables */
+
+typedef struct {
+    uint64_t start;
+    uint64_t size;
+    const char *type;
+    char *params;
+} ldmcore_dm_target_t;
+
+typedef struct {
+    char *name;
+    char *uuid;
+
+    uint32_t n_targets;
+    ldmcore_dm_target_t *targets;
+
+    int read_only;      /* The device should be created read-only */
+} ldmcore_dm_table_t;
+
+/* Optional parameters of the dm-raid target used for mirrored and RAID5
+ * volumes. A zeroed structure gives the kernel's defaults. */
+typedef struct {
+    uint32_t region_size;       /* Sectors, a power of 2. 0 for the default. */
+    int nosync;                 /* Don't synchronise legs on creation */
+    uint32_t min_recovery_rate; /* KiB/s per leg. 0 for the default. */
+    uint32_t max_recovery_rate; /* KiB/s per leg. 0 for the default. */
+    uint32_t daemon_sleep;      /* Bitmap flush interval in ms. 0 for the
+                                   default. */
+    uint64_t write_mostly;      /* Bit n set marks leg n as write mostly.
+                                   Mirrored volumes only. */
+} ldmcore_dm_raid_opts_t;
+
+char *ldmcore_dm_part_name(const ldmcore_part_t *part);
+char *ldmcore_dm_part_uuid(const ldmcore_part_t *part);
+char *ldmcore_dm_vol_name(const ldmcore_vol_t *vol);
+char *ldmcore_dm_vol_uuid(const ldmcore_vol_t *vol, const uuid_t uuid_override);
+
+/* Returns non-zero if the volume is built on device mapper devices for each of
+ * its partitions, which must be passed to ldmcore_dm_vol_table() as legs */
+int ldmcore_dm_vol_has_legs(const ldmcore_vol_t *vol);
+
+int ldmcore_dm_part_table(const ldmcore_part_t *part,
+                          ldmcore_dm_table_t *table, ldmcore_err_t *err);
+
+/* legs contains one entry for each partition of the volume. An entry is the
+ * path of the partition's device mapper device, or NULL if it is missing. metas
+ * may be NULL, or contain the path of a dm-raid metadata device for each leg,
+ * or NULL for a leg without one. legs, metas and raid_opts are ignored for
+ * volume types which don't use them. uuid_override and raid_opts may be
+ * NULL. */
+int ldmcore_dm_vol_table(const ldmcore_vol_t *vol, const uuid_t uuid_override,
+                         const char * const *legs, const char * const *metas,
+                         const ldmcore_dm_raid_opts_t *raid_opts,
+                         ldmcore_dm_table_t *table, ldmcore_err_t *err);
+
+/* Generate a table for a mirrored volume which maps it directly to the first
+ * leg whose disk is present, without its partition devices or a raid target.
+ * Writes would not reach the other legs, so the table is marked read-only. */
+int ldmcore_dm_vol_leg_table(const ldmcore_vol_t *vol,
+                             const uuid_t uuid_override,
+                             ldmcore_dm_table_t *table, ldmcore_err_t *err);
+
+/* Caches stacked on volumes. The volume's own device is renamed with
+ * LDMCORE_DM_CACHE_ORIGIN, and a cache device takes its name and UUID. dm-cache
+ * also needs the cache device split into a metadata and a data device. */
+
+#define LDMCORE_DM_CACHE_ORIGIN "-corig"
+#define LDMCORE_DM_CACHE_META   "-cmeta"
+#define LDMCORE_DM_CACHE_DATA   "-cdata"
+
+typedef enum {
+    LDMCORE_DM_CACHE_NONE,
+    LDMCORE_DM_CACHE_WRITECACHE,    /* dm-writecache */
+    LDMCORE_DM_CACHE_WRITETHROUGH,  /* dm-cache in writethrough mode */
+    LDMCORE_DM_CACHE_WRITEBACK      /* dm-cache in writeback mode */
+} ldmcore_dm_cache_mode_t;
+
+typedef struct {
+    ldmcore_dm_cache_mode_t mode;
+    const char *device;         /* Path of the cache device */
+    uint64_t device_size;       /* Size of the cache device in sectors */
+} ldmcore_dm_cache_t;
+
+/* Append suffix to the name and UUID of a table */
+void ldmcore_dm_table_add_suffix(ldmcore_dm_table_t *table, const char *suffix);
+
+/* Generate the tables of the metadata and data devices which dm-cache uses on
+ * the cache device. Must not be called for dm-writecache. */
+int ldmcore_dm_cache_pool_tables(const ldmcore_vol_t *vol,
+                                 const uuid_t uuid_override,
+                                 const ldmcore_dm_cache_t *cache,
+                                 ldmcore_dm_table_t *meta,
+                                 ldmcore_dm_table_t *data,
+                                 ldmcore_err_t *err);
+
+/* Generate the table of a cache stacked on the volume's origin device. meta and
+ * data are the devices from ldmcore_dm_cache_pool_tables() for dm-cache, and
+ * are ignored for dm-writecache. Devices may be given as paths or as
+ * major:minor. */
+int ldmcore_dm_cache_table(const ldmcore_vol_t *vol,
+                           const uuid_t uuid_override,
+                           const ldmcore_dm_cache_t *cache, const char *origin,
+                           const char *meta, const char *data,
+                           ldmcore_dm_table_t *table, ldmcore_err_t *err);
+
+/* Snapshots stacked on volumes. The volume's own device is created read-only
+ * and renamed with LDMCORE_DM_SNAPSHOT_ORIGIN, and a writable snapshot device
+ * takes its name and UUID. Writes go only to the snapshot's COW store. */
+
+#define LDMCORE_DM_SNAPSHOT_ORIGIN "-sorig"
+
+/* Generate the table of a snapshot of the volume's origin device, with its COW
+ * store on cow. A persistent COW store keeps its changes across activations.
+ * Devices may be given as paths or as major:minor. */
+int ldmcore_dm_snapshot_table(const ldmcore_vol_t *vol,
+                              const uuid_t uuid_override, const char *origin,
+                              const char *cow, int persistent,
+                              ldmcore_dm_table_t *table, ldmcore_err_t *err);
+
+/* dm-raid metadata devices. A metadata device holds the superblock and
+ * write-intent bitmap of one leg of a mirrored or RAID5 volume, so that after
+ * an unclean shutdown only dirty regions are resynchronised. It is backed by a
+ * sparse file named after the volume GUID and leg index in dir, attached to a
+ * loop device which is detached automatically once it is no longer open.
+ *
+ * On success, device contains the malloced path of the loop device, and fd an
+ * open descriptor for it. The caller must keep fd open until the device mapper
+ * device using it has been created, and then close it. */
+int ldmcore_dm_meta_attach(const char *dir, const ldmcore_vol_t *vol,
+                           uint32_t leg, char **device, int *fd,
+                           ldmcore_err_t *err);
+
+/* Snapshot COW stores. If path is a block device, device contains a malloced
+ * copy of it and fd is -1. If path is a regular file, it is attached to a loop
+ * device as for ldmcore_dm_meta_attach(). */
+int ldmcore_dm_cow_attach(const char *path, char **device, int *fd,
+                          ldmcore_err_t *err);
+
+void ldmcore_dm_table_clear(ldmcore_dm_table_t *table);
+
+/* Set libdevmapper's udev synchronisation for the process, and return the udev
+ * flags to pass with every device which is created. Without sync, device nodes
+ * are created directly, and udev is told to ignore the devices until they are
+ * triggered. */
+uint16_t ldmcore_dm_udev_flags(int sync);
+
+#endif /* LIBLDM_LDMCORE_H__ */
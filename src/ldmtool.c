@@ -54,7 +54,23 @@
     "  remove all\n" \
     "  remove volume <disk group guid> <name>"
 
-#define USAGE_ALL USAGE_SCAN "\n" USAGE_SHOW "\n" USAGE_CREATE "\n" USAGE_REMOVE
+#define USAGE_RELOAD \
+    "  reload all\n" \
+    "  reload volume <disk group guid> <name>"
+
+#define USAGE_TABLES \
+    "  tables all\n" \
+    "  tables volume <disk group guid> <name>"
+
+#define USAGE_STATS \
+    "  stats"
+
+#define USAGE_TRIGGER \
+    "  trigger"
+
+#define USAGE_ALL USAGE_SCAN "\n" USAGE_SHOW "\n" USAGE_CREATE "\n" \
+                  USAGE_REMOVE "\n" USAGE_RELOAD "\n" USAGE_TABLES "\n" \
+                  USAGE_STATS "\n" USAGE_TRIGGER
 
 gboolean
 usage_show(void)
@@ -75,11 +91,91 @@ gboolean usage_remove(void)
     return FALSE;
 }
 
+gboolean usage_reload(void)
+{
+    g_warning(USAGE_RELOAD);
+    return FALSE;
+}
+
+gboolean usage_tables(void)
+{
+    g_warning(USAGE_TABLES);
+    return FALSE;
+}
+
+gboolean usage_stats(void)
+{
+    g_warning(USAGE_STATS);
+    return FALSE;
+}
+
+gboolean usage_trigger(void)
+{
+    g_warning(USAGE_TRIGGER);
+    return FALSE;
+}
+
 typedef struct {
     /* User specified UUID for device mapper */
     uuid_t uuid_override;
+
+    /* Maximum number of volumes to create concurrently */
+    gint jobs;
+
+    /* Milliseconds to wait for missing disks when creating volumes */
+    guint wait;
+
+    /* Directory for persistent dm-raid metadata, or NULL */
+    const gchar *metadata_dir;
+
+    /* dm-raid parameters for mirrored and RAID5 volumes */
+    LDMDMRaidOptions raid_opts;
+
+    /* Create devices read-only */
+    gboolean read_only;
+
+    /* Cache to stack on a single volume, or NULL */
+    LDMDMCacheMode cache_mode;
+    const gchar *cache_device;
+
+    /* COW store of a snapshot to stack on a single volume, or NULL */
+    const gchar *snapshot_cow;
+    gboolean snapshot_persistent;
+
+    /* Output tables for dmsetup create --concise instead of JSON */
+    gboolean dmsetup;
 } _options_t;
 
+/* Apply device mapper options which apply to every volume */
+static void
+_set_volume_options(LDMVolume * const vol, const _options_t * const opts)
+{
+    ldm_volume_dm_set_metadata_dir(vol, opts->metadata_dir);
+    ldm_volume_dm_set_raid_options(vol, &opts->raid_opts);
+    ldm_volume_dm_set_read_only(vol, opts->read_only);
+    ldm_volume_dm_set_cache(vol, opts->cache_mode, opts->cache_device);
+    ldm_volume_dm_set_snapshot(vol, opts->snapshot_cow,
+                               opts->snapshot_persistent);
+}
+
+/* Options which only make sense for a single volume can't be used when
+ * operating on several. context completes the warning, e.g. "in shell mode". */
+static gboolean
+_check_single_volume_options(const _options_t * const opts,
+                             const gchar * const context)
+{
+    if (!uuid_is_null(opts->uuid_override)) {
+        g_warning("UUID override cannot be used %s", context);
+        return FALSE;
+    }
+    if (opts->cache_device || opts->snapshot_cow) {
+        g_warning("A cache or snapshot cannot be used %s", context);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 typedef gboolean (*_action_t) (LDM *ldm, const _options_t * const opts,
                                gint argc, gchar **argv, JsonBuilder *jb);
 
@@ -91,6 +187,14 @@ gboolean ldm_create(LDM *ldm, const _options_t * const opts, gint argc,
                     gchar **argv, JsonBuilder *jb);
 gboolean ldm_remove(LDM *ldm, const _options_t * const opts, gint argc,
                     gchar **argv, JsonBuilder *jb);
+gboolean ldm_reload(LDM *ldm, const _options_t * const opts, gint argc,
+                    gchar **argv, JsonBuilder *jb);
+gboolean ldm_tables(LDM *ldm, const _options_t * const opts, gint argc,
+                    gchar **argv, JsonBuilder *jb);
+gboolean ldm_stats(LDM *ldm, const _options_t * const opts, gint argc,
+                   gchar **argv, JsonBuilder *jb);
+gboolean ldm_trigger(LDM *ldm, const _options_t * const opts, gint argc,
+                     gchar **argv, JsonBuilder *jb);
 
 typedef struct {
     const char * name;
@@ -102,6 +206,10 @@ static const _command_t commands[] = {
     { "show", ldm_show },
     { "create", ldm_create },
     { "remove", ldm_remove },
+    { "reload", ldm_reload },
+    { "tables", ldm_tables },
+    { "stats", ldm_stats },
+    { "trigger", ldm_trigger },
     { NULL }
 };
 
@@ -115,14 +223,19 @@ do_command(LDM * const ldm, const _options_t * const opts,
     while (i->name) {
         if (g_strcmp0(i->name, argv[0]) == 0) {
             if ((i->action)(ldm, opts, argc - 1, argv + 1, jb)) {
-                GError *err = NULL;
-                json_generator_set_root(jg, json_builder_get_root(jb));
-                if (!json_generator_to_stream(jg, out, NULL, &err)) {
-                    g_warning("Error writing JSON output: %s",
-                              err ? err->message : "(no detail)");
-                    if (err) { g_error_free(err); err = NULL; }
+                /* A command which doesn't build any JSON has written its
+                 * own output */
+                JsonNode * const root = json_builder_get_root(jb);
+                if (root) {
+                    GError *err = NULL;
+                    json_generator_set_root(jg, root);
+                    if (!json_generator_to_stream(jg, out, NULL, &err)) {
+                        g_warning("Error writing JSON output: %s",
+                                  err ? err->message : "(no detail)");
+                        if (err) { g_error_free(err); err = NULL; }
+                    }
+                    printf("\n");
                 }
-                printf("\n");
 
                 if (result) *result = TRUE;
             } else {
@@ -240,6 +353,35 @@ find_diskgroup(LDM * const ldm, const gchar * const guid)
     return dg;
 }
 
+LDMVolume *
+find_volume(LDM * const ldm, const gchar * const dg_guid,
+            const gchar * const name)
+{
+    LDMDiskGroup * const dg = find_diskgroup(ldm, dg_guid);
+    if (!dg) return NULL;
+
+    LDMVolume *vol = NULL;
+
+    GArray * const volumes = ldm_disk_group_get_volumes(dg);
+    for (guint i = 0; i < volumes->len; i++) {
+        LDMVolume * const vol_i = g_array_index(volumes, LDMVolume *, i);
+
+        gchar *name_i = ldm_volume_get_name(vol_i);
+        if (g_strcmp0(name_i, name) == 0) vol = g_object_ref(vol_i);
+        g_free(name_i);
+
+        if (vol) break;
+    }
+    g_array_unref(volumes);
+    g_object_unref(dg);
+
+    if (!vol) {
+        g_warning("Disk group %s doesn't contain volume %s", dg_guid, name);
+    }
+
+    return vol;
+}
+
 gboolean
 show_diskgroup(LDM * const ldm, const gint argc, gchar ** const argv,
                 JsonBuilder * const jb)
@@ -274,6 +416,32 @@ show_diskgroup(LDM * const ldm, const gint argc, gchar ** const argv,
     return TRUE;
 }
 
+/* Get the state of all device mapper devices, warning on error */
+static GHashTable *
+get_dm_status(LDM *const ldm)
+{
+    GError *err = NULL;
+    GHashTable * const r = ldm_dm_get_status_map(ldm, &err);
+    if (!r) {
+        g_warning("Unable to get device mapper status: %s", err->message);
+        g_error_free(err);
+    }
+    return r;
+}
+
+static void
+show_dm_status(JsonBuilder * const jb, const LDMDMStatus * const status)
+{
+    if (status == NULL) return;
+
+    json_builder_set_member_name(jb, "device");
+    json_builder_add_string_value(jb, status->device);
+    json_builder_set_member_name(jb, "open-count");
+    json_builder_add_int_value(jb, status->open_count);
+    json_builder_set_member_name(jb, "suspended");
+    json_builder_add_boolean_value(jb, status->suspended);
+}
+
 gboolean
 show_volume(LDM *const ldm, const gint argc, gchar ** const argv,
              JsonBuilder * const jb)
@@ -299,13 +467,7 @@ show_volume(LDM *const ldm, const gint argc, gchar ** const argv,
             guint64 chunk_size = ldm_volume_get_chunk_size(vol);
             gchar *hint = ldm_volume_get_hint(vol);
 
-            GError *err = NULL;
-            gchar *device = ldm_volume_dm_get_device(vol, &err);
-            if (err) {
-                g_warning("Unable to get device for volume %s with GUID %s: %s",
-                          name, guid, err->message);
-                g_error_free(err);
-            }
+            GHashTable * const dm_status = get_dm_status(ldm);
 
             json_builder_begin_object(jb);
 
@@ -326,9 +488,9 @@ show_volume(LDM *const ldm, const gint argc, gchar ** const argv,
                 json_builder_set_member_name(jb, "hint");
                 json_builder_add_string_value(jb, hint);
             }
-            if (device != NULL) {
-                json_builder_set_member_name(jb, "device");
-                json_builder_add_string_value(jb, device);
+            if (dm_status) {
+                show_dm_status(jb, ldm_volume_dm_get_status(vol, dm_status));
+                g_hash_table_unref(dm_status);
             }
 
             json_builder_set_member_name(jb, "partitions");
@@ -349,7 +511,6 @@ show_volume(LDM *const ldm, const gint argc, gchar ** const argv,
 
             g_free(guid);
             g_free(hint);
-            g_free(device);
         }
 
         g_free(name);
@@ -387,13 +548,7 @@ show_partition(LDM *const ldm, const gint argc, gchar ** const argv,
             gchar *diskname = ldm_disk_get_name(disk);
             g_object_unref(disk);
 
-            GError *err = NULL;
-            gchar *device = ldm_partition_dm_get_device(part, &err);
-            if (err) {
-                g_warning("Unable to get device for partition %s on disk %s: %s",
-                          name, diskname, err->message);
-                g_error_free(err);
-            }
+            GHashTable * const dm_status = get_dm_status(ldm);
 
             json_builder_begin_object(jb);
 
@@ -405,15 +560,15 @@ show_partition(LDM *const ldm, const gint argc, gchar ** const argv,
             json_builder_add_int_value(jb, size);
             json_builder_set_member_name(jb, "disk");
             json_builder_add_string_value(jb, diskname);
-            if (device != NULL) {
-                json_builder_set_member_name(jb, "device");
-                json_builder_add_string_value(jb, device);
+            if (dm_status) {
+                show_dm_status(jb, ldm_partition_dm_get_status(part,
+                                                               dm_status));
+                g_hash_table_unref(dm_status);
             }
 
             json_builder_end_object(jb);
 
             g_free(diskname);
-            g_free(device);
         }
 
         g_free(name);
@@ -520,8 +675,7 @@ _ldm_vol_action(LDM *const ldm, const _options_t * const opts, const gint argc,
     if (argc == 1) {
         if (g_strcmp0(argv[0], "all") != 0) return (*usage)();
 
-        if (!uuid_is_null(opts->uuid_override)) {
-            g_warning("UUID override cannot be used for multiple volumes");
+        if (!_check_single_volume_options(opts, "for multiple volumes")) {
             return FALSE;
         }
 
@@ -532,6 +686,7 @@ _ldm_vol_action(LDM *const ldm, const _options_t * const opts, const gint argc,
             GArray *volumes = ldm_disk_group_get_volumes(dg);
             for (guint j = 0; j < volumes->len; j++) {
                 LDMVolume * const vol = g_array_index(volumes, LDMVolume *, j);
+                _set_volume_options(vol, opts);
 
                 GError *err = NULL;
                 GString *device = NULL;
@@ -560,36 +715,19 @@ _ldm_vol_action(LDM *const ldm, const _options_t * const opts, const gint argc,
     else if (argc == 3) {
         if (g_strcmp0(argv[0], "volume") != 0) return (*usage)();
 
-        LDMDiskGroup * const dg = find_diskgroup(ldm, argv[1]);
-        if (!dg) return FALSE;
-
-        GArray * const volumes = ldm_disk_group_get_volumes(dg);
-        LDMVolume *vol = NULL;
-        for (guint i = 0; i < volumes->len; i++) {
-            LDMVolume * const o = g_array_index(volumes, LDMVolume *, i);
-
-            gchar *name = ldm_volume_get_name(o);
-            if (g_strcmp0(name, argv[2]) == 0) vol = o;
-            g_free(name);
-
-            if (vol) break;
-        }
-        g_object_unref(dg);
-        g_array_unref(volumes);
-
-        if (!vol) {
-            g_warning("Disk group %s doesn't contain volume %s",
-                      argv[1], argv[2]);
-            return FALSE;
-        }
+        LDMVolume * const vol = find_volume(ldm, argv[1], argv[2]);
+        if (!vol) return FALSE;
 
         if (!uuid_is_null(opts->uuid_override)) {
             ldm_volume_override_uuid(vol, opts->uuid_override);
         }
+        _set_volume_options(vol, opts);
 
         GError *err = NULL;
         GString *device = NULL;
-        if (!(*action)(vol, &device, &err)) {
+        const gboolean r = (*action)(vol, &device, &err);
+        g_object_unref(vol);
+        if (!r) {
             g_warning("Unable to %s volume %s in disk group %s: %s",
                       action_desc, argv[2], argv[1], err->message);
             g_error_free(err); err = NULL;
@@ -611,31 +749,437 @@ _ldm_vol_action(LDM *const ldm, const _options_t * const opts, const gint argc,
     return TRUE;
 }
 
+/* Returns all volumes in all disk groups, with options applied. The volumes are
+ * owned by their disk groups, which are returned in dgs. The disk group guid of
+ * each volume, for messages, is appended to dg_guids. */
+static GArray *
+_get_all_volumes(LDM *const ldm, const _options_t * const opts,
+                 GArray ** const dgs, GPtrArray * const dg_guids)
+{
+    GArray * const volumes = g_array_new(FALSE, FALSE, sizeof(LDMVolume *));
+
+    *dgs = ldm_get_disk_groups(ldm);
+    for (guint i = 0; i < (*dgs)->len; i++) {
+        LDMDiskGroup * const dg = g_array_index(*dgs, LDMDiskGroup *, i);
+
+        GArray *dg_volumes = ldm_disk_group_get_volumes(dg);
+        for (guint j = 0; j < dg_volumes->len; j++) {
+            LDMVolume * const vol = g_array_index(dg_volumes, LDMVolume *, j);
+
+            _set_volume_options(vol, opts);
+            g_array_append_val(volumes, vol);
+            g_ptr_array_add(dg_guids, ldm_disk_group_get_guid(dg));
+        }
+        g_array_unref(dg_volumes);
+    }
+
+    return volumes;
+}
+
+/* Create all volumes in a single batch, or as their disks appear */
+static gboolean
+_ldm_create_all(LDM *const ldm, const _options_t * const opts,
+                JsonBuilder * const jb)
+{
+    GPtrArray * const dg_guids = g_ptr_array_new_with_free_func(g_free);
+    GArray *dgs;
+    GArray * const volumes = _get_all_volumes(ldm, opts, &dgs, dg_guids);
+
+    GArray * const results =
+        opts->wait > 0 ?
+            ldm_volumes_dm_create_deferred(ldm, volumes, opts->jobs,
+                                           opts->wait) :
+        opts->jobs == 1 ?
+            ldm_volumes_dm_create(volumes) :
+            ldm_volumes_dm_create_parallel(volumes, opts->jobs);
+
+    json_builder_begin_array(jb);
+
+    for (guint i = 0; i < results->len; i++) {
+        const LDMVolumeDMResult * const result =
+            &g_array_index(results, LDMVolumeDMResult, i);
+
+        if (result->error) {
+            gchar *vol_name = ldm_volume_get_name(result->volume);
+
+            g_warning("Unable to create volume %s in disk group %s: %s",
+                      vol_name, (gchar *) g_ptr_array_index(dg_guids, i),
+                      result->error->message);
+
+            g_free(vol_name);
+        }
+
+        if (result->created) {
+            json_builder_add_string_value(jb, result->created->str);
+        }
+    }
+
+    json_builder_end_array(jb);
+
+    g_array_unref(results);
+    g_ptr_array_unref(dg_guids);
+    g_array_unref(volumes);
+    g_array_unref(dgs);
+
+    return TRUE;
+}
+
 gboolean
 ldm_create(LDM *const ldm, const _options_t * const opts, const gint argc,
            gchar ** const argv, JsonBuilder * const jb)
 {
+    if (argc == 1 && g_strcmp0(argv[0], "all") == 0) {
+        if (!_check_single_volume_options(opts, "for multiple volumes")) {
+            return FALSE;
+        }
+
+        return _ldm_create_all(ldm, opts, jb);
+    }
+
+    if (opts->wait > 0 && argc == 3 && g_strcmp0(argv[0], "volume") == 0) {
+        LDMVolume * const vol = find_volume(ldm, argv[1], argv[2]);
+        if (!vol) return FALSE;
+
+        if (!uuid_is_null(opts->uuid_override)) {
+            ldm_volume_override_uuid(vol, opts->uuid_override);
+        }
+        _set_volume_options(vol, opts);
+
+        GArray * const volumes = g_array_new(FALSE, FALSE,
+                                             sizeof(LDMVolume *));
+        g_array_append_val(volumes, vol);
+        GArray * const results =
+            ldm_volumes_dm_create_deferred(ldm, volumes, 1, opts->wait);
+        const LDMVolumeDMResult * const result =
+            &g_array_index(results, LDMVolumeDMResult, 0);
+
+        const gboolean r = result->error == NULL;
+        if (result->error) {
+            g_warning("Unable to create volume %s in disk group %s: %s",
+                      argv[2], argv[1], result->error->message);
+        } else {
+            json_builder_begin_array(jb);
+            if (result->created) {
+                json_builder_add_string_value(jb, result->created->str);
+            }
+            json_builder_end_array(jb);
+        }
+
+        g_array_unref(results);
+        g_array_unref(volumes);
+        g_object_unref(vol);
+
+        return r;
+    }
+
     return _ldm_vol_action(ldm, opts, argc, argv, jb,
                            "create", usage_create, ldm_volume_dm_create);
 }
 
+/* Remove all volumes in a single batch */
+static gboolean
+_ldm_remove_all(LDM *const ldm, const _options_t * const opts,
+                JsonBuilder * const jb)
+{
+    GPtrArray * const dg_guids = g_ptr_array_new_with_free_func(g_free);
+    GArray *dgs;
+    GArray * const volumes = _get_all_volumes(ldm, opts, &dgs, dg_guids);
+
+    GArray * const results = ldm_volumes_dm_remove(volumes);
+
+    json_builder_begin_array(jb);
+
+    for (guint i = 0; i < results->len; i++) {
+        const LDMVolumeDMRemoveResult * const result =
+            &g_array_index(results, LDMVolumeDMRemoveResult, i);
+
+        if (result->error) {
+            gchar *vol_name = ldm_volume_get_name(result->volume);
+
+            g_warning("Unable to remove volume %s in disk group %s: %s",
+                      vol_name, (gchar *) g_ptr_array_index(dg_guids, i),
+                      result->error->message);
+
+            g_free(vol_name);
+        }
+
+        if (result->removed) {
+            json_builder_add_string_value(jb, result->removed->str);
+        }
+    }
+
+    json_builder_end_array(jb);
+
+    g_array_unref(results);
+    g_ptr_array_unref(dg_guids);
+    g_array_unref(volumes);
+    g_array_unref(dgs);
+
+    return TRUE;
+}
+
 gboolean
 ldm_remove(LDM *const ldm, const _options_t * const opts, const gint argc,
            gchar ** const argv, JsonBuilder * const jb)
 {
+    if (argc == 1 && g_strcmp0(argv[0], "all") == 0) {
+        if (!_check_single_volume_options(opts, "for multiple volumes")) {
+            return FALSE;
+        }
+
+        return _ldm_remove_all(ldm, opts, jb);
+    }
+
     return _ldm_vol_action(ldm, opts, argc, argv, jb,
                            "remove", usage_remove, ldm_volume_dm_remove);
 }
 
 gboolean
-shell(LDM * const ldm, const _options_t * const opts, gchar ** const devices,
-      JsonGenerator * const jg, GOutputStream * const out)
+ldm_reload(LDM *const ldm, const _options_t * const opts, const gint argc,
+           gchar ** const argv, JsonBuilder * const jb)
 {
-    if (!uuid_is_null(opts->uuid_override)) {
-        g_warning("UUID override cannot be used in shell mode");
+    return _ldm_vol_action(ldm, opts, argc, argv, jb,
+                           "reload", usage_reload, ldm_volume_dm_reload);
+}
+
+/* Append a field to a dmsetup --concise table list, escaping its separators */
+static void
+_append_concise(GString * const out, const gchar * const field)
+{
+    for (const gchar *c = field; *c != '\0'; c++) {
+        if (*c == ',' || *c == ';' || *c == '\\') {
+            g_string_append_c(out, '\\');
+        }
+        g_string_append_c(out, *c);
+    }
+}
+
+/* Append a device in the format of dmsetup create --concise:
+ * <name>,<uuid>,<minor>,<flags>,<table>[,<table>...] */
+static void
+_table_concise(GString * const out, const LDMDMTable * const table)
+{
+    if (out->len > 0) g_string_append_c(out, ';');
+
+    _append_concise(out, table->name);
+    g_string_append_c(out, ',');
+    _append_concise(out, table->uuid);
+    g_string_append_printf(out, ",,%s", table->read_only ? "ro" : "rw");
+
+    for (guint i = 0; i < table->targets->len; i++) {
+        const LDMDMTarget * const target =
+            &g_array_index(table->targets, LDMDMTarget, i);
+
+        gchar * const line = g_strdup_printf("%" G_GUINT64_FORMAT " %"
+                                             G_GUINT64_FORMAT " %s %s",
+                                             target->start, target->size,
+                                             target->type, target->params);
+        g_string_append_c(out, ',');
+        _append_concise(out, line);
+        g_free(line);
+    }
+}
+
+static void
+_table_json(JsonBuilder * const jb, const LDMDMTable * const table)
+{
+    json_builder_begin_object(jb);
+
+    json_builder_set_member_name(jb, "name");
+    json_builder_add_string_value(jb, table->name);
+    json_builder_set_member_name(jb, "uuid");
+    json_builder_add_string_value(jb, table->uuid);
+    json_builder_set_member_name(jb, "read-only");
+    json_builder_add_boolean_value(jb, table->read_only);
+
+    json_builder_set_member_name(jb, "targets");
+    json_builder_begin_array(jb);
+    for (guint i = 0; i < table->targets->len; i++) {
+        const LDMDMTarget * const target =
+            &g_array_index(table->targets, LDMDMTarget, i);
+
+        json_builder_begin_object(jb);
+        json_builder_set_member_name(jb, "start");
+        json_builder_add_int_value(jb, target->start);
+        json_builder_set_member_name(jb, "size");
+        json_builder_add_int_value(jb, target->size);
+        json_builder_set_member_name(jb, "type");
+        json_builder_add_string_value(jb, target->type);
+        json_builder_set_member_name(jb, "params");
+        json_builder_add_string_value(jb, target->params);
+        json_builder_end_object(jb);
+    }
+    json_builder_end_array(jb);
+
+    json_builder_end_object(jb);
+}
+
+gboolean
+ldm_tables(LDM *const ldm, const _options_t * const opts, const gint argc,
+           gchar ** const argv, JsonBuilder * const jb)
+{
+    GArray *dgs = NULL;
+    GArray *volumes;
+    LDMVolume *vol = NULL;
+    GPtrArray * const dg_guids = g_ptr_array_new_with_free_func(g_free);
+
+    if (argc == 1 && g_strcmp0(argv[0], "all") == 0) {
+        if (!_check_single_volume_options(opts, "for multiple volumes")) {
+            g_ptr_array_unref(dg_guids);
+            return FALSE;
+        }
+
+        volumes = _get_all_volumes(ldm, opts, &dgs, dg_guids);
+    }
+
+    else if (argc == 3 && g_strcmp0(argv[0], "volume") == 0) {
+        vol = find_volume(ldm, argv[1], argv[2]);
+        if (!vol) {
+            g_ptr_array_unref(dg_guids);
+            return FALSE;
+        }
+
+        if (!uuid_is_null(opts->uuid_override)) {
+            ldm_volume_override_uuid(vol, opts->uuid_override);
+        }
+        _set_volume_options(vol, opts);
+
+        volumes = g_array_new(FALSE, FALSE, sizeof(LDMVolume *));
+        g_array_append_val(volumes, vol);
+        g_ptr_array_add(dg_guids, g_strdup(argv[1]));
+    }
+
+    else {
+        g_ptr_array_unref(dg_guids);
+        return usage_tables();
+    }
+
+    gboolean r = TRUE;
+    GString * const concise = g_string_new("");
+
+    if (!opts->dmsetup) json_builder_begin_array(jb);
+
+    for (guint i = 0; i < volumes->len; i++) {
+        LDMVolume * const vol_i = g_array_index(volumes, LDMVolume *, i);
+
+        GError *err = NULL;
+        GArray * const tables = ldm_volume_dm_get_tables(vol_i, &err);
+        if (!tables) {
+            gchar *vol_name = ldm_volume_get_name(vol_i);
+
+            g_warning("Unable to generate tables for volume %s in disk group "
+                      "%s: %s", vol_name,
+                      (gchar *) g_ptr_array_index(dg_guids, i), err->message);
+
+            g_free(vol_name);
+            g_error_free(err);
+
+            /* Failing to generate a single volume is an error */
+            if (volumes->len == 1) r = FALSE;
+            continue;
+        }
+
+        for (guint j = 0; j < tables->len; j++) {
+            const LDMDMTable * const table =
+                &g_array_index(tables, LDMDMTable, j);
+
+            if (opts->dmsetup) {
+                _table_concise(concise, table);
+            } else {
+                _table_json(jb, table);
+            }
+        }
+
+        g_array_unref(tables);
+    }
+
+    if (!opts->dmsetup) {
+        json_builder_end_array(jb);
+    } else if (r) {
+        printf("%s\n", concise->str);
+    }
+
+    g_string_free(concise, TRUE);
+    g_ptr_array_unref(dg_guids);
+    g_array_unref(volumes);
+    if (vol) g_object_unref(vol);
+    if (dgs) g_array_unref(dgs);
+
+    return r;
+}
+
+gboolean
+ldm_stats(LDM *const ldm, const _options_t * const opts, const gint argc,
+          gchar ** const argv, JsonBuilder * const jb)
+{
+    if (argc != 0) return usage_stats();
+
+    json_builder_begin_array(jb);
+
+    GArray * const usage = ldm_get_memory_usage(ldm);
+    for (guint i = 0; i < usage->len; i++) {
+        const LDMMemoryUsage * const u =
+            &g_array_index(usage, LDMMemoryUsage, i);
+
+        char guid[37];
+        uuid_unparse(u->disk_group, guid);
+
+        json_builder_begin_object(jb);
+
+        json_builder_set_member_name(jb, "guid");
+        json_builder_add_string_value(jb, guid);
+        json_builder_set_member_name(jb, "config");
+        json_builder_add_int_value(jb, u->config);
+        json_builder_set_member_name(jb, "structs");
+        json_builder_add_int_value(jb, u->structs);
+        json_builder_set_member_name(jb, "names");
+        json_builder_add_int_value(jb, u->names);
+        json_builder_set_member_name(jb, "arrays");
+        json_builder_add_int_value(jb, u->arrays);
+        json_builder_set_member_name(jb, "total");
+        json_builder_add_int_value(jb, u->structs + u->names + u->arrays);
+
+        json_builder_end_object(jb);
+    }
+    g_array_unref(usage);
+
+    json_builder_end_array(jb);
+
+    return TRUE;
+}
+
+gboolean
+ldm_trigger(LDM *const ldm, const _options_t * const opts, const gint argc,
+            gchar ** const argv, JsonBuilder * const jb)
+{
+    if (argc != 0) return usage_trigger();
+
+    GError *err = NULL;
+    GArray * const triggered = ldm_dm_trigger(ldm, &err);
+    if (!triggered) {
+        g_warning("Unable to trigger devices: %s", err->message);
+        g_error_free(err);
         return FALSE;
     }
 
+    json_builder_begin_array(jb);
+    for (guint i = 0; i < triggered->len; i++) {
+        const GString * const name = g_array_index(triggered, GString *, i);
+        json_builder_add_string_value(jb, name->str);
+    }
+    json_builder_end_array(jb);
+
+    g_array_unref(triggered);
+
+    return TRUE;
+}
+
+gboolean
+shell(LDM * const ldm, const _options_t * const opts, gchar ** const devices,
+      JsonGenerator * const jg, GOutputStream * const out)
+{
+    if (!_check_single_volume_options(opts, "in shell mode")) return FALSE;
+
     int history_len = 0;
 
     rl_readline_name = "ldmtool";
@@ -815,6 +1359,22 @@ main(int argc, char *argv[])
 {
     static gchar **devices = NULL;
     static gchar *uuid_override_str = NULL;
+    static gint jobs = 1;
+    static gint wait_time = 0;
+    static gchar *metadata_dir = NULL;
+    static gint region_size = 0;
+    static gboolean nosync = FALSE;
+    static gint min_recovery_rate = 0;
+    static gint max_recovery_rate = 0;
+    static gint daemon_sleep = 0;
+    static gchar **write_mostly = NULL;
+    static gboolean read_only = FALSE;
+    static gboolean dmsetup = FALSE;
+    static gchar *cache_device = NULL;
+    static gchar *cache_mode = NULL;
+    static gchar *snapshot_cow = NULL;
+    static gboolean transient = FALSE;
+    static gboolean no_udev = FALSE;
 
     static const GOptionEntry entries[] =
     {
@@ -822,6 +1382,44 @@ main(int argc, char *argv[])
           &devices, "Block device to scan for LDM metadata", NULL },
         { "uuid_override", 0, 0, G_OPTION_ARG_STRING,
           &uuid_override_str, "UUID override for device mapper", NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT,
+          &jobs, "Number of volumes to create concurrently "
+                 "(0 for one per processor)", "N" },
+        { "wait", 'w', 0, G_OPTION_ARG_INT,
+          &wait_time, "Time to wait for missing disks when creating volumes",
+          "SECONDS" },
+        { "metadata-dir", 0, 0, G_OPTION_ARG_FILENAME,
+          &metadata_dir, "Directory for persistent mirror and RAID5 "
+                         "metadata", "DIR" },
+        { "region-size", 0, 0, G_OPTION_ARG_INT,
+          &region_size, "Mirror and RAID5 region size in sectors", "SECTORS" },
+        { "nosync", 0, 0, G_OPTION_ARG_NONE,
+          &nosync, "Don't synchronise mirror and RAID5 legs on creation",
+          NULL },
+        { "min-recovery-rate", 0, 0, G_OPTION_ARG_INT,
+          &min_recovery_rate, "Minimum recovery rate per leg", "KIB/S" },
+        { "max-recovery-rate", 0, 0, G_OPTION_ARG_INT,
+          &max_recovery_rate, "Maximum recovery rate per leg", "KIB/S" },
+        { "daemon-sleep", 0, 0, G_OPTION_ARG_INT,
+          &daemon_sleep, "Interval between bitmap flushes", "MS" },
+        { "write-mostly", 0, 0, G_OPTION_ARG_STRING_ARRAY,
+          &write_mostly, "Mirror leg to avoid reading from", "LEG" },
+        { "read-only", 'r', 0, G_OPTION_ARG_NONE,
+          &read_only, "Create devices read-only", NULL },
+        { "cache-device", 0, 0, G_OPTION_ARG_FILENAME,
+          &cache_device, "Block device to cache a volume on", "DEV" },
+        { "cache-mode", 0, 0, G_OPTION_ARG_STRING,
+          &cache_mode, "Cache mode: writecache, writethrough or writeback "
+                       "(default writethrough)", "MODE" },
+        { "snapshot", 0, 0, G_OPTION_ARG_FILENAME,
+          &snapshot_cow, "Create a writable snapshot of a volume, with changes "
+                         "stored in COW", "COW" },
+        { "transient", 0, 0, G_OPTION_ARG_NONE,
+          &transient, "Discard snapshot changes when it is removed", NULL },
+        { "no-udev", 0, 0, G_OPTION_ARG_NONE,
+          &no_udev, "Create device nodes without waiting for udev", NULL },
+        { "dmsetup", 0, 0, G_OPTION_ARG_NONE,
+          &dmsetup, "Output tables for dmsetup create --concise", NULL },
         { NULL }
     };
 
@@ -841,8 +1439,71 @@ main(int argc, char *argv[])
     }
     g_option_context_free(context);
 
+    if (jobs < 0) {
+        g_warning("Invalid number of jobs: %i", jobs);
+        return 1;
+    }
+
+    if (wait_time < 0 || wait_time > G_MAXINT / 1000) {
+        g_warning("Invalid wait time: %i", wait_time);
+        return 1;
+    }
+
     _options_t opts;
     uuid_clear(opts.uuid_override);
+    opts.jobs = jobs;
+    opts.wait = wait_time * 1000;
+    opts.metadata_dir = metadata_dir;
+    opts.read_only = read_only;
+    opts.dmsetup = dmsetup;
+
+    opts.cache_device = cache_device;
+    opts.cache_mode = LDM_DM_CACHE_NONE;
+    if (cache_device) {
+        if (!cache_mode || g_strcmp0(cache_mode, "writethrough") == 0) {
+            opts.cache_mode = LDM_DM_CACHE_WRITETHROUGH;
+        } else if (g_strcmp0(cache_mode, "writeback") == 0) {
+            opts.cache_mode = LDM_DM_CACHE_WRITEBACK;
+        } else if (g_strcmp0(cache_mode, "writecache") == 0) {
+            opts.cache_mode = LDM_DM_CACHE_WRITECACHE;
+        } else {
+            g_warning("Invalid cache mode: %s", cache_mode);
+            return 1;
+        }
+    } else if (cache_mode) {
+        g_warning("--cache-mode requires --cache-device");
+        return 1;
+    }
+
+    opts.snapshot_cow = snapshot_cow;
+    opts.snapshot_persistent = !transient;
+    if (transient && !snapshot_cow) {
+        g_warning("--transient requires --snapshot");
+        return 1;
+    }
+
+    if (region_size < 0 || min_recovery_rate < 0 || max_recovery_rate < 0 ||
+        daemon_sleep < 0)
+    {
+        g_warning("Invalid negative raid option");
+        return 1;
+    }
+    memset(&opts.raid_opts, 0, sizeof(opts.raid_opts));
+    opts.raid_opts.region_size = region_size;
+    opts.raid_opts.nosync = nosync;
+    opts.raid_opts.min_recovery_rate = min_recovery_rate;
+    opts.raid_opts.max_recovery_rate = max_recovery_rate;
+    opts.raid_opts.daemon_sleep = daemon_sleep;
+    for (gchar **leg = write_mostly; leg && *leg; leg++) {
+        gchar *end;
+        const guint64 i = g_ascii_strtoull(*leg, &end, 10);
+        if (**leg == '\0' || *end != '\0' || i >= 64) {
+            g_warning("Invalid write mostly leg: %s", *leg);
+            return 1;
+        }
+        opts.raid_opts.write_mostly |= G_GUINT64_CONSTANT(1) << i;
+    }
+    g_strfreev(write_mostly); write_mostly = NULL;
     if (uuid_override_str) {
         if (uuid_parse(uuid_override_str, opts.uuid_override)) {
             g_warning("Failed to parse %s as a UUID", uuid_override_str);
@@ -857,6 +1518,7 @@ main(int argc, char *argv[])
 #endif
 
     LDM * const ldm = ldm_new();
+    if (no_udev) ldm_dm_set_udev_sync(FALSE);
 
     int ret = 0;
 
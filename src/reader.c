@@ -0,0 +1,1052 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reading volumes directly from their member disks, without device mapper */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ldmcore.h"
+
+#define SECTOR_SIZE 512
+
+/* Reads are planned in windows of at most this many bytes, which bounds the
+ * memory used to reconstruct missing RAID5 data */
+#define READ_WINDOW (8 * 1024 * 1024)
+
+/* Reads smaller than this are done in the calling thread, as handing them to
+ * the disk threads would cost more than reading in parallel saves */
+#define PARALLEL_MIN (128 * 1024)
+
+/* The maximum number of contiguous reads from a disk combined into a single
+ * preadv() */
+#define MAX_IOV 64
+
+/* Reads of mirrored volumes which are split between legs are split on
+ * multiples of this */
+#define MIRROR_ALIGN 4096
+
+/* Requests of at least this size bypass the cache, so that streaming a volume
+ * doesn't evict blocks which are read repeatedly. The decision is made for the
+ * whole request, as a striped volume splits even a large request into ops of
+ * a chunk each. */
+#define CACHE_BYPASS (256 * 1024)
+
+/* Missing RAID5 data is reconstructed in blocks of this size, so that each
+ * block of the destination stays in cache while every surviving column is
+ * combined with it */
+#define RECONSTRUCT_BLOCK (256 * 1024)
+
+/* Readahead of a sequential stream starts with a window of this size, and
+ * doubles it on each refill up to READ_WINDOW. Both are rounded to whole
+ * stripes for striped and RAID5 volumes. */
+#define READAHEAD_MIN (128 * 1024)
+
+/* A read of a contiguous range of one partition's disk */
+typedef struct {
+    uint32_t part;
+    uint8_t *dst;
+    size_t count;
+    uint64_t offset;    /* Bytes from the start of the disk */
+} _op_t;
+
+/* Missing RAID5 data, which is the XOR of n_srcs reads starting at first_op.
+ * The first is read directly into dst, and the others into a temporary buffer
+ * starting at tmp_offset. */
+typedef struct {
+    uint8_t *dst;
+    size_t count;
+    uint32_t first_op;
+    uint32_t n_srcs;
+    size_t tmp_offset;
+} _xor_t;
+
+typedef struct _batch _batch_t;
+
+/* A batch's reads from one disk, queued on the disk's thread */
+typedef struct _task {
+    _batch_t *batch;
+    uint32_t part;
+    uint32_t n_ops;
+    struct _task *next;
+} _task_t;
+
+/* The reads of one window, which are done by one thread per disk */
+struct _batch {
+    ldmcore_reader_t *reader;
+    const _op_t *ops;
+    uint32_t n_ops;
+    int cached;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint32_t pending;
+    int r;
+    ldmcore_err_t err;
+};
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    _task_t *head;
+    _task_t *tail;
+    int quit;
+} _worker_t;
+
+/* The state of a leg of a mirrored volume. All fields are accessed
+ * atomically. */
+typedef struct {
+    int failed;         /* A read from the leg has failed */
+    uint32_t inflight;  /* Batches reading from the leg */
+    uint64_t next;      /* The volume byte following the last read planned */
+} _leg_t;
+
+struct _ldmcore_reader {
+    const ldmcore_vol_t *vol;
+
+    /* One per partition of the volume, or -1 if its disk is missing */
+    int *fds;
+    uint64_t *disk_sizes;   /* Bytes, for each partition whose disk is present */
+
+    /* One per partition, for mirrored volumes */
+    _leg_t *legs;
+    uint32_t next_leg;  /* For round robin between equally busy legs */
+    uint64_t failovers; /* Reads which failed on one leg and were read from
+                           another */
+
+    ldmcore_cache_t *cache; /* NULL if there is none */
+
+    /* Readahead of one sequential stream. The lock is only ever tried, so
+     * that other threads read directly rather than wait for a refill. */
+    pthread_mutex_t ra_lock;
+    uint64_t ra_next;   /* The volume byte following the last read, or
+                           UINT64_MAX before the first */
+    size_t ra_window;   /* 0 until a read continues from ra_next */
+    uint8_t *ra_buf;
+    size_t ra_alloc;
+    uint64_t ra_start;  /* The volume offset of ra_buf */
+    size_t ra_len;
+    uint64_t ra_hits;   /* Reads served entirely from ra_buf */
+
+    /* One per partition, running for those whose disk is present. They are
+     * started by the first read which can use them. workers_state is 0 before
+     * then, 1 if they are running, and -1 if they couldn't be started. */
+    pthread_mutex_t workers_lock;
+    int workers_state;
+    _worker_t *workers;
+};
+
+/* Stop the threads of the first n partitions */
+static void
+_stop_workers(ldmcore_reader_t * const reader, const uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        if (reader->fds[i] == -1) continue;
+
+        _worker_t * const w = &reader->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->quit = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+}
+
+void
+ldmcore_reader_close(ldmcore_reader_t * const reader)
+{
+    if (reader == NULL) return;
+
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    if (reader->workers_state == 1) _stop_workers(reader, vol->n_parts);
+    free(reader->workers);
+    pthread_mutex_destroy(&reader->workers_lock);
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        if (reader->fds[i] != -1) close(reader->fds[i]);
+    }
+    free(reader->fds);
+    free(reader->disk_sizes);
+    free(reader->legs);
+    ldmcore_cache_free(reader->cache);
+    pthread_mutex_destroy(&reader->ra_lock);
+    free(reader->ra_buf);
+
+    ldmcore_dg_unref(vol->dg);
+    free(reader);
+}
+
+int
+ldmcore_reader_open(const ldmcore_vol_t * const vol,
+                    ldmcore_reader_t ** const reader,
+                    ldmcore_err_t * const err)
+{
+    *reader = NULL;
+
+    ldmcore_reader_t * const r = malloc(sizeof(*r));
+    if (r == NULL) abort();
+    r->vol = vol;
+    r->fds = malloc(vol->n_parts * sizeof(*r->fds));
+    if (r->fds == NULL && vol->n_parts > 0) abort();
+    r->disk_sizes = calloc(vol->n_parts, sizeof(*r->disk_sizes));
+    if (r->disk_sizes == NULL && vol->n_parts > 0) abort();
+    r->legs = calloc(vol->n_parts, sizeof(*r->legs));
+    if (r->legs == NULL && vol->n_parts > 0) abort();
+    r->next_leg = 0;
+    r->failovers = 0;
+    r->cache = NULL;
+    pthread_mutex_init(&r->ra_lock, NULL);
+    r->ra_next = UINT64_MAX;
+    r->ra_window = 0;
+    r->ra_buf = NULL;
+    r->ra_alloc = 0;
+    r->ra_start = 0;
+    r->ra_len = 0;
+    r->ra_hits = 0;
+    pthread_mutex_init(&r->workers_lock, NULL);
+    r->workers_state = 0;
+    r->workers = NULL;
+    ldmcore_dg_ref(vol->dg);
+
+    uint32_t n_missing = 0;
+    const ldmcore_part_t *missing = NULL;
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        r->fds[i] = -1;
+    }
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        const ldmcore_part_t * const part = vol->parts[i];
+        const char * const device = ldmcore_disk_get_device(part->disk);
+
+        if (device == NULL) {
+            n_missing++;
+            if (missing == NULL) missing = part;
+            continue;
+        }
+
+        r->fds[i] = open(device, O_RDONLY | O_CLOEXEC);
+        if (r->fds[i] == -1) {
+            const int ret = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                            "Unable to open %s: %m", device);
+            ldmcore_reader_close(r);
+            return ret;
+        }
+
+        const off_t size = lseek(r->fds[i], 0, SEEK_END);
+        if (size == -1) {
+            const int ret = ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                            "Unable to get size of %s: %m",
+                                            device);
+            ldmcore_reader_close(r);
+            return ret;
+        }
+        r->disk_sizes[i] = size;
+    }
+
+    /* A mirrored volume needs one leg, and RAID5 can reconstruct one missing
+     * column from parity. Other volume types need every partition. */
+    int readable;
+    switch (vol->type) {
+    case LDMCORE_VOLUME_TYPE_MIRRORED:
+        readable = n_missing < vol->n_parts;
+        break;
+
+    case LDMCORE_VOLUME_TYPE_RAID5:
+        readable = n_missing <= 1;
+        break;
+
+    default:
+        readable = n_missing == 0;
+    }
+
+    if (!readable) {
+        const int ret = vol->n_parts == 0 ?
+            ldmcore_set_err(err, LDMCORE_ERROR_INVALID,
+                            "Volume %s has no partitions", vol->name) :
+            ldmcore_set_err(err, LDMCORE_ERROR_MISSING_DISK,
+                            "Unable to read volume %s: disk %s of partition "
+                            "%s is missing",
+                            vol->name, missing->disk->name, missing->name);
+        ldmcore_reader_close(r);
+        return ret;
+    }
+
+    *reader = r;
+    return 0;
+}
+
+/* Read exactly the size of iov from a partition at the given byte offset.
+ * Modifies iov. */
+static int
+_readv_full(const ldmcore_reader_t * const reader, const uint32_t part,
+            struct iovec *iov, int n_iov, uint64_t offset,
+            ldmcore_err_t * const err)
+{
+    const ldmcore_part_t * const p = reader->vol->parts[part];
+
+    while (n_iov > 0) {
+        ssize_t n = preadv(reader->fds[part], iov, n_iov, offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+
+            return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                   "Error reading from %s: %m",
+                                   ldmcore_disk_get_device(p->disk));
+        }
+        if (n == 0) {
+            return ldmcore_set_err(err, LDMCORE_ERROR_IO,
+                                   "Unexpected end of %s reading partition %s",
+                                   ldmcore_disk_get_device(p->disk), p->name);
+        }
+
+        offset += n;
+        while (n_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++; n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* The byte offset on a leg's disk of the start of a mirrored volume */
+static uint64_t
+_leg_base(const ldmcore_reader_t * const reader, const uint32_t leg)
+{
+    const ldmcore_part_t * const p = reader->vol->parts[leg];
+
+    /* Wraps if vol_offset is larger, which cancels out when a volume offset
+     * is added */
+    return (p->disk->data_start + p->start - p->vol_offset) * SECTOR_SIZE;
+}
+
+/* Retry an op of a mirrored volume which failed on its own leg, on each other
+ * leg until one succeeds. Legs which haven't failed are tried first. */
+static int
+_retry_mirror(ldmcore_reader_t * const reader, const _op_t * const op,
+              ldmcore_err_t * const err)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+    const uint64_t vol_offset = op->offset - _leg_base(reader, op->part);
+
+    int r = -LDMCORE_ERROR_IO;
+    for (int failed = 0; failed < 2; failed++) {
+        for (uint32_t i = 0; i < vol->n_parts; i++) {
+            if (i == op->part || reader->fds[i] == -1) continue;
+
+            _leg_t * const leg = &reader->legs[i];
+            if (__atomic_load_n(&leg->failed, __ATOMIC_RELAXED) != failed)
+                continue;
+
+            struct iovec iov = { op->dst, op->count };
+            r = _readv_full(reader, i, &iov, 1,
+                            _leg_base(reader, i) + vol_offset, err);
+            if (r == 0) {
+                __atomic_add_fetch(&reader->failovers, 1, __ATOMIC_RELAXED);
+                return 0;
+            }
+
+            __atomic_store_n(&leg->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return r;
+}
+
+/* Do an op through the cache, a block at a time. A block which extends past
+ * the end of the disk is read directly. */
+static int
+_read_cached(const ldmcore_reader_t * const reader, const _op_t * const op,
+             ldmcore_err_t * const err)
+{
+    const ldmcore_part_t * const p = reader->vol->parts[op->part];
+    const uint64_t disk_size = reader->disk_sizes[op->part];
+
+    uint8_t *block = NULL;
+    int r = 0;
+
+    const uint64_t end = op->offset + op->count;
+    for (uint64_t pos = op->offset; pos < end && r == 0;) {
+        const uint64_t b = pos / LDMCORE_CACHE_BLOCK;
+        const uint64_t b_start = b * LDMCORE_CACHE_BLOCK;
+        const size_t within = pos - b_start;
+        const size_t len = end - pos < LDMCORE_CACHE_BLOCK - within ?
+                           end - pos : LDMCORE_CACHE_BLOCK - within;
+        uint8_t * const dst = op->dst + (pos - op->offset);
+
+        if (b_start + LDMCORE_CACHE_BLOCK > disk_size) {
+            struct iovec iov = { dst, len };
+            r = _readv_full(reader, op->part, &iov, 1, pos, err);
+        } else if (!ldmcore_cache_lookup(reader->cache, p->disk, b,
+                                         within, len, dst))
+        {
+            if (block == NULL) {
+                block = malloc(LDMCORE_CACHE_BLOCK);
+                if (block == NULL) abort();
+            }
+
+            struct iovec iov = { block, LDMCORE_CACHE_BLOCK };
+            r = _readv_full(reader, op->part, &iov, 1, b_start, err);
+            if (r == 0) {
+                ldmcore_cache_insert(reader->cache, p->disk, b, block);
+                memcpy(dst, block + within, len);
+            }
+        }
+
+        pos += len;
+    }
+
+    free(block);
+    return r;
+}
+
+/* Do the ops of one partition, combining those which are contiguous on disk.
+ * Striped and RAID5 volumes put successive rows of a column next to each
+ * other, so a large read needs only one preadv() per disk. If a read from a
+ * leg of a mirrored volume fails, the leg is marked as failed and each op is
+ * retried on the other legs. If cached is set, ops go through the reader's
+ * cache instead. */
+static int
+_run_part(ldmcore_reader_t * const reader,
+          const _op_t * const ops, const uint32_t n_ops, const uint32_t part,
+          const int cached, ldmcore_err_t * const err)
+{
+    struct iovec iov[MAX_IOV];
+    const _op_t *run[MAX_IOV];
+    int n_iov = 0;
+    uint64_t start = 0;
+    uint64_t next = 0;
+
+    for (uint32_t i = 0; i <= n_ops; i++) {
+        const _op_t * const op = i < n_ops ? &ops[i] : NULL;
+        if (op && op->part != part) continue;
+
+        if (op && cached) {
+            int r = _read_cached(reader, op, err);
+            if (r < 0 && reader->vol->type == LDMCORE_VOLUME_TYPE_MIRRORED) {
+                __atomic_store_n(&reader->legs[part].failed, 1,
+                                 __ATOMIC_RELAXED);
+                r = _retry_mirror(reader, op, err);
+            }
+            if (r < 0) return r;
+            continue;
+        }
+
+        if (n_iov > 0 &&
+            (op == NULL || op->offset != next || n_iov == MAX_IOV))
+        {
+            int r = _readv_full(reader, part, iov, n_iov, start, err);
+            if (r < 0 && reader->vol->type == LDMCORE_VOLUME_TYPE_MIRRORED) {
+                __atomic_store_n(&reader->legs[part].failed, 1,
+                                 __ATOMIC_RELAXED);
+
+                for (int j = 0; j < n_iov; j++) {
+                    r = _retry_mirror(reader, run[j], err);
+                    if (r < 0) break;
+                }
+            }
+            if (r < 0) return r;
+            n_iov = 0;
+        }
+        if (op == NULL) break;
+
+        if (n_iov == 0) start = op->offset;
+        iov[n_iov].iov_base = op->dst;
+        iov[n_iov].iov_len = op->count;
+        run[n_iov] = op;
+        n_iov++;
+        next = op->offset + op->count;
+    }
+
+    return 0;
+}
+
+static void *
+_worker_thread(void * const data)
+{
+    _worker_t * const w = data;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL && !w->quit) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        _task_t * const task = w->head;
+        if (task) {
+            w->head = task->next;
+            if (w->head == NULL) w->tail = NULL;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        /* Only quit once the queue is empty */
+        if (task == NULL) break;
+
+        _batch_t * const batch = task->batch;
+        ldmcore_err_t err;
+        const int r = _run_part(batch->reader, batch->ops, batch->n_ops,
+                                task->part, batch->cached, &err);
+
+        pthread_mutex_lock(&batch->lock);
+        if (r < 0 && batch->r == 0) {
+            batch->r = r;
+            batch->err = err;
+        }
+        if (--batch->pending == 0) pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    return NULL;
+}
+
+/* Start a thread for each disk if they aren't already running. Returns 0 if
+ * they can't be started, in which case reads are done serially. */
+static int
+_start_workers(ldmcore_reader_t * const reader)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    pthread_mutex_lock(&reader->workers_lock);
+
+    if (reader->workers_state == 0) {
+        reader->workers = calloc(vol->n_parts, sizeof(*reader->workers));
+        if (reader->workers == NULL) abort();
+
+        uint32_t i;
+        for (i = 0; i < vol->n_parts; i++) {
+            if (reader->fds[i] == -1) continue;
+
+            _worker_t * const w = &reader->workers[i];
+            pthread_mutex_init(&w->lock, NULL);
+            pthread_cond_init(&w->cond, NULL);
+
+            if (pthread_create(&w->thread, NULL, _worker_thread, w) != 0) {
+                pthread_mutex_destroy(&w->lock);
+                pthread_cond_destroy(&w->cond);
+                break;
+            }
+        }
+
+        if (i < vol->n_parts) {
+            _stop_workers(reader, i);
+            reader->workers_state = -1;
+        } else {
+            reader->workers_state = 1;
+        }
+    }
+
+    const int r = reader->workers_state == 1;
+    pthread_mutex_unlock(&reader->workers_lock);
+
+    return r;
+}
+
+/* Do a set of ops, with a thread for each disk if they involve more than one
+ * and are large enough to benefit */
+static int
+_run_ops(ldmcore_reader_t * const reader, const _op_t * const ops,
+         const uint32_t n_ops, const int cached, ldmcore_err_t * const err)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    _task_t * const tasks = calloc(vol->n_parts, sizeof(*tasks));
+    if (tasks == NULL) abort();
+
+    uint32_t n_parts = 0;
+    size_t total = 0;
+    for (uint32_t i = 0; i < n_ops; i++) {
+        if (tasks[ops[i].part].n_ops++ == 0) {
+            n_parts++;
+            __atomic_add_fetch(&reader->legs[ops[i].part].inflight, 1,
+                               __ATOMIC_RELAXED);
+        }
+        total += ops[i].count;
+    }
+
+    int r = 0;
+    if (n_parts < 2 || total < PARALLEL_MIN || !_start_workers(reader)) {
+        for (uint32_t i = 0; i < vol->n_parts && r == 0; i++) {
+            if (tasks[i].n_ops > 0) {
+                r = _run_part(reader, ops, n_ops, i, cached, err);
+            }
+        }
+
+        goto out;
+    }
+
+    _batch_t batch;
+    batch.reader = reader;
+    batch.ops = ops;
+    batch.n_ops = n_ops;
+    batch.cached = cached;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = n_parts;
+    batch.r = 0;
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        _task_t * const task = &tasks[i];
+        if (task->n_ops == 0) continue;
+
+        task->batch = &batch;
+        task->part = i;
+
+        _worker_t * const w = &reader->workers[i];
+        pthread_mutex_lock(&w->lock);
+        if (w->tail) w->tail->next = task;
+        else w->head = task;
+        w->tail = task;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    r = batch.r;
+    if (r < 0 && err) *err = batch.err;
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+
+out:
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        if (tasks[i].n_ops > 0) {
+            __atomic_sub_fetch(&reader->legs[i].inflight, 1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    free(tasks);
+
+    return r;
+}
+
+typedef struct {
+    _op_t *ops;
+    uint32_t n_ops;
+    uint32_t alloc_ops;
+
+    _xor_t *xors;
+    uint32_t n_xors;
+    uint32_t alloc_xors;
+
+    size_t tmp_size;
+} _plan_t;
+
+static _op_t *
+_plan_add_op(_plan_t * const plan, const uint32_t part, uint8_t * const dst,
+             const size_t count, const uint64_t offset)
+{
+    if (plan->n_ops == plan->alloc_ops) {
+        plan->alloc_ops = plan->alloc_ops ? plan->alloc_ops * 2 : 16;
+        plan->ops = realloc(plan->ops, plan->alloc_ops * sizeof(*plan->ops));
+        if (plan->ops == NULL) abort();
+    }
+
+    _op_t * const op = &plan->ops[plan->n_ops++];
+    op->part = part;
+    op->dst = dst;
+    op->count = count;
+    op->offset = offset;
+
+    return op;
+}
+
+/* Plan the reconstruction of count bytes at part_offset within a missing RAID5
+ * partition from the same range of every other partition. Reads into the
+ * temporary buffer have a NULL dst until it is allocated. */
+static void
+_plan_xor(_plan_t * const plan, const ldmcore_reader_t * const reader,
+          const uint32_t part, uint8_t * const dst, const size_t count,
+          const uint64_t part_offset)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    if (plan->n_xors == plan->alloc_xors) {
+        plan->alloc_xors = plan->alloc_xors ? plan->alloc_xors * 2 : 8;
+        plan->xors = realloc(plan->xors,
+                             plan->alloc_xors * sizeof(*plan->xors));
+        if (plan->xors == NULL) abort();
+    }
+
+    _xor_t * const x = &plan->xors[plan->n_xors++];
+    x->dst = dst;
+    x->count = count;
+    x->first_op = plan->n_ops;
+    x->n_srcs = 0;
+    x->tmp_offset = plan->tmp_size;
+
+    for (uint32_t i = 0; i < vol->n_parts; i++) {
+        if (i == part) continue;
+
+        const ldmcore_part_t * const p = vol->parts[i];
+        _plan_add_op(plan, i, x->n_srcs == 0 ? dst : NULL, count,
+                     (p->disk->data_start + p->start) * SECTOR_SIZE +
+                     part_offset);
+
+        if (x->n_srcs > 0) plan->tmp_size += count;
+        x->n_srcs++;
+    }
+}
+
+/* Choose the leg for a read of a mirrored volume at vol_offset. A leg whose
+ * last read ended there is preferred, so that sequential streams stay on one
+ * disk. Otherwise the leg with the fewest reads in progress is chosen, in
+ * turn with any which are equally busy. */
+static uint32_t
+_pick_leg(ldmcore_reader_t * const reader, const uint32_t * const legs,
+          const uint32_t n_legs, const uint64_t vol_offset)
+{
+    for (uint32_t i = 0; i < n_legs; i++) {
+        const _leg_t * const leg = &reader->legs[legs[i]];
+        if (__atomic_load_n(&leg->next, __ATOMIC_RELAXED) == vol_offset)
+            return legs[i];
+    }
+
+    const uint32_t first =
+        __atomic_fetch_add(&reader->next_leg, 1, __ATOMIC_RELAXED) % n_legs;
+    uint32_t best = legs[first];
+    uint32_t best_inflight = UINT32_MAX;
+    for (uint32_t i = 0; i < n_legs; i++) {
+        const uint32_t l = legs[(first + i) % n_legs];
+        const uint32_t inflight =
+            __atomic_load_n(&reader->legs[l].inflight, __ATOMIC_RELAXED);
+        if (inflight < best_inflight) {
+            best = l;
+            best_inflight = inflight;
+        }
+    }
+
+    return best;
+}
+
+/* Plan a read of a mirrored volume. A large read is split between the legs
+ * which haven't failed, so that they are read in parallel. A small read is
+ * given to a single leg. A read through the cache goes to a leg chosen by its
+ * cache block, so that reading it again finds the blocks cached from that
+ * leg's disk. */
+static void
+_plan_mirror(_plan_t * const plan, ldmcore_reader_t * const reader,
+             uint8_t * const dst, const size_t count, const uint64_t vol_offset,
+             const int cached)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    /* If every leg has failed, keep trying all of them */
+    uint32_t * const legs = malloc(vol->n_parts * sizeof(*legs));
+    if (legs == NULL) abort();
+    uint32_t n_legs = 0;
+    for (int failed = 0; failed < 2 && n_legs == 0; failed++) {
+        for (uint32_t i = 0; i < vol->n_parts; i++) {
+            if (reader->fds[i] == -1) continue;
+            if (__atomic_load_n(&reader->legs[i].failed, __ATOMIC_RELAXED) !=
+                failed)
+            {
+                continue;
+            }
+
+            legs[n_legs++] = i;
+        }
+    }
+
+    size_t piece = count;
+    uint32_t leg = 0;
+    if (count >= PARALLEL_MIN && n_legs > 1) {
+        piece = (count / n_legs + MIRROR_ALIGN - 1) / MIRROR_ALIGN *
+                MIRROR_ALIGN;
+    } else if (cached) {
+        leg = legs[vol_offset / LDMCORE_CACHE_BLOCK % n_legs];
+    } else {
+        leg = _pick_leg(reader, legs, n_legs, vol_offset);
+    }
+
+    for (size_t done = 0, i = 0; done < count; done += piece, i++) {
+        const size_t len = count - done < piece ? count - done : piece;
+        if (piece < count) leg = legs[i];
+
+        _plan_add_op(plan, leg, dst + done, len,
+                     _leg_base(reader, leg) + vol_offset + done);
+        __atomic_store_n(&reader->legs[leg].next, vol_offset + done + len,
+                         __ATOMIC_RELAXED);
+    }
+
+    free(legs);
+}
+
+/* Read a range of the volume which is within its bounds */
+static int
+_read_window(ldmcore_reader_t * const reader, uint8_t * const buf,
+             const size_t count, const uint64_t offset, const int cached,
+             ldmcore_err_t * const err)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    const uint64_t end = offset + count;
+    const uint64_t first = offset / SECTOR_SIZE;
+    const uint64_t last = (end + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    ldmcore_extent_t *extents;
+    uint32_t n_extents;
+    int r = ldmcore_vol_map_range(vol, first, last - first,
+                                  &extents, &n_extents, err);
+    if (r < 0) return r;
+
+    _plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+
+    for (uint32_t i = 0; i < n_extents; i++) {
+        const ldmcore_extent_t * const e = &extents[i];
+
+        if (e->role == LDMCORE_EXTENT_PARITY) continue;
+
+        /* Every leg has an extent for the same range, and the leg to read is
+         * chosen separately */
+        if (e->role == LDMCORE_EXTENT_MIRROR && e->part != extents[0].part)
+            continue;
+
+        /* Clip the extent to the requested byte range */
+        const uint64_t e_start = e->vol_offset * SECTOR_SIZE;
+        const uint64_t e_end = e_start + e->length * SECTOR_SIZE;
+        const uint64_t start = e_start > offset ? e_start : offset;
+        const uint64_t stop = e_end < end ? e_end : end;
+        if (start >= stop) continue;
+
+        uint8_t * const dst = buf + (start - offset);
+        const uint64_t disk_offset =
+            e->offset * SECTOR_SIZE + (start - e_start);
+
+        if (e->role == LDMCORE_EXTENT_MIRROR) {
+            _plan_mirror(&plan, reader, dst, stop - start, start, cached);
+        } else if (reader->fds[e->part] != -1) {
+            _plan_add_op(&plan, e->part, dst, stop - start, disk_offset);
+        } else {
+            const ldmcore_part_t * const p = vol->parts[e->part];
+            _plan_xor(&plan, reader, e->part, dst, stop - start,
+                disk_offset - (p->disk->data_start + p->start) * SECTOR_SIZE);
+        }
+    }
+
+    free(extents);
+
+    uint8_t *tmp = NULL;
+    if (plan.tmp_size > 0) {
+        tmp = malloc(plan.tmp_size);
+        if (tmp == NULL) abort();
+
+        for (uint32_t i = 0; i < plan.n_xors; i++) {
+            const _xor_t * const x = &plan.xors[i];
+            for (uint32_t j = 1; j < x->n_srcs; j++) {
+                plan.ops[x->first_op + j].dst =
+                    tmp + x->tmp_offset + (j - 1) * x->count;
+            }
+        }
+    }
+
+    r = _run_ops(reader, plan.ops, plan.n_ops, cached, err);
+
+    for (uint32_t i = 0; i < plan.n_xors && r == 0; i++) {
+        const _xor_t * const x = &plan.xors[i];
+
+        for (size_t done = 0; done < x->count; done += RECONSTRUCT_BLOCK) {
+            const size_t len = x->count - done < RECONSTRUCT_BLOCK ?
+                               x->count - done : RECONSTRUCT_BLOCK;
+
+            for (uint32_t j = 1; j < x->n_srcs; j++) {
+                ldmcore_xor(x->dst + done,
+                            plan.ops[x->first_op + j].dst + done, len);
+            }
+        }
+    }
+
+    free(tmp);
+    free(plan.ops);
+    free(plan.xors);
+
+    return r;
+}
+
+/* Read a range of the volume which is within its bounds, a window at a time */
+static int
+_read_range(ldmcore_reader_t * const reader, uint8_t * const buf,
+            const size_t count, const uint64_t offset, const int cached,
+            ldmcore_err_t * const err)
+{
+    for (size_t done = 0; done < count; done += READ_WINDOW) {
+        const size_t len = count - done < READ_WINDOW ?
+                           count - done : READ_WINDOW;
+
+        const int r = _read_window(reader, buf + done, len, offset + done,
+                                   cached, err);
+        if (r < 0) return r;
+    }
+
+    return 0;
+}
+
+/* The unit of readahead in bytes: a full stripe of data for striped and RAID5
+ * volumes, so every column is read at once */
+static uint64_t
+_readahead_unit(const ldmcore_vol_t * const vol)
+{
+    uint64_t unit = 0;
+    switch (vol->type) {
+    case LDMCORE_VOLUME_TYPE_STRIPED:
+        unit = vol->chunk_size * vol->n_parts * SECTOR_SIZE;
+        break;
+
+    case LDMCORE_VOLUME_TYPE_RAID5:
+        unit = vol->chunk_size * (vol->n_parts - 1) * SECTOR_SIZE;
+        break;
+
+    default:
+        ;
+    }
+
+    return unit > 0 ? unit : SECTOR_SIZE;
+}
+
+/* Copy the start of a read from the readahead buffer. If the read continues a
+ * sequential stream, first refill the buffer with the range following it,
+ * ending on a stripe boundary. Returns the number of bytes copied, which may
+ * be 0. The rest of the read is done directly. A failed refill is dropped, so
+ * that an error is only returned for data which was asked for. */
+static size_t
+_readahead(ldmcore_reader_t * const reader, uint8_t * const buf,
+           const size_t count, const uint64_t offset)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    if (pthread_mutex_trylock(&reader->ra_lock) != 0) return 0;
+
+    size_t done = 0;
+    if (offset >= reader->ra_start &&
+        offset < reader->ra_start + reader->ra_len)
+    {
+        const size_t avail = reader->ra_start + reader->ra_len - offset;
+        done = count < avail ? count : avail;
+        memcpy(buf, reader->ra_buf + (offset - reader->ra_start), done);
+    }
+
+    if (done == count) {
+        __atomic_add_fetch(&reader->ra_hits, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    if (done == 0 && offset != reader->ra_next) {
+        reader->ra_window = 0;
+        goto out;
+    }
+
+    const uint64_t unit = _readahead_unit(vol);
+    const uint64_t min = (READAHEAD_MIN + unit - 1) / unit * unit;
+    const uint64_t max = READ_WINDOW > min ? READ_WINDOW / unit * unit : min;
+    if (reader->ra_window == 0) reader->ra_window = min;
+    else if (reader->ra_window < max) reader->ra_window *= 2;
+    if (reader->ra_window > max) reader->ra_window = max;
+
+    /* A read larger than the window gains nothing from readahead */
+    if (count - done >= reader->ra_window) goto out;
+
+    const uint64_t vol_bytes = vol->size * SECTOR_SIZE;
+    const uint64_t start = offset + done;
+    uint64_t end = (start + reader->ra_window + unit - 1) / unit * unit;
+    if (end > vol_bytes) end = vol_bytes;
+    const size_t len = end - start;
+
+    if (len > reader->ra_alloc) {
+        free(reader->ra_buf);
+        reader->ra_buf = malloc(len);
+        if (reader->ra_buf == NULL) abort();
+        reader->ra_alloc = len;
+    }
+
+    reader->ra_start = start;
+    reader->ra_len = 0;
+    /* A refill is streaming, so it bypasses the cache whatever its size */
+    if (_read_range(reader, reader->ra_buf, len, start, 0, NULL) < 0) {
+        reader->ra_window = 0;
+        goto out;
+    }
+    reader->ra_len = len;
+
+    memcpy(buf + done, reader->ra_buf, count - done);
+    done = count;
+
+out:
+    reader->ra_next = offset + count;
+    pthread_mutex_unlock(&reader->ra_lock);
+
+    return done;
+}
+
+void
+ldmcore_reader_set_cache(ldmcore_reader_t * const reader, const uint64_t size)
+{
+    ldmcore_cache_free(reader->cache);
+    reader->cache = size > 0 ? ldmcore_cache_new(size) : NULL;
+}
+
+void
+ldmcore_reader_get_stats(ldmcore_reader_t * const reader,
+                         ldmcore_reader_stats_t * const stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if (reader->cache) ldmcore_cache_get_stats(reader->cache, &stats->cache);
+    stats->failovers = __atomic_load_n(&reader->failovers, __ATOMIC_RELAXED);
+    stats->readahead_hits =
+        __atomic_load_n(&reader->ra_hits, __ATOMIC_RELAXED);
+}
+
+ssize_t
+ldmcore_reader_pread(ldmcore_reader_t * const reader, void * const buf,
+                     size_t count, const uint64_t offset,
+                     ldmcore_err_t * const err)
+{
+    const ldmcore_vol_t * const vol = reader->vol;
+
+    const uint64_t vol_bytes = vol->size * SECTOR_SIZE;
+    if (offset >= vol_bytes) return 0;
+    if (count > vol_bytes - offset) count = vol_bytes - offset;
+    if (count > SSIZE_MAX) count = SSIZE_MAX;
+
+    const int cached = reader->cache != NULL && count < CACHE_BYPASS;
+    const size_t done = _readahead(reader, buf, count, offset);
+    const int r = _read_range(reader, (uint8_t *) buf + done, count - done,
+                              offset + done, cached, err);
+    if (r < 0) return r;
+
+    return count;
+}
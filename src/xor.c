@@ -0,0 +1,142 @@
+/* libldm
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* XOR of buffers for RAID5 parity, with an implementation for each vector
+ * instruction set chosen when first used */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ldmcore.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XOR_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*_xor_fn_t)(uint8_t *dst, const uint8_t *src, size_t count);
+
+static void
+_xor_generic(uint8_t * const dst, const uint8_t * const src, const size_t count)
+{
+    size_t i = 0;
+
+    /* memcpy avoids unaligned access, and is compiled to a plain load */
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+
+    for (; i < count; i++) dst[i] ^= src[i];
+}
+
+#ifdef XOR_X86
+
+/* Each loop handles 4 vectors per iteration, which is enough to keep the load
+ * ports busy. The remainder is handled by _xor_generic(). */
+
+__attribute__((target("sse2")))
+static void
+_xor_sse2(uint8_t * const dst, const uint8_t * const src, const size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 * sizeof(__m128i) <= count; i += 4 * sizeof(__m128i)) {
+        __m128i * const d = (__m128i *) (dst + i);
+        const __m128i * const s = (const __m128i *) (src + i);
+
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_si128(d + j, _mm_xor_si128(_mm_loadu_si128(d + j),
+                                                  _mm_loadu_si128(s + j)));
+        }
+    }
+
+    _xor_generic(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void
+_xor_avx2(uint8_t * const dst, const uint8_t * const src, const size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 * sizeof(__m256i) <= count; i += 4 * sizeof(__m256i)) {
+        __m256i * const d = (__m256i *) (dst + i);
+        const __m256i * const s = (const __m256i *) (src + i);
+
+        for (int j = 0; j < 4; j++) {
+            _mm256_storeu_si256(d + j,
+                                _mm256_xor_si256(_mm256_loadu_si256(d + j),
+                                                 _mm256_loadu_si256(s + j)));
+        }
+    }
+
+    _xor_generic(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+static void
+_xor_avx512(uint8_t * const dst, const uint8_t * const src, const size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 * sizeof(__m512i) <= count; i += 4 * sizeof(__m512i)) {
+        __m512i * const d = (__m512i *) (dst + i);
+        const __m512i * const s = (const __m512i *) (src + i);
+
+        for (int j = 0; j < 4; j++) {
+            _mm512_storeu_si512(d + j,
+                                _mm512_xor_si512(_mm512_loadu_si512(d + j),
+                                                 _mm512_loadu_si512(s + j)));
+        }
+    }
+
+    _xor_generic(dst + i, src + i, count - i);
+}
+
+#endif /* XOR_X86 */
+
+static _xor_fn_t
+_xor_select(void)
+{
+#ifdef XOR_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) return _xor_avx512;
+    if (__builtin_cpu_supports("avx2")) return _xor_avx2;
+    if (__builtin_cpu_supports("sse2")) return _xor_sse2;
+#endif
+
+    return _xor_generic;
+}
+
+void
+ldmcore_xor(void * const dst, const void * const src, const size_t count)
+{
+    /* Selecting more than once in a race is harmless */
+    static _xor_fn_t fn = NULL;
+
+    _xor_fn_t f = __atomic_load_n(&fn, __ATOMIC_RELAXED);
+    if (f == NULL) {
+        f = _xor_select();
+        __atomic_store_n(&fn, f, __ATOMIC_RELAXED);
+    }
+
+    f(dst, src, count);
+}
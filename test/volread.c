@@ -0,0 +1,191 @@
+/* volread
+ * Copyright 2012 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Read a volume with ldm_volume_pread() and check that it contains the NTFS
+ * filesystem of the test images. Unlike checkmount.pl, this doesn't need
+ * root. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib-object.h>
+
+#include "ldm.h"
+
+/* An odd size, so reads don't align with chunks or sectors */
+#define READ_SIZE (64 * 1024 + 13)
+
+/* A file on every test filesystem, which is small enough to be resident in
+ * the MFT */
+#define NEEDLE "Filesystem test"
+
+static LDMVolume *
+_find_volume(LDM * const ldm, const char * const dg_guid,
+             const char * const name)
+{
+    LDMVolume *r = NULL;
+
+    GArray * const dgs = ldm_get_disk_groups(ldm);
+    for (guint i = 0; i < dgs->len && r == NULL; i++) {
+        LDMDiskGroup * const dg = g_array_index(dgs, LDMDiskGroup *, i);
+
+        gchar * const guid = ldm_disk_group_get_guid(dg);
+        const gboolean match = strcmp(guid, dg_guid) == 0;
+        g_free(guid);
+        if (!match) continue;
+
+        GArray * const vols = ldm_disk_group_get_volumes(dg);
+        for (guint j = 0; j < vols->len; j++) {
+            LDMVolume * const vol = g_array_index(vols, LDMVolume *, j);
+
+            gchar * const vol_name = ldm_volume_get_name(vol);
+            if (strcmp(vol_name, name) == 0) r = g_object_ref(vol);
+            g_free(vol_name);
+
+            if (r) break;
+        }
+        g_array_unref(vols);
+    }
+    g_array_unref(dgs);
+
+    return r;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <disk group guid> <volume> <drive> "
+                        "[<drive> ...]\n", argv[0]);
+        return 1;
+    }
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+    g_type_init();
+#endif
+
+    int ret = 1;
+    GError *err = NULL;
+
+    LDM *ldm = ldm_new();
+    for (int i = 3; i < argc; i++) {
+        if (!ldm_add(ldm, argv[i], &err)) {
+            fprintf(stderr, "Error reading LDM: %s\n", err->message);
+            goto out;
+        }
+    }
+
+    LDMVolume * const vol = _find_volume(ldm, argv[1], argv[2]);
+    if (vol == NULL) {
+        fprintf(stderr, "Volume %s not found in disk group %s\n",
+                argv[2], argv[1]);
+        goto out;
+    }
+
+    const guint64 size = ldm_volume_get_size(vol) * 512;
+
+    LDMVolumeReader * const reader = ldm_volume_open(vol, &err);
+    g_object_unref(vol);
+    if (reader == NULL) {
+        fprintf(stderr, "Error opening volume: %s\n", err->message);
+        goto out;
+    }
+
+    /* Read the boot sector twice. Both reads are small enough to go through
+     * the cache, and the second should be found in it. */
+    ldm_volume_reader_set_cache(reader, 1024 * 1024);
+
+    gchar boot[2][512];
+    LDMVolumeReaderStats boot_stats[2];
+    for (int i = 0; i < 2; i++) {
+        if (ldm_volume_pread(reader, boot[i], sizeof(boot[i]), 0,
+                             &err) == -1)
+        {
+            fprintf(stderr, "Error reading volume at 0: %s\n", err->message);
+            ldm_volume_close(reader);
+            goto out;
+        }
+        ldm_volume_reader_get_stats(reader, &boot_stats[i]);
+    }
+
+    /* Keep the end of the previous read, so the needle is found if it spans
+     * two reads */
+    const size_t overlap = strlen(NEEDLE) - 1;
+    gchar * const buf = g_malloc(overlap + READ_SIZE);
+    memset(buf, 0, overlap);
+
+    gboolean found_boot = FALSE;
+    gboolean found_needle = FALSE;
+    guint64 offset = 0;
+    for (;;) {
+        const gssize n = ldm_volume_pread(reader, buf + overlap, READ_SIZE,
+                                          offset, &err);
+        if (n == -1) {
+            fprintf(stderr, "Error reading volume at %" G_GUINT64_FORMAT
+                            ": %s\n", offset, err->message);
+            goto out_close;
+        }
+        if (n == 0) break;
+
+        /* The OEM ID of an NTFS boot sector */
+        if (offset == 0 && n >= 11 &&
+            memcmp(buf + overlap + 3, "NTFS    ", 8) == 0)
+        {
+            found_boot = TRUE;
+        }
+
+        if (!found_needle &&
+            memmem(buf, overlap + n, NEEDLE, strlen(NEEDLE)) != NULL)
+        {
+            found_needle = TRUE;
+        }
+
+        memmove(buf, buf + n, overlap);
+        offset += n;
+    }
+
+    /* The scan is sequential, so it should have been served by readahead */
+    LDMVolumeReaderStats stats;
+    ldm_volume_reader_get_stats(reader, &stats);
+
+    if (offset != size) {
+        fprintf(stderr, "Read %" G_GUINT64_FORMAT " bytes from volume of "
+                        "size %" G_GUINT64_FORMAT "\n", offset, size);
+    } else if (!found_boot) {
+        fprintf(stderr, "Volume doesn't contain an NTFS boot sector\n");
+    } else if (!found_needle) {
+        fprintf(stderr, "Volume doesn't contain '%s'\n", NEEDLE);
+    } else if (memcmp(boot[0], boot[1], sizeof(boot[0])) != 0) {
+        fprintf(stderr, "Boot sector differs when read again\n");
+    } else if (boot_stats[1].cache_hits <= boot_stats[0].cache_hits) {
+        fprintf(stderr, "Reading the boot sector again missed the cache\n");
+    } else if (stats.readahead_hits == 0) {
+        fprintf(stderr, "Sequential reads weren't read ahead\n");
+    } else {
+        ret = 0;
+    }
+
+out_close:
+    g_free(buf);
+    ldm_volume_close(reader);
+out:
+    if (err) g_error_free(err);
+    g_object_unref(ldm);
+
+    return ret;
+}